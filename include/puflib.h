@@ -18,6 +18,16 @@
  */
 #define PUFLIB_HEADER "puflib-sealed\n"
 
+/**
+ * Magic header prepended to blobs sealed to several modules at once
+ */
+#define PUFLIB_MULTI_HEADER "puflib-multi\n"
+
+/**
+ * Magic header prepended to blobs sealed in envelope mode
+ */
+#define PUFLIB_ENVELOPE_HEADER "puflib-envelope\n"
+
 /**
  * Module status flags - bitwise OR'd
  */
@@ -40,6 +50,40 @@ enum puflib_status_level {
     STATUS_ERROR,   ///< Messages indicating failure
 };
 
+/**
+ * How far a module's operations can run at once.
+ */
+enum puflib_threading {
+    PUFLIB_THREADS_SERIAL,      ///< Calls must not overlap; puflib serializes them
+    PUFLIB_THREADS_SAFE,        ///< Calls may overlap, but the module serializes
+                                ///< its hardware access itself, so running them
+                                ///< at once gains nothing
+    PUFLIB_THREADS_PARALLEL,    ///< Calls may overlap, and run in parallel
+};
+
+/**
+ * Capabilities of a module, which let puflib and its tools choose fast paths
+ * that are only safe for some modules. Each field is conservative when zero,
+ * so a module only needs to set those it can vouch for.
+ */
+typedef struct puflib_caps {
+    enum puflib_threading threading;    ///< Concurrency the operations allow
+    bool deterministic;     ///< chal_resp always answers a challenge the same
+                            ///< way, while the module stays provisioned
+    size_t max_input_len;   ///< Longest input seal and chal_resp take, in
+                            ///< bytes; 0 for no limit
+    size_t response_len;    ///< Length of every chal_resp response, in bytes;
+                            ///< 0 if it varies
+    unsigned typical_us;    ///< Typical duration of a chal_resp call, in
+                            ///< microseconds; 0 if unknown
+    size_t batch_len;       ///< If not 0, chal_resp takes any number of
+                            ///< challenges of this many bytes in one call,
+                            ///< concatenated, and answers them all
+    bool volatile_probe;    ///< is_hw_supported() depends on more than the
+                            ///< hardware, such as the environment, so its
+                            ///< result is never cached
+} puflib_caps;
+
 /**
  * Structure containing the information and functions belonging to a puflib
  * module. Every module must provide this.
@@ -48,6 +92,9 @@ typedef struct module_info_s {
   char * name;          ///< Short name of the module, used to identify it
   char * author;        ///< Author string. May contain authors, email addresses, etc.
   char * desc;          ///< Longer (but still brief) description of the module
+  char * version;       ///< Module version. Optional; changing it, or
+                        ///< rebuilding the plugin, invalidates cached
+                        ///< hardware probe results.
   bool (*is_hw_supported)();                ///< Return true if the platform present is supported
   enum provisioning_status (*provision)();  ///< Provision the module on this hardware
 
@@ -81,7 +128,8 @@ typedef struct module_info_s {
 
   /**
    * Low-level challenge/response call. Should return each module's rough
-   * equivalent of puf(hash(i)).
+   * equivalent of puf(hash(i)). puflib_sha256() (puflib_module.h) can serve
+   * as the hash.
    *
    * This is an optional function. Leave this pointer NULL if not implemented.
    *
@@ -101,6 +149,58 @@ typedef struct module_info_s {
           void const * data_in,  size_t   data_in_len,
           void **      data_out, size_t * data_out_len );
 
+  /*
+   * The fields below are only read from modules that export
+   * MODULE_ABI_VERSION 2 or later; see puflib_module.h.
+   */
+
+  /**
+   * Open an instance of the module: open its devices, map its enrollment
+   * data, build its tables. puflib opens one instance on the first seal,
+   * unseal or challenge (or on puflib_warmup()), passes it to every operation
+   * after that, and closes it once the module's store changes (it is
+   * provisioned again, disabled or deprovisioned) and no call is using it.
+   *
+   * Optional. A module that provides it must provide instance_seal and
+   * instance_unseal, which are then used instead of seal and unseal.
+   *
+   * @param instance - outparam for the module's instance handle
+   * @return false on success, true on error (with errno set)
+   */
+  bool (*open)(void ** instance);
+
+  /**
+   * Close an instance opened by open(). Required if open is provided.
+   */
+  void (*close)(void * instance);
+
+  /**
+   * As seal, unseal and chal_resp, on an open instance. Calls from several
+   * threads share the instance, and unless the module is serialized (see
+   * caps), may run at once, so the module must synchronize anything it
+   * changes after open(). instance_chal_resp is optional.
+   */
+  bool (*instance_seal)(void * instance,
+          uint8_t const * data_in,  size_t   data_in_len,
+          uint8_t **      data_out, size_t * data_out_len );
+  bool (*instance_unseal)(void * instance,
+          uint8_t const * data_in,  size_t   data_in_len,
+          uint8_t **      data_out, size_t * data_out_len );
+  bool (*instance_chal_resp)(void * instance,
+          void const * data_in,  size_t   data_in_len,
+          void **      data_out, size_t * data_out_len );
+
+  /*
+   * The fields below are only read from modules that export
+   * MODULE_ABI_VERSION 3 or later.
+   */
+
+  /**
+   * What the module can do; see puflib_get_caps(). Optional: without it, the
+   * module's calls are serialized and nothing else is assumed.
+   */
+  puflib_caps const * caps;
+
 } module_info;
 
 /**
@@ -165,6 +265,37 @@ module_info const * const * puflib_get_modules();
  */
 module_info const * puflib_get_module(char const * name);
 
+/**
+ * Check whether the running platform is supported by a module. This calls the
+ * module's ->is_hw_supported() and caches the result in the puflib state
+ * directory, keyed by a fingerprint of the platform and the module's version,
+ * so that later checks on an unchanged host do not probe the hardware again.
+ *
+ * @param module - module to check
+ * @return true if the platform present is supported
+ */
+bool puflib_is_hw_supported(module_info const * module);
+
+/**
+ * Ignore cached hardware probe results. Any later puflib_is_hw_supported()
+ * will call the module's ->is_hw_supported() and store the fresh result.
+ *
+ * @param reprobe - if true, always probe; if false (the default), use the
+ *  cache.
+ */
+void puflib_set_reprobe(bool reprobe);
+
+/**
+ * Return a module's capabilities: those it declares (module_info.caps), or
+ * the most conservative ones if it declares none. puflib serializes the calls
+ * of PUFLIB_THREADS_SERIAL modules, and refuses inputs over max_input_len
+ * without calling the module.
+ *
+ * @param module - module
+ * @return capabilities, valid for as long as the module
+ */
+puflib_caps const * puflib_get_caps(module_info const * module);
+
 /**
  * Query the status of a module.
  * @param module - module to check
@@ -192,11 +323,67 @@ bool puflib_seal(module_info const * module,
         uint8_t const * data_in, size_t data_in_len,
         uint8_t ** data_out, size_t * data_out_len);
 
+/**
+ * Seal a secret to several modules at once, so that any one of them can unseal
+ * it. The modules seal concurrently, and their results are combined into a
+ * single blob, which puflib_unseal() accepts like any other. Fails if any of
+ * the modules fails.
+ *
+ * @param modules - modules to use
+ * @param n_modules - number of modules in modules (at most 64)
+ * @param data_in - data to be sealed
+ * @param data_in_len - length of data_in, in bytes
+ * @param data_out - pointer to a (uint8_t *) to receive the data.
+ *  Caller is responsible for freeing.
+ * @param data_out_len - pointer to a size_t to receive the output data's
+ *  length, in bytes.
+ *
+ * @return true on error
+ */
+bool puflib_seal_multi(module_info const * const * modules, size_t n_modules,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Seal data in envelope mode. The module seals a random data key once, which
+ * is kept in the library's state directory, and the data itself is encrypted
+ * in software (AES-256-GCM) under a key derived from it. The blob refers to
+ * the data key by ID, and still only unseals where the module can unwrap the
+ * data key, i.e. on the same hardware.
+ *
+ * The module's current data key is unwrapped once and then held in locked
+ * memory, so seals, and unseals of blobs sealed under it, use the PUF once
+ * per process. It is wiped when the module is disabled or deprovisioned, and
+ * on puflib_flush_keys(). Older data keys go through the key cache (see
+ * puflib_set_key_cache()); with it disabled, unsealing a blob under an older
+ * key unwraps that key each time. Deprovisioning the module destroys its data
+ * keys, and with them all its envelope blobs.
+ *
+ * Blobs sealed this way are unsealed with puflib_unseal() like any other.
+ *
+ * @param module - module to wrap the data key with
+ * @param data_in - data to seal
+ * @param data_in_len - length of data_in
+ * @param data_out - will be set to a pointer to the sealed blob; caller is
+ *  responsible for freeing
+ * @param data_out_len - will be set to the length of the sealed blob
+ * @return true on error (with errno set)
+ */
+bool puflib_seal_envelope(module_info const * module,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
 /**
  * Unseal a secret. The input data will be decrypted by the PUF module, and the
  * output data will be passed as a newly allocated block through data_out and
  * data_out_len. Caller is responsible for freeing data_out.
  *
+ * Blobs from puflib_seal_multi() are tried with all of their modules at once,
+ * returning the first that succeeds.
+ *
+ * Threads unsealing the same blob at the same time share one module call, and
+ * each gets its own copy of the result.
+ *
  * @param data_in - data to be unsealed
  * @param data_in_len - length of data_in, in bytes
  * @param data_out - pointer to a (uint8_t *) to receive the data.
@@ -222,6 +409,10 @@ bool puflib_unseal(
  * Not all modules implement chal_resp(); if the chosen module does not,
  * this function will return true.
  *
+ * Threads asking a deterministic module (see puflib_caps.deterministic) the
+ * same challenge at the same time share one call. Calls to other modules are
+ * never shared, so each one is an independent read.
+ *
  * @param module - module to use
  * @param data_in - challenge input data
  * @param data_in_len - challenge input length in bytes
@@ -237,11 +428,248 @@ bool puflib_chal_resp(module_info const * module,
 /**
  * Deprovision the module. No-op if the module is not provisioned. If the
  * module is partially provisioned, it will be reset to non-provisioned.
+ *
+ * The module is deprovisioned as soon as this returns, but its stored data is
+ * deleted in the background; see puflib_wait_cleanup().
  * @param module - module to deprovision
  * @return true on error
  */
 bool puflib_deprovision(module_info const * module);
 
+/**
+ * Wait for background deletion started by puflib_deprovision() to finish.
+ * Programs should call this before exiting; anything left unfinished at exit
+ * is deleted the next time a process enables, disables or deprovisions a
+ * module, which also sweeps up what earlier processes left.
+ */
+void puflib_wait_cleanup();
+
+/**
+ * Let modules cache the keys they reconstruct from their PUFs, so that a
+ * burst of seals and unseals reads the hardware once rather than every call.
+ * The cache is off by default.
+ *
+ * Cached keys are held in memory locked against swapping and left out of
+ * core dumps. They are wiped when they expire or are used up, when their
+ * module is disabled or deprovisioned, on puflib_flush_keys(), and when the
+ * cache is reconfigured.
+ *
+ * @param ttl_ms - how long a key stays cached after it is reconstructed, in
+ *  milliseconds; 0 turns the cache off
+ * @param max_uses - how many lookups a cached key serves before it is
+ *  dropped; 0 for no limit
+ * @return true on error (with errno set; EPERM or ENOMEM if memory could not
+ *  be locked)
+ */
+bool puflib_set_key_cache(unsigned ttl_ms, unsigned max_uses);
+
+/**
+ * Wipe all cached keys, for example before the machine is left unattended.
+ * The cache stays enabled.
+ */
+void puflib_flush_keys();
+
+/**
+ * Module operations, as seen by interposed layers. These are bit flags, so
+ * that a layer can be limited to some of them.
+ */
+enum puflib_op {
+    PUFLIB_OP_SEAL      = 0x01,     ///< module_info.seal
+    PUFLIB_OP_UNSEAL    = 0x02,     ///< module_info.unseal
+    PUFLIB_OP_CHAL_RESP = 0x04,     ///< module_info.chal_resp
+    PUFLIB_OP_ALL       = 0x07,
+};
+
+/**
+ * A call to a module, on its way through the interposed layers. For
+ * PUFLIB_OP_SEAL and PUFLIB_OP_UNSEAL, the data is uint8_t.
+ */
+typedef struct puflib_call {
+    module_info const * module;     ///< Module being called
+    enum puflib_op op;              ///< Operation
+    void const * data_in;           ///< Input data
+    size_t data_in_len;             ///< Length of data_in, in bytes
+    void ** data_out;               ///< Receives the output on success
+    size_t * data_out_len;          ///< Receives the length of the output
+
+    struct puflib_chain_s * chain;  ///< For internal use
+    struct puflib_plugin_s * plugin;    ///< For internal use
+    size_t depth;                   ///< For internal use
+} puflib_call;
+
+/// Opaque handle to an interposed layer
+typedef struct puflib_layer_s puflib_layer;
+
+/**
+ * Layer function. It may inspect or change the call, and passes it on with
+ * puflib_call_next() or answers it itself.
+ *
+ * @param ctx - the layer's context pointer
+ * @param call - call in progress
+ * @return false on success, true on error (with errno set), as for the module
+ *  operation
+ */
+typedef bool (*puflib_layer_fn)(void * ctx, puflib_call * call);
+
+/**
+ * Interpose a layer between puflib and a module, for example to cache, time
+ * or alter calls. Every seal, unseal and challenge-response call the library
+ * makes to a module, including those made for puflib_seal_multi() and
+ * puflib_seal_envelope(), goes through the layers interposed on it. The layer
+ * added last is outermost, and sees calls first.
+ *
+ * Layers are also added from the PUFLIB_INTERPOSE environment variable the
+ * first time a module is called: a list of LAYER or MODULE:LAYER separated
+ * by semicolons, where LAYER is "latency=US[/JITTER_US]", "errors=RATE",
+ * "stats" or "cache[=ENTRIES]". These apply the layers below to all
+ * operations, injecting EIO for errors, and the stats are reported as status
+ * messages at exit. The variable is ignored in setuid and other privileged
+ * processes.
+ *
+ * @param module - module to interpose on, or NULL for all modules
+ * @param ops - bitwise OR of the puflib_op values to interpose on
+ * @param fn - layer function
+ * @param ctx - context pointer for fn
+ * @param free_ctx - called with ctx once the layer has been removed and no
+ *  call is in it any more; may be NULL
+ * @return layer handle, or NULL on error (with errno set)
+ */
+puflib_layer * puflib_interpose(module_info const * module, unsigned ops,
+        puflib_layer_fn fn, void * ctx, void (*free_ctx)(void * ctx));
+
+/**
+ * Remove an interposed layer. Calls already in it carry on; new calls skip it.
+ *
+ * @param layer - layer handle
+ * @return false on success, true on error (with errno set to ENOENT if the
+ *  layer has already been removed)
+ */
+bool puflib_remove_layer(puflib_layer * layer);
+
+/**
+ * Pass a call on to the next layer, or the module itself.
+ *
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_call_next(puflib_call * call);
+
+/**
+ * Interpose a layer that delays each call by delay_us, plus or minus up to
+ * jitter_us (uniformly distributed), microseconds before passing it on.
+ * Simulates slow hardware.
+ */
+puflib_layer * puflib_interpose_latency(module_info const * module, unsigned ops,
+        unsigned delay_us, unsigned jitter_us);
+
+/**
+ * Interpose a layer that fails each call with probability rate, setting
+ * errno to error, instead of passing it on. Simulates failing hardware.
+ */
+puflib_layer * puflib_interpose_errors(module_info const * module, unsigned ops,
+        double rate, int error);
+
+/**
+ * Counters kept by a puflib_interpose_stats() layer, for one operation
+ */
+typedef struct puflib_op_stats {
+    uint64_t calls;         ///< Calls passed on
+    uint64_t errors;        ///< Calls that failed
+    uint64_t bytes_in;      ///< Total input length
+    uint64_t bytes_out;     ///< Total output length of the calls that succeeded
+    uint64_t total_us;      ///< Total time spent in calls, in microseconds
+    uint64_t max_us;        ///< Longest call, in microseconds
+} puflib_op_stats;
+
+/**
+ * Interpose a layer that counts and times the calls passing through it. Put
+ * it outermost to measure the module as the application sees it, or
+ * innermost to measure the module alone.
+ */
+puflib_layer * puflib_interpose_stats(module_info const * module, unsigned ops);
+
+/**
+ * Read the counters of a puflib_interpose_stats() layer.
+ *
+ * @param layer - layer handle, not yet removed
+ * @param op - one operation
+ * @param stats - receives the counters
+ * @return false on success, true on error (with errno set to EINVAL if the
+ *  layer does not keep stats, or op is not a single operation)
+ */
+bool puflib_layer_stats(puflib_layer const * layer, enum puflib_op op,
+        puflib_op_stats * stats);
+
+/**
+ * Interpose a layer that records every call passing through it, with its
+ * input, output and duration, to a trace file. The replay module serves the
+ * recorded calls back, so that a trace taken on real hardware can drive
+ * benchmarks and tests anywhere. If the trace exists, calls are appended to
+ * it, as long as it is owned by the process's effective user and is not a
+ * symbolic link. Unsealed data is recorded too, so a new trace is created
+ * readable only by its owner.
+ *
+ * In PUFLIB_INTERPOSE, this layer is "record=PATH".
+ *
+ * @param module - module to record, or NULL for all modules
+ * @param ops - bitwise OR of the puflib_op values to record
+ * @param path - trace file
+ * @return layer handle, or NULL on error (with errno set)
+ */
+puflib_layer * puflib_interpose_record(module_info const * module, unsigned ops,
+        char const * path);
+
+/**
+ * Interpose a layer that keeps the responses of deterministic modules (see
+ * puflib_caps.deterministic), and answers a challenge it has seen before
+ * without calling the module. Calls to other modules pass straight through.
+ * A response is kept until its slot is taken by another challenge, or the
+ * module's store changes.
+ *
+ * In PUFLIB_INTERPOSE, this layer is "cache[=ENTRIES]".
+ *
+ * @param module - module to cache, or NULL for all deterministic modules
+ * @param entries - number of responses kept, at most (0 for a default of
+ *  1024)
+ * @return layer handle, or NULL on error (with errno set)
+ */
+puflib_layer * puflib_interpose_cache(module_info const * module, size_t entries);
+
+/**
+ * Open a module's instance now, rather than on its first call, so that the
+ * cost of opening it is not paid by the first seal, unseal or challenge.
+ * Does nothing for a module that keeps no instance (see module_info.open).
+ *
+ * @param module - module to warm up
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_warmup(module_info const * module);
+
+/**
+ * Priority classes for module calls. Calls to a module that cannot run them
+ * in parallel (see puflib_caps.threading) wait their turn in the module's
+ * queue, where the classes share the module by weighted fair queuing:
+ * interactive calls get most of a busy module, and bulk calls the rest.
+ */
+enum puflib_priority {
+    PUFLIB_PRIORITY_INTERACTIVE,    ///< Someone is waiting on the result (the default)
+    PUFLIB_PRIORITY_BULK,           ///< Background work, such as sealing data again
+};
+
+/**
+ * Set the priority class of the calling thread's module calls, including
+ * those puflib_seal_multi() and puflib_unseal() make from their own threads
+ * on its behalf.
+ *
+ * @param priority - priority class
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_set_priority(enum puflib_priority priority);
+
+/**
+ * Return the priority class of the calling thread's module calls.
+ */
+enum puflib_priority puflib_get_priority();
+
 /**
  * Enable the module if disabled. No-op if the module is not disabled or not
  * provisioned.
@@ -7,6 +7,7 @@
 #define _PUFLIB_INTERNAL_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <puflib_module.h>
 
@@ -22,6 +23,15 @@
  */
 char const * puflib_get_path_sep();
 
+/**
+ * Return the directory holding all puflib state for the running process. This
+ * is allocated on the heap; the caller is responsible for freeing it. The
+ * directory is not created.
+ *
+ * @return path to directory on success, NULL on error (with errno set)
+ */
+char * puflib_get_state_dir();
+
 /**
  * Return a path for a nonvolatile store, given the store type and module
  * name. This is allocated on the heap; the caller is responsible for freeing
@@ -33,6 +43,22 @@ char const * puflib_get_path_sep();
  */
 char * puflib_get_nv_store_path(char const * module_name, enum puflib_storage_type type);
 
+/**
+ * Atomically move a module's nonvolatile store from one store type to another
+ * (e.g. from STORAGE_FINAL_DIR to STORAGE_DISABLED_DIR), failing rather than
+ * replacing a store that already exists at the destination. File and
+ * directory stores of the same kind share a location, so either type moves
+ * whichever exists. This should be a single atomic operation wherever
+ * possible, and should not allocate once the state directory has been
+ * opened.
+ *
+ * @return false on success, true on error (with errno set). In particular,
+ *  errno is ENOENT if there is no store to move, and EEXIST if the
+ *  destination already exists.
+ */
+bool puflib_move_nv_store(char const * module_name, enum puflib_storage_type from,
+        enum puflib_storage_type to);
+
 /**
  * Create a directory and all parent directories that don't already exist. This
  * is equivalent to 'mkdir -p'.
@@ -55,7 +81,8 @@ FILE * puflib_create_and_open(char const * path, char const * mode);
 
 /**
  * Open an existing file, but fail without creating it if it does not exist.
- * This should be implemented atomically wherever possible.
+ * This should be implemented atomically wherever possible. A symbolic link,
+ * or a file owned by another user, is refused rather than written to.
  *
  * @param path - path to the file
  * @param mode - mode string, compatible with fopen()
@@ -86,11 +113,385 @@ bool puflib_mkdir(char const * path);
 bool puflib_check_access(char const * path, bool isdirectory);
 
 /**
- * Delete an entire directory tree.
+ * Replace the contents of a file atomically: the data is written to a
+ * temporary file beside it, flushed to stable storage and renamed over the
+ * original, and the rename is flushed too. A reader, even after a crash or
+ * power loss, sees either the old or the new contents.
+ *
+ * @param path - path to the file
+ * @param data - new contents
+ * @param len - length of data, in bytes
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_replace_file(char const * path, void const * data, size_t len);
+
+/**
+ * A file mapped into memory. Fields other than data and len are private to
+ * the platform implementation.
+ */
+typedef struct puflib_map_s {
+    void * data;        ///< Start of the mapping, or NULL if the file is empty
+    size_t len;         ///< Length of the mapping (and of the file), in bytes
+    bool writable;      ///< Whether the mapping is writable
+    uint64_t identity;  ///< File identity, as from puflib_file_identity()
+    intptr_t handle;    ///< Platform file handle
+    char * temp_path;   ///< Path of a temporary file (puflib_map_create_temp())
+} puflib_map;
+
+/**
+ * Map an existing file into memory, shared with the file. A read-only mapping
+ * takes a shared lock on the file, and a writable mapping an exclusive lock,
+ * both held until puflib_map_close(); this blocks until the lock is available.
+ *
+ * @param path - path to the file
+ * @param writable - map for writing
+ * @param map - map structure to fill in
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_map_open(char const * path, bool writable, puflib_map * map);
+
+/**
+ * Change the length of a writable mapped file and remap it. The mapping may
+ * move, so any pointers into it must be recomputed.
+ *
+ * @param map - writable mapping
+ * @param len - new length, in bytes
+ * @return false on success, true on error (with errno set). On error, the
+ *  mapping is unchanged.
+ */
+bool puflib_map_resize(puflib_map * map, size_t len);
+
+/**
+ * Create a new file of a given length beside path, under a temporary name,
+ * with its space allocated, and map it for writing. Once filled in, it is
+ * moved into place with puflib_map_commit_temp(), or thrown away with
+ * puflib_map_discard_temp().
+ *
+ * @param path - path the file will eventually have
+ * @param len - length of the file, in bytes
+ * @param map - map structure to fill in
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_map_create_temp(char const * path, size_t len, puflib_map * map);
+
+/**
+ * Flush a file created by puflib_map_create_temp() to stable storage,
+ * atomically rename it to path, and unmap it. On error, the temporary file is
+ * discarded.
+ *
+ * @param map - mapping from puflib_map_create_temp()
+ * @param path - final path of the file
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_map_commit_temp(puflib_map * map, char const * path);
+
+/**
+ * Unmap and delete a file created by puflib_map_create_temp().
+ */
+void puflib_map_discard_temp(puflib_map * map);
+
+/**
+ * Flush changes to a writable mapping to stable storage.
+ *
+ * @param map - writable mapping
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_map_sync(puflib_map * map);
+
+/**
+ * Unmap a file and release its lock. Changes to a writable mapping are not
+ * flushed to stable storage; call puflib_map_sync() first if required.
+ */
+void puflib_map_close(puflib_map * map);
+
+/**
+ * Take an exclusive lock shared with other processes, blocking until it is
+ * available. The lock file at path is created if needed and never removed.
+ *
+ * @param path - path to the lock file
+ * @return a handle for puflib_unlock_file(), or -1 on error (with errno set)
+ */
+intptr_t puflib_lock_file(char const * path);
+
+/// Release a lock taken with puflib_lock_file()
+void puflib_unlock_file(intptr_t handle);
+
+/**
+ * Compute a value that changes whenever the file at path is replaced or
+ * modified, for checking whether a cached copy of it is still current.
+ *
+ * @param path - path to the file
+ * @param identity - outparam for the identity value
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_file_identity(char const * path, uint64_t * identity);
+
+/**
+ * Return a short string identifying the running platform, used to invalidate
+ * cached information when the hardware or OS changes. It must be cheap to
+ * compute. This is allocated on the heap; the caller is responsible for
+ * freeing it.
+ *
+ * @return fingerprint string, or NULL on error (with errno set)
+ */
+char * puflib_get_platform_fingerprint();
+
+/**
+ * Fill a buffer with cryptographically secure random bytes from the
+ * operating system.
+ *
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_random_bytes(void * buf, size_t len);
+
+/**
+ * Allocate zeroed memory that is locked against being swapped out, and where
+ * the platform allows, left out of core dumps and not inherited by children.
+ * Allocations are rounded up to whole pages, so this is for a few long-lived
+ * buffers.
+ *
+ * @return memory, or NULL on error (with errno set)
+ */
+void * puflib_alloc_locked(size_t len);
+
+/**
+ * Wipe and free memory from puflib_alloc_locked(). NULL is ignored.
+ */
+void puflib_free_locked(void * data, size_t len);
+
+/**
+ * Milliseconds on a clock that only moves forward, from an arbitrary start.
+ */
+uint64_t puflib_monotonic_ms();
+
+/**
+ * Microseconds on the same clock as puflib_monotonic_ms().
+ */
+uint64_t puflib_monotonic_us();
+
+/**
+ * Sleep for a number of microseconds.
+ */
+void puflib_sleep_us(uint64_t us);
+
+/**
+ * Call a module operation through the layers interposed on it (see
+ * puflib_interpose()). A module without chal_resp() fails it with ENOTSUP,
+ * and one that was not loaded by the registry fails every call with EINVAL.
+ * Unseals, and challenges to deterministic modules, identical to one already
+ * in progress wait for it and share its result.
+ */
+bool puflib_module_call(module_info const * module, enum puflib_op op,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len);
+
+/// A module call, as made by puflib_coalesce()
+typedef bool (*puflib_call_fn)(puflib_call * call);
+
+/**
+ * Make a module call with fn(), unless an identical one (same module,
+ * operation, priority class and input) is in progress, in which case wait
+ * for it and return a copy of its output, or its error.
+ *
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_coalesce(puflib_call * call, puflib_call_fn fn);
+
+/**
+ * @name Module instances and calls
+ * Modules with open() (ABI version 2) keep one open instance, which calls
+ * hold a reference to while they use it.
+ */
+/// @{
+typedef struct puflib_instance_s puflib_instance;
+
+/**
+ * Registry entry of a loaded module. A call looks it up once and passes it to
+ * the functions below, which then take no global lock.
+ */
+typedef struct puflib_plugin_s puflib_plugin;
+
+/// The plugin that loaded a module, or NULL if it did not come from one
+puflib_plugin * puflib_find_plugin(module_info const * module);
+
+/// A plugin's module capabilities, or the defaults if plugin is NULL
+puflib_caps const * puflib_plugin_caps(puflib_plugin const * plugin);
+
+/**
+ * Identity of the plugin file as it was when loaded (see
+ * puflib_file_identity()), which changes whenever the plugin is rebuilt.
+ * @return the identity, or 0 if plugin is NULL or the file could not be read
+ */
+uint64_t puflib_plugin_file_identity(puflib_plugin const * plugin);
+
+/**
+ * Take a reference to a module's instance, opening one first if there is
+ * none, or if the module's store has changed since it was opened.
+ *
+ * @param plugin - module's plugin, or NULL
+ * @param instance - outparam for the instance, or NULL for a module without
+ *  open()
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_instance_acquire(puflib_plugin * plugin, puflib_instance ** instance);
+
+/// Module's handle for an instance
+void * puflib_instance_handle(puflib_instance const * instance);
+
+/// Release a reference from puflib_instance_acquire(). instance may be NULL.
+void puflib_instance_release(puflib_instance * instance);
+
+/**
+ * Close a module's instance once the calls using it have returned, so that
+ * the next call opens a new one.
+ */
+void puflib_instance_reset(module_info const * module);
+
+/**
+ * Identity of a module's final store, which changes whenever the module is
+ * provisioned again, disabled or deprovisioned.
+ * @return the identity, or 0 if the module has no store
+ */
+uint64_t puflib_store_identity(puflib_plugin const * plugin);
+
+/**
+ * Bracket a call into a module. For a module that cannot run calls in
+ * parallel, this waits for the call's turn in the module's queue; for others,
+ * it does nothing.
+ */
+void puflib_module_enter(puflib_plugin * plugin);
+void puflib_module_leave(puflib_plugin * plugin);
+
+/// Queue of the calls to one module, which run one at a time
+typedef struct puflib_queue_s puflib_queue;
+
+/// Create an empty queue. Returns NULL on error (with errno set).
+puflib_queue * puflib_queue_new();
+
+/**
+ * Wait for the calling thread's turn to call into the module, in its priority
+ * class (puflib_get_priority()). Must be paired with puflib_queue_leave().
+ */
+void puflib_queue_enter(puflib_queue * queue);
+
+/// Hand the module on to the next call in the queue
+void puflib_queue_leave(puflib_queue * queue);
+/// @}
+
+/**
+ * @name Call traces
+ * Written by puflib_interpose_record() and read by the replay module. A trace
+ * is PUFLIB_TRACE_MAGIC and the le32 PUFLIB_TRACE_VERSION, padded to
+ * PUFLIB_TRACE_HEADER_LEN bytes, then one record per call in the order the
+ * calls returned. A record is a PUFLIB_TRACE_RECORD_LEN byte header:
+ *
+ *  - u8 operation (enum puflib_op)
+ *  - u8 1 if the call failed, else 0
+ *  - le16 length of the module name
+ *  - le32 errno of a failed call
+ *  - le32 duration of the call, in microseconds
+ *  - le32 input length
+ *  - le32 output length, 0 for a failed call
+ *
+ * followed by the module name, input and output.
+ */
+/// @{
+#define PUFLIB_TRACE_MAGIC          "PUFTRACE"
+#define PUFLIB_TRACE_VERSION        1
+#define PUFLIB_TRACE_HEADER_LEN     16
+#define PUFLIB_TRACE_RECORD_LEN     20
+/// @}
+
+/**
+ * Wipe any keys a module has cached with puflib_key_cache_put().
+ */
+void puflib_key_cache_drop(module_info const * module);
+
+/**
+ * Wipe the envelope data key held for a module, or for every module if
+ * module is NULL, and forget which key is current.
+ */
+void puflib_envelope_drop(module_info const * module);
+
+/**
+ * Return whether data begins with the multi-module container header.
+ */
+bool puflib_is_multi_sealed(uint8_t const * data, size_t len);
+
+/**
+ * Return whether data begins with the envelope header.
+ */
+bool puflib_is_envelope_sealed(uint8_t const * data, size_t len);
+
+/**
+ * Unseal a blob from puflib_seal_envelope() (see puflib_is_envelope_sealed()).
+ */
+bool puflib_unseal_envelope(uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Unseal a multi-module container (see puflib_is_multi_sealed()), trying all
+ * of its sections concurrently and returning the first success.
+ *
+ * @return true on error (with errno set)
+ */
+bool puflib_unseal_multi(uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Delete an entire directory tree. Subdirectories of the tree may be deleted
+ * concurrently.
  *
  * @param path - tree to delete
  * @return false on success, true on error (with errno set)
  */
 bool puflib_delete_tree(char const * path);
 
+/**
+ * Move a module's nonvolatile store out of the way and delete it in the
+ * background. The store disappears from its location before this returns;
+ * the space is reclaimed asynchronously, and whatever a previous process
+ * left unfinished is reclaimed along with it.
+ *
+ * @return false on success, true on error (with errno set). errno is ENOENT
+ *  if there is no store to delete.
+ */
+bool puflib_trash_nv_store(char const * module_name, enum puflib_storage_type type);
+
+/**
+ * Wait for all background deletion started by puflib_trash_nv_store() in this
+ * process to finish.
+ */
+void puflib_wait_trash();
+
+/**
+ * Return the directory holding module plugins and their manifest. This is
+ * allocated on the heap; the caller is responsible for freeing it.
+ *
+ * @return path to directory on success, NULL on error (with errno set)
+ */
+char * puflib_get_plugin_dir();
+
+/**
+ * Load a module plugin.
+ *
+ * @param path - path to the plugin file
+ * @return opaque plugin handle, or NULL on error (see puflib_plugin_error())
+ */
+void * puflib_plugin_open(char const * path);
+
+/**
+ * Look up a symbol exported by a loaded plugin.
+ *
+ * @param handle - handle returned by puflib_plugin_open()
+ * @param symbol - symbol name
+ * @return address of the symbol, or NULL on error (see puflib_plugin_error())
+ */
+void * puflib_plugin_symbol(void * handle, char const * symbol);
+
+/**
+ * Return a human-readable description of the last plugin loading error.
+ */
+char const * puflib_plugin_error();
+
 #endif // _PUFLIB_INTERNAL_H_
@@ -10,6 +10,21 @@
 
 #include <puflib.h>
 
+/**
+ * Module ABI version implemented by this puflib. A module that uses fields of
+ * module_info added after version 1 declares the version it was built for by
+ * exporting, next to MODULE_INFO:
+ *
+ *     unsigned const MODULE_ABI_VERSION = PUFLIB_MODULE_ABI_VERSION;
+ *
+ * A module without it is taken to be version 1, and only the fields up to
+ * chal_resp are read. puflib refuses to load a module built for a newer ABI.
+ *
+ * Version 2 adds open(), close() and the instance operations, and version 3
+ * adds caps.
+ */
+#define PUFLIB_MODULE_ABI_VERSION 3
+
 /**
  * @name Nonvolatile storage
  * These functions provide nonvolatile storage to modules, both for temporary
@@ -28,6 +43,7 @@ enum puflib_storage_type
 
     STORAGE_DISABLED_FILE,  ///< disabled final file - for internal use
     STORAGE_DISABLED_DIR,   ///< disabled final directory - for internal use
+    STORAGE_ENVELOPE_DIR,   ///< wrapped envelope keys - for internal use
 };
 
 /**
@@ -79,6 +95,715 @@ bool puflib_delete_nv_store(module_info const * module, enum puflib_storage_type
 
 /// @}
 
+/**
+ * @name Key/value stores
+ * A key/value store is a single file in one of a module's directory stores,
+ * mapped into memory with an index, so that helper data, counters and
+ * configuration can be read in constant time without parsing a file on every
+ * seal or unseal.
+ *
+ * Values returned by puflib_kv_get() point directly into the mapping. They are
+ * only valid until the next puflib_kv_put(), puflib_kv_delete() or
+ * puflib_kv_close() on the same handle, and must not be written through.
+ *
+ * A handle must not be used by more than one thread at a time. Between
+ * processes, any number of read-only handles or one writable handle may be
+ * open on a store at once; opening blocks until this is possible.
+ */
+/// @{
+
+/// Opaque key/value store handle
+typedef struct puflib_kv_s puflib_kv;
+
+/**
+ * Open a key/value store. The store lives in a directory store, which must
+ * already exist (see puflib_create_nv_store()), so it is deprovisioned,
+ * disabled and enabled along with it. A store that does not exist yet is
+ * created if opened for writing.
+ *
+ * @param module - the calling module
+ * @param type - directory store to use: STORAGE_TEMP_DIR or STORAGE_FINAL_DIR
+ * @param name - name of the store within the directory; a module may have
+ *  several
+ * @param writable - open for writing
+ * @return handle, or NULL on error (with errno set)
+ */
+puflib_kv * puflib_kv_open(module_info const * module, enum puflib_storage_type type,
+        char const * name, bool writable);
+
+/**
+ * Look up a key.
+ *
+ * If the key does not exist, this returns true with errno set to ENOENT.
+ *
+ * @param kv - store handle
+ * @param key - NUL-terminated key
+ * @param value - outparam for a pointer to the value, inside the store
+ * @param value_len - outparam for the length of the value, in bytes
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_kv_get(puflib_kv * kv, char const * key,
+        void const ** value, size_t * value_len);
+
+/**
+ * Set a key, adding it or replacing its value. The handle must be writable.
+ *
+ * @param kv - store handle
+ * @param key - NUL-terminated key
+ * @param value - value to store
+ * @param value_len - length of value, in bytes
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_kv_put(puflib_kv * kv, char const * key,
+        void const * value, size_t value_len);
+
+/**
+ * Remove a key. No-op if it does not exist. The handle must be writable.
+ *
+ * @param kv - store handle
+ * @param key - NUL-terminated key
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_kv_delete(puflib_kv * kv, char const * key);
+
+/**
+ * Flush changes to stable storage. Changes are visible to handles opened
+ * later, but are only guaranteed to survive a crash once synced.
+ *
+ * @param kv - store handle
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_kv_sync(puflib_kv * kv);
+
+/**
+ * Close a store handle. Changes are not synced; call puflib_kv_sync() first if
+ * required.
+ *
+ * @param kv - store handle, or NULL
+ */
+void puflib_kv_close(puflib_kv * kv);
+
+/// @}
+
+/**
+ * @name Enrollment blobs
+ * Blobs hold large, write-once data such as reference images and helper data
+ * produced at enrollment. A blob is a single checksummed file in one of a
+ * module's directory stores. Writing one preallocates its space and commits it
+ * atomically, so a crash never leaves a partial blob behind; reading one maps
+ * it into memory read-only.
+ *
+ * Mappings are cached for the life of the process and shared between callers,
+ * so mapping the same blob on every unseal costs a stat() rather than a read
+ * of the whole file. A cached mapping is dropped once the blob is replaced.
+ */
+/// @{
+
+/// Opaque handle to a mapped blob
+typedef struct puflib_blob_s puflib_blob;
+
+/// Opaque handle to a blob being written
+typedef struct puflib_blob_writer_s puflib_blob_writer;
+
+/// Flags for puflib_blob_map()
+enum puflib_blob_flags {
+    PUFLIB_BLOB_VERIFY = 0x01,  ///< Verify the checksum of the contents. This
+                                ///< reads the whole blob, but only the first
+                                ///< time it is mapped in this process.
+};
+
+/**
+ * Map a blob read-only. The store directory must exist.
+ *
+ * A blob whose header or (with PUFLIB_BLOB_VERIFY) contents are damaged is
+ * rejected with errno set to EBADMSG.
+ *
+ * @param module - the calling module
+ * @param type - directory store holding the blob: STORAGE_TEMP_DIR or
+ *  STORAGE_FINAL_DIR
+ * @param name - name of the blob within the directory
+ * @param flags - bitwise OR of puflib_blob_flags
+ * @return handle, or NULL on error (with errno set). Release with
+ *  puflib_blob_unmap().
+ */
+puflib_blob * puflib_blob_map(module_info const * module, enum puflib_storage_type type,
+        char const * name, unsigned flags);
+
+/**
+ * Return a pointer to the contents of a mapped blob, valid until it is
+ * unmapped.
+ */
+void const * puflib_blob_data(puflib_blob const * blob);
+
+/**
+ * Return the length of the contents of a mapped blob, in bytes.
+ */
+size_t puflib_blob_size(puflib_blob const * blob);
+
+/**
+ * Release a blob mapped with puflib_blob_map().
+ *
+ * @param blob - handle, or NULL
+ */
+void puflib_blob_unmap(puflib_blob * blob);
+
+/**
+ * Start writing a blob of a known size. Space for the whole blob is allocated
+ * immediately. The contents are filled in through puflib_blob_writer_data(),
+ * then made visible with puflib_blob_commit(), replacing any previous blob of
+ * the same name.
+ *
+ * @param module - the calling module
+ * @param type - directory store to hold the blob: STORAGE_TEMP_DIR or
+ *  STORAGE_FINAL_DIR
+ * @param name - name of the blob within the directory
+ * @param len - length of the contents, in bytes
+ * @return handle, or NULL on error (with errno set)
+ */
+puflib_blob_writer * puflib_blob_create(module_info const * module,
+        enum puflib_storage_type type, char const * name, size_t len);
+
+/**
+ * Return a pointer to the buffer for the contents of a blob being written.
+ */
+void * puflib_blob_writer_data(puflib_blob_writer * writer);
+
+/**
+ * Checksum a blob being written, flush it to stable storage and atomically
+ * move it into place. The writer is released, whether or not this succeeds.
+ *
+ * @param writer - handle from puflib_blob_create()
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_blob_commit(puflib_blob_writer * writer);
+
+/**
+ * Abandon a blob being written. Any previous blob of the same name is left as
+ * it was.
+ *
+ * @param writer - handle from puflib_blob_create(), or NULL
+ */
+void puflib_blob_abort(puflib_blob_writer * writer);
+
+/**
+ * Write a whole blob from memory. Equivalent to puflib_blob_create(), copying
+ * the data in and puflib_blob_commit().
+ *
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_blob_write(module_info const * module, enum puflib_storage_type type,
+        char const * name, void const * data, size_t len);
+
+/// @}
+
+/**
+ * @name Response stabilization
+ * Reading a response many times and taking a bitwise majority vote reduces
+ * its noise; counting how often each bit disagreed with the vote also shows
+ * which bits are unstable ("dark") and should be left out. A voter
+ * accumulates reads one at a time, and can be queried at any point. Bit
+ * strings are packed least significant bit first.
+ *
+ * A typical enrollment takes the majority of many reads, masks out the bits
+ * whose minority count exceeds a small threshold, and stores the mask with
+ * the helper data. Reconstruction then votes over fewer reads and keeps only
+ * the masked bits (puflib_bits_select()) before fuzzy extraction.
+ */
+/// @{
+
+/// Opaque majority voter
+typedef struct puflib_voter_s puflib_voter;
+
+/**
+ * Create a voter.
+ *
+ * @param nbits - number of bits in each read
+ * @param max_samples - maximum number of reads to be added, at most 65535
+ * @return voter, or NULL on error (with errno set)
+ */
+puflib_voter * puflib_voter_new(size_t nbits, unsigned max_samples);
+
+/**
+ * Free a voter.
+ *
+ * @param voter - voter, or NULL
+ */
+void puflib_voter_free(puflib_voter * voter);
+
+/**
+ * Add a read.
+ *
+ * @param voter - voter
+ * @param sample - read, of the voter's nbits bits
+ * @return false on success, true on error (errno is EOVERFLOW if max_samples
+ *  reads have already been added)
+ */
+bool puflib_voter_add(puflib_voter * voter, uint8_t const * sample);
+
+/// Number of reads added so far
+unsigned puflib_voter_samples(puflib_voter const * voter);
+
+/**
+ * Compute the bitwise majority of the reads so far. Bits that were 1 in
+ * exactly half the reads come out 0.
+ *
+ * @param voter - voter
+ * @param majority - receives nbits bits
+ */
+void puflib_voter_majority(puflib_voter const * voter, uint8_t * majority);
+
+/**
+ * Compute the mask of stable bits: those that disagreed with the majority in
+ * at most max_minority of the reads so far.
+ *
+ * @param voter - voter
+ * @param max_minority - largest minority count allowed for a stable bit
+ * @param mask - receives nbits bits, 1 for stable bits; may be NULL to only
+ *  count them
+ * @return number of stable bits
+ */
+size_t puflib_voter_mask(puflib_voter const * voter, unsigned max_minority, uint8_t * mask);
+
+/**
+ * Estimate the bit error rate of a single read: the fraction of all bits read
+ * that disagreed with the majority.
+ */
+double puflib_voter_error_rate(puflib_voter const * voter);
+
+/**
+ * Gather the bits selected by a mask into a dense string, in order.
+ *
+ * @param bits - nbits bits to select from
+ * @param mask - nbits bits, 1 for bits to keep
+ * @param nbits - number of bits in bits and mask
+ * @param out - receives the selected bits; must have room for one bit per
+ *  set bit of the mask
+ * @return number of bits written
+ */
+size_t puflib_bits_select(uint8_t const * bits, uint8_t const * mask, size_t nbits,
+        uint8_t * out);
+
+/// @}
+
+/**
+ * @name Fuzzy extraction
+ * PUF responses are noisy; these functions turn them into stable keys using
+ * the code-offset construction. At enrollment, a random key is encoded with
+ * an error-correcting code and XORed with the response to give helper data,
+ * which the module stores (it reveals little about the key on its own). At
+ * reconstruction, a fresh response and the helper data give the same key
+ * back, as long as the response has not drifted further than the code can
+ * correct.
+ *
+ * The code is an outer code applied to each block of the key, with each of
+ * its bits then repeated an odd number of times. The repetition corrects
+ * scattered bit errors cheaply, and the outer code what remains: use a BCH
+ * code for high-rate keys, or a Reed-Muller code (decoded using the
+ * repetition votes as soft information) for very noisy responses.
+ *
+ * Keys come out as uniformly random bits, but the response's entropy is
+ * what bounds their strength; hash the key before use. Handles are
+ * immutable once created, and may be shared between threads.
+ */
+/// @{
+
+/// Outer codes for the fuzzy extractor
+enum puflib_ecc_code {
+    PUFLIB_ECC_REPETITION,      ///< No outer code; one key bit per block
+    PUFLIB_ECC_BCH,             ///< Binary BCH code of length 2^m - 1 (3 <= m <= 15)
+                                ///< correcting t errors (t <= 128)
+    PUFLIB_ECC_REED_MULLER,     ///< Reed-Muller code RM(1, m): 2^m bits carrying m + 1
+                                ///< key bits (1 <= m <= 10)
+};
+
+/// Fuzzy extractor code parameters
+typedef struct puflib_ecc_params {
+    enum puflib_ecc_code code;  ///< Outer code
+    unsigned m;                 ///< Outer code size parameter; unused for repetition
+    unsigned t;                 ///< Errors corrected per BCH block; BCH only
+    unsigned repetition;        ///< Inner repetition factor: odd, at most 255; 1 for none
+    unsigned blocks;            ///< Number of outer codewords, at most 65535
+} puflib_ecc_params;
+
+/// Opaque fuzzy extractor
+typedef struct puflib_fe_s puflib_fe;
+
+/**
+ * Set up a fuzzy extractor. Code tables are computed here, so an extractor
+ * should be created once and reused.
+ *
+ * @param params - code parameters
+ * @return extractor, or NULL on error (with errno set; EINVAL for
+ *  unsupported parameters)
+ */
+puflib_fe * puflib_fe_new(puflib_ecc_params const * params);
+
+/**
+ * Set up a fuzzy extractor matching the parameters recorded in helper data.
+ *
+ * @return extractor, or NULL on error (with errno set; EBADMSG if the helper
+ *  data is not valid)
+ */
+puflib_fe * puflib_fe_from_helper(void const * helper, size_t helper_len);
+
+/**
+ * Free a fuzzy extractor.
+ *
+ * @param fe - extractor, or NULL
+ */
+void puflib_fe_free(puflib_fe * fe);
+
+/// Number of response bits consumed, packed least significant bit first
+size_t puflib_fe_response_bits(puflib_fe const * fe);
+
+/// Number of key bits produced, packed least significant bit first
+size_t puflib_fe_key_bits(puflib_fe const * fe);
+
+/// Length of the helper data, in bytes
+size_t puflib_fe_helper_len(puflib_fe const * fe);
+
+/**
+ * Enroll a response: choose a random key and compute helper data for it.
+ *
+ * @param fe - extractor
+ * @param response - enrollment response, puflib_fe_response_bits() long.
+ *  Ideally the majority of several reads; see puflib_voter_majority().
+ * @param key - receives the key, (puflib_fe_key_bits() + 7) / 8 bytes
+ * @param helper - receives the helper data, puflib_fe_helper_len() bytes
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_fe_enroll(puflib_fe const * fe, uint8_t const * response,
+        uint8_t * key, uint8_t * helper);
+
+/**
+ * Reconstruct a key from a fresh response and the helper data from its
+ * enrollment.
+ *
+ * Fails with errno set to EBADMSG if the helper data is damaged or was made
+ * with different parameters, or if the response has too many errors to
+ * correct. Note that a BCH code may also miscorrect a response with far too
+ * many errors into a wrong key; callers should check the key, e.g. by
+ * decrypting something authenticated with it.
+ *
+ * @param fe - extractor
+ * @param response - fresh response, puflib_fe_response_bits() long
+ * @param helper - helper data from puflib_fe_enroll()
+ * @param helper_len - length of helper, in bytes
+ * @param key - receives the key, (puflib_fe_key_bits() + 7) / 8 bytes
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_fe_reproduce(puflib_fe const * fe, uint8_t const * response,
+        uint8_t const * helper, size_t helper_len, uint8_t * key);
+
+/// @}
+
+/**
+ * @name Hashing
+ * SHA-256, for the hash in the puf(hash(i)) of module_info.chal_resp, and
+ * for deriving keys from fuzzy extractor output. The implementation is
+ * chosen once per process from what the CPU supports: the SHA extensions,
+ * or else portable C. Where the SHA extensions are missing but AVX2 is
+ * available, puflib_sha256_many() and puflib_sha256_batch() hash eight
+ * messages at a time, which makes them the better choice for hashing a
+ * large set of challenges during enrollment.
+ *
+ * Setting PUFLIB_SHA256 to "scalar", "sha-ni" or "avx2" in the environment
+ * limits the choice to that implementation (or the portable one, if the CPU
+ * lacks it); this is meant for benchmarking.
+ */
+/// @{
+
+/// Length of a SHA-256 digest, in bytes
+#define PUFLIB_SHA256_LEN 32
+
+/// Incremental SHA-256 state
+typedef struct puflib_sha256_ctx {
+    uint32_t state[8];
+    uint64_t len;               ///< Bytes hashed so far
+    uint8_t buf[64];            ///< Partial block
+} puflib_sha256_ctx;
+
+/**
+ * Start an incremental hash.
+ */
+void puflib_sha256_init(puflib_sha256_ctx * ctx);
+
+/**
+ * Add data to an incremental hash.
+ */
+void puflib_sha256_update(puflib_sha256_ctx * ctx, void const * data, size_t len);
+
+/**
+ * Finish an incremental hash. The context is wiped, and must be initialized
+ * again before reuse.
+ */
+void puflib_sha256_final(puflib_sha256_ctx * ctx, uint8_t digest[PUFLIB_SHA256_LEN]);
+
+/**
+ * Hash a buffer in one call.
+ */
+void puflib_sha256(void const * data, size_t len, uint8_t digest[PUFLIB_SHA256_LEN]);
+
+/**
+ * Hash many independent messages.
+ *
+ * @param count - number of messages
+ * @param data - pointer to each message
+ * @param lens - length of each message; equal lengths make best use of the
+ *  multi-buffer path
+ * @param digests - receives count digests, one after the other
+ */
+void puflib_sha256_many(size_t count, void const * const * data, size_t const * lens,
+        uint8_t * digests);
+
+/**
+ * Hash count messages of len bytes each, stored one after the other, as for
+ * a table of challenges.
+ *
+ * @param digests - receives count digests, one after the other
+ */
+void puflib_sha256_batch(void const * data, size_t len, size_t count, uint8_t * digests);
+
+/**
+ * Name of the implementation in use: "sha-ni", "avx2" (multi-buffer, with
+ * single messages hashed portably) or "scalar".
+ */
+char const * puflib_sha256_impl(void);
+
+/// @}
+
+/**
+ * @name Authenticated encryption
+ * AES-256-GCM, for modules to encrypt sealed data under a key derived from
+ * the PUF. On x86 the AES-NI and PCLMULQDQ instructions are used where
+ * available, with VAES for the keystream on CPUs that have it; elsewhere a
+ * portable implementation is used, which is much slower and whose AES table
+ * lookups are not constant time.
+ *
+ * An IV must never be used twice with the same key; with a fresh key per
+ * seal a fixed IV is fine, otherwise use a random one and store it with the
+ * ciphertext. Key handles are immutable once created, and may be shared
+ * between threads.
+ *
+ * Setting PUFLIB_GCM to "portable", "aes-ni" or "vaes" in the environment
+ * limits the choice to that implementation (or a slower one, if the CPU
+ * lacks it); this is meant for benchmarking.
+ */
+/// @{
+
+#define PUFLIB_GCM_KEY_LEN 32       ///< Key length, in bytes
+#define PUFLIB_GCM_IV_LEN  12       ///< IV length, in bytes
+#define PUFLIB_GCM_TAG_LEN 16       ///< Authentication tag length, in bytes
+
+/// Opaque expanded key
+typedef struct puflib_gcm_s puflib_gcm;
+
+/// Incremental encryption or decryption of one message. Members are private.
+typedef struct puflib_gcm_ctx {
+    puflib_gcm const * gcm;
+    uint8_t iv[PUFLIB_GCM_IV_LEN];
+    uint32_t ctr;
+    uint8_t acc[16];
+    uint8_t buf[16];
+    uint8_t ks[16];
+    uint64_t aad_len;
+    uint64_t text_len;
+} puflib_gcm_ctx;
+
+/**
+ * Expand a key. Keys should be expanded once and reused where possible.
+ *
+ * @return key handle, or NULL on error (with errno set)
+ */
+puflib_gcm * puflib_gcm_new(uint8_t const key[PUFLIB_GCM_KEY_LEN]);
+
+/**
+ * Wipe and free a key handle. NULL is ignored.
+ */
+void puflib_gcm_free(puflib_gcm * gcm);
+
+/**
+ * Encrypt a message in one call.
+ *
+ * @param aad - additional data, authenticated but not encrypted; may be NULL
+ *  if aad_len is 0
+ * @param out - receives len bytes of ciphertext; may be the same as in
+ * @param tag - receives the authentication tag
+ * @return false on success, true on error (with errno set; EMSGSIZE if the
+ *  message is over 64 GiB)
+ */
+bool puflib_gcm_seal(puflib_gcm const * gcm, uint8_t const iv[PUFLIB_GCM_IV_LEN],
+        void const * aad, size_t aad_len, void const * in, size_t len, void * out,
+        uint8_t tag[PUFLIB_GCM_TAG_LEN]);
+
+/**
+ * Decrypt and authenticate a message in one call. If the tag does not match,
+ * the output is wiped.
+ *
+ * @param out - receives len bytes of plaintext; may be the same as in
+ * @return false on success, true on error (with errno set; EBADMSG if the
+ *  ciphertext, additional data or tag has been altered)
+ */
+bool puflib_gcm_open(puflib_gcm const * gcm, uint8_t const iv[PUFLIB_GCM_IV_LEN],
+        void const * aad, size_t aad_len, void const * in, size_t len,
+        uint8_t const tag[PUFLIB_GCM_TAG_LEN], void * out);
+
+/**
+ * Start an incremental encryption or decryption. The key handle must stay
+ * alive until the context is finished.
+ */
+void puflib_gcm_start(puflib_gcm_ctx * ctx, puflib_gcm const * gcm,
+        uint8_t const iv[PUFLIB_GCM_IV_LEN]);
+
+/**
+ * Add additional data. All of it must be added before any text.
+ *
+ * @return false on success, true on error (with errno set; EINVAL if text
+ *  has already been processed)
+ */
+bool puflib_gcm_aad(puflib_gcm_ctx * ctx, void const * aad, size_t len);
+
+/**
+ * Encrypt the next part of a message. Parts may be any length.
+ *
+ * @param out - receives len bytes; may be the same as in
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_gcm_encrypt(puflib_gcm_ctx * ctx, void const * in, size_t len, void * out);
+
+/**
+ * Decrypt the next part of a message. The plaintext is not authenticated
+ * until puflib_gcm_verify() succeeds, and must not be acted on before then.
+ *
+ * @param out - receives len bytes; may be the same as in
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_gcm_decrypt(puflib_gcm_ctx * ctx, void const * in, size_t len, void * out);
+
+/**
+ * Finish an encryption, producing the tag. The context is wiped.
+ */
+void puflib_gcm_finish(puflib_gcm_ctx * ctx, uint8_t tag[PUFLIB_GCM_TAG_LEN]);
+
+/**
+ * Finish a decryption, checking the tag. The context is wiped.
+ *
+ * @return false if the tag matches, true otherwise (with errno set to
+ *  EBADMSG)
+ */
+bool puflib_gcm_verify(puflib_gcm_ctx * ctx, uint8_t const tag[PUFLIB_GCM_TAG_LEN]);
+
+/**
+ * Name of the implementation in use: "vaes", "aes-ni" or "portable".
+ */
+char const * puflib_gcm_impl(void);
+
+/// @}
+
+/**
+ * @name Key cache
+ * Reading the PUF and reconstructing a key is usually the slowest part of
+ * a seal or unseal. When the application enables the cache (see
+ * puflib_set_key_cache()), a module can keep keys it has reconstructed and
+ * skip the hardware for a while. Each key is identified by the module and an
+ * ID of the module's choosing, such as a hash of the helper data it was
+ * reconstructed from.
+ *
+ * Caching is best effort: a lookup may miss at any time, and the module
+ * must then reconstruct the key as usual.
+ */
+/// @{
+
+/// Longest key the cache holds, in bytes
+#define PUFLIB_KEY_CACHE_MAX 64
+
+/**
+ * Look up a cached key.
+ *
+ * @param module - module the key belongs to
+ * @param id - key ID
+ * @param key - receives the key
+ * @param key_len - length of the key
+ * @return false if the key was found, true otherwise (with errno set to
+ *  ENOENT)
+ */
+bool puflib_key_cache_get(module_info const * module, void const * id, size_t id_len,
+        uint8_t * key, size_t key_len);
+
+/**
+ * Cache a key, replacing any with the same ID. Does nothing if the cache is
+ * off.
+ *
+ * @param module - module the key belongs to
+ * @param id - key ID
+ * @param key - key to cache; the caller still owns and should wipe its copy
+ * @param key_len - length of the key, at most PUFLIB_KEY_CACHE_MAX
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_key_cache_put(module_info const * module, void const * id, size_t id_len,
+        uint8_t const * key, size_t key_len);
+
+/// @}
+
+/**
+ * @name Provisioning checkpoints
+ * These functions let a module record its progress through a multi-step
+ * provisioning process, and pick up where it left off when provisioning is
+ * continued. A checkpoint holds a step number and arbitrary module data,
+ * tagged with a module-defined format version.
+ *
+ * Each commit atomically replaces the previous checkpoint and is flushed to
+ * stable storage before returning, so after a crash or power loss the module
+ * sees either the old or the new checkpoint, never a mix. The checkpoint is
+ * kept in the module's STORAGE_TEMP_FILE store, so while one exists the module
+ * is reported as MODULE_IN_PROGRESS; a module using checkpoints must not use
+ * that store for anything else.
+ */
+/// @{
+
+/**
+ * Commit a checkpoint, replacing any previous one.
+ *
+ * @param module - the calling module
+ * @param version - format version of the data, chosen by the module
+ * @param step - provisioning step reached
+ * @param data - module data to store with the checkpoint; may be NULL if
+ *  data_len is zero
+ * @param data_len - length of data, in bytes
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_checkpoint_commit(module_info const * module, uint32_t version,
+        uint32_t step, void const * data, size_t data_len);
+
+/**
+ * Read back the last committed checkpoint.
+ *
+ * If there is no checkpoint, this returns true with errno set to ENOENT. If
+ * the checkpoint is damaged, it returns true with errno set to EBADMSG.
+ *
+ * @param module - the calling module
+ * @param version - outparam for the format version of the data
+ * @param step - outparam for the provisioning step reached
+ * @param data - outparam for the module data. Will be allocated; caller is
+ *  responsible for freeing. May be NULL if the data is not wanted.
+ * @param data_len - outparam for the length of the data, in bytes. May be
+ *  NULL if data is NULL.
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_checkpoint_restore(module_info const * module, uint32_t * version,
+        uint32_t * step, void ** data, size_t * data_len);
+
+/**
+ * Delete the checkpoint, typically once provisioning is complete. No-op if
+ * there is no checkpoint.
+ *
+ * @param module - the calling module
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_checkpoint_discard(module_info const * module);
+
+/// @}
+
 /**
  * Report a status message. The message should be unformatted and raw, like
  * "hardware caught fire"; formatting like "error (eeprom): hardware caught fire"
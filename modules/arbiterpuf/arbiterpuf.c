@@ -0,0 +1,611 @@
+// PUFlib arbiter PUF model module
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A software arbiter PUF, and XOR arbiter PUF, for protocol tests and load
+// tests that need a great many challenge-response pairs. It uses the additive
+// delay model: a 64-stage chain's delay difference for a challenge c is
+// w . phi(c), where phi_i(c) is the product of (1 - 2 c_j) over stages j >= i
+// (and phi_64 = 1), and it answers 1 when the difference is negative. A k-XOR
+// PUF XORs the answers of k chains. The weights are drawn at provisioning and
+// kept in the module's store.
+//
+// phi is a suffix parity of the challenge bits, so with p the suffix parity,
+// w . phi = sum(w) - 2 * sum(w_i for the bits set in p). That sum is taken
+// with lookup tables for chunks of p: bytes for portable C, 3-bit chunks with
+// vpermd for AVX2 (8 challenges at a time), and nibbles with vpermd on ZMM
+// registers for AVX-512 (16 at a time). Weights are integers, so all three
+// give the same responses.
+//
+// Challenges are taken as they are, not hashed, so that tests can choose
+// them; hash them first to follow the puf(hash(i)) convention. chal_resp()
+// takes any number of challenges, as 8 bytes each, little endian, with bit i
+// for stage i. It answers with one bit per challenge, least significant bit
+// first.
+//
+// PUFLIB_ARBITERPUF_CHAINS sets k when provisioning (default 4).
+// PUFLIB_ARBITERPUF can be set to "scalar", "avx2" or "avx512" to limit the
+// implementation used.
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ARBITERPUF_X86 1
+#include <immintrin.h>
+#endif
+
+bool is_hw_supported();
+enum provisioning_status provision();
+bool seal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len);
+bool unseal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len);
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len);
+
+static puflib_caps const CAPS;
+
+unsigned const MODULE_ABI_VERSION = PUFLIB_MODULE_ABI_VERSION;
+
+module_info const MODULE_INFO =
+{
+    .name = "arbiterpuf",
+    .author = "Assured Information Security, Inc.",
+    .desc = "arbiter and XOR arbiter PUF model",
+    .version = "1.0",
+    .is_hw_supported = &is_hw_supported,
+    .provision = &provision,
+    .chal_resp = &chal_resp,
+    .seal = &seal,
+    .unseal = &unseal,
+    .caps = &CAPS,
+};
+
+#define STAGES          64
+#define MAX_CHAINS      16
+#define DEFAULT_CHAINS  4
+#define CHALLENGE_LEN   8
+
+// The model has no noise, and calls only share it read-only
+static puflib_caps const CAPS = {
+    .threading = PUFLIB_THREADS_PARALLEL,
+    .deterministic = true,
+    .typical_us = 5,
+    .batch_len = CHALLENGE_LEN,
+};
+
+// Weights blob: format, stages, chains, reserved (le32 each), then for each
+// chain STAGES + 1 weights as le32 two's complement
+#define WEIGHTS_BLOB    "weights"
+#define WEIGHTS_FORMAT  1
+#define WEIGHTS_HEADER  16
+
+// Weights are normal with this standard deviation, and within 6 of them of 0,
+// so no delay difference can overflow 32 bits
+#define WEIGHT_SCALE    65536
+
+// Lookup tables for one chain. Entry v of a table is -2 times the sum of the
+// weights of the stages selected by the bits of v.
+struct chain_tables {
+    int32_t base;                   // sum of all weights
+    int32_t byte[8][256];           // byte b of the parity
+    int32_t tri[22][8];             // 3-bit chunk j of each 32-bit half
+    int32_t nibble[16][16];         // nibble j of each 32-bit half
+};
+
+// A loaded model. Models are shared by concurrent calls, and replaced when
+// the weights change.
+struct model {
+    unsigned refs;
+    unsigned chains;
+    int32_t * weights;              // chains * (STAGES + 1), for comparison
+    struct chain_tables * tables;   // chains
+};
+
+typedef void (*eval_fn)(struct model const * model, uint8_t const * challenges,
+        size_t count, uint8_t * out);
+
+static pthread_mutex_t MODEL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static struct model * MODEL = NULL;
+
+static pthread_once_t IMPL_ONCE = PTHREAD_ONCE_INIT;
+static eval_fn EVAL = NULL;
+
+
+bool is_hw_supported()
+{
+    return true;
+}
+
+
+static void store_le32(uint8_t * dest, uint32_t value)
+{
+    for (unsigned i = 0; i < 4; ++i) {
+        dest[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+static uint32_t load_le32(uint8_t const * src)
+{
+    return src[0] | (uint32_t) src[1] << 8 | (uint32_t) src[2] << 16 | (uint32_t) src[3] << 24;
+}
+
+
+static uint64_t load_le64(uint8_t const * src)
+{
+    return load_le32(src) | (uint64_t) load_le32(src + 4) << 32;
+}
+
+
+/// Bit i of the result is the XOR of bits i and up of x
+static inline uint64_t suffix_parity(uint64_t x)
+{
+    x ^= x >> 1;
+    x ^= x >> 2;
+    x ^= x >> 4;
+    x ^= x >> 8;
+    x ^= x >> 16;
+    x ^= x >> 32;
+    return x;
+}
+
+
+/**
+ * Sum -2 * w_i over the stages from first, for each bit of v, up to len bits
+ * and not past the last stage.
+ */
+static int32_t table_entry(int32_t const * w, unsigned first, unsigned len, unsigned v)
+{
+    int32_t sum = 0;
+    for (unsigned i = 0; i < len && first + i < STAGES; ++i) {
+        if ((v >> i) & 1) {
+            sum -= 2 * w[first + i];
+        }
+    }
+    return sum;
+}
+
+
+static void build_tables(int32_t const * w, struct chain_tables * t)
+{
+    t->base = 0;
+    for (unsigned i = 0; i <= STAGES; ++i) {
+        t->base += w[i];
+    }
+
+    for (unsigned b = 0; b < 8; ++b) {
+        for (unsigned v = 0; v < 256; ++v) {
+            t->byte[b][v] = table_entry(w, 8 * b, 8, v);
+        }
+    }
+
+    // Chunks never cross the 32-bit halves; the last of each half is 2 bits
+    for (unsigned h = 0; h < 2; ++h) {
+        for (unsigned j = 0; j < 11; ++j) {
+            for (unsigned v = 0; v < 8; ++v) {
+                t->tri[11 * h + j][v] = table_entry(w, 32 * h + 3 * j,
+                        j == 10 ? 2 : 3, v);
+            }
+        }
+        for (unsigned j = 0; j < 8; ++j) {
+            for (unsigned v = 0; v < 16; ++v) {
+                t->nibble[8 * h + j][v] = table_entry(w, 32 * h + 4 * j, 4, v);
+            }
+        }
+    }
+}
+
+
+static void eval_scalar(struct model const * model, uint8_t const * challenges,
+        size_t count, uint8_t * out)
+{
+    for (size_t n = 0; n < count; ++n) {
+        uint64_t const p = suffix_parity(load_le64(challenges + CHALLENGE_LEN * n));
+        uint32_t r = 0;
+
+        for (unsigned c = 0; c < model->chains; ++c) {
+            struct chain_tables const * t = &model->tables[c];
+            int32_t d = t->base;
+            for (unsigned b = 0; b < 8; ++b) {
+                d += t->byte[b][(p >> (8 * b)) & 0xff];
+            }
+            r ^= (uint32_t) d;
+        }
+
+        out[n / 8] |= (uint8_t) ((r >> 31) << (n % 8));
+    }
+}
+
+
+#ifdef ARBITERPUF_X86
+
+/**
+ * Suffix parities of 32-bit halves: hi within itself, lo continuing into hi.
+ */
+__attribute__((target("avx2")))
+static inline void parity_avx2(__m256i * lo, __m256i * hi)
+{
+    __m256i l = *lo, h = *hi;
+
+    for (int s = 1; s < 32; s *= 2) {
+        l = _mm256_xor_si256(l, _mm256_srli_epi32(l, s));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, s));
+    }
+    *lo = _mm256_xor_si256(l, _mm256_sub_epi32(_mm256_setzero_si256(),
+                _mm256_and_si256(h, _mm256_set1_epi32(1))));
+    *hi = h;
+}
+
+
+__attribute__((target("avx2")))
+static void eval_avx2(struct model const * model, uint8_t const * challenges,
+        size_t count, uint8_t * out)
+{
+    __m256i const order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    __m256i const seven = _mm256_set1_epi32(7);
+    size_t n = 0;
+
+    for (; n + 8 <= count; n += 8) {
+        __m128 const * src = (__m128 const *) (challenges + CHALLENGE_LEN * n);
+        __m256 a = _mm256_loadu_ps((float const *) src);
+        __m256 b = _mm256_loadu_ps((float const *) (src + 2));
+        __m256i idx[22];
+
+        // Even dwords are the low halves; the shuffle leaves the challenges
+        // in the order 0 1 4 5 2 3 6 7
+        __m256i lo = _mm256_permutevar8x32_epi32(
+                _mm256_castps_si256(_mm256_shuffle_ps(a, b, 0x88)), order);
+        __m256i hi = _mm256_permutevar8x32_epi32(
+                _mm256_castps_si256(_mm256_shuffle_ps(a, b, 0xdd)), order);
+        parity_avx2(&lo, &hi);
+
+        for (int j = 0; j < 11; ++j) {
+            idx[j] = _mm256_and_si256(_mm256_srli_epi32(lo, 3 * j), seven);
+            idx[11 + j] = _mm256_and_si256(_mm256_srli_epi32(hi, 3 * j), seven);
+        }
+
+        __m256i r = _mm256_setzero_si256();
+        for (unsigned c = 0; c < model->chains; ++c) {
+            struct chain_tables const * t = &model->tables[c];
+            __m256i d = _mm256_set1_epi32(t->base);
+            for (unsigned j = 0; j < 22; ++j) {
+                __m256i table = _mm256_loadu_si256((__m256i const *) t->tri[j]);
+                d = _mm256_add_epi32(d, _mm256_permutevar8x32_epi32(table, idx[j]));
+            }
+            r = _mm256_xor_si256(r, d);
+        }
+
+        out[n / 8] = (uint8_t) _mm256_movemask_ps(_mm256_castsi256_ps(r));
+    }
+
+    eval_scalar(model, challenges + CHALLENGE_LEN * n, count - n, out + n / 8);
+}
+
+
+__attribute__((target("avx512f")))
+static void eval_avx512(struct model const * model, uint8_t const * challenges,
+        size_t count, uint8_t * out)
+{
+    __m512i const even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+            16, 18, 20, 22, 24, 26, 28, 30);
+    __m512i const odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+    __m512i const fifteen = _mm512_set1_epi32(15);
+    size_t n = 0;
+
+    for (; n + 16 <= count; n += 16) {
+        uint8_t const * src = challenges + CHALLENGE_LEN * n;
+        __m512i a = _mm512_loadu_si512(src);
+        __m512i b = _mm512_loadu_si512(src + 64);
+        __m512i idx[16];
+
+        __m512i lo = _mm512_permutex2var_epi32(a, even, b);
+        __m512i hi = _mm512_permutex2var_epi32(a, odd, b);
+        for (int s = 1; s < 32; s *= 2) {
+            lo = _mm512_xor_si512(lo, _mm512_srli_epi32(lo, s));
+            hi = _mm512_xor_si512(hi, _mm512_srli_epi32(hi, s));
+        }
+        lo = _mm512_xor_si512(lo, _mm512_sub_epi32(_mm512_setzero_si512(),
+                    _mm512_and_si512(hi, _mm512_set1_epi32(1))));
+
+        for (int j = 0; j < 8; ++j) {
+            idx[j] = _mm512_and_si512(_mm512_srli_epi32(lo, 4 * j), fifteen);
+            idx[8 + j] = _mm512_and_si512(_mm512_srli_epi32(hi, 4 * j), fifteen);
+        }
+
+        __m512i r = _mm512_setzero_si512();
+        for (unsigned c = 0; c < model->chains; ++c) {
+            struct chain_tables const * t = &model->tables[c];
+            __m512i d = _mm512_set1_epi32(t->base);
+            for (unsigned j = 0; j < 16; ++j) {
+                __m512i table = _mm512_loadu_si512(t->nibble[j]);
+                d = _mm512_add_epi32(d, _mm512_permutexvar_epi32(idx[j], table));
+            }
+            r = _mm512_xor_si512(r, d);
+        }
+
+        __mmask16 m = _mm512_cmplt_epi32_mask(r, _mm512_setzero_si512());
+        out[n / 8] = (uint8_t) m;
+        out[n / 8 + 1] = (uint8_t) (m >> 8);
+    }
+
+    eval_avx2(model, challenges + CHALLENGE_LEN * n, count - n, out + n / 8);
+}
+
+#endif // ARBITERPUF_X86
+
+
+static void choose_impl(void)
+{
+    EVAL = &eval_scalar;
+
+#ifdef ARBITERPUF_X86
+    char const * want = getenv("PUFLIB_ARBITERPUF");
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool avx512 = avx2 && __builtin_cpu_supports("avx512f");
+
+    if (want && !strcmp(want, "scalar")) {
+        avx2 = avx512 = false;
+    } else if (want && !strcmp(want, "avx2")) {
+        avx512 = false;
+    }
+
+    if (avx512) {
+        EVAL = &eval_avx512;
+    } else if (avx2) {
+        EVAL = &eval_avx2;
+    }
+#endif
+}
+
+
+static void free_model(struct model * model)
+{
+    if (model) {
+        free(model->weights);
+        free(model->tables);
+        free(model);
+    }
+}
+
+
+static void release_model(struct model * model)
+{
+    pthread_mutex_lock(&MODEL_LOCK);
+    bool last = !--model->refs;
+    pthread_mutex_unlock(&MODEL_LOCK);
+
+    if (last) {
+        free_model(model);
+    }
+}
+
+
+/**
+ * Get the model for the stored weights, building its tables only when the
+ * weights differ from last time. Release with release_model().
+ */
+static struct model * get_model(void)
+{
+    struct model * model = NULL;
+    int errno_hold;
+
+    puflib_blob * blob = puflib_blob_map(&MODULE_INFO, STORAGE_FINAL_DIR, WEIGHTS_BLOB, 0);
+    if (!blob) {
+        if (errno == ENOENT) {
+            puflib_report(&MODULE_INFO, STATUS_ERROR, "module has not been provisioned");
+        }
+        return NULL;
+    }
+
+    uint8_t const * data = puflib_blob_data(blob);
+    size_t const len = puflib_blob_size(blob);
+    unsigned const chains = len >= WEIGHTS_HEADER ? load_le32(data + 8) : 0;
+
+    if (len < WEIGHTS_HEADER
+            || load_le32(data) != WEIGHTS_FORMAT
+            || load_le32(data + 4) != STAGES
+            || chains < 1 || chains > MAX_CHAINS
+            || len != WEIGHTS_HEADER + 4 * chains * (STAGES + 1)) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "weights have unexpected format");
+        errno_hold = EBADMSG;
+        goto err;
+    }
+
+    size_t const nweights = chains * (STAGES + 1);
+    int32_t weights[MAX_CHAINS * (STAGES + 1)];
+    for (size_t i = 0; i < nweights; ++i) {
+        weights[i] = (int32_t) load_le32(data + WEIGHTS_HEADER + 4 * i);
+    }
+    puflib_blob_unmap(blob);
+    blob = NULL;
+
+    pthread_mutex_lock(&MODEL_LOCK);
+    if (MODEL && MODEL->chains == chains
+            && !memcmp(MODEL->weights, weights, nweights * sizeof(weights[0]))) {
+        model = MODEL;
+        ++model->refs;
+        pthread_mutex_unlock(&MODEL_LOCK);
+        return model;
+    }
+    pthread_mutex_unlock(&MODEL_LOCK);
+
+    model = calloc(1, sizeof(*model));
+    if (!model) {
+        errno_hold = errno;
+        goto err;
+    }
+    model->chains = chains;
+    model->weights = malloc(nweights * sizeof(weights[0]));
+    model->tables = malloc(chains * sizeof(model->tables[0]));
+    if (!model->weights || !model->tables) {
+        errno_hold = errno;
+        goto err;
+    }
+    memcpy(model->weights, weights, nweights * sizeof(weights[0]));
+    for (unsigned c = 0; c < chains; ++c) {
+        build_tables(weights + c * (STAGES + 1), &model->tables[c]);
+    }
+
+    // One reference for the caller, one for MODEL
+    model->refs = 2;
+    pthread_mutex_lock(&MODEL_LOCK);
+    struct model * old = MODEL;
+    MODEL = model;
+    bool last = old && !--old->refs;
+    pthread_mutex_unlock(&MODEL_LOCK);
+
+    if (last) {
+        free_model(old);
+    }
+    return model;
+
+err:
+    puflib_blob_unmap(blob);
+    free_model(model);
+    errno = errno_hold;
+    return NULL;
+}
+
+
+/**
+ * Draw normally distributed weights, as sums of 12 uniform variables. This
+ * bounds them to 6 standard deviations.
+ */
+static bool draw_weights(uint8_t * out, size_t count)
+{
+    uint16_t u[12];
+
+    for (size_t i = 0; i < count; ++i) {
+        if (puflib_random_bytes(u, sizeof(u))) {
+            return true;
+        }
+        int32_t w = -6 * WEIGHT_SCALE;
+        for (unsigned j = 0; j < 12; ++j) {
+            w += u[j];
+        }
+        store_le32(out + 4 * i, (uint32_t) w);
+    }
+    return false;
+}
+
+
+enum provisioning_status provision()
+{
+    unsigned chains = DEFAULT_CHAINS;
+    char const * s = getenv("PUFLIB_ARBITERPUF_CHAINS");
+
+    if (s && *s) {
+        char * end;
+        unsigned long v = strtoul(s, &end, 10);
+        if (*end || v < 1 || v > MAX_CHAINS) {
+            puflib_report_fmt(&MODULE_INFO, STATUS_ERROR,
+                    "PUFLIB_ARBITERPUF_CHAINS must be from 1 to %d", MAX_CHAINS);
+            return PROVISION_ERROR;
+        }
+        chains = (unsigned) v;
+    }
+
+    char * store = puflib_create_nv_store(&MODULE_INFO, STORAGE_FINAL_DIR);
+    if (!store) {
+        puflib_perror(&MODULE_INFO);
+        return PROVISION_ERROR;
+    }
+    free(store);
+
+    size_t const len = WEIGHTS_HEADER + 4 * chains * (STAGES + 1);
+    puflib_blob_writer * writer = puflib_blob_create(&MODULE_INFO, STORAGE_FINAL_DIR,
+            WEIGHTS_BLOB, len);
+    if (!writer) {
+        goto err;
+    }
+
+    uint8_t * data = puflib_blob_writer_data(writer);
+    memset(data, 0, WEIGHTS_HEADER);
+    store_le32(data, WEIGHTS_FORMAT);
+    store_le32(data + 4, STAGES);
+    store_le32(data + 8, chains);
+
+    if (draw_weights(data + WEIGHTS_HEADER, chains * (STAGES + 1))) {
+        int errno_hold = errno;
+        puflib_blob_abort(writer);
+        errno = errno_hold;
+        goto err;
+    }
+    if (puflib_blob_commit(writer)) {
+        goto err;
+    }
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO, "created a %u-XOR arbiter PUF of %d stages",
+            chains, STAGES);
+    return PROVISION_COMPLETE;
+
+err:
+    puflib_perror(&MODULE_INFO);
+    puflib_delete_nv_store(&MODULE_INFO, STORAGE_FINAL_DIR);
+    return PROVISION_ERROR;
+}
+
+
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len)
+{
+    if (!data_in_len || data_in_len % CHALLENGE_LEN) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_ERROR,
+                "challenges must be %d bytes each", CHALLENGE_LEN);
+        errno = EINVAL;
+        return true;
+    }
+
+    size_t const count = data_in_len / CHALLENGE_LEN;
+    uint8_t * out = calloc((count + 7) / 8, 1);
+    if (!out) {
+        puflib_perror(&MODULE_INFO);
+        return true;
+    }
+
+    struct model * model = get_model();
+    if (!model) {
+        int errno_hold = errno;
+        free(out);
+        errno = errno_hold;
+        puflib_perror(&MODULE_INFO);
+        return true;
+    }
+
+    pthread_once(&IMPL_ONCE, &choose_impl);
+    EVAL(model, data_in, count, out);
+    release_model(model);
+
+    *data_out = out;
+    *data_out_len = (count + 7) / 8;
+    return false;
+}
+
+
+// A delay model is no place to keep secrets: anyone holding the weights can
+// predict every response, and a model's responses are no harder to learn.
+// Sealing is for the hardware modules.
+bool seal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len)
+{
+    (void) data_in;
+    (void) data_in_len;
+    (void) data_out;
+    (void) data_out_len;
+
+    puflib_report(&MODULE_INFO, STATUS_ERROR, "sealing is not supported by this module");
+    errno = ENOTSUP;
+    return true;
+}
+
+
+bool unseal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len)
+{
+    return seal(data_in, data_in_len, data_out, data_out_len);
+}
@@ -0,0 +1,659 @@
+// PUFlib memory timing module
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Derives a fingerprint from the memory hierarchy's access latencies, as
+// measured from userspace with the time stamp counter, so that it runs on
+// ordinary x86-64 machines. The fingerprint binds to the machine's caches,
+// TLBs, memory and their configuration rather than to one chip, so it is a
+// weaker binding than a hardware PUF; it is meant for machines without one,
+// and for testing.
+//
+// The key is NOT unique to the machine. Most of the stable pairs are
+// structural orderings (a larger working set, or random order, is slower)
+// that come out the same on every machine of the same class, so another
+// machine with the same processor and memory configuration is likely to
+// unseal the same data. Only the less stable pairs carry anything of the
+// individual machine.
+//
+// Each measurement round times pointer chases through working sets from 8 KiB
+// to 32 MiB, in sequential, page-strided and random order. A feature is the
+// median of several timed batches, in cycles per load, which filters out
+// interrupts and migrations. The chases are dependent loads, which is what
+// makes them measure latency, so rather than vectorizing them the overhead
+// is kept down by timing batches of loads between fences. Rounds are
+// serialized within the process, since concurrent ones would disturb each
+// other.
+//
+// Absolute latencies move with clock speed and load, but their order mostly
+// does not: the response is one bit for each pair of features, set if the
+// first is slower. Enrollment votes over many rounds and masks off the pairs
+// that ever disagreed, and the stable pairs go through the fuzzy extractor.
+// Every feature takes part in the enrolled pairs, and the mask and helper
+// data are public, so a response built from them would give away the key:
+// chal_resp() is not supported.
+//
+
+#define _DEFAULT_SOURCE
+
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if !defined(__x86_64__)
+#error "memtiming requires x86-64"
+#endif
+
+#include <cpuid.h>
+#include <x86intrin.h>
+
+bool is_hw_supported();
+enum provisioning_status provision();
+bool seal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len);
+bool unseal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len);
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len);
+
+static puflib_caps const CAPS;
+
+unsigned const MODULE_ABI_VERSION = PUFLIB_MODULE_ABI_VERSION;
+
+module_info const MODULE_INFO =
+{
+    .name = "memtiming",
+    .author = "Assured Information Security, Inc.",
+    .desc = "memory access timing fingerprint (not machine-unique)",
+    .version = "1.0",
+    .is_hw_supported = &is_hw_supported,
+    .provision = &provision,
+    .chal_resp = &chal_resp,
+    .seal = &seal,
+    .unseal = &unseal,
+    .caps = &CAPS,
+};
+
+#define LINE            64
+#define PAGE            4096
+
+// Working sets are 2^MIN_SHIFT to 2^MAX_SHIFT bytes, each chased in every
+// pattern
+#define MIN_SHIFT       13
+#define MAX_SHIFT       25
+#define BUFFER_LEN      ((size_t) 1 << MAX_SHIFT)
+enum pattern { SEQUENTIAL, PAGE_STRIDE, RANDOM, PATTERNS };
+#define FEATURES        ((MAX_SHIFT - MIN_SHIFT + 1) * PATTERNS)
+#define PAIRS           (FEATURES * (FEATURES - 1) / 2)
+#define PAIR_BYTES      ((PAIRS + 7) / 8)
+
+// Loads per timed batch, and batches per feature
+#define BATCH           4096
+#define SAMPLES         9
+
+// Enrollment keeps the pairs that agreed in all ENROLL_ROUNDS rounds; keys
+// are reconstructed from the majority of RECONSTRUCT_ROUNDS
+#define ENROLL_ROUNDS       11
+#define RECONSTRUCT_ROUNDS  3
+
+// Fuzzy extraction: repetition code, one key bit per REPETITION stable pairs,
+// and no fewer than MIN_KEY_BITS
+#define REPETITION      5
+#define MIN_KEY_BITS    32
+#define MAX_KEY_BITS    128
+
+// Key blob: format, mask length (le32 each), mask of the stable pairs, then
+// the fuzzy extractor helper data
+#define KEY_BLOB        "key"
+#define KEY_FORMAT      1
+#define KEY_HEADER      8
+
+// Sealed data: nonce, ciphertext, tag
+#define SEALED_OVERHEAD (PUFLIB_GCM_IV_LEN + PUFLIB_GCM_TAG_LEN)
+
+// Rounds are serialized by MEASURE_LOCK, and take about 100 ms
+static puflib_caps const CAPS = {
+    .threading = PUFLIB_THREADS_SAFE,
+    .typical_us = 100000,
+};
+
+static pthread_mutex_t MEASURE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+bool is_hw_supported()
+{
+    unsigned eax, ebx, ecx, edx;
+
+    // Time stamp counter
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & (1u << 4));
+}
+
+
+static void wipe(void * data, size_t len)
+{
+    volatile uint8_t * p = data;
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+
+static void store_le32(uint8_t * dest, uint32_t value)
+{
+    for (unsigned i = 0; i < 4; ++i) {
+        dest[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+static uint32_t load_le32(uint8_t const * src)
+{
+    return src[0] | (uint32_t) src[1] << 8 | (uint32_t) src[2] << 16 | (uint32_t) src[3] << 24;
+}
+
+
+/**
+ * Link the lines of the first len bytes of buf into a cycle, in the order of
+ * the pattern, and return its start. Random orders come from a fixed seed, so
+ * every round chases the same cycle.
+ */
+static void ** build_chain(uint8_t * buf, size_t len, enum pattern pattern, uint32_t * order)
+{
+    size_t const lines = len / LINE;
+    size_t const pages = len / PAGE;
+
+    for (size_t k = 0; k < lines; ++k) {
+        switch (pattern) {
+        case SEQUENTIAL:
+            order[k] = (uint32_t) k;
+            break;
+        case PAGE_STRIDE:
+            // Every page in turn, then the next line of each
+            order[k] = (uint32_t) ((k % pages) * (PAGE / LINE) + k / pages);
+            break;
+        default:
+            order[k] = (uint32_t) k;
+        }
+    }
+
+    if (pattern == RANDOM) {
+        uint64_t s = 0x9e3779b97f4a7c15ull ^ len;
+        for (size_t k = lines - 1; k > 0; --k) {
+            s ^= s >> 12;
+            s ^= s << 25;
+            s ^= s >> 27;
+            size_t j = (size_t) ((s * 0x2545f4914f6cdd1dull) % (k + 1));
+            uint32_t t = order[k];
+            order[k] = order[j];
+            order[j] = t;
+        }
+    }
+
+    for (size_t k = 0; k < lines; ++k) {
+        void ** line = (void **) (buf + (size_t) order[k] * LINE);
+        *line = buf + (size_t) order[(k + 1) % lines] * LINE;
+    }
+    return (void **) (buf + (size_t) order[0] * LINE);
+}
+
+
+/**
+ * Chase count pointers from *p, leaving *p where the chase stopped.
+ * @return elapsed time stamp counter ticks
+ */
+static uint64_t chase(void *** p, size_t count)
+{
+    void ** q = *p;
+
+    _mm_lfence();
+    uint64_t start = __rdtsc();
+    _mm_lfence();
+
+    for (size_t i = 0; i < count; ++i) {
+        q = (void **) *q;
+    }
+
+    _mm_lfence();
+    uint64_t end = __rdtsc();
+    _mm_lfence();
+
+    *p = q;
+    return end - start;
+}
+
+
+/// Median of SAMPLES values; sorts them
+static uint64_t median(uint64_t * v)
+{
+    for (size_t i = 1; i < SAMPLES; ++i) {
+        uint64_t x = v[i];
+        size_t j = i;
+        for (; j && v[j - 1] > x; --j) {
+            v[j] = v[j - 1];
+        }
+        v[j] = x;
+    }
+    return v[SAMPLES / 2];
+}
+
+
+/**
+ * Measure every feature once, in ticks per BATCH loads.
+ */
+static bool measure(uint64_t features[FEATURES])
+{
+    int errno_hold;
+
+    uint8_t * buf = mmap(NULL, BUFFER_LEN, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return true;
+    }
+    // Whether a set is backed by huge pages changes from run to run, and
+    // would change its latencies with it
+#ifdef MADV_NOHUGEPAGE
+    madvise(buf, BUFFER_LEN, MADV_NOHUGEPAGE);
+#endif
+
+    uint32_t * order = malloc(BUFFER_LEN / LINE * sizeof(uint32_t));
+    if (!order) {
+        errno_hold = errno;
+        munmap(buf, BUFFER_LEN);
+        errno = errno_hold;
+        return true;
+    }
+
+    pthread_mutex_lock(&MEASURE_LOCK);
+
+    size_t f = 0;
+    for (unsigned shift = MIN_SHIFT; shift <= MAX_SHIFT; ++shift) {
+        for (enum pattern pattern = 0; pattern < PATTERNS; ++pattern, ++f) {
+            void ** p = build_chain(buf, (size_t) 1 << shift, pattern, order);
+            uint64_t samples[SAMPLES];
+
+            // One batch to warm up, then the batches carry on around the
+            // cycle, so sets larger than the caches keep missing
+            chase(&p, BATCH);
+            for (unsigned i = 0; i < SAMPLES; ++i) {
+                samples[i] = chase(&p, BATCH);
+            }
+            features[f] = median(samples);
+        }
+    }
+
+    pthread_mutex_unlock(&MEASURE_LOCK);
+
+    free(order);
+    munmap(buf, BUFFER_LEN);
+    return false;
+}
+
+
+/// Set bit n of out if feature a is slower than feature b
+static inline void compare(uint64_t const * features, size_t a, size_t b, size_t n,
+        uint8_t * out)
+{
+    out[n / 8] |= (uint8_t) ((features[a] > features[b]) << (n % 8));
+}
+
+
+/**
+ * Measure a round and compare every pair of features, into PAIRS bits.
+ */
+static bool read_pairs(uint8_t out[PAIR_BYTES])
+{
+    uint64_t features[FEATURES];
+
+    if (measure(features)) {
+        return true;
+    }
+
+    memset(out, 0, PAIR_BYTES);
+    size_t n = 0;
+    for (size_t a = 0; a < FEATURES; ++a) {
+        for (size_t b = a + 1; b < FEATURES; ++b, ++n) {
+            compare(features, a, b, n, out);
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Vote over a number of rounds.
+ */
+static puflib_voter * vote(unsigned rounds)
+{
+    uint8_t pairs[PAIR_BYTES];
+
+    puflib_voter * voter = puflib_voter_new(PAIRS, rounds);
+    if (!voter) {
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < rounds; ++i) {
+        if (read_pairs(pairs) || puflib_voter_add(voter, pairs)) {
+            int errno_hold = errno;
+            puflib_voter_free(voter);
+            errno = errno_hold;
+            return NULL;
+        }
+    }
+    return voter;
+}
+
+
+static bool enroll_key(void)
+{
+    puflib_voter * voter = NULL;
+    puflib_fe * fe = NULL;
+    uint8_t * blob = NULL;
+    uint8_t majority[PAIR_BYTES], response[PAIR_BYTES];
+    uint8_t fe_key[MAX_KEY_BITS / 8];
+    int errno_hold;
+
+    voter = vote(ENROLL_ROUNDS);
+    if (!voter) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    size_t stable = puflib_voter_mask(voter, 0, NULL);
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO,
+            "%zu of %d feature pairs are stable; estimated bit error rate %.4f",
+            stable, PAIRS, puflib_voter_error_rate(voter));
+
+    unsigned key_bits = (unsigned) (stable / REPETITION);
+    if (key_bits > MAX_KEY_BITS) {
+        key_bits = MAX_KEY_BITS;
+    }
+    if (key_bits < MIN_KEY_BITS) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR,
+                "too few stable timing features; is the machine heavily loaded?");
+        errno_hold = ENOSPC;
+        goto err;
+    }
+
+    puflib_ecc_params const code = {
+        .code = PUFLIB_ECC_REPETITION,
+        .repetition = REPETITION,
+        .blocks = key_bits,
+    };
+    fe = puflib_fe_new(&code);
+    if (!fe) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    size_t const blob_len = KEY_HEADER + PAIR_BYTES + puflib_fe_helper_len(fe);
+    blob = calloc(blob_len, 1);
+    if (!blob) {
+        errno_hold = errno;
+        goto err;
+    }
+    store_le32(blob, KEY_FORMAT);
+    store_le32(blob + 4, PAIR_BYTES);
+    uint8_t * mask = blob + KEY_HEADER;
+    puflib_voter_mask(voter, 0, mask);
+
+    // Keep only as many stable pairs as the extractor takes
+    size_t const response_bits = puflib_fe_response_bits(fe);
+    for (size_t i = 0, kept = 0; i < PAIRS; ++i) {
+        if ((mask[i / 8] >> (i % 8)) & 1) {
+            if (kept == response_bits) {
+                mask[i / 8] &= (uint8_t) ~(1u << (i % 8));
+            } else {
+                ++kept;
+            }
+        }
+    }
+
+    puflib_voter_majority(voter, majority);
+    puflib_bits_select(majority, mask, PAIRS, response);
+    if (puflib_fe_enroll(fe, response, fe_key, blob + KEY_HEADER + PAIR_BYTES)
+            || puflib_blob_write(&MODULE_INFO, STORAGE_FINAL_DIR, KEY_BLOB, blob, blob_len)) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO, "enrolled a %u-bit key", key_bits);
+
+    wipe(fe_key, sizeof(fe_key));
+    free(blob);
+    puflib_fe_free(fe);
+    puflib_voter_free(voter);
+    return false;
+
+err:
+    wipe(fe_key, sizeof(fe_key));
+    free(blob);
+    puflib_fe_free(fe);
+    puflib_voter_free(voter);
+    errno = errno_hold;
+    return true;
+}
+
+
+enum provisioning_status provision()
+{
+    char * store = puflib_create_nv_store(&MODULE_INFO, STORAGE_FINAL_DIR);
+    if (!store) {
+        puflib_perror(&MODULE_INFO);
+        return PROVISION_ERROR;
+    }
+    free(store);
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO, "measuring memory timing, %d rounds",
+            ENROLL_ROUNDS);
+    if (enroll_key()) {
+        puflib_perror(&MODULE_INFO);
+        // Leave nothing behind, or the module would look provisioned
+        puflib_delete_nv_store(&MODULE_INFO, STORAGE_FINAL_DIR);
+        return PROVISION_ERROR;
+    }
+
+    return PROVISION_COMPLETE;
+}
+
+
+/**
+ * Reconstruct the sealing key, or take it from the key cache under the hash
+ * of the key blob.
+ */
+static bool get_key(uint8_t key[PUFLIB_GCM_KEY_LEN])
+{
+    puflib_voter * voter = NULL;
+    puflib_fe * fe = NULL;
+    uint8_t majority[PAIR_BYTES], response[PAIR_BYTES];
+    uint8_t fe_key[MAX_KEY_BITS / 8];
+    uint8_t id[PUFLIB_SHA256_LEN];
+    int errno_hold;
+
+    puflib_blob * blob = puflib_blob_map(&MODULE_INFO, STORAGE_FINAL_DIR, KEY_BLOB, 0);
+    if (!blob) {
+        if (errno == ENOENT) {
+            puflib_report(&MODULE_INFO, STATUS_ERROR, "module has not been provisioned");
+        }
+        return true;
+    }
+
+    uint8_t const * data = puflib_blob_data(blob);
+    size_t const len = puflib_blob_size(blob);
+
+    puflib_sha256(data, len, id);
+    if (!puflib_key_cache_get(&MODULE_INFO, id, sizeof(id), key, PUFLIB_GCM_KEY_LEN)) {
+        puflib_blob_unmap(blob);
+        return false;
+    }
+
+    if (len < KEY_HEADER + PAIR_BYTES || load_le32(data) != KEY_FORMAT
+            || load_le32(data + 4) != PAIR_BYTES) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "key data has unexpected format");
+        errno_hold = EBADMSG;
+        goto err;
+    }
+    uint8_t const * mask = data + KEY_HEADER;
+    uint8_t const * helper = mask + PAIR_BYTES;
+    size_t const helper_len = len - KEY_HEADER - PAIR_BYTES;
+
+    fe = puflib_fe_from_helper(helper, helper_len);
+    if (!fe) {
+        errno_hold = errno;
+        goto err;
+    }
+    if (puflib_fe_key_bits(fe) > MAX_KEY_BITS) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "key data has unexpected format");
+        errno_hold = EBADMSG;
+        goto err;
+    }
+
+    voter = vote(RECONSTRUCT_ROUNDS);
+    if (!voter) {
+        errno_hold = errno;
+        goto err;
+    }
+    puflib_voter_majority(voter, majority);
+
+    if (puflib_bits_select(majority, mask, PAIRS, response) != puflib_fe_response_bits(fe)) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "key data has unexpected format");
+        errno_hold = EBADMSG;
+        goto err;
+    }
+
+    if (puflib_fe_reproduce(fe, response, helper, helper_len, fe_key)) {
+        errno_hold = errno;
+        puflib_report(&MODULE_INFO, STATUS_ERROR,
+                "could not reconstruct the key; the memory timing has changed");
+        goto err;
+    }
+    puflib_sha256(fe_key, (puflib_fe_key_bits(fe) + 7) / 8, key);
+
+    if (puflib_key_cache_put(&MODULE_INFO, id, sizeof(id), key, PUFLIB_GCM_KEY_LEN)) {
+        puflib_perror(&MODULE_INFO);
+    }
+
+    wipe(fe_key, sizeof(fe_key));
+    wipe(response, sizeof(response));
+    puflib_voter_free(voter);
+    puflib_fe_free(fe);
+    puflib_blob_unmap(blob);
+    return false;
+
+err:
+    wipe(fe_key, sizeof(fe_key));
+    wipe(response, sizeof(response));
+    puflib_voter_free(voter);
+    puflib_fe_free(fe);
+    puflib_blob_unmap(blob);
+    errno = errno_hold;
+    return true;
+}
+
+
+bool seal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t key[PUFLIB_GCM_KEY_LEN];
+    puflib_gcm * gcm = NULL;
+    uint8_t * out = NULL;
+    int errno_hold;
+
+    if (data_in_len > SIZE_MAX - SEALED_OVERHEAD) {
+        errno_hold = EMSGSIZE;
+        goto err;
+    }
+
+    if (get_key(key)) {
+        errno_hold = errno;
+        goto err;
+    }
+    gcm = puflib_gcm_new(key);
+    wipe(key, sizeof(key));
+
+    out = malloc(data_in_len + SEALED_OVERHEAD);
+    if (!gcm || !out || puflib_random_bytes(out, PUFLIB_GCM_IV_LEN)
+            || puflib_gcm_seal(gcm, out, NULL, 0, data_in, data_in_len,
+                out + PUFLIB_GCM_IV_LEN, out + PUFLIB_GCM_IV_LEN + data_in_len)) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    puflib_gcm_free(gcm);
+    *data_out = out;
+    *data_out_len = data_in_len + SEALED_OVERHEAD;
+    return false;
+
+err:
+    puflib_gcm_free(gcm);
+    free(out);
+    errno = errno_hold;
+    puflib_perror(&MODULE_INFO);
+    return true;
+}
+
+
+bool unseal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t key[PUFLIB_GCM_KEY_LEN];
+    puflib_gcm * gcm = NULL;
+    uint8_t * out = NULL;
+    int errno_hold;
+
+    if (data_in_len < SEALED_OVERHEAD) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "sealed data is truncated");
+        errno_hold = EBADMSG;
+        goto err;
+    }
+    size_t const len = data_in_len - SEALED_OVERHEAD;
+
+    if (get_key(key)) {
+        errno_hold = errno;
+        goto err;
+    }
+    gcm = puflib_gcm_new(key);
+    wipe(key, sizeof(key));
+
+    // One extra byte, so that empty data still gives a valid pointer
+    out = malloc(len + 1);
+    if (!gcm || !out) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    if (puflib_gcm_open(gcm, data_in, NULL, 0, data_in + PUFLIB_GCM_IV_LEN, len,
+                data_in + PUFLIB_GCM_IV_LEN + len, out)) {
+        errno_hold = errno;
+        if (errno_hold == EBADMSG) {
+            puflib_report(&MODULE_INFO, STATUS_ERROR,
+                    "sealed data was altered or sealed on another machine");
+        }
+        goto err;
+    }
+
+    puflib_gcm_free(gcm);
+    *data_out = out;
+    *data_out_len = len;
+    return false;
+
+err:
+    puflib_gcm_free(gcm);
+    free(out);
+    errno = errno_hold;
+    puflib_perror(&MODULE_INFO);
+    return true;
+}
+
+
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len)
+{
+    (void) data_in;
+    (void) data_in_len;
+    (void) data_out;
+    (void) data_out_len;
+
+    puflib_report(&MODULE_INFO, STATUS_ERROR,
+            "challenge-response is not supported by this module");
+    errno = ENOTSUP;
+    return true;
+}
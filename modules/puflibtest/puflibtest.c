@@ -20,6 +20,7 @@ module_info const MODULE_INFO =
     .name = "puflibtest",
     .author = "Chris Pavlina <pavlinac@ainfosec.com>",
     .desc = "puflib test module",
+    .version = "1.0",
     .is_hw_supported = &is_hw_supported,
     .provision = &provision,
     .chal_resp = &chal_resp,
@@ -74,88 +75,81 @@ bool unseal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, si
 }
 
 
-static enum provisioning_status provision_start(FILE *f);
-static enum provisioning_status provision_continue(FILE *f);
+// Provisioning runs over three invocations, to exercise continuing. Progress
+// is kept in a checkpoint, along with the answer to the query asked in the
+// first step.
+#define CHECKPOINT_VERSION 1
+
+static enum provisioning_status provision_start(void);
+static enum provisioning_status provision_continue(uint32_t step, char const * input);
 
 enum provisioning_status provision()
 {
-    char *path;
-    FILE *f;
+    uint32_t version, step;
+    void * data;
+    size_t data_len;
 
-    path = puflib_create_nv_store(&MODULE_INFO, STORAGE_TEMP_FILE);
-    if (path) {
-        f = fopen(path, "r+");
-        if (!f) {
+    if (puflib_checkpoint_restore(&MODULE_INFO, &version, &step, &data, &data_len)) {
+        if (errno == ENOENT) {
+            return provision_start();
+        } else {
             puflib_perror(&MODULE_INFO);
-            free(path);
             return PROVISION_ERROR;
         }
-        puflib_report(&MODULE_INFO, STATUS_INFO, "creating NV store");
-        free(path);
-        return provision_start(f);
-    } else {
-        puflib_report(&MODULE_INFO, STATUS_INFO, "could not create or NV store exists, continuing provision");
-        free(path);
-        path = puflib_get_nv_store(&MODULE_INFO, STORAGE_TEMP_FILE);
-        if (!path) {
-            puflib_perror(&MODULE_INFO);
-            return PROVISION_ERROR;
-        } else {
-            f = fopen(path, "r+");
-            if (!f) {
-                puflib_perror(&MODULE_INFO);
-                free(path);
-                return PROVISION_ERROR;
-            }
-            free(path);
-            return provision_continue(f);
-        }
     }
-}
 
+    if (version != CHECKPOINT_VERSION || !data_len || ((char *) data)[data_len - 1]) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "checkpoint has unexpected format");
+        free(data);
+        return PROVISION_ERROR;
+    }
 
-static enum provisioning_status provision_start(FILE *f)
-{
-    puflib_report(&MODULE_INFO, STATUS_INFO, "writing to NV store");
-    fprintf(f, "%d\n", 1);
+    puflib_report(&MODULE_INFO, STATUS_INFO, "checkpoint found, continuing provision");
+    enum provisioning_status rc = provision_continue(step, data);
+    free(data);
+    return rc;
+}
 
-    puflib_report(&MODULE_INFO, STATUS_INFO, "provisioning will continue after the next invocation");
-    fclose(f);
 
+static enum provisioning_status provision_start(void)
+{
     char querybuf[500];
-    puflib_query(&MODULE_INFO, "testquery", "Enter any data: ", &querybuf[0], sizeof(querybuf));
+    if (puflib_query(&MODULE_INFO, "testquery", "Enter any data: ", &querybuf[0], sizeof(querybuf))) {
+        querybuf[0] = 0;
+    }
     querybuf[sizeof(querybuf) - 1] = 0;
     puflib_report_fmt(&MODULE_INFO, STATUS_INFO, "query input was: %s", querybuf);
 
+    puflib_report(&MODULE_INFO, STATUS_INFO, "writing checkpoint");
+    if (puflib_checkpoint_commit(&MODULE_INFO, CHECKPOINT_VERSION, 1,
+                querybuf, strlen(querybuf) + 1)) {
+        puflib_perror(&MODULE_INFO);
+        return PROVISION_ERROR;
+    }
+
+    puflib_report(&MODULE_INFO, STATUS_INFO, "provisioning will continue after the next invocation");
     return PROVISION_INCOMPLETE;
 }
 
 
-static enum provisioning_status provision_continue(FILE *f)
+static enum provisioning_status provision_continue(uint32_t step, char const * input)
 {
-    int step = 0;
-
-    puflib_report(&MODULE_INFO, STATUS_INFO, "reading from NV store");
-    if (fscanf(f, "%d", &step) != 1) {
-        puflib_report(&MODULE_INFO, STATUS_ERROR, "NV store is corrupted");
-        return PROVISION_ERROR;
-    }
-
     switch(step) {
     case 1:
-        puflib_report(&MODULE_INFO, STATUS_INFO, "writing to NV store again");
+        puflib_report(&MODULE_INFO, STATUS_INFO, "writing checkpoint again");
+        if (puflib_checkpoint_commit(&MODULE_INFO, CHECKPOINT_VERSION, 2,
+                    input, strlen(input) + 1)) {
+            puflib_perror(&MODULE_INFO);
+            return PROVISION_ERROR;
+        }
         puflib_report(&MODULE_INFO, STATUS_INFO, "provisioning will continue after the next invocation");
-        rewind(f);
-        fprintf(f, "%d\n", 2);
-        fclose(f);
         return PROVISION_INCOMPLETE;
 
     case 2:
-        fclose(f);
-        puflib_report(&MODULE_INFO, STATUS_INFO, "complete");
-        puflib_report(&MODULE_INFO, STATUS_INFO, "deleting NV store");
-        if (puflib_delete_nv_store(&MODULE_INFO, STORAGE_TEMP_FILE)) {
-            puflib_report(&MODULE_INFO, STATUS_ERROR, strerror(errno));
+        puflib_report_fmt(&MODULE_INFO, STATUS_INFO, "complete; query input was: %s", input);
+        puflib_report(&MODULE_INFO, STATUS_INFO, "deleting checkpoint");
+        if (puflib_checkpoint_discard(&MODULE_INFO)) {
+            puflib_perror(&MODULE_INFO);
             return PROVISION_ERROR;
         }
 
@@ -186,11 +180,8 @@ static enum provisioning_status provision_continue(FILE *f)
         }
 
     default:
-        fclose(f);
-        puflib_report(&MODULE_INFO, STATUS_WARN, "NV store corrupted");
+        puflib_report(&MODULE_INFO, STATUS_WARN, "checkpoint has unknown step");
         return PROVISION_ERROR;
     }
 
 }
-
-
@@ -0,0 +1,508 @@
+// PUFlib trace replay module
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Serves module calls from a trace recorded with puflib_interpose_record()
+// (or "record=PATH" in PUFLIB_INTERPOSE), so that benchmarks and tests can run
+// against the responses and timing of real PUF hardware on any machine.
+//
+// A call whose operation and input match a recorded call gets that call's
+// output, or its error; calls that were recorded several times with the same
+// input take their recordings in turn. Any other seal or chal_resp gets the
+// next recorded call of the same operation, in trace order and wrapping
+// around, which keeps the sizes and timing of the recording though not its
+// contents. Any other unseal takes the next recorded unseal's time and then
+// fails with EBADMSG, since answering it with some other blob's plaintext
+// would be a wrong answer passed off as a right one. A blob sealed while
+// recording unseals here to the recorded data once its header names this
+// module instead.
+//
+// The trace is read from the environment on first use (but not in setuid or
+// other privileged processes, which get no trace):
+//
+//  PUFLIB_REPLAY_TRACE       path to the trace (required; without it the
+//                            module reports no supported hardware, so it is
+//                            never provisioned by accident)
+//  PUFLIB_REPLAY_MODULE      serve only the calls recorded from this module
+//                            (default: all calls in the trace)
+//  PUFLIB_REPLAY_TIMING      "original" to take as long as each recorded call
+//                            did, "fast" to answer at once, or a factor to
+//                            scale the recorded durations by (default
+//                            "original")
+//  PUFLIB_REPLAY_THREADS     "parallel", "safe" or "serial": the threading
+//                            capability to declare, so that a trace can be
+//                            replayed as the module it came from would run
+//                            (default "parallel"). Read when the module loads.
+//
+
+#define _GNU_SOURCE     // secure_getenv()
+
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+bool is_hw_supported();
+enum provisioning_status provision();
+bool seal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len);
+bool unseal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len);
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len);
+
+// The trace is looked up under TRACE_LOCK, and the recorded time is waited out
+// without it, so calls can run in parallel. Calls are answered with whatever
+// was recorded, so nothing else can be promised. Support depends on the
+// environment, so it must not be cached.
+static puflib_caps CAPS = {
+    .threading = PUFLIB_THREADS_PARALLEL,
+    .volatile_probe = true,
+};
+
+unsigned const MODULE_ABI_VERSION = PUFLIB_MODULE_ABI_VERSION;
+
+module_info const MODULE_INFO =
+{
+    .name = "replay",
+    .author = "Assured Information Security, Inc.",
+    .desc = "recorded trace replay",
+    .version = "1.0",
+    .is_hw_supported = &is_hw_supported,
+    .provision = &provision,
+    .chal_resp = &chal_resp,
+    .seal = &seal,
+    .unseal = &unseal,
+    .caps = &CAPS,
+};
+
+/**
+ * Take the threading capability from the environment. This runs when the
+ * plugin is loaded, before puflib reads the capabilities.
+ */
+__attribute__((constructor)) static void read_threads(void)
+{
+    char const * s = secure_getenv("PUFLIB_REPLAY_THREADS");
+
+    if (!s || !*s || !strcmp(s, "parallel")) {
+        CAPS.threading = PUFLIB_THREADS_PARALLEL;
+    } else if (!strcmp(s, "safe")) {
+        CAPS.threading = PUFLIB_THREADS_SAFE;
+    } else if (!strcmp(s, "serial")) {
+        CAPS.threading = PUFLIB_THREADS_SERIAL;
+    } else {
+        puflib_report_fmt(&MODULE_INFO, STATUS_WARN,
+                "unknown PUFLIB_REPLAY_THREADS \"%s\", using \"parallel\"", s);
+    }
+}
+
+#define OPS 3
+
+struct record {
+    size_t seq;                 ///< Position in the trace
+    unsigned op;                ///< Index into the per-operation tables
+    bool failed;
+    int error;
+    uint32_t duration_us;
+    uint8_t const * data_in;
+    size_t data_in_len;
+    uint8_t const * data_out;
+    size_t data_out_len;
+    unsigned uses;              ///< Times served by an exact match
+};
+
+// Loaded trace. Records are sorted by operation, then input, then trace
+// order; each operation's records are also listed in trace order, for calls
+// that match none of them.
+struct trace {
+    puflib_map map;
+    struct record * records;
+    size_t n_records;
+    struct record ** by_op[OPS];
+    size_t n_by_op[OPS];
+    size_t next_by_op[OPS];
+    double timing;              ///< Factor applied to recorded durations
+};
+
+static struct trace * TRACE = NULL;
+static int TRACE_ERROR = 0;     ///< errno from loading the trace, if it failed
+static pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+bool is_hw_supported()
+{
+    char const * path = secure_getenv("PUFLIB_REPLAY_TRACE");
+    return path && *path;
+}
+
+
+static uint32_t load_le32(uint8_t const * src)
+{
+    return src[0] | (uint32_t) src[1] << 8 | (uint32_t) src[2] << 16 | (uint32_t) src[3] << 24;
+}
+
+
+static int op_index(enum puflib_op op)
+{
+    switch (op) {
+    case PUFLIB_OP_SEAL:        return 0;
+    case PUFLIB_OP_UNSEAL:      return 1;
+    case PUFLIB_OP_CHAL_RESP:   return 2;
+    default:                    return -1;
+    }
+}
+
+
+static int compare_records(void const * a, void const * b)
+{
+    struct record const * ra = a, * rb = b;
+
+    if (ra->op != rb->op) {
+        return ra->op < rb->op ? -1 : 1;
+    }
+    if (ra->data_in_len != rb->data_in_len) {
+        return ra->data_in_len < rb->data_in_len ? -1 : 1;
+    }
+    int c = ra->data_in_len ? memcmp(ra->data_in, rb->data_in, ra->data_in_len) : 0;
+    if (c) {
+        return c;
+    }
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+
+static int compare_by_position(void const * a, void const * b)
+{
+    struct record const * ra = *(struct record * const *) a;
+    struct record const * rb = *(struct record * const *) b;
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+
+static bool get_timing(double * timing)
+{
+    char const * s = secure_getenv("PUFLIB_REPLAY_TIMING");
+    if (!s || !*s || !strcmp(s, "original")) {
+        *timing = 1;
+        return false;
+    }
+    if (!strcmp(s, "fast")) {
+        *timing = 0;
+        return false;
+    }
+
+    char * end;
+    *timing = strtod(s, &end);
+    if (*end || !(*timing >= 0 && *timing <= 1000)) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR,
+                "PUFLIB_REPLAY_TIMING must be original, fast or a factor from 0 to 1000");
+        errno = EINVAL;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Walk the records of a mapped trace, storing those to be served if records
+ * is not NULL.
+ * @return number of records, or (size_t) -1 if the trace is malformed
+ */
+static size_t parse_records(puflib_map const * map, char const * module,
+        struct record * records)
+{
+    uint8_t const * data = map->data;
+    size_t pos = PUFLIB_TRACE_HEADER_LEN, n = 0;
+
+    while (pos < map->len) {
+        if (map->len - pos < PUFLIB_TRACE_RECORD_LEN) {
+            return (size_t) -1;
+        }
+        uint8_t const * h = data + pos;
+        size_t name_len = h[2] | (size_t) h[3] << 8;
+        size_t in_len = load_le32(&h[12]);
+        size_t out_len = load_le32(&h[16]);
+        int op = op_index(h[0]);
+
+        pos += PUFLIB_TRACE_RECORD_LEN;
+        if (op < 0 || h[1] > 1 || map->len - pos < name_len
+                || map->len - pos - name_len < in_len
+                || map->len - pos - name_len - in_len < out_len) {
+            return (size_t) -1;
+        }
+
+        bool wanted = !module || (strlen(module) == name_len
+                && !memcmp(module, data + pos, name_len));
+        if (wanted && records) {
+            records[n] = (struct record) {
+                .seq = n,
+                .op = (unsigned) op,
+                .failed = h[1],
+                .error = (int) load_le32(&h[4]),
+                .duration_us = load_le32(&h[8]),
+                .data_in = data + pos + name_len,
+                .data_in_len = in_len,
+                .data_out = data + pos + name_len + in_len,
+                .data_out_len = out_len,
+            };
+        }
+        n += wanted;
+        pos += name_len + in_len + out_len;
+    }
+    return n;
+}
+
+
+static void free_trace(struct trace * trace)
+{
+    if (trace) {
+        for (size_t i = 0; i < OPS; ++i) {
+            free(trace->by_op[i]);
+        }
+        free(trace->records);
+        if (trace->map.handle != -1) {
+            puflib_map_close(&trace->map);
+        }
+        free(trace);
+    }
+}
+
+
+static struct trace * load_trace(void)
+{
+    char const * path = secure_getenv("PUFLIB_REPLAY_TRACE");
+    char const * module = secure_getenv("PUFLIB_REPLAY_MODULE");
+    if (module && !*module) {
+        module = NULL;
+    }
+
+    if (!path || !*path) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "PUFLIB_REPLAY_TRACE is not set");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct trace * trace = calloc(1, sizeof(*trace));
+    if (!trace) {
+        return NULL;
+    }
+    trace->map.handle = -1;
+
+    if (get_timing(&trace->timing)) {
+        goto err;
+    }
+
+    if (puflib_map_open(path, false, &trace->map)) {
+        trace->map.handle = -1;
+        puflib_report_fmt(&MODULE_INFO, STATUS_ERROR, "cannot open trace %s: %s",
+                path, strerror(errno));
+        goto err;
+    }
+
+    uint8_t const * data = trace->map.data;
+    size_t n;
+    if (trace->map.len < PUFLIB_TRACE_HEADER_LEN
+            || memcmp(data, PUFLIB_TRACE_MAGIC, strlen(PUFLIB_TRACE_MAGIC))
+            || load_le32(&data[8]) != PUFLIB_TRACE_VERSION
+            || (n = parse_records(&trace->map, module, NULL)) == (size_t) -1) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_ERROR, "%s is not a valid trace", path);
+        errno = EBADMSG;
+        goto err;
+    }
+    if (!n) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_ERROR, "%s has no calls%s%s to replay",
+                path, module ? " from " : "", module ? module : "");
+        errno = ENOENT;
+        goto err;
+    }
+
+    trace->records = calloc(n, sizeof(trace->records[0]));
+    for (size_t i = 0; i < OPS; ++i) {
+        trace->by_op[i] = calloc(n, sizeof(trace->by_op[i][0]));
+        if (!trace->by_op[i]) {
+            goto err;
+        }
+    }
+    if (!trace->records) {
+        goto err;
+    }
+    trace->n_records = parse_records(&trace->map, module, trace->records);
+
+    qsort(trace->records, n, sizeof(trace->records[0]), &compare_records);
+
+    // List each operation's records by position in the trace too, for calls
+    // that match none of them
+    for (size_t i = 0; i < n; ++i) {
+        struct record * r = &trace->records[i];
+        trace->by_op[r->op][trace->n_by_op[r->op]++] = r;
+    }
+    for (size_t i = 0; i < OPS; ++i) {
+        qsort(trace->by_op[i], trace->n_by_op[i], sizeof(trace->by_op[i][0]),
+                &compare_by_position);
+    }
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_DEBUG,
+            "replaying %zu seal, %zu unseal and %zu chal_resp calls from %s",
+            trace->n_by_op[0], trace->n_by_op[1], trace->n_by_op[2], path);
+    return trace;
+
+err:;
+    int errno_hold = errno;
+    free_trace(trace);
+    errno = errno_hold;
+    return NULL;
+}
+
+
+/**
+ * Find the recorded call to answer a call with, loading the trace first if
+ * need be.
+ * @param matched - outparam, set to whether the record's input matches
+ * @return record, or NULL on error (with errno set)
+ */
+static struct record const * find_record(enum puflib_op op, void const * data_in,
+        size_t data_in_len, bool * matched)
+{
+    struct record const * found = NULL;
+    int i = op_index(op);
+
+    pthread_mutex_lock(&TRACE_LOCK);
+    if (!TRACE && !TRACE_ERROR) {
+        TRACE = load_trace();
+        if (!TRACE) {
+            TRACE_ERROR = errno;
+        }
+    }
+    if (!TRACE) {
+        errno = TRACE_ERROR;
+        goto out;
+    }
+
+    struct trace * trace = TRACE;
+    if (!trace->n_by_op[i]) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_ERROR, "trace has no %s calls",
+                op == PUFLIB_OP_SEAL ? "seal" : op == PUFLIB_OP_UNSEAL ? "unseal" : "chal_resp");
+        errno = ENOENT;
+        goto out;
+    }
+
+    // Lower bound of the matching records
+    struct record key = {
+        .seq = 0,
+        .op = (unsigned) i,
+        .data_in = data_in,
+        .data_in_len = data_in_len,
+    };
+    size_t lo = 0, hi = trace->n_records;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_records(&trace->records[mid], &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t end = lo;
+    key.seq = (size_t) -1;
+    while (end < trace->n_records && compare_records(&trace->records[end], &key) < 0) {
+        ++end;
+    }
+
+    *matched = end > lo;
+    if (*matched) {
+        struct record * first = &trace->records[lo];
+        found = &trace->records[lo + first->uses++ % (end - lo)];
+    } else {
+        found = trace->by_op[i][trace->next_by_op[i]++ % trace->n_by_op[i]];
+    }
+
+out:
+    pthread_mutex_unlock(&TRACE_LOCK);
+    return found;
+}
+
+
+/**
+ * Answer a call from the trace, taking as long as the timing says.
+ */
+static bool replay(enum puflib_op op, void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len)
+{
+    uint64_t start = puflib_monotonic_us();
+
+    bool matched;
+    struct record const * r = find_record(op, data_in, data_in_len, &matched);
+    if (!r) {
+        return true;
+    }
+
+    uint64_t duration = (uint64_t) (r->duration_us * TRACE->timing);
+    uint64_t elapsed = puflib_monotonic_us() - start;
+    if (duration > elapsed) {
+        puflib_sleep_us(duration - elapsed);
+    }
+
+    if (!matched && op == PUFLIB_OP_UNSEAL) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "blob was not unsealed in the trace");
+        errno = EBADMSG;
+        return true;
+    }
+
+    if (r->failed) {
+        errno = r->error;
+        return true;
+    }
+
+    // malloc(0) may return NULL, so always ask for at least a byte
+    void * out = malloc(r->data_out_len ? r->data_out_len : 1);
+    if (!out) {
+        return true;
+    }
+    memcpy(out, r->data_out, r->data_out_len);
+    *data_out = out;
+    *data_out_len = r->data_out_len;
+    return false;
+}
+
+
+enum provisioning_status provision()
+{
+    // There is no hardware; the trace is all there is, and is only read when
+    // it is used
+    char * store = puflib_create_nv_store(&MODULE_INFO, STORAGE_FINAL_DIR);
+    if (!store) {
+        puflib_perror(&MODULE_INFO);
+        return PROVISION_ERROR;
+    }
+    free(store);
+    return PROVISION_COMPLETE;
+}
+
+
+bool seal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len)
+{
+    void * out;
+    if (replay(PUFLIB_OP_SEAL, data_in, data_in_len, &out, data_out_len)) {
+        return true;
+    }
+    *data_out = out;
+    return false;
+}
+
+
+bool unseal(uint8_t const * data_in, size_t data_in_len, uint8_t ** data_out, size_t * data_out_len)
+{
+    void * out;
+    if (replay(PUFLIB_OP_UNSEAL, data_in, data_in_len, &out, data_out_len)) {
+        return true;
+    }
+    *data_out = out;
+    return false;
+}
+
+
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len)
+{
+    return replay(PUFLIB_OP_CHAL_RESP, data_in, data_in_len, data_out, data_out_len);
+}
@@ -0,0 +1,843 @@
+// PUFlib SRAM PUF emulator module
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Emulates an SRAM start-up PUF, so the whole stack can be exercised and
+// benchmarked on machines without PUF hardware. Provisioning creates the
+// "device": a random reference image of the power-up state of each cell,
+// along with how noisy each cell is, kept as a blob in the module's store.
+// Every read of the emulated SRAM is a fresh power-up, in which each cell
+// flips away from its reference value with its own probability. Most cells
+// are quiet and a few are very noisy, as in real SRAM.
+//
+// Keys are enrolled the way a real SRAM PUF module would: the majority of
+// many reads, masked down to the stable cells, goes through the fuzzy
+// extractor, and the helper data and mask are stored. Sealing reconstructs
+// the key from a single read and encrypts with AES-256-GCM. chal_resp()
+// reads cells at addresses picked by the hash of the challenge, and is as
+// noisy as the raw hardware would be. It only reads cells above the key
+// region, so responses never expose the enrolled cells.
+//
+// The module keeps an instance (module ABI version 2) holding the image and
+// the enrolled key data mapped and parsed, so operations only power up and
+// read the SRAM.
+//
+// The emulated conditions are taken from the environment on every operation:
+//
+//  PUFLIB_SRAMPUF_BER        bit error rate of an average cell at the
+//                            enrollment temperature (default 0.05)
+//  PUFLIB_SRAMPUF_BIAS       fraction of cells powering up as 1; only used
+//                            when provisioning (default 0.5)
+//  PUFLIB_SRAMPUF_TEMP       temperature, in degrees C (default 25). The
+//                            error rate grows with the distance from the
+//                            temperature at provisioning.
+//  PUFLIB_SRAMPUF_LATENCY_US time taken by each power-up, in microseconds
+//                            (default 0)
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+bool is_hw_supported();
+enum provisioning_status provision();
+bool open_instance(void ** instance);
+void close_instance(void * instance);
+bool seal(void * instance, uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+bool unseal(void * instance, uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+bool chal_resp(void * instance, void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len);
+
+static puflib_caps const CAPS;
+
+unsigned const MODULE_ABI_VERSION = PUFLIB_MODULE_ABI_VERSION;
+
+module_info const MODULE_INFO =
+{
+    .name = "srampuf",
+    .author = "Assured Information Security, Inc.",
+    .desc = "software SRAM PUF emulator",
+    .version = "1.0",
+    .is_hw_supported = &is_hw_supported,
+    .provision = &provision,
+    .open = &open_instance,
+    .close = &close_instance,
+    .instance_seal = &seal,
+    .instance_unseal = &unseal,
+    .instance_chal_resp = &chal_resp,
+    .caps = &CAPS,
+};
+
+// Emulated SRAM: 64 Kbit, of which the first ENROLL_CELLS hold the key
+#define CELLS           (64 * 1024)
+#define ENROLL_CELLS    8192
+
+// Image blob: header, then the reference bits (CELLS / 8 bytes, least
+// significant bit first), then one noise weight byte per cell. A cell's
+// error rate is the configured rate times its weight / WEIGHT_ONE.
+#define IMAGE_BLOB      "image"
+#define IMAGE_FORMAT    1
+#define IMAGE_HEADER    16
+#define IMAGE_LEN       (IMAGE_HEADER + CELLS / 8 + CELLS)
+#define WEIGHT_ONE      64
+
+// Key blob: mask length (le32), mask of the stable enrollment cells, then the
+// fuzzy extractor helper data
+#define KEY_BLOB        "key"
+#define MASK_LEN        (ENROLL_CELLS / 8)
+
+// Enrollment takes the majority of ENROLL_READS reads, and keeps cells that
+// disagreed with it at most MAX_MINORITY times
+#define ENROLL_READS    15
+#define MAX_MINORITY    1
+
+// Relative growth of the error rate per degree from the enrollment temperature
+#define DRIFT_PER_DEGREE 0.015
+
+// Sealed data: nonce, ciphertext, tag
+#define SEALED_OVERHEAD (PUFLIB_GCM_IV_LEN + PUFLIB_GCM_TAG_LEN)
+
+// Largest fuzzy extractor key, in bytes
+#define FE_KEY_MAX      64
+
+// chal_resp() reads this many cells
+#define RESPONSE_BITS   256
+
+// The instance is read-only, and each power-up has its own state
+static puflib_caps const CAPS = {
+    .threading = PUFLIB_THREADS_PARALLEL,
+    .response_len = RESPONSE_BITS / 8,
+    .typical_us = 10,
+};
+
+static puflib_ecc_params const CODE = {
+    .code = PUFLIB_ECC_BCH,
+    .m = 8,
+    .t = 16,
+    .repetition = 5,
+    .blocks = 2,
+};
+
+// Emulated operating conditions
+struct conditions {
+    double ber;
+    double bias;
+    double temp;
+    long latency_us;
+};
+
+
+bool is_hw_supported()
+{
+    return true;
+}
+
+
+static void wipe(void * data, size_t len)
+{
+    volatile uint8_t * p = data;
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+
+static void store_le32(uint8_t * dest, uint32_t value)
+{
+    for (unsigned i = 0; i < 4; ++i) {
+        dest[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+static uint32_t load_le32(uint8_t const * src)
+{
+    return src[0] | (uint32_t) src[1] << 8 | (uint32_t) src[2] << 16 | (uint32_t) src[3] << 24;
+}
+
+
+/**
+ * Read a number from the environment.
+ * @return false on success, true if it is set but not a number in range
+ */
+static bool env_number(char const * name, double min, double max, double * value)
+{
+    char const * s = getenv(name);
+    if (!s || !*s) {
+        return false;
+    }
+
+    char * end;
+    double v = strtod(s, &end);
+    if (*end || !(v >= min && v <= max)) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_ERROR,
+                "%s must be a number from %g to %g", name, min, max);
+        errno = EINVAL;
+        return true;
+    }
+    *value = v;
+    return false;
+}
+
+
+static bool get_conditions(struct conditions * cond)
+{
+    double latency = 0;
+
+    cond->ber = 0.05;
+    cond->bias = 0.5;
+    cond->temp = 25;
+
+    if (env_number("PUFLIB_SRAMPUF_BER", 0, 0.5, &cond->ber)
+            || env_number("PUFLIB_SRAMPUF_BIAS", 0, 1, &cond->bias)
+            || env_number("PUFLIB_SRAMPUF_TEMP", -273, 1000, &cond->temp)
+            || env_number("PUFLIB_SRAMPUF_LATENCY_US", 0, 60e6, &latency)) {
+        return true;
+    }
+    cond->latency_us = (long) latency;
+    return false;
+}
+
+
+// xoshiro256** generator for the noise; fast, and plenty good for this
+struct rng {
+    uint64_t s[4];
+};
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rng_next(struct rng * rng)
+{
+    uint64_t * s = rng->s;
+    uint64_t const result = rotl(s[1] * 5, 7) * 9;
+    uint64_t const t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/// Seed a generator from 32 bytes, which must not all be zero
+static void rng_seed(struct rng * rng, uint8_t const seed[32])
+{
+    memcpy(rng->s, seed, sizeof(rng->s));
+}
+
+static bool rng_seed_random(struct rng * rng)
+{
+    do {
+        if (puflib_random_bytes(rng->s, sizeof(rng->s))) {
+            return true;
+        }
+    } while (!(rng->s[0] | rng->s[1] | rng->s[2] | rng->s[3]));
+    return false;
+}
+
+/// Uniform double in [0, 1)
+static inline double rng_double(struct rng * rng)
+{
+    return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+
+/**
+ * The emulated device: the mapped reference image and noise weights.
+ */
+struct image {
+    puflib_blob * blob;
+    uint8_t const * ref;
+    uint8_t const * weight;
+    double enroll_temp;
+};
+
+
+static bool image_open(struct image * image)
+{
+    image->blob = puflib_blob_map(&MODULE_INFO, STORAGE_FINAL_DIR, IMAGE_BLOB, 0);
+    if (!image->blob) {
+        if (errno == ENOENT) {
+            puflib_report(&MODULE_INFO, STATUS_ERROR, "module has not been provisioned");
+        }
+        return true;
+    }
+
+    uint8_t const * data = puflib_blob_data(image->blob);
+    if (puflib_blob_size(image->blob) != IMAGE_LEN
+            || load_le32(data) != IMAGE_FORMAT
+            || load_le32(data + 4) != CELLS) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "SRAM image has unexpected format");
+        puflib_blob_unmap(image->blob);
+        errno = EBADMSG;
+        return true;
+    }
+
+    image->ref = data + IMAGE_HEADER;
+    image->weight = image->ref + CELLS / 8;
+    image->enroll_temp = (int32_t) load_le32(data + 8);
+    return false;
+}
+
+
+static void image_close(struct image * image)
+{
+    puflib_blob_unmap(image->blob);
+}
+
+
+/**
+ * Emulated SRAM, as of one power-up. Reading cells samples the noise; the
+ * thresholds give each noise weight's flip probability scaled to 2^64.
+ */
+struct sram {
+    struct image const * image;
+    uint64_t threshold[256];
+    struct rng rng;
+};
+
+
+/**
+ * Power the SRAM up under the current conditions.
+ */
+static bool sram_power_up(struct sram * sram, struct image const * image)
+{
+    struct conditions cond;
+
+    if (get_conditions(&cond) || rng_seed_random(&sram->rng)) {
+        return true;
+    }
+    sram->image = image;
+
+    double drift = cond.temp - image->enroll_temp;
+    double ber = cond.ber * (1 + DRIFT_PER_DEGREE * (drift < 0 ? -drift : drift));
+
+    for (unsigned w = 0; w < 256; ++w) {
+        double p = ber * w / WEIGHT_ONE;
+        sram->threshold[w] = p >= 0.5 ? UINT64_C(1) << 63 : (uint64_t) (p * 0x1.0p64);
+    }
+
+    if (cond.latency_us) {
+        struct timespec ts = {
+            .tv_sec = cond.latency_us / 1000000,
+            .tv_nsec = (cond.latency_us % 1000000) * 1000,
+        };
+        while (nanosleep(&ts, &ts) && errno == EINTR);
+    }
+
+    return false;
+}
+
+
+static inline unsigned sram_read_cell(struct sram * sram, size_t cell)
+{
+    struct image const * image = sram->image;
+    unsigned bit = (image->ref[cell / 8] >> (cell % 8)) & 1;
+    return bit ^ (rng_next(&sram->rng) < sram->threshold[image->weight[cell]]);
+}
+
+
+/**
+ * Power up and read the enrollment cells once, into ENROLL_CELLS bits.
+ */
+static bool sram_read_enroll(struct image const * image, uint8_t out[MASK_LEN])
+{
+    struct sram sram;
+
+    if (sram_power_up(&sram, image)) {
+        return true;
+    }
+
+    memset(out, 0, MASK_LEN);
+    for (size_t i = 0; i < ENROLL_CELLS; ++i) {
+        out[i / 8] |= sram_read_cell(&sram, i) << (i % 8);
+    }
+    return false;
+}
+
+
+/**
+ * Create the emulated device: a random reference image, biased as
+ * configured, with noise weights. Products of two uniform variables give
+ * many quiet cells and a few noisy ones, averaging WEIGHT_ONE.
+ */
+static bool create_image(void)
+{
+    struct conditions cond;
+    struct rng rng;
+
+    if (get_conditions(&cond) || rng_seed_random(&rng)) {
+        return true;
+    }
+
+    puflib_blob_writer * writer = puflib_blob_create(&MODULE_INFO, STORAGE_FINAL_DIR,
+            IMAGE_BLOB, IMAGE_LEN);
+    if (!writer) {
+        return true;
+    }
+
+    uint8_t * image = puflib_blob_writer_data(writer);
+    uint8_t * ref = image + IMAGE_HEADER;
+    uint8_t * weight = ref + CELLS / 8;
+
+    memset(image, 0, IMAGE_LEN);
+    store_le32(image, IMAGE_FORMAT);
+    store_le32(image + 4, CELLS);
+    store_le32(image + 8, (uint32_t) (int32_t) cond.temp);
+
+    for (size_t i = 0; i < CELLS; ++i) {
+        ref[i / 8] |= (rng_double(&rng) < cond.bias) << (i % 8);
+        weight[i] = (uint8_t) (rng_double(&rng) * rng_double(&rng) * 4 * WEIGHT_ONE);
+    }
+
+    return puflib_blob_commit(writer);
+}
+
+
+/**
+ * Enroll the key: vote over many reads, mask off the unstable cells and run
+ * the stable ones through the fuzzy extractor.
+ */
+static bool enroll_key(struct image const * image)
+{
+    puflib_fe * fe = NULL;
+    puflib_voter * voter = NULL;
+    uint8_t * blob = NULL;
+    uint8_t read[MASK_LEN], majority[MASK_LEN], response[MASK_LEN];
+    uint8_t fe_key[FE_KEY_MAX];
+    int errno_hold;
+
+    fe = puflib_fe_new(&CODE);
+    voter = puflib_voter_new(ENROLL_CELLS, ENROLL_READS);
+    if (!fe || !voter) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    size_t const response_bits = puflib_fe_response_bits(fe);
+    size_t const blob_len = 4 + MASK_LEN + puflib_fe_helper_len(fe);
+
+    for (unsigned i = 0; i < ENROLL_READS; ++i) {
+        if (sram_read_enroll(image, read) || puflib_voter_add(voter, read)) {
+            errno_hold = errno;
+            goto err;
+        }
+    }
+
+    blob = malloc(blob_len);
+    if (!blob) {
+        errno_hold = errno;
+        goto err;
+    }
+    uint8_t * mask = blob + 4;
+    store_le32(blob, MASK_LEN);
+
+    size_t stable = puflib_voter_mask(voter, MAX_MINORITY, mask);
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO,
+            "%zu of %u cells are stable; estimated bit error rate %.4f",
+            stable, ENROLL_CELLS, puflib_voter_error_rate(voter));
+    if (stable < response_bits) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_ERROR,
+                "too few stable cells for the key (%zu needed); lower PUFLIB_SRAMPUF_BER",
+                response_bits);
+        errno_hold = ENOSPC;
+        goto err;
+    }
+
+    // Keep only as many stable cells as the extractor takes
+    for (size_t i = 0, kept = 0; i < ENROLL_CELLS; ++i) {
+        if ((mask[i / 8] >> (i % 8)) & 1) {
+            if (kept == response_bits) {
+                mask[i / 8] &= (uint8_t) ~(1u << (i % 8));
+            } else {
+                ++kept;
+            }
+        }
+    }
+
+    puflib_voter_majority(voter, majority);
+    puflib_bits_select(majority, mask, ENROLL_CELLS, response);
+
+    // The extracted key is hashed before use, so it is not kept here
+    if (puflib_fe_enroll(fe, response, fe_key, blob + 4 + MASK_LEN)) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    if (puflib_blob_write(&MODULE_INFO, STORAGE_FINAL_DIR, KEY_BLOB, blob, blob_len)) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO, "enrolled a %zu-bit key from %zu cells",
+            puflib_fe_key_bits(fe), response_bits);
+
+    wipe(read, sizeof(read));
+    wipe(majority, sizeof(majority));
+    wipe(response, sizeof(response));
+    wipe(fe_key, sizeof(fe_key));
+    free(blob);
+    puflib_voter_free(voter);
+    puflib_fe_free(fe);
+    return false;
+
+err:
+    wipe(read, sizeof(read));
+    wipe(majority, sizeof(majority));
+    wipe(response, sizeof(response));
+    wipe(fe_key, sizeof(fe_key));
+    free(blob);
+    puflib_voter_free(voter);
+    puflib_fe_free(fe);
+    errno = errno_hold;
+    return true;
+}
+
+
+enum provisioning_status provision()
+{
+    struct image image;
+
+    char * store = puflib_create_nv_store(&MODULE_INFO, STORAGE_FINAL_DIR);
+    if (!store) {
+        puflib_perror(&MODULE_INFO);
+        return PROVISION_ERROR;
+    }
+    free(store);
+
+    puflib_report(&MODULE_INFO, STATUS_INFO, "creating emulated SRAM");
+    if (create_image() || image_open(&image)) {
+        goto err;
+    }
+
+    puflib_report(&MODULE_INFO, STATUS_INFO, "enrolling key");
+    bool failed = enroll_key(&image);
+    int errno_hold = errno;
+    image_close(&image);
+    errno = errno_hold;
+    if (failed) {
+        goto err;
+    }
+
+    return PROVISION_COMPLETE;
+
+err:
+    puflib_perror(&MODULE_INFO);
+    // Leave nothing behind, or the module would look provisioned
+    puflib_delete_nv_store(&MODULE_INFO, STORAGE_FINAL_DIR);
+    return PROVISION_ERROR;
+}
+
+
+/**
+ * Enrolled key: the mask of the cells making up the response, and the fuzzy
+ * extractor for its helper data.
+ */
+struct key_data {
+    puflib_blob * blob;
+    uint8_t id[PUFLIB_SHA256_LEN];  ///< Key cache ID: the hash of the key blob
+    uint8_t const * mask;
+    uint8_t const * helper;
+    size_t helper_len;
+    puflib_fe * fe;
+};
+
+
+static bool key_data_open(struct key_data * kd)
+{
+    kd->fe = NULL;
+    kd->blob = puflib_blob_map(&MODULE_INFO, STORAGE_FINAL_DIR, KEY_BLOB, 0);
+    if (!kd->blob) {
+        if (errno == ENOENT) {
+            puflib_report(&MODULE_INFO, STATUS_ERROR, "module has not been provisioned");
+        }
+        return true;
+    }
+
+    uint8_t const * data = puflib_blob_data(kd->blob);
+    size_t const len = puflib_blob_size(kd->blob);
+    int errno_hold = EBADMSG;
+
+    puflib_sha256(data, len, kd->id);
+
+    if (len < 4 + MASK_LEN || load_le32(data) != MASK_LEN) {
+        goto bad;
+    }
+    kd->mask = data + 4;
+    kd->helper = kd->mask + MASK_LEN;
+    kd->helper_len = len - 4 - MASK_LEN;
+
+    kd->fe = puflib_fe_from_helper(kd->helper, kd->helper_len);
+    if (!kd->fe) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    // The mask selects one cell per response bit
+    uint8_t response[MASK_LEN];
+    if (puflib_fe_key_bits(kd->fe) > 8 * FE_KEY_MAX
+            || puflib_bits_select(kd->mask, kd->mask, ENROLL_CELLS, response)
+                != puflib_fe_response_bits(kd->fe)) {
+        goto bad;
+    }
+    return false;
+
+bad:
+    puflib_report(&MODULE_INFO, STATUS_ERROR, "key data has unexpected format");
+err:
+    puflib_fe_free(kd->fe);
+    puflib_blob_unmap(kd->blob);
+    errno = errno_hold;
+    return true;
+}
+
+
+static void key_data_close(struct key_data * kd)
+{
+    puflib_fe_free(kd->fe);
+    puflib_blob_unmap(kd->blob);
+}
+
+
+/**
+ * Open instance: the device and the key enrolled on it, mapped and parsed
+ * once. Nothing in it changes after open(), so calls share it unlocked.
+ */
+struct instance {
+    struct image image;
+    struct key_data key;
+};
+
+
+bool open_instance(void ** instance)
+{
+    struct instance * inst = malloc(sizeof(*inst));
+    int errno_hold;
+
+    if (!inst) {
+        puflib_perror(&MODULE_INFO);
+        return true;
+    }
+
+    if (image_open(&inst->image)) {
+        errno_hold = errno;
+        goto err;
+    }
+    if (key_data_open(&inst->key)) {
+        errno_hold = errno;
+        image_close(&inst->image);
+        goto err;
+    }
+
+    *instance = inst;
+    return false;
+
+err:
+    free(inst);
+    errno = errno_hold;
+    puflib_perror(&MODULE_INFO);
+    return true;
+}
+
+
+void close_instance(void * instance)
+{
+    struct instance * inst = instance;
+
+    key_data_close(&inst->key);
+    image_close(&inst->image);
+    free(inst);
+}
+
+
+/**
+ * Reconstruct the sealing key from a single read, or take it from the key
+ * cache.
+ */
+static bool get_key(struct instance const * inst, uint8_t key[PUFLIB_GCM_KEY_LEN])
+{
+    struct key_data const * kd = &inst->key;
+    uint8_t read[MASK_LEN], response[MASK_LEN];
+    uint8_t fe_key[FE_KEY_MAX];
+    int errno_hold;
+
+    if (!puflib_key_cache_get(&MODULE_INFO, kd->id, sizeof(kd->id), key, PUFLIB_GCM_KEY_LEN)) {
+        return false;
+    }
+
+    if (sram_read_enroll(&inst->image, read)) {
+        errno_hold = errno;
+        goto err;
+    }
+    puflib_bits_select(read, kd->mask, ENROLL_CELLS, response);
+
+    if (puflib_fe_reproduce(kd->fe, response, kd->helper, kd->helper_len, fe_key)) {
+        errno_hold = errno;
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "could not reconstruct the key");
+        goto err;
+    }
+    puflib_sha256(fe_key, (puflib_fe_key_bits(kd->fe) + 7) / 8, key);
+
+    if (puflib_key_cache_put(&MODULE_INFO, kd->id, sizeof(kd->id), key, PUFLIB_GCM_KEY_LEN)) {
+        puflib_perror(&MODULE_INFO);
+    }
+
+    wipe(read, sizeof(read));
+    wipe(response, sizeof(response));
+    wipe(fe_key, sizeof(fe_key));
+    return false;
+
+err:
+    wipe(read, sizeof(read));
+    wipe(response, sizeof(response));
+    wipe(fe_key, sizeof(fe_key));
+    errno = errno_hold;
+    return true;
+}
+
+
+bool seal(void * instance, uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t key[PUFLIB_GCM_KEY_LEN];
+    puflib_gcm * gcm = NULL;
+    uint8_t * out = NULL;
+    int errno_hold;
+
+    if (data_in_len > SIZE_MAX - SEALED_OVERHEAD) {
+        errno_hold = EMSGSIZE;
+        goto err;
+    }
+
+    if (get_key(instance, key)) {
+        errno_hold = errno;
+        goto err;
+    }
+    gcm = puflib_gcm_new(key);
+    wipe(key, sizeof(key));
+
+    out = malloc(data_in_len + SEALED_OVERHEAD);
+    if (!gcm || !out || puflib_random_bytes(out, PUFLIB_GCM_IV_LEN)
+            || puflib_gcm_seal(gcm, out, NULL, 0, data_in, data_in_len,
+                out + PUFLIB_GCM_IV_LEN, out + PUFLIB_GCM_IV_LEN + data_in_len)) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    puflib_gcm_free(gcm);
+    *data_out = out;
+    *data_out_len = data_in_len + SEALED_OVERHEAD;
+    return false;
+
+err:
+    puflib_gcm_free(gcm);
+    free(out);
+    errno = errno_hold;
+    puflib_perror(&MODULE_INFO);
+    return true;
+}
+
+
+bool unseal(void * instance, uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t key[PUFLIB_GCM_KEY_LEN];
+    puflib_gcm * gcm = NULL;
+    uint8_t * out = NULL;
+    int errno_hold;
+
+    if (data_in_len < SEALED_OVERHEAD) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "sealed data is truncated");
+        errno_hold = EBADMSG;
+        goto err;
+    }
+    size_t const len = data_in_len - SEALED_OVERHEAD;
+
+    if (get_key(instance, key)) {
+        errno_hold = errno;
+        goto err;
+    }
+    gcm = puflib_gcm_new(key);
+    wipe(key, sizeof(key));
+
+    // One extra byte, so that empty data still gives a valid pointer
+    out = malloc(len + 1);
+    if (!gcm || !out) {
+        errno_hold = errno;
+        goto err;
+    }
+
+    if (puflib_gcm_open(gcm, data_in, NULL, 0, data_in + PUFLIB_GCM_IV_LEN, len,
+                data_in + PUFLIB_GCM_IV_LEN + len, out)) {
+        errno_hold = errno;
+        if (errno_hold == EBADMSG) {
+            puflib_report(&MODULE_INFO, STATUS_ERROR,
+                    "sealed data was altered or sealed by another device");
+        }
+        goto err;
+    }
+
+    puflib_gcm_free(gcm);
+    *data_out = out;
+    *data_out_len = len;
+    return false;
+
+err:
+    puflib_gcm_free(gcm);
+    free(out);
+    errno = errno_hold;
+    puflib_perror(&MODULE_INFO);
+    return true;
+}
+
+
+bool chal_resp(void * instance, void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len)
+{
+    struct sram sram;
+    struct rng addr;
+    uint8_t digest[PUFLIB_SHA256_LEN];
+
+    uint8_t * out = calloc(RESPONSE_BITS / 8, 1);
+    if (!out) {
+        puflib_perror(&MODULE_INFO);
+        return true;
+    }
+
+    if (sram_power_up(&sram, &((struct instance *) instance)->image)) {
+        int errno_hold = errno;
+        free(out);
+        errno = errno_hold;
+        puflib_perror(&MODULE_INFO);
+        return true;
+    }
+
+    // The challenge's hash picks the cells to read, never from the key
+    // region; an all-zero digest is as good as impossible, but would stall
+    // the generator
+    puflib_sha256(data_in, data_in_len, digest);
+    digest[0] |= 1;
+    rng_seed(&addr, digest);
+
+    for (size_t i = 0; i < RESPONSE_BITS; ++i) {
+        size_t cell = ENROLL_CELLS + (size_t) (rng_next(&addr) % (CELLS - ENROLL_CELLS));
+        out[i / 8] |= sram_read_cell(&sram, cell) << (i % 8);
+    }
+
+    *data_out = out;
+    *data_out_len = RESPONSE_BITS / 8;
+    return false;
+}
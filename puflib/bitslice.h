@@ -0,0 +1,187 @@
+// PUFlib bit array helpers
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+// Bit arrays are held in uint64_t words, bit i of the array being bit (i % 64)
+// of word (i / 64). Byte strings use the matching order: bit i is bit (i % 8)
+// of byte (i / 8).
+//
+// Counters over many bit arrays are kept bit-sliced: a counter of width w is
+// w words, word b holding bit b of the count for each of 64 positions, so a
+// whole word of positions is updated with a handful of logic operations.
+//
+
+#ifndef _PUFLIB_BITSLICE_H_
+#define _PUFLIB_BITSLICE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Number of words needed to hold a number of bits
+#define BITS_WORDS(nbits) (((nbits) + 63) / 64)
+
+static inline bool bits_get(uint64_t const * words, size_t i)
+{
+    return (words[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bits_flip(uint64_t * words, size_t i)
+{
+    words[i / 64] ^= (uint64_t) 1 << (i % 64);
+}
+
+/// Mask of the valid bits in the last word of an array of nbits
+static inline uint64_t bits_tail_mask(size_t nbits)
+{
+    return (nbits % 64) ? ((uint64_t) 1 << (nbits % 64)) - 1 : ~(uint64_t) 0;
+}
+
+/**
+ * Load word w of a byte string of nbits bits. Bits past nbits are cleared.
+ */
+static inline uint64_t bits_load_word(uint8_t const * src, size_t nbits, size_t w)
+{
+    size_t const nbytes = (nbits + 7) / 8;
+    uint64_t v = 0;
+
+    for (size_t b = 0; b < 8 && 8 * w + b < nbytes; ++b) {
+        v |= (uint64_t) src[8 * w + b] << (8 * b);
+    }
+    if (w == BITS_WORDS(nbits) - 1) {
+        v &= bits_tail_mask(nbits);
+    }
+    return v;
+}
+
+/**
+ * Unpack a byte string into words. Bits of the last word past nbits are
+ * cleared.
+ */
+static inline void bits_from_bytes(uint64_t * dest, uint8_t const * src, size_t nbits)
+{
+    for (size_t w = 0; w < BITS_WORDS(nbits); ++w) {
+        dest[w] = bits_load_word(src, nbits, w);
+    }
+}
+
+/**
+ * Pack words into a byte string. Bits of the last byte past nbits are
+ * cleared.
+ */
+static inline void bits_to_bytes(uint8_t * dest, uint64_t const * src, size_t nbits)
+{
+    size_t nbytes = (nbits + 7) / 8;
+
+    for (size_t i = 0; i < nbytes; ++i) {
+        dest[i] = (uint8_t) (src[i / 8] >> (8 * (i % 8)));
+    }
+    if (nbits % 8) {
+        dest[nbytes - 1] &= (1u << (nbits % 8)) - 1;
+    }
+}
+
+/**
+ * Copy nbits bits starting at bit offset off of src into dest, starting at
+ * bit 0. Bits of the last word past nbits are cleared.
+ */
+static inline void bits_extract(uint64_t * dest, uint64_t const * src, size_t off, size_t nbits)
+{
+    size_t shift = off % 64;
+    uint64_t const * s = src + off / 64;
+    size_t nwords = BITS_WORDS(nbits);
+
+    for (size_t w = 0; w < nwords; ++w) {
+        uint64_t v = s[w] >> shift;
+        // Only touch the next source word if any of its bits are wanted
+        if (shift && 64 * w + (64 - shift) < nbits) {
+            v |= s[w + 1] << (64 - shift);
+        }
+        dest[w] = v;
+    }
+    if (nbits) {
+        dest[nwords - 1] &= bits_tail_mask(nbits);
+    }
+}
+
+/**
+ * OR nbits bits of src, starting at bit 0, into dest starting at bit offset
+ * off. The destination range is expected to be clear.
+ */
+static inline void bits_insert(uint64_t * dest, size_t off, uint64_t const * src, size_t nbits)
+{
+    size_t shift = off % 64;
+    uint64_t * d = dest + off / 64;
+    size_t nwords = BITS_WORDS(nbits);
+
+    for (size_t w = 0; w < nwords; ++w) {
+        uint64_t v = src[w];
+        if (w == nwords - 1) {
+            v &= bits_tail_mask(nbits);
+        }
+        d[w] |= v << shift;
+        if (shift && 64 * w + (64 - shift) < nbits) {
+            d[w + 1] |= v >> (64 - shift);
+        }
+    }
+}
+
+/// Number of bits needed for a counter that can reach max
+static inline unsigned bitslice_width(unsigned max)
+{
+    unsigned width = 1;
+    while (width < 32 && (max >> width)) {
+        ++width;
+    }
+    return width;
+}
+
+/**
+ * Add one bit for each of 64 positions to a bit-sliced counter of the given
+ * width. Counts past the counter's range wrap.
+ */
+static inline void bitslice_add(uint64_t * counter, unsigned width, uint64_t bits)
+{
+    for (unsigned b = 0; b < width && bits; ++b) {
+        uint64_t carry = counter[b] & bits;
+        counter[b] ^= bits;
+        bits = carry;
+    }
+}
+
+/**
+ * Compare a bit-sliced counter against a constant.
+ * @return mask of positions whose count is >= threshold
+ */
+static inline uint64_t bitslice_ge(uint64_t const * counter, unsigned width, unsigned threshold)
+{
+    uint64_t gt = 0, eq = ~(uint64_t) 0;
+
+    if (width < 32 && (threshold >> width)) {
+        return 0;
+    }
+
+    for (unsigned b = width; b-- > 0;) {
+        if ((threshold >> b) & 1) {
+            eq &= counter[b];
+        } else {
+            gt |= eq & counter[b];
+            eq &= ~counter[b];
+        }
+    }
+    return gt | eq;
+}
+
+/// Read back the count for one position of a bit-sliced counter
+static inline unsigned bitslice_count(uint64_t const * counter, unsigned width, unsigned pos)
+{
+    unsigned count = 0;
+    for (unsigned b = 0; b < width; ++b) {
+        count |= (unsigned) ((counter[b] >> pos) & 1) << b;
+    }
+    return count;
+}
+
+#endif // _PUFLIB_BITSLICE_H_
@@ -0,0 +1,303 @@
+// PUFlib enrollment blobs
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A blob is one file in a module's directory store: a fixed header followed
+// by the contents. All integers are stored little-endian:
+//
+//      offset  size    field
+//      0       8       magic, "PUFBLOB\n"
+//      8       4       format (BLOB_FORMAT)
+//      12      4       CRC-32 of the contents
+//      16      8       length of the contents
+//      24      4       CRC-32 of bytes 0-23
+//      28      36      reserved, zero
+//      64      ...     contents
+//
+// The contents start on a 64-byte boundary so modules can access them with
+// aligned vector loads.
+//
+// Read-only mappings are kept in a process-wide cache. An entry is reused
+// while the file it maps is still the one at its path, and dropped once
+// unused and stale.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define BLOB_MAGIC "PUFBLOB\n"
+#define BLOB_FORMAT 1
+#define BLOB_HEADER_LEN 64
+#define BLOB_SUFFIX ".blob"
+
+struct puflib_blob_s {
+    char * path;
+    puflib_map map;
+    unsigned refs;
+    bool verified;
+    struct puflib_blob_s * next;
+};
+
+struct puflib_blob_writer_s {
+    char * path;
+    puflib_map map;
+};
+
+static struct puflib_blob_s * BLOBS = NULL;
+static pthread_mutex_t BLOBS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+static char * blob_path(module_info const * module, enum puflib_storage_type type,
+        char const * name)
+{
+    if (type != STORAGE_TEMP_DIR && type != STORAGE_FINAL_DIR) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    char * dir = puflib_get_nv_store(module, type);
+    if (!dir) {
+        return NULL;
+    }
+
+    char * path = puflib_concat(dir, puflib_get_path_sep(), name, BLOB_SUFFIX, NULL);
+    free(dir);
+    return path;
+}
+
+
+static void free_blob(struct puflib_blob_s * blob)
+{
+    puflib_map_close(&blob->map);
+    free(blob->path);
+    free(blob);
+}
+
+
+/**
+ * Check a freshly mapped blob's header.
+ * @return false if valid
+ */
+static bool check_header(puflib_map const * map)
+{
+    uint8_t const * hdr = map->data;
+
+    return map->len < BLOB_HEADER_LEN
+        || memcmp(hdr, BLOB_MAGIC, 8)
+        || puflib_load_le32(hdr + 8) != BLOB_FORMAT
+        || puflib_load_le32(hdr + 24) != puflib_crc32(hdr, 24, PUFLIB_CRC32_INIT)
+        || puflib_load_le64(hdr + 16) != map->len - BLOB_HEADER_LEN;
+}
+
+
+/**
+ * Drop cached mappings that are unused and no longer current. Must be called
+ * with BLOBS_LOCK held.
+ */
+static void prune_blobs(void)
+{
+    struct puflib_blob_s ** link = &BLOBS;
+
+    while (*link) {
+        struct puflib_blob_s * blob = *link;
+        uint64_t identity;
+
+        if (!blob->refs && (puflib_file_identity(blob->path, &identity)
+                    || identity != blob->map.identity)) {
+            *link = blob->next;
+            free_blob(blob);
+        } else {
+            link = &blob->next;
+        }
+    }
+}
+
+
+puflib_blob * puflib_blob_map(module_info const * module, enum puflib_storage_type type,
+        char const * name, unsigned flags)
+{
+    struct puflib_blob_s * blob = NULL;
+    uint64_t identity;
+
+    char * path = blob_path(module, type, name);
+    if (!path) {
+        return NULL;
+    }
+    if (puflib_file_identity(path, &identity)) {
+        goto err;
+    }
+
+    pthread_mutex_lock(&BLOBS_LOCK);
+    prune_blobs();
+
+    for (blob = BLOBS; blob; blob = blob->next) {
+        if (blob->map.identity == identity && !strcmp(blob->path, path)) {
+            break;
+        }
+    }
+
+    if (!blob) {
+        blob = calloc(1, sizeof(*blob));
+        if (!blob) {
+            goto err_unlock;
+        }
+        if (puflib_map_open(path, false, &blob->map)) {
+            free(blob);
+            blob = NULL;
+            goto err_unlock;
+        }
+        if (check_header(&blob->map)) {
+            puflib_report_fmt(module, STATUS_ERROR, "blob %s is damaged", name);
+            puflib_map_close(&blob->map);
+            free(blob);
+            blob = NULL;
+            errno = EBADMSG;
+            goto err_unlock;
+        }
+        blob->path = path;
+        path = NULL;
+        blob->next = BLOBS;
+        BLOBS = blob;
+    }
+
+    if ((flags & PUFLIB_BLOB_VERIFY) && !blob->verified) {
+        uint8_t const * hdr = blob->map.data;
+        if (puflib_crc32(hdr + BLOB_HEADER_LEN, blob->map.len - BLOB_HEADER_LEN,
+                    PUFLIB_CRC32_INIT) != puflib_load_le32(hdr + 12)) {
+            puflib_report_fmt(module, STATUS_ERROR, "blob %s is damaged", name);
+            errno = EBADMSG;
+            goto err_unlock;
+        }
+        blob->verified = true;
+    }
+
+    ++blob->refs;
+    pthread_mutex_unlock(&BLOBS_LOCK);
+    free(path);
+    return blob;
+
+err_unlock:
+    {
+        int errno_hold = errno;
+        pthread_mutex_unlock(&BLOBS_LOCK);
+        errno = errno_hold;
+    }
+err:
+    {
+        int errno_hold = errno;
+        free(path);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+void const * puflib_blob_data(puflib_blob const * blob)
+{
+    return (uint8_t const *) blob->map.data + BLOB_HEADER_LEN;
+}
+
+
+size_t puflib_blob_size(puflib_blob const * blob)
+{
+    return blob->map.len - BLOB_HEADER_LEN;
+}
+
+
+void puflib_blob_unmap(puflib_blob * blob)
+{
+    if (blob) {
+        // The mapping stays cached; it is released by prune_blobs() once the
+        // blob is replaced or deleted.
+        pthread_mutex_lock(&BLOBS_LOCK);
+        --blob->refs;
+        pthread_mutex_unlock(&BLOBS_LOCK);
+    }
+}
+
+
+puflib_blob_writer * puflib_blob_create(module_info const * module,
+        enum puflib_storage_type type, char const * name, size_t len)
+{
+    puflib_blob_writer * writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        return NULL;
+    }
+
+    writer->path = blob_path(module, type, name);
+    if (!writer->path) {
+        goto err;
+    }
+
+    if (puflib_map_create_temp(writer->path, BLOB_HEADER_LEN + len, &writer->map)) {
+        goto err;
+    }
+
+    return writer;
+
+err:
+    {
+        int errno_hold = errno;
+        free(writer->path);
+        free(writer);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+void * puflib_blob_writer_data(puflib_blob_writer * writer)
+{
+    return (uint8_t *) writer->map.data + BLOB_HEADER_LEN;
+}
+
+
+bool puflib_blob_commit(puflib_blob_writer * writer)
+{
+    uint8_t * hdr = writer->map.data;
+    size_t len = writer->map.len - BLOB_HEADER_LEN;
+
+    memset(hdr, 0, BLOB_HEADER_LEN);
+    memcpy(hdr, BLOB_MAGIC, 8);
+    puflib_store_le32(hdr + 8, BLOB_FORMAT);
+    puflib_store_le32(hdr + 12, puflib_crc32(hdr + BLOB_HEADER_LEN, len, PUFLIB_CRC32_INIT));
+    puflib_store_le64(hdr + 16, len);
+    puflib_store_le32(hdr + 24, puflib_crc32(hdr, 24, PUFLIB_CRC32_INIT));
+
+    bool rc = puflib_map_commit_temp(&writer->map, writer->path);
+    int errno_hold = errno;
+    free(writer->path);
+    free(writer);
+    errno = errno_hold;
+    return rc;
+}
+
+
+void puflib_blob_abort(puflib_blob_writer * writer)
+{
+    if (writer) {
+        puflib_map_discard_temp(&writer->map);
+        free(writer->path);
+        free(writer);
+    }
+}
+
+
+bool puflib_blob_write(module_info const * module, enum puflib_storage_type type,
+        char const * name, void const * data, size_t len)
+{
+    puflib_blob_writer * writer = puflib_blob_create(module, type, name, len);
+    if (!writer) {
+        return true;
+    }
+
+    if (len) {
+        memcpy(puflib_blob_writer_data(writer), data, len);
+    }
+    return puflib_blob_commit(writer);
+}
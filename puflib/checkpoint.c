@@ -0,0 +1,162 @@
+// PUFlib provisioning checkpoints
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A checkpoint is a single record in the module's temporary file store,
+// replaced as a whole with puflib_replace_file(). All integers are stored
+// little-endian:
+//
+//      offset  size    field
+//      0       8       magic, "PUFCKPT\n"
+//      8       4       record format (CHECKPOINT_FORMAT)
+//      12      4       module data format version
+//      16      4       step
+//      20      4       CRC-32 of the data
+//      24      8       data length
+//      32      4       CRC-32 of bytes 0-31
+//      36      ...     data
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <string.h>
+#include <errno.h>
+
+#define CHECKPOINT_MAGIC "PUFCKPT\n"
+#define CHECKPOINT_FORMAT 1
+#define CHECKPOINT_HEADER_LEN 36
+
+// Checkpoints hold provisioning progress, not bulk data; refuse to read
+// anything larger so a damaged length field cannot exhaust memory.
+#define CHECKPOINT_MAX_DATA (16 * 1024 * 1024)
+
+
+bool puflib_checkpoint_commit(module_info const * module, uint32_t version,
+        uint32_t step, void const * data, size_t data_len)
+{
+    if (data_len > CHECKPOINT_MAX_DATA) {
+        errno = EFBIG;
+        return true;
+    }
+
+    char * path = puflib_get_nv_store_path(module->name, STORAGE_TEMP_FILE);
+    if (!path) {
+        return true;
+    }
+
+    uint8_t * record = malloc(CHECKPOINT_HEADER_LEN + data_len);
+    if (!record) {
+        goto err;
+    }
+
+    memcpy(record, CHECKPOINT_MAGIC, 8);
+    puflib_store_le32(record + 8, CHECKPOINT_FORMAT);
+    puflib_store_le32(record + 12, version);
+    puflib_store_le32(record + 16, step);
+    puflib_store_le32(record + 20, puflib_crc32(data, data_len, PUFLIB_CRC32_INIT));
+    puflib_store_le64(record + 24, data_len);
+    puflib_store_le32(record + 32, puflib_crc32(record, 32, PUFLIB_CRC32_INIT));
+    if (data_len) {
+        memcpy(record + CHECKPOINT_HEADER_LEN, data, data_len);
+    }
+
+    if (puflib_create_directory_tree(path, true)) {
+        goto err;
+    }
+    if (puflib_replace_file(path, record, CHECKPOINT_HEADER_LEN + data_len)) {
+        goto err;
+    }
+
+    free(record);
+    free(path);
+    return false;
+
+err:
+    {
+        int errno_hold = errno;
+        free(record);
+        free(path);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+bool puflib_checkpoint_restore(module_info const * module, uint32_t * version,
+        uint32_t * step, void ** data, size_t * data_len)
+{
+    uint8_t header[CHECKPOINT_HEADER_LEN];
+    uint8_t * buf = NULL;
+    FILE * f = NULL;
+
+    char * path = puflib_get_nv_store_path(module->name, STORAGE_TEMP_FILE);
+    if (!path) {
+        return true;
+    }
+
+    f = fopen(path, "rb");
+    if (!f) {
+        goto err;
+    }
+
+    if (fread(header, 1, sizeof(header), f) != sizeof(header)
+            || memcmp(header, CHECKPOINT_MAGIC, 8)
+            || puflib_load_le32(header + 8) != CHECKPOINT_FORMAT
+            || puflib_load_le32(header + 32) != puflib_crc32(header, 32, PUFLIB_CRC32_INIT)) {
+        goto corrupt;
+    }
+
+    uint64_t len = puflib_load_le64(header + 24);
+    if (len > CHECKPOINT_MAX_DATA) {
+        goto corrupt;
+    }
+
+    buf = malloc(len ? (size_t) len : 1);
+    if (!buf) {
+        goto err;
+    }
+    if (fread(buf, 1, (size_t) len, f) != len
+            || puflib_crc32(buf, (size_t) len, PUFLIB_CRC32_INIT) != puflib_load_le32(header + 20)) {
+        goto corrupt;
+    }
+
+    fclose(f);
+    free(path);
+
+    *version = puflib_load_le32(header + 12);
+    *step = puflib_load_le32(header + 16);
+    if (data) {
+        *data = buf;
+        *data_len = (size_t) len;
+    } else {
+        free(buf);
+    }
+    return false;
+
+corrupt:
+    puflib_report(module, STATUS_ERROR, "provisioning checkpoint is damaged");
+    errno = EBADMSG;
+err:
+    {
+        int errno_hold = errno;
+        if (f) fclose(f);
+        free(buf);
+        free(path);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+bool puflib_checkpoint_discard(module_info const * module)
+{
+    if (puflib_delete_nv_store(module, STORAGE_TEMP_FILE)) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
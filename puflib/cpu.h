@@ -0,0 +1,84 @@
+// PUFlib CPU feature detection
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+// Helpers for choosing between instruction set specific implementations at
+// run time. Code using them should be compiled for the baseline instruction
+// set, with the accelerated functions given target attributes.
+//
+
+#ifndef _PUFLIB_CPU_H_
+#define _PUFLIB_CPU_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PUFLIB_CPU_X86 1
+
+#include <cpuid.h>
+
+// Leaf 1, ECX
+#define CPU_X86_1C_PCLMUL   (1u << 1)
+#define CPU_X86_1C_SSSE3    (1u << 9)
+#define CPU_X86_1C_SSE41    (1u << 19)
+#define CPU_X86_1C_AES      (1u << 25)
+#define CPU_X86_1C_OSXSAVE  (1u << 27)
+
+// Leaf 7, subleaf 0, EBX and ECX
+#define CPU_X86_7B_AVX2     (1u << 5)
+#define CPU_X86_7B_SHA      (1u << 29)
+#define CPU_X86_7C_VAES     (1u << 9)
+#define CPU_X86_7C_VPCLMUL  (1u << 10)
+
+enum { CPU_X86_EAX, CPU_X86_EBX, CPU_X86_ECX, CPU_X86_EDX };
+
+/**
+ * Run cpuid for a leaf and subleaf.
+ * @return false if the CPU does not have the leaf
+ */
+static inline bool cpu_x86_cpuid(unsigned leaf, unsigned subleaf, uint32_t regs[4])
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < leaf) {
+        return false;
+    }
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+    regs[CPU_X86_EAX] = a;
+    regs[CPU_X86_EBX] = b;
+    regs[CPU_X86_ECX] = c;
+    regs[CPU_X86_EDX] = d;
+    return true;
+}
+
+/**
+ * Whether all the given bits are set in a cpuid register.
+ */
+static inline bool cpu_x86_has(unsigned leaf, unsigned reg, uint32_t bits)
+{
+    uint32_t regs[4];
+    return cpu_x86_cpuid(leaf, 0, regs) && (regs[reg] & bits) == bits;
+}
+
+/**
+ * Whether the OS saves the YMM registers on context switch, which AVX
+ * instructions need on top of CPU support.
+ */
+static inline bool cpu_x86_os_avx(void)
+{
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (!cpu_x86_has(1, CPU_X86_ECX, CPU_X86_1C_OSXSAVE)) {
+        return false;
+    }
+    __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    (void) xcr0_hi;
+    return (xcr0_lo & 0x6) == 0x6;
+}
+
+#endif
+
+#endif // _PUFLIB_CPU_H_
@@ -0,0 +1,378 @@
+// PUFlib error-correcting codes
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Binary BCH codes (Berlekamp-Massey decoding with a Chien search),
+// first-order Reed-Muller codes (fast Hadamard transform decoding) and
+// interleaved repetition codes (bit-sliced majority decoding).
+//
+
+#include "ecc.h"
+#include "bitslice.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct puflib_bch {
+    unsigned m, n, k, t;
+    unsigned parity;        ///< n - k, the degree of the generator
+    uint16_t * exp;         ///< alpha^i for 0 <= i < 2n, so sums of logs need no reduction
+    uint16_t * log;         ///< discrete log, for nonzero elements
+    uint64_t * gen;         ///< generator polynomial, less its x^parity term
+};
+
+// Primitive polynomials for GF(2^m), indexed by m
+static const unsigned PRIMITIVE[PUFLIB_BCH_MAX_M + 1] = {
+    [3] = 0xb,      [4] = 0x13,     [5] = 0x25,     [6] = 0x43,
+    [7] = 0x89,     [8] = 0x11d,    [9] = 0x211,    [10] = 0x409,
+    [11] = 0x805,   [12] = 0x1053,  [13] = 0x201b,  [14] = 0x4443,
+    [15] = 0x8003,
+};
+
+
+static inline uint16_t gf_mul(puflib_bch const * bch, uint16_t a, uint16_t b)
+{
+    return (a && b) ? bch->exp[bch->log[a] + bch->log[b]] : 0;
+}
+
+
+static inline uint16_t gf_div(puflib_bch const * bch, uint16_t a, uint16_t b)
+{
+    return a ? bch->exp[bch->log[a] + bch->n - bch->log[b]] : 0;
+}
+
+
+puflib_bch * puflib_bch_new(unsigned m, unsigned t)
+{
+    uint16_t * g = NULL;
+    uint8_t * covered = NULL;
+
+    if (m < PUFLIB_BCH_MIN_M || m > PUFLIB_BCH_MAX_M || !t || t > PUFLIB_BCH_MAX_T) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    puflib_bch * bch = calloc(1, sizeof(*bch));
+    if (!bch) {
+        return NULL;
+    }
+    bch->m = m;
+    bch->n = (1u << m) - 1;
+    bch->t = t;
+
+    if (2 * t >= bch->n) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    bch->exp = malloc(2 * bch->n * sizeof(*bch->exp));
+    bch->log = calloc(bch->n + 1, sizeof(*bch->log));
+    g = calloc(bch->n + 1, sizeof(*g));
+    covered = calloc(bch->n, 1);
+    if (!bch->exp || !bch->log || !g || !covered) {
+        goto err;
+    }
+
+    unsigned x = 1;
+    for (unsigned i = 0; i < bch->n; ++i) {
+        bch->exp[i] = bch->exp[i + bch->n] = (uint16_t) x;
+        bch->log[x] = (uint16_t) i;
+        x <<= 1;
+        if (x & (1u << m)) {
+            x ^= PRIMITIVE[m];
+        }
+    }
+
+    // The generator is the product of the minimal polynomials of alpha^1 to
+    // alpha^2t, i.e. of (x + alpha^e) over the union of their cyclotomic
+    // cosets.
+    unsigned deg = 0;
+    g[0] = 1;
+    for (unsigned i = 1; i <= 2 * t; ++i) {
+        if (covered[i]) {
+            continue;
+        }
+        unsigned e = i;
+        do {
+            covered[e] = 1;
+            for (unsigned j = deg + 1; j > 0; --j) {
+                g[j] = g[j - 1] ^ gf_mul(bch, g[j], bch->exp[e]);
+            }
+            g[0] = gf_mul(bch, g[0], bch->exp[e]);
+            ++deg;
+            e = (2 * e) % bch->n;
+        } while (e != i);
+    }
+
+    if (deg >= bch->n) {
+        errno = EINVAL;
+        goto err;
+    }
+    bch->parity = deg;
+    bch->k = bch->n - deg;
+
+    bch->gen = calloc(BITS_WORDS(deg), sizeof(*bch->gen));
+    if (!bch->gen) {
+        goto err;
+    }
+    for (unsigned j = 0; j < deg; ++j) {
+        if (g[j]) {
+            bch->gen[j / 64] |= (uint64_t) 1 << (j % 64);
+        }
+    }
+
+    free(g);
+    free(covered);
+    return bch;
+
+err:
+    {
+        int errno_hold = errno;
+        free(g);
+        free(covered);
+        puflib_bch_free(bch);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+void puflib_bch_free(puflib_bch * bch)
+{
+    if (bch) {
+        free(bch->exp);
+        free(bch->log);
+        free(bch->gen);
+        free(bch);
+    }
+}
+
+
+unsigned puflib_bch_n(puflib_bch const * bch)
+{
+    return bch->n;
+}
+
+
+unsigned puflib_bch_k(puflib_bch const * bch)
+{
+    return bch->k;
+}
+
+
+void puflib_bch_encode(puflib_bch const * bch, uint64_t const * msg, uint64_t * cw)
+{
+    unsigned const p = bch->parity;
+    size_t const pw = BITS_WORDS(p);
+    uint64_t rem[pw];
+
+    // Remainder of msg(x) * x^p divided by the generator, a word at a time
+    // through the LFSR
+    memset(rem, 0, sizeof(rem));
+    for (unsigned i = bch->k; i-- > 0;) {
+        bool feedback = bits_get(msg, i) ^ bits_get(rem, p - 1);
+        for (size_t w = pw - 1; w > 0; --w) {
+            rem[w] = (rem[w] << 1) | (rem[w - 1] >> 63);
+        }
+        rem[0] <<= 1;
+        rem[pw - 1] &= bits_tail_mask(p);
+        if (feedback) {
+            for (size_t w = 0; w < pw; ++w) {
+                rem[w] ^= bch->gen[w];
+            }
+        }
+    }
+
+    memset(cw, 0, BITS_WORDS(bch->n) * sizeof(*cw));
+    bits_insert(cw, 0, rem, p);
+    bits_insert(cw, p, msg, bch->k);
+}
+
+
+int puflib_bch_decode(puflib_bch const * bch, uint64_t * cw, uint64_t * msg)
+{
+    unsigned const n = bch->n, t = bch->t;
+    uint16_t synd[2 * t + 1];
+    bool any = false;
+
+    // Odd syndromes from the set bits of the received word; even ones are
+    // squares of earlier ones.
+    memset(synd, 0, sizeof(synd));
+    for (size_t w = 0; w < BITS_WORDS(n); ++w) {
+        uint64_t bits = cw[w];
+        if (w == BITS_WORDS(n) - 1) {
+            bits &= bits_tail_mask(n);
+        }
+        while (bits) {
+            unsigned i = 64 * w + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            for (unsigned j = 1; j < 2 * t; j += 2) {
+                synd[j] ^= bch->exp[(i * j) % n];
+            }
+        }
+    }
+    for (unsigned j = 1; j <= t; ++j) {
+        synd[2 * j] = gf_mul(bch, synd[j], synd[j]);
+    }
+    for (unsigned j = 1; j <= 2 * t; ++j) {
+        any |= synd[j] != 0;
+    }
+
+    int corrected = 0;
+    if (any) {
+        // Berlekamp-Massey: find the error locator polynomial
+        uint16_t lambda[2 * t + 1], prev[2 * t + 1], saved[2 * t + 1];
+        unsigned len = 0, shift = 1;
+        uint16_t prev_disc = 1;
+
+        memset(lambda, 0, sizeof(lambda));
+        memset(prev, 0, sizeof(prev));
+        lambda[0] = prev[0] = 1;
+
+        for (unsigned r = 1; r <= 2 * t; ++r) {
+            uint16_t disc = synd[r];
+            for (unsigned i = 1; i <= len; ++i) {
+                disc ^= gf_mul(bch, lambda[i], synd[r - i]);
+            }
+            if (!disc) {
+                ++shift;
+                continue;
+            }
+
+            uint16_t coef = gf_div(bch, disc, prev_disc);
+            bool grow = 2 * len < r;
+            if (grow) {
+                memcpy(saved, lambda, sizeof(saved));
+            }
+            for (unsigned i = 0; i + shift <= 2 * t; ++i) {
+                lambda[i + shift] ^= gf_mul(bch, coef, prev[i]);
+            }
+            if (grow) {
+                len = r - len;
+                memcpy(prev, saved, sizeof(prev));
+                prev_disc = disc;
+                shift = 1;
+            } else {
+                ++shift;
+            }
+        }
+
+        if (len > t) {
+            return -1;
+        }
+
+        // Chien search: position i is in error if lambda(alpha^-i) = 0.
+        // Each term is stepped along in the log domain.
+        unsigned term[len + 1];
+        bool present[len + 1];
+        unsigned positions[len + 1];
+        unsigned n_roots = 0;
+
+        for (unsigned j = 1; j <= len; ++j) {
+            present[j] = lambda[j] != 0;
+            term[j] = present[j] ? bch->log[lambda[j]] : 0;
+        }
+        for (unsigned i = 0; i < n && n_roots <= len; ++i) {
+            uint16_t sum = 1;
+            for (unsigned j = 1; j <= len; ++j) {
+                if (present[j]) {
+                    sum ^= bch->exp[term[j]];
+                    term[j] += n - j;
+                    if (term[j] >= n) {
+                        term[j] -= n;
+                    }
+                }
+            }
+            if (!sum) {
+                if (n_roots == len) {
+                    return -1;
+                }
+                positions[n_roots++] = i;
+            }
+        }
+
+        if (n_roots != len) {
+            return -1;
+        }
+        for (unsigned i = 0; i < n_roots; ++i) {
+            bits_flip(cw, positions[i]);
+        }
+        corrected = (int) n_roots;
+    }
+
+    bits_extract(msg, cw, bch->parity, bch->k);
+    return corrected;
+}
+
+
+void puflib_rm_encode(unsigned m, unsigned msg, uint64_t * cw)
+{
+    size_t const n = (size_t) 1 << m;
+    unsigned const coords = msg >> 1;
+    unsigned const ones = msg & 1;
+
+    memset(cw, 0, BITS_WORDS(n) * sizeof(*cw));
+    for (size_t x = 0; x < n; ++x) {
+        if ((ones ^ __builtin_parity(coords & (unsigned) x)) & 1) {
+            cw[x / 64] |= (uint64_t) 1 << (x % 64);
+        }
+    }
+}
+
+
+unsigned puflib_rm_decode(unsigned m, int32_t * soft)
+{
+    size_t const n = (size_t) 1 << m;
+
+    // In-place fast Hadamard transform. Coefficient j correlates the input
+    // with the codeword for coordinates j; the largest in magnitude wins, and
+    // its sign gives the all-ones bit.
+    for (size_t h = 1; h < n; h <<= 1) {
+        for (size_t i = 0; i < n; i += 2 * h) {
+            for (size_t j = i; j < i + h; ++j) {
+                int32_t a = soft[j], b = soft[j + h];
+                soft[j] = a + b;
+                soft[j + h] = a - b;
+            }
+        }
+    }
+
+    size_t best = 0;
+    int32_t best_mag = soft[0] < 0 ? -soft[0] : soft[0];
+    for (size_t j = 1; j < n; ++j) {
+        int32_t mag = soft[j] < 0 ? -soft[j] : soft[j];
+        if (mag > best_mag) {
+            best = j;
+            best_mag = mag;
+        }
+    }
+
+    return ((unsigned) best << 1) | (soft[best] < 0);
+}
+
+
+void puflib_rep_decode(uint64_t const * slices, unsigned r, size_t nbits,
+        uint64_t * hard, int32_t * soft)
+{
+    size_t const nw = BITS_WORDS(nbits);
+    unsigned const width = bitslice_width(r);
+    uint64_t counter[32];
+
+    for (size_t w = 0; w < nw; ++w) {
+        memset(counter, 0, width * sizeof(*counter));
+        for (unsigned j = 0; j < r; ++j) {
+            bitslice_add(counter, width, slices[j * nw + w]);
+        }
+        hard[w] = bitslice_ge(counter, width, (r + 1) / 2);
+
+        if (soft) {
+            for (unsigned b = 0; b < 64 && 64 * w + b < nbits; ++b) {
+                soft[64 * w + b] = (int32_t) r - 2 * (int32_t) bitslice_count(counter, width, b);
+            }
+        }
+    }
+    if (nw) {
+        hard[nw - 1] &= bits_tail_mask(nbits);
+    }
+}
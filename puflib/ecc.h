@@ -0,0 +1,97 @@
+// PUFlib error-correcting codes
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+// The component codes used by the fuzzy extractor. All codewords and messages
+// are bit arrays as described in bitslice.h.
+//
+
+#ifndef _PUFLIB_ECC_H_
+#define _PUFLIB_ECC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Supported range of the BCH field degree m (code length 2^m - 1)
+#define PUFLIB_BCH_MIN_M 3
+#define PUFLIB_BCH_MAX_M 15
+
+/// Largest supported BCH error-correcting capability
+#define PUFLIB_BCH_MAX_T 128
+
+/// Largest supported Reed-Muller log2 length
+#define PUFLIB_RM_MAX_M 10
+
+/// Opaque precomputed BCH code
+typedef struct puflib_bch puflib_bch;
+
+/**
+ * Set up a binary BCH code of length 2^m - 1 correcting t errors. The tables
+ * are computed here, so a code should be built once and reused.
+ *
+ * @return code, or NULL on error (with errno set; EINVAL if no such code)
+ */
+puflib_bch * puflib_bch_new(unsigned m, unsigned t);
+
+void puflib_bch_free(puflib_bch * bch);
+
+/// Codeword length, in bits
+unsigned puflib_bch_n(puflib_bch const * bch);
+
+/// Message length, in bits
+unsigned puflib_bch_k(puflib_bch const * bch);
+
+/**
+ * Encode systematically: the codeword holds n - k parity bits followed by
+ * the k message bits.
+ *
+ * @param msg - k message bits
+ * @param cw - receives n codeword bits; must hold BITS_WORDS(n) words
+ */
+void puflib_bch_encode(puflib_bch const * bch, uint64_t const * msg, uint64_t * cw);
+
+/**
+ * Correct a received word in place and extract its message.
+ *
+ * @param cw - n received bits, corrected in place
+ * @param msg - receives k message bits; must hold BITS_WORDS(k) words
+ * @return number of errors corrected, or -1 if the word is uncorrectable
+ */
+int puflib_bch_decode(puflib_bch const * bch, uint64_t * cw, uint64_t * msg);
+
+/**
+ * Encode a message of m + 1 bits with the first-order Reed-Muller code
+ * RM(1, m). Bit 0 of msg selects the all-ones word, and bits 1 to m the
+ * coordinate functions.
+ *
+ * @param cw - receives 2^m codeword bits
+ */
+void puflib_rm_encode(unsigned m, unsigned msg, uint64_t * cw);
+
+/**
+ * Maximum-likelihood decode RM(1, m) from soft input with a fast Hadamard
+ * transform.
+ *
+ * @param soft - 2^m values, positive for a likely 0 bit and negative for a
+ *  likely 1, in proportion to confidence. Overwritten.
+ * @return decoded message
+ */
+unsigned puflib_rm_decode(unsigned m, int32_t * soft);
+
+/**
+ * Decode an interleaved repetition code: r copies of an nbits-bit array,
+ * stored one after another in slices, each starting on a word boundary.
+ * Each bit is decided by majority, r being odd.
+ *
+ * @param slices - r * BITS_WORDS(nbits) words
+ * @param hard - receives nbits majority bits
+ * @param soft - if not NULL, receives nbits values of r - 2 * (number of
+ *  copies that were 1), for soft-decision decoding of an outer code
+ */
+void puflib_rep_decode(uint64_t const * slices, unsigned r, size_t nbits,
+        uint64_t * hard, int32_t * soft);
+
+#endif // _PUFLIB_ECC_H_
@@ -0,0 +1,629 @@
+// PUFlib envelope sealing
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Each module gets a random data key, sealed ("wrapped") by the module once
+// and kept in the module's envelope store as <key ID>.key, with the ID of the
+// key in use in "current". Envelope blobs are encrypted in software under a
+// key derived from the data key and a per-blob nonce, so nonces never repeat
+// under one GCM key and a data key can serve any number of blobs. Layout:
+//
+//  PUFLIB_ENVELOPE_HEADER, module name, "\n"
+//  key ID (16 bytes)
+//  nonce (16 bytes)
+//  ciphertext
+//  GCM tag (16 bytes)
+//
+// with everything up to the ciphertext authenticated as additional data.
+//
+// Each module's current data key is held unwrapped in locked memory once it
+// has been used, so sealing costs the PUF one unwrap per process rather than
+// one per blob, whether or not the key cache is on. It is checked against its
+// wrapped file on each use, so a key that another process has deprovisioned
+// is not used again, and wiped when the module is disabled or deprovisioned
+// or on puflib_flush_keys(). Other data keys, needed to unseal older blobs,
+// go through the key cache (see keycache.c), so the application's TTL and use
+// limits decide how often the PUF is used for them; with the cache off, each
+// such blob costs an unwrap.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define KEY_LEN     PUFLIB_GCM_KEY_LEN
+#define ID_LEN      16
+#define NONCE_LEN   16
+#define CURRENT     "current"
+#define KEY_SUFFIX  ".key"
+
+// Wrapped keys are a few hundred bytes for any sensible module; refuse to
+// read anything absurd
+#define MAX_WRAPPED_LEN (64 * 1024)
+
+// Key cache IDs are this prefix followed by the key ID
+#define CACHE_PREFIX "puflib-envelope:"
+
+// Modules' current key IDs, once known, so sealing does not read "current"
+// every time, and their unwrapped keys. Creating a key also happens under the
+// lock, so concurrent first seals create one key between them.
+struct current_key {
+    struct current_key * next;
+    uint8_t id[ID_LEN];
+    uint8_t * key;              ///< Unwrapped key, in locked memory, or NULL
+    uint64_t identity;          ///< Identity of its wrapped file
+    char name[];
+};
+
+static struct current_key * CURRENT_KEYS = NULL;
+static pthread_mutex_t CURRENT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void id_to_hex(uint8_t const id[ID_LEN], char hex[2 * ID_LEN + 1])
+{
+    static char const digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < ID_LEN; ++i) {
+        hex[2 * i] = digits[id[i] >> 4];
+        hex[2 * i + 1] = digits[id[i] & 0xf];
+    }
+    hex[2 * ID_LEN] = 0;
+}
+
+
+static bool id_from_hex(char const * hex, uint8_t id[ID_LEN])
+{
+    for (size_t i = 0; i < 2 * ID_LEN; ++i) {
+        char c = hex[i];
+        unsigned v;
+        if (c >= '0' && c <= '9') {
+            v = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            v = c - 'a' + 10;
+        } else {
+            return true;
+        }
+        id[i / 2] = (uint8_t) ((i % 2) ? (id[i / 2] | v) : (v << 4));
+    }
+    return false;
+}
+
+
+/**
+ * Path to a file in a module's envelope store.
+ */
+static char * store_path(module_info const * module, char const * file, char const * suffix)
+{
+    char * dir = puflib_get_nv_store_path(module->name, STORAGE_ENVELOPE_DIR);
+    if (!dir) {
+        return NULL;
+    }
+    char * path = puflib_concat(dir, "/", file, suffix, NULL);
+    free(dir);
+    return path;
+}
+
+
+/**
+ * Read a whole file of at most max bytes.
+ * @return false on success, true on error (with errno set)
+ */
+static bool read_file(char const * path, size_t max, uint8_t ** data, size_t * len)
+{
+    uint8_t * buf = NULL;
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        return true;
+    }
+
+    buf = malloc(max + 1);
+    if (!buf) {
+        goto err;
+    }
+
+    size_t n = fread(buf, 1, max + 1, f);
+    if (ferror(f)) {
+        errno = EIO;
+        goto err;
+    } else if (n > max) {
+        errno = EFBIG;
+        goto err;
+    }
+
+    fclose(f);
+    *data = buf;
+    *len = n;
+    return false;
+
+err:;
+    int errno_hold = errno;
+    fclose(f);
+    free(buf);
+    errno = errno_hold;
+    return true;
+}
+
+
+static void cache_id(uint8_t const id[ID_LEN], uint8_t out[sizeof(CACHE_PREFIX) - 1 + ID_LEN])
+{
+    memcpy(out, CACHE_PREFIX, sizeof(CACHE_PREFIX) - 1);
+    memcpy(out + sizeof(CACHE_PREFIX) - 1, id, ID_LEN);
+}
+
+
+/**
+ * Get a data key by ID, from the key cache or by unwrapping it.
+ * @return false on success, true on error (with errno set; ENOENT if there is
+ *  no such key)
+ */
+static bool load_key(module_info const * module, uint8_t const id[ID_LEN], uint8_t key[KEY_LEN])
+{
+    uint8_t cid[sizeof(CACHE_PREFIX) - 1 + ID_LEN];
+    uint8_t * wrapped = NULL, * unwrapped = NULL;
+    size_t wrapped_len, unwrapped_len = 0;
+    char hex[2 * ID_LEN + 1];
+    char * path = NULL;
+
+    cache_id(id, cid);
+    if (!puflib_key_cache_get(module, cid, sizeof(cid), key, KEY_LEN)) {
+        return false;
+    }
+
+    id_to_hex(id, hex);
+    path = store_path(module, hex, KEY_SUFFIX);
+    if (!path || read_file(path, MAX_WRAPPED_LEN, &wrapped, &wrapped_len)) {
+        goto err;
+    }
+
+    if (puflib_module_call(module, PUFLIB_OP_UNSEAL, wrapped, wrapped_len,
+                (void **) &unwrapped, &unwrapped_len)) {
+        goto err;
+    }
+    if (unwrapped_len != KEY_LEN) {
+        puflib_report(module, STATUS_ERROR, "envelope key did not unwrap to a key");
+        errno = EBADMSG;
+        goto err;
+    }
+
+    memcpy(key, unwrapped, KEY_LEN);
+    puflib_key_cache_put(module, cid, sizeof(cid), key, KEY_LEN);
+
+    puflib_wipe(unwrapped, unwrapped_len);
+    free(unwrapped);
+    free(wrapped);
+    free(path);
+    return false;
+
+err:;
+    int errno_hold = errno;
+    if (unwrapped) {
+        puflib_wipe(unwrapped, unwrapped_len);
+        free(unwrapped);
+    }
+    free(wrapped);
+    free(path);
+    errno = errno_hold;
+    return true;
+}
+
+
+/**
+ * Create, wrap and store a new data key, and make it current.
+ */
+static bool create_key(module_info const * module, uint8_t id[ID_LEN], uint8_t key[KEY_LEN])
+{
+    uint8_t cid[sizeof(CACHE_PREFIX) - 1 + ID_LEN];
+    uint8_t * wrapped = NULL;
+    size_t wrapped_len;
+    char hex[2 * ID_LEN + 1];
+    char * dir = NULL, * path = NULL, * current = NULL;
+
+    if (puflib_random_bytes(id, ID_LEN) || puflib_random_bytes(key, KEY_LEN)) {
+        goto err;
+    }
+
+    if (puflib_module_call(module, PUFLIB_OP_SEAL, key, KEY_LEN,
+                (void **) &wrapped, &wrapped_len)) {
+        goto err;
+    }
+
+    id_to_hex(id, hex);
+    dir = puflib_get_nv_store_path(module->name, STORAGE_ENVELOPE_DIR);
+    path = store_path(module, hex, KEY_SUFFIX);
+    current = store_path(module, CURRENT, "");
+    if (!dir || !path || !current) {
+        goto err;
+    }
+
+    // The key must be durable before anything refers to it
+    if (puflib_create_directory_tree(dir, false)
+            || puflib_replace_file(path, wrapped, wrapped_len)
+            || puflib_replace_file(current, hex, 2 * ID_LEN)) {
+        goto err;
+    }
+
+    cache_id(id, cid);
+    puflib_key_cache_put(module, cid, sizeof(cid), key, KEY_LEN);
+
+    puflib_report(module, STATUS_DEBUG, "created a new envelope key");
+    free(wrapped);
+    free(dir);
+    free(path);
+    free(current);
+    return false;
+
+err:;
+    int errno_hold = errno;
+    puflib_wipe(key, KEY_LEN);
+    free(wrapped);
+    free(dir);
+    free(path);
+    free(current);
+    errno = errno_hold;
+    return true;
+}
+
+
+/**
+ * Identity of a data key's wrapped file.
+ * @return false on success, true on error (with errno set)
+ */
+static bool key_identity(module_info const * module, uint8_t const id[ID_LEN],
+        uint64_t * identity)
+{
+    char hex[2 * ID_LEN + 1];
+
+    id_to_hex(id, hex);
+    char * path = store_path(module, hex, KEY_SUFFIX);
+    if (!path) {
+        return true;
+    }
+    bool rc = puflib_file_identity(path, identity);
+    int errno_hold = errno;
+    free(path);
+    errno = errno_hold;
+    return rc;
+}
+
+
+/**
+ * Hold on to an entry's unwrapped key. Best effort: if memory cannot be
+ * locked, the key is unwrapped again next time instead. Must be called with
+ * CURRENT_LOCK held.
+ */
+static void hold_key(module_info const * module, struct current_key * entry,
+        uint8_t const key[KEY_LEN])
+{
+    int errno_hold = errno;
+    if (!entry->key) {
+        entry->key = puflib_alloc_locked(KEY_LEN);
+    }
+    if (entry->key && !key_identity(module, entry->id, &entry->identity)) {
+        memcpy(entry->key, key, KEY_LEN);
+    } else {
+        puflib_free_locked(entry->key, KEY_LEN);
+        entry->key = NULL;
+    }
+    errno = errno_hold;
+}
+
+
+/**
+ * Wipe an entry's unwrapped key. Must be called with CURRENT_LOCK held.
+ */
+static void drop_key(struct current_key * entry)
+{
+    puflib_free_locked(entry->key, KEY_LEN);
+    entry->key = NULL;
+}
+
+
+/**
+ * Get an entry's held key if it is still the one on disk. Must be called with
+ * CURRENT_LOCK held.
+ * @return true if the key was copied out
+ */
+static bool held_key(module_info const * module, struct current_key * entry,
+        uint8_t key[KEY_LEN])
+{
+    uint64_t identity;
+
+    if (!entry->key) {
+        return false;
+    }
+    if (key_identity(module, entry->id, &identity) || identity != entry->identity) {
+        drop_key(entry);
+        return false;
+    }
+    memcpy(key, entry->key, KEY_LEN);
+    return true;
+}
+
+
+/**
+ * Get the module's current data key, creating one if it has none.
+ */
+static bool current_key(module_info const * module, uint8_t id[ID_LEN], uint8_t key[KEY_LEN])
+{
+    struct current_key * entry;
+    bool rc = true;
+
+    pthread_mutex_lock(&CURRENT_LOCK);
+
+    for (entry = CURRENT_KEYS; entry; entry = entry->next) {
+        if (!strcmp(entry->name, module->name)) {
+            break;
+        }
+    }
+
+    if (!entry) {
+        entry = calloc(1, sizeof(*entry) + strlen(module->name) + 1);
+        if (!entry) {
+            goto out;
+        }
+        strcpy(entry->name, module->name);
+
+        uint8_t * hex = NULL;
+        size_t hex_len;
+        char * path = store_path(module, CURRENT, "");
+        bool found = path && !read_file(path, 2 * ID_LEN, &hex, &hex_len)
+            && hex_len == 2 * ID_LEN && !id_from_hex((char const *) hex, entry->id);
+        free(hex);
+        free(path);
+
+        if (!found && create_key(module, entry->id, key)) {
+            free(entry);
+            goto out;
+        }
+
+        entry->next = CURRENT_KEYS;
+        CURRENT_KEYS = entry;
+        if (!found) {
+            hold_key(module, entry, key);
+            memcpy(id, entry->id, ID_LEN);
+            rc = false;
+            goto out;
+        }
+    }
+
+    memcpy(id, entry->id, ID_LEN);
+    if (held_key(module, entry, key)) {
+        rc = false;
+    } else if (!load_key(module, id, key)) {
+        hold_key(module, entry, key);
+        rc = false;
+    } else if (errno == ENOENT) {
+        // The store has gone, e.g. the module was deprovisioned; start over
+        rc = create_key(module, entry->id, key);
+        if (!rc) {
+            hold_key(module, entry, key);
+        }
+        memcpy(id, entry->id, ID_LEN);
+    }
+
+out:
+    pthread_mutex_unlock(&CURRENT_LOCK);
+    return rc;
+}
+
+
+/**
+ * Get the data key a blob was sealed with: the held current key if it is the
+ * one, or else from the key cache or by unwrapping it.
+ * @return false on success, true on error (with errno set; ENOENT if there is
+ *  no such key)
+ */
+static bool unseal_key(module_info const * module, uint8_t const id[ID_LEN],
+        uint8_t key[KEY_LEN])
+{
+    bool held = false;
+
+    pthread_mutex_lock(&CURRENT_LOCK);
+    for (struct current_key * entry = CURRENT_KEYS; entry; entry = entry->next) {
+        if (!strcmp(entry->name, module->name)) {
+            held = !memcmp(entry->id, id, ID_LEN) && held_key(module, entry, key);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&CURRENT_LOCK);
+
+    return !held && load_key(module, id, key);
+}
+
+
+void puflib_envelope_drop(module_info const * module)
+{
+    pthread_mutex_lock(&CURRENT_LOCK);
+    // Forget the IDs too, since the modules' keys may be gone
+    struct current_key ** link = &CURRENT_KEYS;
+    while (*link) {
+        struct current_key * entry = *link;
+        if (module && strcmp(entry->name, module->name)) {
+            link = &entry->next;
+            continue;
+        }
+        *link = entry->next;
+        drop_key(entry);
+        free(entry);
+    }
+    pthread_mutex_unlock(&CURRENT_LOCK);
+}
+
+
+/**
+ * Derive a blob's GCM key from the data key and its nonce.
+ */
+static puflib_gcm * blob_key(uint8_t const key[KEY_LEN], uint8_t const nonce[NONCE_LEN])
+{
+    uint8_t derived[PUFLIB_SHA256_LEN];
+    puflib_sha256_ctx ctx;
+
+    puflib_sha256_init(&ctx);
+    puflib_sha256_update(&ctx, CACHE_PREFIX, sizeof(CACHE_PREFIX) - 1);
+    puflib_sha256_update(&ctx, key, KEY_LEN);
+    puflib_sha256_update(&ctx, nonce, NONCE_LEN);
+    puflib_sha256_final(&ctx, derived);
+
+    puflib_gcm * gcm = puflib_gcm_new(derived);
+    puflib_wipe(derived, sizeof(derived));
+    return gcm;
+}
+
+
+bool puflib_seal_envelope(module_info const * module,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    static uint8_t const iv[PUFLIB_GCM_IV_LEN] = {0};
+    uint8_t key[KEY_LEN];
+    uint8_t * out = NULL;
+    puflib_gcm * gcm = NULL;
+
+    if (!module) {
+        errno = EINVAL;
+        return true;
+    }
+
+    size_t const name_len = strlen(module->name);
+    size_t const header_len = strlen(PUFLIB_ENVELOPE_HEADER) + name_len + 1
+        + ID_LEN + NONCE_LEN;
+
+    if (data_in_len > SIZE_MAX - header_len - PUFLIB_GCM_TAG_LEN) {
+        errno = EMSGSIZE;
+        return true;
+    }
+
+    out = malloc(header_len + data_in_len + PUFLIB_GCM_TAG_LEN);
+    if (!out) {
+        return true;
+    }
+
+    uint8_t * p = out;
+    memcpy(p, PUFLIB_ENVELOPE_HEADER, strlen(PUFLIB_ENVELOPE_HEADER));
+    p += strlen(PUFLIB_ENVELOPE_HEADER);
+    memcpy(p, module->name, name_len);
+    p += name_len;
+    *p++ = '\n';
+    uint8_t * const id = p;
+    uint8_t * const nonce = p + ID_LEN;
+
+    if (current_key(module, id, key)) {
+        goto err;
+    }
+    if (puflib_random_bytes(nonce, NONCE_LEN)) {
+        goto err;
+    }
+
+    gcm = blob_key(key, nonce);
+    if (!gcm) {
+        goto err;
+    }
+    if (puflib_gcm_seal(gcm, iv, out, header_len, data_in, data_in_len,
+                out + header_len, out + header_len + data_in_len)) {
+        goto err;
+    }
+
+    puflib_gcm_free(gcm);
+    puflib_wipe(key, sizeof(key));
+    *data_out = out;
+    *data_out_len = header_len + data_in_len + PUFLIB_GCM_TAG_LEN;
+    return false;
+
+err:;
+    int errno_hold = errno;
+    puflib_gcm_free(gcm);
+    puflib_wipe(key, sizeof(key));
+    free(out);
+    errno = errno_hold;
+    return true;
+}
+
+
+bool puflib_is_envelope_sealed(uint8_t const * data, size_t len)
+{
+    size_t const magic_len = strlen(PUFLIB_ENVELOPE_HEADER);
+    return len >= magic_len && !memcmp(data, PUFLIB_ENVELOPE_HEADER, magic_len);
+}
+
+
+bool puflib_unseal_envelope(uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    static uint8_t const iv[PUFLIB_GCM_IV_LEN] = {0};
+    size_t const magic_len = strlen(PUFLIB_ENVELOPE_HEADER);
+    uint8_t key[KEY_LEN];
+    uint8_t * out = NULL;
+    puflib_gcm * gcm = NULL;
+    char * module_name = NULL;
+
+    uint8_t const * name = data_in + magic_len;
+    uint8_t const * name_end = memchr(name, '\n', data_in_len - magic_len);
+    if (!name_end) {
+        goto malformed;
+    }
+
+    size_t const header_len = (size_t) (name_end - data_in) + 1 + ID_LEN + NONCE_LEN;
+    if (data_in_len < header_len + PUFLIB_GCM_TAG_LEN) {
+        goto malformed;
+    }
+    size_t const text_len = data_in_len - header_len - PUFLIB_GCM_TAG_LEN;
+    uint8_t const * id = name_end + 1;
+    uint8_t const * nonce = id + ID_LEN;
+
+    module_name = malloc((size_t) (name_end - name) + 1);
+    if (!module_name) {
+        goto err;
+    }
+    memcpy(module_name, name, (size_t) (name_end - name));
+    module_name[name_end - name] = 0;
+
+    module_info const * module = puflib_get_module(module_name);
+    if (!module) {
+        puflib_report_fmt(NULL, STATUS_ERROR,
+                "cannot unseal blob; requested module not found: %s", module_name);
+        errno = ENOENT;
+        goto err;
+    }
+
+    if (unseal_key(module, id, key)) {
+        if (errno == ENOENT) {
+            puflib_report(module, STATUS_ERROR,
+                    "cannot unseal blob; its envelope key no longer exists");
+        }
+        goto err;
+    }
+
+    gcm = blob_key(key, nonce);
+    out = malloc(text_len ? text_len : 1);
+    if (!gcm || !out) {
+        goto err;
+    }
+    if (puflib_gcm_open(gcm, iv, data_in, header_len, data_in + header_len, text_len,
+                data_in + header_len + text_len, out)) {
+        puflib_report(module, STATUS_ERROR, "cannot unseal blob; it has been altered");
+        goto err;
+    }
+
+    puflib_gcm_free(gcm);
+    puflib_wipe(key, sizeof(key));
+    free(module_name);
+    *data_out = out;
+    *data_out_len = text_len;
+    return false;
+
+malformed:
+    puflib_report(NULL, STATUS_ERROR, "malformed envelope blob");
+    errno = EINVAL;
+err:;
+    int errno_hold = errno;
+    puflib_gcm_free(gcm);
+    puflib_wipe(key, sizeof(key));
+    free(out);
+    free(module_name);
+    errno = errno_hold;
+    return true;
+}
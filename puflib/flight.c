@@ -0,0 +1,179 @@
+// PUFlib single-flight call coalescing
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// When many threads ask a module the same thing at once (a burst of unseals
+// of one blob at start-up, or a herd of identical challenges to a
+// deterministic module), only the first call goes to the module. The others
+// find it in flight, wait for it, and take a copy of its result or its error.
+// A flight is matched by module, operation, priority class and the SHA-256 of
+// the input, and only while it is running: a call that arrives after it
+// returns makes its own.
+//
+// The leader's output belongs to its caller, so once the call returns, the
+// leader leaves one copy with the flight for the waiters, which is wiped
+// (unsealed data may be secret) and freed by the last of them. If that copy
+// cannot be made, the waiters make their own calls instead.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+struct flight {
+    module_info const * module;
+    enum puflib_op op;
+    enum puflib_priority priority;
+    uint8_t digest[PUFLIB_SHA256_LEN];  ///< Hash of the input
+    unsigned refs;              ///< Held by the leader and each waiter
+    bool done;                  ///< The call has returned
+    bool failed;
+    int error;                  ///< errno of a failed call
+    bool no_copy;               ///< The result could not be shared
+    void * result;
+    size_t result_len;
+    pthread_cond_t cond;        ///< Signalled when done
+    struct flight * next;
+};
+
+// Flights in progress, protected by FLIGHT_LOCK. There are at most as many as
+// threads calling modules, so a list does.
+static struct flight * FLIGHTS = NULL;
+static pthread_mutex_t FLIGHT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Drop a reference to a flight, freeing it if it was the last. Must be called
+ * with FLIGHT_LOCK held, once the flight is done.
+ */
+static void unref_flight(struct flight * f)
+{
+    if (--f->refs) {
+        return;
+    }
+    if (f->result) {
+        puflib_wipe(f->result, f->result_len);
+        free(f->result);
+    }
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+
+/**
+ * Wait for a flight to land, and copy out its result. Must be called with
+ * FLIGHT_LOCK held and a reference to the flight, both of which it drops.
+ * @return true if the waiter must make the call itself
+ */
+static bool wait_flight(struct flight * f, bool * rv, void ** data_out, size_t * data_out_len)
+{
+    while (!f->done) {
+        pthread_cond_wait(&f->cond, &FLIGHT_LOCK);
+    }
+    pthread_mutex_unlock(&FLIGHT_LOCK);
+
+    // A landed flight doesn't change, so the copy needs no lock
+    bool retry = false;
+    int errno_hold = 0;
+    if (f->failed) {
+        *rv = true;
+        errno_hold = f->error;
+    } else if (f->no_copy) {
+        retry = true;
+    } else {
+        void * copy = malloc(f->result_len ? f->result_len : 1);
+        *rv = !copy;
+        errno_hold = errno;
+        if (copy) {
+            memcpy(copy, f->result, f->result_len);
+            *data_out = copy;
+            *data_out_len = f->result_len;
+        }
+    }
+
+    pthread_mutex_lock(&FLIGHT_LOCK);
+    unref_flight(f);
+    pthread_mutex_unlock(&FLIGHT_LOCK);
+    errno = errno_hold;
+    return retry;
+}
+
+
+bool puflib_coalesce(puflib_call * call, puflib_call_fn fn)
+{
+    void ** const data_out = call->data_out;
+    size_t * const data_out_len = call->data_out_len;
+    struct flight key = {
+        .module = call->module,
+        .op = call->op,
+        .priority = puflib_get_priority(),
+    };
+    puflib_sha256(call->data_in, call->data_in_len, key.digest);
+
+    pthread_mutex_lock(&FLIGHT_LOCK);
+    for (struct flight * f = FLIGHTS; f; f = f->next) {
+        if (f->module == key.module && f->op == key.op && f->priority == key.priority
+                && !memcmp(f->digest, key.digest, sizeof(key.digest))) {
+            bool rv;
+            ++f->refs;
+            if (wait_flight(f, &rv, data_out, data_out_len)) {
+                return fn(call);
+            }
+            return rv;
+        }
+    }
+
+    // Without a flight to share, this call simply goes alone
+    struct flight * f = malloc(sizeof(*f));
+    if (!f) {
+        pthread_mutex_unlock(&FLIGHT_LOCK);
+        return fn(call);
+    }
+    *f = key;
+    f->refs = 1;
+    pthread_cond_init(&f->cond, NULL);
+    f->next = FLIGHTS;
+    FLIGHTS = f;
+    pthread_mutex_unlock(&FLIGHT_LOCK);
+
+    bool rv = fn(call);
+    int errno_hold = errno;
+
+    pthread_mutex_lock(&FLIGHT_LOCK);
+    struct flight ** link;
+    for (link = &FLIGHTS; *link != f; link = &(*link)->next);
+    *link = f->next;
+
+    // Waiters can only join while it is listed, so the count is now final,
+    // and nobody reads the result until it is marked done
+    bool const shared = f->refs > 1;
+    pthread_mutex_unlock(&FLIGHT_LOCK);
+
+    if (shared) {
+        if (rv) {
+            f->failed = true;
+            f->error = errno_hold;
+        } else {
+            f->result = malloc(*data_out_len ? *data_out_len : 1);
+            f->no_copy = !f->result;
+            if (f->result) {
+                memcpy(f->result, *data_out, *data_out_len);
+                f->result_len = *data_out_len;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&FLIGHT_LOCK);
+    f->done = true;
+    pthread_cond_broadcast(&f->cond);
+    unref_flight(f);
+    pthread_mutex_unlock(&FLIGHT_LOCK);
+
+    errno = errno_hold;
+    return rv;
+}
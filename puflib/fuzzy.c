@@ -0,0 +1,347 @@
+// PUFlib fuzzy extractor
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Code-offset construction: at enrollment a random key is encoded into a
+// codeword c, and the helper data is the response w XORed with c. A later,
+// noisy response w' gives w' ^ helper = c ^ (w ^ w'), which decodes back to
+// the key as long as the noise is within what the code corrects.
+//
+// The code is an outer code (repetition, BCH or Reed-Muller) applied to each
+// block of the key, concatenated with an inner repetition code. Repetitions
+// are interleaved: copy j of outer bit i is response bit j * L + i, where L
+// is the total length of the outer codewords, so majority decoding works on
+// whole words of bits at a time.
+//
+// Helper data format, integers little-endian:
+//
+//      offset  size    field
+//      0       8       magic, "PUFHELP\n"
+//      8       1       outer code (enum puflib_ecc_code)
+//      9       1       m
+//      10      1       t
+//      11      1       reserved, zero
+//      12      2       inner repetition factor
+//      14      2       number of blocks
+//      16      4       CRC-32 of bytes 0-15 followed by the code offset
+//      20      ...     code offset, packed as the response
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+#include "ecc.h"
+#include "bitslice.h"
+
+#include <string.h>
+#include <errno.h>
+
+#define HELPER_MAGIC "PUFHELP\n"
+#define HELPER_HEADER_LEN 20
+#define MAX_REPETITION 255
+#define MAX_BLOCKS 65535
+
+struct puflib_fe_s {
+    puflib_ecc_params params;
+    puflib_bch * bch;           ///< Outer BCH code, if used
+    unsigned outer_n;           ///< Bits per outer codeword
+    unsigned outer_k;           ///< Key bits per outer codeword
+    size_t outer_bits;          ///< Length of all outer codewords together
+    size_t response_bits;
+    size_t key_bits;
+};
+
+
+puflib_fe * puflib_fe_new(puflib_ecc_params const * params)
+{
+    unsigned r = params->repetition;
+
+    if (!r || !(r & 1) || r > MAX_REPETITION
+            || !params->blocks || params->blocks > MAX_BLOCKS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    puflib_fe * fe = calloc(1, sizeof(*fe));
+    if (!fe) {
+        return NULL;
+    }
+    fe->params = *params;
+
+    switch (params->code) {
+    case PUFLIB_ECC_REPETITION:
+        fe->params.m = fe->params.t = 0;
+        fe->outer_n = fe->outer_k = 1;
+        break;
+
+    case PUFLIB_ECC_BCH:
+        fe->bch = puflib_bch_new(params->m, params->t);
+        if (!fe->bch) {
+            goto err;
+        }
+        fe->outer_n = puflib_bch_n(fe->bch);
+        fe->outer_k = puflib_bch_k(fe->bch);
+        break;
+
+    case PUFLIB_ECC_REED_MULLER:
+        if (!params->m || params->m > PUFLIB_RM_MAX_M) {
+            errno = EINVAL;
+            goto err;
+        }
+        fe->params.t = 0;
+        fe->outer_n = 1u << params->m;
+        fe->outer_k = params->m + 1;
+        break;
+
+    default:
+        errno = EINVAL;
+        goto err;
+    }
+
+    fe->outer_bits = (size_t) params->blocks * fe->outer_n;
+    fe->response_bits = fe->outer_bits * r;
+    fe->key_bits = (size_t) params->blocks * fe->outer_k;
+    return fe;
+
+err:
+    {
+        int errno_hold = errno;
+        puflib_fe_free(fe);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+puflib_fe * puflib_fe_from_helper(void const * helper, size_t helper_len)
+{
+    uint8_t const * hdr = helper;
+
+    if (helper_len < HELPER_HEADER_LEN || memcmp(hdr, HELPER_MAGIC, 8)) {
+        errno = EBADMSG;
+        return NULL;
+    }
+
+    puflib_ecc_params params = {
+        .code = hdr[8],
+        .m = hdr[9],
+        .t = hdr[10],
+        .repetition = hdr[12] | (unsigned) hdr[13] << 8,
+        .blocks = hdr[14] | (unsigned) hdr[15] << 8,
+    };
+
+    puflib_fe * fe = puflib_fe_new(&params);
+    if (!fe && errno == EINVAL) {
+        errno = EBADMSG;
+    }
+    return fe;
+}
+
+
+void puflib_fe_free(puflib_fe * fe)
+{
+    if (fe) {
+        puflib_bch_free(fe->bch);
+        free(fe);
+    }
+}
+
+
+size_t puflib_fe_response_bits(puflib_fe const * fe)
+{
+    return fe->response_bits;
+}
+
+
+size_t puflib_fe_key_bits(puflib_fe const * fe)
+{
+    return fe->key_bits;
+}
+
+
+size_t puflib_fe_helper_len(puflib_fe const * fe)
+{
+    return HELPER_HEADER_LEN + (fe->response_bits + 7) / 8;
+}
+
+
+/**
+ * Encode key bits into a full response-length codeword.
+ */
+static void encode(puflib_fe const * fe, uint64_t const * key, uint64_t * cw,
+        uint64_t * outer)
+{
+    uint64_t block_msg[BITS_WORDS(fe->outer_k)];
+    uint64_t block_cw[BITS_WORDS(fe->outer_n)];
+
+    memset(outer, 0, BITS_WORDS(fe->outer_bits) * sizeof(*outer));
+    for (unsigned b = 0; b < fe->params.blocks; ++b) {
+        bits_extract(block_msg, key, (size_t) b * fe->outer_k, fe->outer_k);
+
+        switch (fe->params.code) {
+        case PUFLIB_ECC_REPETITION:
+            block_cw[0] = block_msg[0];
+            break;
+        case PUFLIB_ECC_BCH:
+            puflib_bch_encode(fe->bch, block_msg, block_cw);
+            break;
+        case PUFLIB_ECC_REED_MULLER:
+            puflib_rm_encode(fe->params.m, (unsigned) block_msg[0], block_cw);
+            break;
+        }
+
+        bits_insert(outer, (size_t) b * fe->outer_n, block_cw, fe->outer_n);
+    }
+
+    memset(cw, 0, BITS_WORDS(fe->response_bits) * sizeof(*cw));
+    for (unsigned j = 0; j < fe->params.repetition; ++j) {
+        bits_insert(cw, j * fe->outer_bits, outer, fe->outer_bits);
+    }
+
+    puflib_wipe(block_msg, sizeof(block_msg));
+    puflib_wipe(block_cw, sizeof(block_cw));
+}
+
+
+static uint32_t helper_crc(uint8_t const * helper, size_t helper_len)
+{
+    uint32_t crc = puflib_crc32(helper, 16, PUFLIB_CRC32_INIT);
+    return puflib_crc32(helper + HELPER_HEADER_LEN, helper_len - HELPER_HEADER_LEN, crc);
+}
+
+
+bool puflib_fe_enroll(puflib_fe const * fe, uint8_t const * response,
+        uint8_t * key, uint8_t * helper)
+{
+    size_t const kw = BITS_WORDS(fe->key_bits);
+    size_t const rw = BITS_WORDS(fe->response_bits);
+    size_t const ow = BITS_WORDS(fe->outer_bits);
+    size_t const scratch_words = kw + 2 * rw + ow;
+
+    uint64_t * scratch = malloc(scratch_words * sizeof(*scratch));
+    if (!scratch) {
+        return true;
+    }
+    uint64_t * key_words = scratch;
+    uint64_t * cw = key_words + kw;
+    uint64_t * resp = cw + rw;
+    uint64_t * outer = resp + rw;
+
+    if (puflib_random_bytes(key, (fe->key_bits + 7) / 8)) {
+        int errno_hold = errno;
+        free(scratch);
+        errno = errno_hold;
+        return true;
+    }
+    bits_from_bytes(key_words, key, fe->key_bits);
+    bits_to_bytes(key, key_words, fe->key_bits);
+
+    encode(fe, key_words, cw, outer);
+    bits_from_bytes(resp, response, fe->response_bits);
+    for (size_t w = 0; w < rw; ++w) {
+        cw[w] ^= resp[w];
+    }
+
+    size_t const helper_len = puflib_fe_helper_len(fe);
+    memset(helper, 0, HELPER_HEADER_LEN);
+    memcpy(helper, HELPER_MAGIC, 8);
+    helper[8] = (uint8_t) fe->params.code;
+    helper[9] = (uint8_t) fe->params.m;
+    helper[10] = (uint8_t) fe->params.t;
+    helper[12] = (uint8_t) fe->params.repetition;
+    helper[13] = (uint8_t) (fe->params.repetition >> 8);
+    helper[14] = (uint8_t) fe->params.blocks;
+    helper[15] = (uint8_t) (fe->params.blocks >> 8);
+    bits_to_bytes(helper + HELPER_HEADER_LEN, cw, fe->response_bits);
+    puflib_store_le32(helper + 16, helper_crc(helper, helper_len));
+
+    puflib_wipe(scratch, scratch_words * sizeof(*scratch));
+    free(scratch);
+    return false;
+}
+
+
+bool puflib_fe_reproduce(puflib_fe const * fe, uint8_t const * response,
+        uint8_t const * helper, size_t helper_len, uint8_t * key)
+{
+    size_t const kw = BITS_WORDS(fe->key_bits);
+    size_t const rw = BITS_WORDS(fe->response_bits);
+    size_t const ow = BITS_WORDS(fe->outer_bits);
+    unsigned const r = fe->params.repetition;
+    bool const soft = fe->params.code == PUFLIB_ECC_REED_MULLER;
+
+    if (helper_len != puflib_fe_helper_len(fe)
+            || memcmp(helper, HELPER_MAGIC, 8)
+            || helper[8] != fe->params.code
+            || helper[9] != fe->params.m
+            || helper[10] != fe->params.t
+            || (helper[12] | (unsigned) helper[13] << 8) != r
+            || (helper[14] | (unsigned) helper[15] << 8) != fe->params.blocks
+            || puflib_load_le32(helper + 16) != helper_crc(helper, helper_len)) {
+        errno = EBADMSG;
+        return true;
+    }
+
+    size_t const scratch_bytes = (kw + 2 * rw + r * ow + ow
+            + BITS_WORDS(fe->outer_n) + BITS_WORDS(fe->outer_k)) * sizeof(uint64_t)
+        + (soft ? fe->outer_bits * sizeof(int32_t) : 0);
+
+    uint64_t * scratch = malloc(scratch_bytes);
+    if (!scratch) {
+        return true;
+    }
+    uint64_t * key_words = scratch;
+    uint64_t * noisy = key_words + kw;
+    uint64_t * offset = noisy + rw;
+    uint64_t * slices = offset + rw;
+    uint64_t * outer = slices + r * ow;
+    uint64_t * block_cw = outer + ow;
+    uint64_t * block_msg = block_cw + BITS_WORDS(fe->outer_n);
+    int32_t * soft_values = soft ? (int32_t *) (block_msg + BITS_WORDS(fe->outer_k)) : NULL;
+
+    bits_from_bytes(noisy, response, fe->response_bits);
+    bits_from_bytes(offset, helper + HELPER_HEADER_LEN, fe->response_bits);
+    for (size_t w = 0; w < rw; ++w) {
+        noisy[w] ^= offset[w];
+    }
+
+    for (unsigned j = 0; j < r; ++j) {
+        bits_extract(slices + j * ow, noisy, j * fe->outer_bits, fe->outer_bits);
+    }
+    puflib_rep_decode(slices, r, fe->outer_bits, outer, soft_values);
+
+    bool failed = false;
+    memset(key_words, 0, kw * sizeof(*key_words));
+    for (unsigned b = 0; b < fe->params.blocks && !failed; ++b) {
+        size_t const start = (size_t) b * fe->outer_n;
+
+        switch (fe->params.code) {
+        case PUFLIB_ECC_REPETITION:
+            block_msg[0] = bits_get(outer, b);
+            break;
+        case PUFLIB_ECC_BCH:
+            bits_extract(block_cw, outer, start, fe->outer_n);
+            failed = puflib_bch_decode(fe->bch, block_cw, block_msg) < 0;
+            break;
+        case PUFLIB_ECC_REED_MULLER:
+            block_msg[0] = puflib_rm_decode(fe->params.m, soft_values + start);
+            break;
+        }
+
+        if (!failed) {
+            bits_insert(key_words, (size_t) b * fe->outer_k, block_msg, fe->outer_k);
+        }
+    }
+
+    if (!failed) {
+        bits_to_bytes(key, key_words, fe->key_bits);
+    }
+
+    puflib_wipe(scratch, scratch_bytes);
+    free(scratch);
+
+    if (failed) {
+        errno = EBADMSG;
+    }
+    return failed;
+}
@@ -0,0 +1,294 @@
+// PUFlib AES-256-GCM, x86 implementations
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// AES with AES-NI, eight counter blocks in flight to cover the instruction
+// latency, and GHASH with PCLMULQDQ, eight blocks per reduction using the
+// powers H^1..H^8 kept in the key's htable. The VAES variant runs the
+// keystream two blocks per instruction in YMM registers and shares the rest.
+//
+// GHASH works on byte-reversed blocks, in which GF(2^128) multiplication is
+// a carry-less multiply followed by a one-bit shift and a reduction modulo
+// x^128 + x^7 + x^2 + x + 1. The shift and reduction are linear, so eight
+// products can be summed before doing them once.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "gcm.h"
+
+#ifdef PUFLIB_CPU_X86
+
+#include <string.h>
+#include <immintrin.h>
+
+#define TARGET_AESNI __attribute__((target("aes,pclmul,sse4.1,ssse3")))
+#define TARGET_VAES  __attribute__((target("vaes,avx2,aes,pclmul,sse4.1,ssse3")))
+
+// Blocks processed per loop iteration
+#define AESNI_LANES 8
+#define VAES_LANES  16
+
+
+bool puflib_gcm_have_aesni(void)
+{
+    return cpu_x86_has(1, CPU_X86_ECX, CPU_X86_1C_AES | CPU_X86_1C_PCLMUL
+            | CPU_X86_1C_SSSE3 | CPU_X86_1C_SSE41);
+}
+
+
+bool puflib_gcm_have_vaes(void)
+{
+    return puflib_gcm_have_aesni() && cpu_x86_os_avx()
+        && cpu_x86_has(7, CPU_X86_EBX, CPU_X86_7B_AVX2)
+        && cpu_x86_has(7, CPU_X86_ECX, CPU_X86_7C_VAES);
+}
+
+
+TARGET_AESNI
+static inline __m128i bswap128(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+
+/**
+ * Accumulate the 256-bit carry-less product of a and b into lo and hi.
+ */
+TARGET_AESNI
+static inline void clmul_acc(__m128i a, __m128i b, __m128i * lo, __m128i * hi)
+{
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+            _mm_clmulepi64_si128(a, b, 0x01));
+
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00),
+                _mm_slli_si128(mid, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11),
+                _mm_srli_si128(mid, 8)));
+}
+
+
+/**
+ * Shift a 256-bit product left by one bit and reduce it to 128 bits.
+ */
+TARGET_AESNI
+static inline __m128i reduce(__m128i lo, __m128i hi)
+{
+    __m128i t7, t8, t9, t2, t4, t5;
+
+    // Shift left by one across all 256 bits
+    t7 = _mm_srli_epi32(lo, 31);
+    t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(hi, t8);
+    hi = _mm_or_si128(hi, t9);
+
+    // First phase of the reduction
+    t7 = _mm_slli_epi32(lo, 31);
+    t8 = _mm_slli_epi32(lo, 30);
+    t9 = _mm_slli_epi32(lo, 25);
+    t7 = _mm_xor_si128(t7, _mm_xor_si128(t8, t9));
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    lo = _mm_xor_si128(lo, t7);
+
+    // Second phase
+    t2 = _mm_srli_epi32(lo, 1);
+    t4 = _mm_srli_epi32(lo, 2);
+    t5 = _mm_srli_epi32(lo, 7);
+    t2 = _mm_xor_si128(_mm_xor_si128(t2, t4), _mm_xor_si128(t5, t8));
+    lo = _mm_xor_si128(lo, t2);
+
+    return _mm_xor_si128(hi, lo);
+}
+
+
+TARGET_AESNI
+static inline __m128i gfmul(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    clmul_acc(a, b, &lo, &hi);
+    return reduce(lo, hi);
+}
+
+
+TARGET_AESNI
+static void init_aesni(struct puflib_gcm_s * gcm)
+{
+    __m128i const h = bswap128(_mm_loadu_si128((__m128i const *) gcm->h));
+    __m128i p = h;
+
+    // htable[i] = H^(i + 1)
+    for (unsigned i = 0; i < 8; ++i) {
+        _mm_storeu_si128((__m128i *) gcm->htable[i], p);
+        p = gfmul(p, h);
+    }
+}
+
+
+TARGET_AESNI
+static void block_aesni(struct puflib_gcm_s const * gcm, uint8_t const in[GCM_BLOCK],
+        uint8_t out[GCM_BLOCK])
+{
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((__m128i const *) in),
+            _mm_loadu_si128((__m128i const *) gcm->rk[0]));
+
+    for (unsigned r = 1; r < GCM_ROUNDS; ++r) {
+        b = _mm_aesenc_si128(b, _mm_loadu_si128((__m128i const *) gcm->rk[r]));
+    }
+    b = _mm_aesenclast_si128(b, _mm_loadu_si128((__m128i const *) gcm->rk[GCM_ROUNDS]));
+    _mm_storeu_si128((__m128i *) out, b);
+}
+
+
+TARGET_AESNI
+static inline __m128i counter_block(__m128i base, uint32_t ctr)
+{
+    return _mm_insert_epi32(base, (int) __builtin_bswap32(ctr), 3);
+}
+
+
+TARGET_AESNI
+static inline __m128i load_base(uint8_t const iv[12])
+{
+    uint8_t cb[GCM_BLOCK] = {0};
+    memcpy(cb, iv, 12);
+    return _mm_loadu_si128((__m128i const *) cb);
+}
+
+
+TARGET_AESNI
+static void ctr_aesni(struct puflib_gcm_s const * gcm, uint8_t const iv[12], uint32_t ctr,
+        uint8_t const * in, uint8_t * out, size_t nblocks)
+{
+    __m128i const base = load_base(iv);
+    __m128i k[GCM_ROUNDS + 1];
+
+    for (unsigned r = 0; r <= GCM_ROUNDS; ++r) {
+        k[r] = _mm_loadu_si128((__m128i const *) gcm->rk[r]);
+    }
+
+    for (; nblocks >= AESNI_LANES; nblocks -= AESNI_LANES, ctr += AESNI_LANES,
+            in += GCM_BLOCK * AESNI_LANES, out += GCM_BLOCK * AESNI_LANES) {
+        __m128i b[AESNI_LANES];
+
+        for (unsigned i = 0; i < AESNI_LANES; ++i) {
+            b[i] = _mm_xor_si128(counter_block(base, ctr + i), k[0]);
+        }
+        for (unsigned r = 1; r < GCM_ROUNDS; ++r) {
+            for (unsigned i = 0; i < AESNI_LANES; ++i) {
+                b[i] = _mm_aesenc_si128(b[i], k[r]);
+            }
+        }
+        for (unsigned i = 0; i < AESNI_LANES; ++i) {
+            b[i] = _mm_aesenclast_si128(b[i], k[GCM_ROUNDS]);
+            _mm_storeu_si128((__m128i *) (out + GCM_BLOCK * i), _mm_xor_si128(b[i],
+                        _mm_loadu_si128((__m128i const *) (in + GCM_BLOCK * i))));
+        }
+    }
+
+    for (; nblocks; --nblocks, ++ctr, in += GCM_BLOCK, out += GCM_BLOCK) {
+        __m128i b = _mm_xor_si128(counter_block(base, ctr), k[0]);
+        for (unsigned r = 1; r < GCM_ROUNDS; ++r) {
+            b = _mm_aesenc_si128(b, k[r]);
+        }
+        b = _mm_aesenclast_si128(b, k[GCM_ROUNDS]);
+        _mm_storeu_si128((__m128i *) out, _mm_xor_si128(b,
+                    _mm_loadu_si128((__m128i const *) in)));
+    }
+}
+
+
+TARGET_AESNI
+static void ghash_aesni(struct puflib_gcm_s const * gcm, uint8_t acc[GCM_BLOCK],
+        uint8_t const * data, size_t nblocks)
+{
+    __m128i x = bswap128(_mm_loadu_si128((__m128i const *) acc));
+    __m128i h[8];
+
+    for (unsigned i = 0; i < 8; ++i) {
+        h[i] = _mm_loadu_si128((__m128i const *) gcm->htable[i]);
+    }
+
+    // (((x + d0) H + d1) H + ...) H = (x + d0) H^8 + d1 H^7 + ... + d7 H
+    for (; nblocks >= 8; nblocks -= 8, data += 8 * GCM_BLOCK) {
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+        for (unsigned i = 0; i < 8; ++i) {
+            __m128i d = bswap128(_mm_loadu_si128((__m128i const *) (data + GCM_BLOCK * i)));
+            if (i == 0) {
+                d = _mm_xor_si128(d, x);
+            }
+            clmul_acc(d, h[7 - i], &lo, &hi);
+        }
+        x = reduce(lo, hi);
+    }
+
+    for (; nblocks; --nblocks, data += GCM_BLOCK) {
+        __m128i d = bswap128(_mm_loadu_si128((__m128i const *) data));
+        x = gfmul(_mm_xor_si128(d, x), h[0]);
+    }
+
+    _mm_storeu_si128((__m128i *) acc, bswap128(x));
+}
+
+
+TARGET_VAES
+static void ctr_vaes(struct puflib_gcm_s const * gcm, uint8_t const iv[12], uint32_t ctr,
+        uint8_t const * in, uint8_t * out, size_t nblocks)
+{
+    __m128i const base = load_base(iv);
+    __m256i k[GCM_ROUNDS + 1];
+
+    for (unsigned r = 0; r <= GCM_ROUNDS; ++r) {
+        k[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) gcm->rk[r]));
+    }
+
+    for (; nblocks >= VAES_LANES; nblocks -= VAES_LANES, ctr += VAES_LANES,
+            in += GCM_BLOCK * VAES_LANES, out += GCM_BLOCK * VAES_LANES) {
+        __m256i b[VAES_LANES / 2];
+
+        for (unsigned i = 0; i < VAES_LANES / 2; ++i) {
+            b[i] = _mm256_xor_si256(_mm256_set_m128i(counter_block(base, ctr + 2 * i + 1),
+                        counter_block(base, ctr + 2 * i)), k[0]);
+        }
+        for (unsigned r = 1; r < GCM_ROUNDS; ++r) {
+            for (unsigned i = 0; i < VAES_LANES / 2; ++i) {
+                b[i] = _mm256_aesenc_epi128(b[i], k[r]);
+            }
+        }
+        for (unsigned i = 0; i < VAES_LANES / 2; ++i) {
+            b[i] = _mm256_aesenclast_epi128(b[i], k[GCM_ROUNDS]);
+            _mm256_storeu_si256((__m256i *) (out + 2 * GCM_BLOCK * i), _mm256_xor_si256(b[i],
+                        _mm256_loadu_si256((__m256i const *) (in + 2 * GCM_BLOCK * i))));
+        }
+    }
+
+    if (nblocks) {
+        ctr_aesni(gcm, iv, ctr, in, out, nblocks);
+    }
+}
+
+
+struct gcm_impl const puflib_gcm_aesni = {
+    .name = "aes-ni",
+    .init = &init_aesni,
+    .block = &block_aesni,
+    .ctr = &ctr_aesni,
+    .ghash = &ghash_aesni,
+};
+
+struct gcm_impl const puflib_gcm_vaes = {
+    .name = "vaes",
+    .init = &init_aesni,
+    .block = &block_aesni,
+    .ctr = &ctr_vaes,
+    .ghash = &ghash_aesni,
+};
+
+#endif // PUFLIB_CPU_X86
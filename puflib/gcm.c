@@ -0,0 +1,498 @@
+// PUFlib AES-256-GCM
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// The mode (NIST SP 800-38D) over block-level primitives from gcm.h, and the
+// portable primitives. Those use byte-wise AES with S-box lookups, which is
+// not constant time; on x86 the AES-NI path replaces them whenever the CPU
+// has it. PUFLIB_GCM=portable, aes-ni or vaes in the environment restricts
+// the choice, for benchmarking.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+#include "gcm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// SP 800-38D limits plaintext to 2^39 - 256 bits
+#define MAX_TEXT_LEN ((UINT64_C(1) << 36) - 32)
+
+// Blocks run through the keystream and GHASH per pass, kept small so that a
+// pass's output is still in cache when the next primitive reads it
+#define CHUNK_BLOCKS 256
+
+static struct gcm_impl const puflib_gcm_portable;
+static struct gcm_impl const * IMPL = &puflib_gcm_portable;
+static pthread_once_t IMPL_ONCE = PTHREAD_ONCE_INIT;
+
+static uint8_t const SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+
+static inline uint64_t load_be64(uint8_t const * p)
+{
+    uint64_t v = 0;
+    for (unsigned i = 0; i < 8; ++i) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+
+static inline void store_be64(uint8_t * p, uint64_t v)
+{
+    for (unsigned i = 8; i-- > 0; v >>= 8) {
+        p[i] = (uint8_t) v;
+    }
+}
+
+
+static inline void store_be32(uint8_t * p, uint32_t v)
+{
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+
+static inline uint8_t xtime(uint8_t x)
+{
+    return (uint8_t) ((x << 1) ^ (0x1b & -(x >> 7)));
+}
+
+
+/**
+ * AES-256 key expansion. The round keys come out as the byte strings that
+ * AddRoundKey XORs in, which is also the form AES-NI takes.
+ */
+static void expand_key(uint8_t rk[GCM_ROUNDS + 1][GCM_BLOCK], uint8_t const key[PUFLIB_GCM_KEY_LEN])
+{
+    uint8_t * w = &rk[0][0];
+    uint8_t rcon = 1;
+
+    memcpy(w, key, PUFLIB_GCM_KEY_LEN);
+
+    for (unsigned i = 8; i < 4 * (GCM_ROUNDS + 1); ++i) {
+        uint8_t t[4];
+        memcpy(t, &w[4 * (i - 1)], 4);
+
+        if (i % 8 == 0) {
+            uint8_t t0 = t[0];
+            t[0] = SBOX[t[1]] ^ rcon;
+            t[1] = SBOX[t[2]];
+            t[2] = SBOX[t[3]];
+            t[3] = SBOX[t0];
+            rcon = xtime(rcon);
+        } else if (i % 8 == 4) {
+            for (unsigned j = 0; j < 4; ++j) {
+                t[j] = SBOX[t[j]];
+            }
+        }
+
+        for (unsigned j = 0; j < 4; ++j) {
+            w[4 * i + j] = w[4 * (i - 8) + j] ^ t[j];
+        }
+    }
+}
+
+
+static void block_portable(struct puflib_gcm_s const * gcm, uint8_t const in[GCM_BLOCK],
+        uint8_t out[GCM_BLOCK])
+{
+    uint8_t s[GCM_BLOCK], t[GCM_BLOCK];
+
+    for (unsigned i = 0; i < GCM_BLOCK; ++i) {
+        s[i] = in[i] ^ gcm->rk[0][i];
+    }
+
+    for (unsigned round = 1; round <= GCM_ROUNDS; ++round) {
+        // SubBytes and ShiftRows; the state is column-major, byte r of
+        // column c at 4c + r
+        for (unsigned c = 0; c < 4; ++c) {
+            for (unsigned r = 0; r < 4; ++r) {
+                t[4 * c + r] = SBOX[s[4 * ((c + r) % 4) + r]];
+            }
+        }
+
+        if (round < GCM_ROUNDS) {
+            for (unsigned c = 0; c < 4; ++c) {
+                uint8_t * a = &t[4 * c];
+                uint8_t all = a[0] ^ a[1] ^ a[2] ^ a[3];
+                uint8_t a0 = a[0];
+                a[0] ^= all ^ xtime(a[0] ^ a[1]);
+                a[1] ^= all ^ xtime(a[1] ^ a[2]);
+                a[2] ^= all ^ xtime(a[2] ^ a[3]);
+                a[3] ^= all ^ xtime(a[3] ^ a0);
+            }
+        }
+
+        for (unsigned i = 0; i < GCM_BLOCK; ++i) {
+            s[i] = t[i] ^ gcm->rk[round][i];
+        }
+    }
+
+    memcpy(out, s, GCM_BLOCK);
+    puflib_wipe(s, sizeof(s));
+    puflib_wipe(t, sizeof(t));
+}
+
+
+static void ctr_portable(struct puflib_gcm_s const * gcm, uint8_t const iv[12], uint32_t ctr,
+        uint8_t const * in, uint8_t * out, size_t nblocks)
+{
+    uint8_t cb[GCM_BLOCK], ks[GCM_BLOCK];
+
+    memcpy(cb, iv, 12);
+    for (size_t b = 0; b < nblocks; ++b, ++ctr) {
+        store_be32(cb + 12, ctr);
+        block_portable(gcm, cb, ks);
+        for (unsigned i = 0; i < GCM_BLOCK; ++i) {
+            out[GCM_BLOCK * b + i] = in[GCM_BLOCK * b + i] ^ ks[i];
+        }
+    }
+
+    puflib_wipe(ks, sizeof(ks));
+}
+
+
+static void init_portable(struct puflib_gcm_s * gcm)
+{
+    (void) gcm;
+}
+
+
+/**
+ * GHASH multiplying bit by bit with masks rather than branches or tables, so
+ * the time taken does not depend on H.
+ */
+static void ghash_portable(struct puflib_gcm_s const * gcm, uint8_t acc[GCM_BLOCK],
+        uint8_t const * data, size_t nblocks)
+{
+    uint64_t const hh = load_be64(gcm->h), hl = load_be64(gcm->h + 8);
+    uint64_t xh = load_be64(acc), xl = load_be64(acc + 8);
+
+    for (; nblocks; --nblocks, data += GCM_BLOCK) {
+        xh ^= load_be64(data);
+        xl ^= load_be64(data + 8);
+
+        uint64_t zh = 0, zl = 0, vh = hh, vl = hl;
+        for (unsigned i = 0; i < 128; ++i) {
+            uint64_t bit = i < 64 ? (xh >> (63 - i)) & 1 : (xl >> (127 - i)) & 1;
+            uint64_t mask = -bit;
+            zh ^= vh & mask;
+            zl ^= vl & mask;
+
+            uint64_t lsb = vl & 1;
+            vl = (vl >> 1) | (vh << 63);
+            vh = (vh >> 1) ^ (UINT64_C(0xe100000000000000) & -lsb);
+        }
+        xh = zh;
+        xl = zl;
+    }
+
+    store_be64(acc, xh);
+    store_be64(acc + 8, xl);
+}
+
+
+static struct gcm_impl const puflib_gcm_portable = {
+    .name = "portable",
+    .init = &init_portable,
+    .block = &block_portable,
+    .ctr = &ctr_portable,
+    .ghash = &ghash_portable,
+};
+
+
+static void choose_impl(void)
+{
+#ifdef PUFLIB_CPU_X86
+    char const * want = getenv("PUFLIB_GCM");
+    bool aesni = puflib_gcm_have_aesni();
+    bool vaes = puflib_gcm_have_vaes();
+
+    if (want && !strcmp(want, "portable")) {
+        aesni = vaes = false;
+    } else if (want && !strcmp(want, "aes-ni")) {
+        vaes = false;
+    }
+
+    if (vaes) {
+        IMPL = &puflib_gcm_vaes;
+    } else if (aesni) {
+        IMPL = &puflib_gcm_aesni;
+    }
+#endif
+}
+
+
+char const * puflib_gcm_impl(void)
+{
+    pthread_once(&IMPL_ONCE, &choose_impl);
+    return IMPL->name;
+}
+
+
+puflib_gcm * puflib_gcm_new(uint8_t const key[PUFLIB_GCM_KEY_LEN])
+{
+    pthread_once(&IMPL_ONCE, &choose_impl);
+
+    puflib_gcm * gcm = calloc(1, sizeof(*gcm));
+    if (!gcm) {
+        return NULL;
+    }
+
+    gcm->impl = IMPL;
+    expand_key(gcm->rk, key);
+    gcm->impl->block(gcm, gcm->h, gcm->h);
+    gcm->impl->init(gcm);
+    return gcm;
+}
+
+
+void puflib_gcm_free(puflib_gcm * gcm)
+{
+    if (gcm) {
+        puflib_wipe(gcm, sizeof(*gcm));
+        free(gcm);
+    }
+}
+
+
+void puflib_gcm_start(puflib_gcm_ctx * ctx, puflib_gcm const * gcm,
+        uint8_t const iv[PUFLIB_GCM_IV_LEN])
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->gcm = gcm;
+    memcpy(ctx->iv, iv, PUFLIB_GCM_IV_LEN);
+    // Counter 1 is kept for the tag; the text starts at 2
+    ctx->ctr = 2;
+}
+
+
+bool puflib_gcm_aad(puflib_gcm_ctx * ctx, void const * aad, size_t len)
+{
+    uint8_t const * p = aad;
+
+    if (ctx->text_len) {
+        errno = EINVAL;
+        return true;
+    }
+    if (!len) {
+        return false;
+    }
+
+    size_t used = ctx->aad_len % GCM_BLOCK;
+    ctx->aad_len += len;
+
+    if (used) {
+        size_t take = GCM_BLOCK - used < len ? GCM_BLOCK - used : len;
+        memcpy(ctx->buf + used, p, take);
+        p += take;
+        len -= take;
+        if (used + take < GCM_BLOCK) {
+            return false;
+        }
+        ctx->gcm->impl->ghash(ctx->gcm, ctx->acc, ctx->buf, 1);
+    }
+
+    ctx->gcm->impl->ghash(ctx->gcm, ctx->acc, p, len / GCM_BLOCK);
+    memcpy(ctx->buf, p + len - len % GCM_BLOCK, len % GCM_BLOCK);
+    return false;
+}
+
+
+/**
+ * Absorb a final partial block of AAD or text, zero padded.
+ */
+static void flush_partial(puflib_gcm_ctx * ctx, uint64_t len)
+{
+    size_t used = len % GCM_BLOCK;
+    if (used) {
+        memset(ctx->buf + used, 0, GCM_BLOCK - used);
+        ctx->gcm->impl->ghash(ctx->gcm, ctx->acc, ctx->buf, 1);
+    }
+}
+
+
+static bool gcm_crypt(puflib_gcm_ctx * ctx, uint8_t const * in, size_t len, uint8_t * out,
+        bool decrypt)
+{
+    struct gcm_impl const * impl = ctx->gcm->impl;
+
+    if (len > MAX_TEXT_LEN - ctx->text_len) {
+        errno = EMSGSIZE;
+        return true;
+    }
+    if (!len) {
+        return false;
+    }
+
+    if (!ctx->text_len) {
+        flush_partial(ctx, ctx->aad_len);
+    }
+
+    size_t used = ctx->text_len % GCM_BLOCK;
+    ctx->text_len += len;
+
+    // Finish the partial block left by the last call
+    if (used) {
+        for (; used < GCM_BLOCK && len; ++used, --len) {
+            uint8_t c = decrypt ? *in : *in ^ ctx->ks[used];
+            *out++ = *in++ ^ ctx->ks[used];
+            ctx->buf[used] = c;
+        }
+        if (used < GCM_BLOCK) {
+            return false;
+        }
+        impl->ghash(ctx->gcm, ctx->acc, ctx->buf, 1);
+    }
+
+    // GHASH is over the ciphertext, so read it before decrypting in place,
+    // or after encrypting
+    for (size_t nblocks = len / GCM_BLOCK; nblocks;) {
+        size_t n = nblocks < CHUNK_BLOCKS ? nblocks : CHUNK_BLOCKS;
+        if (decrypt) {
+            impl->ghash(ctx->gcm, ctx->acc, in, n);
+        }
+        impl->ctr(ctx->gcm, ctx->iv, ctx->ctr, in, out, n);
+        if (!decrypt) {
+            impl->ghash(ctx->gcm, ctx->acc, out, n);
+        }
+        ctx->ctr += (uint32_t) n;
+        nblocks -= n;
+        in += GCM_BLOCK * n;
+        out += GCM_BLOCK * n;
+        len -= GCM_BLOCK * n;
+    }
+
+    // Start a new partial block
+    if (len) {
+        memset(ctx->ks, 0, GCM_BLOCK);
+        impl->ctr(ctx->gcm, ctx->iv, ctx->ctr++, ctx->ks, ctx->ks, 1);
+        for (size_t i = 0; i < len; ++i) {
+            ctx->buf[i] = decrypt ? in[i] : in[i] ^ ctx->ks[i];
+            out[i] = in[i] ^ ctx->ks[i];
+        }
+    }
+
+    return false;
+}
+
+
+bool puflib_gcm_encrypt(puflib_gcm_ctx * ctx, void const * in, size_t len, void * out)
+{
+    return gcm_crypt(ctx, in, len, out, false);
+}
+
+
+bool puflib_gcm_decrypt(puflib_gcm_ctx * ctx, void const * in, size_t len, void * out)
+{
+    return gcm_crypt(ctx, in, len, out, true);
+}
+
+
+/**
+ * Compute the tag and wipe the context.
+ */
+static void compute_tag(puflib_gcm_ctx * ctx, uint8_t tag[PUFLIB_GCM_TAG_LEN])
+{
+    struct gcm_impl const * impl = ctx->gcm->impl;
+    uint8_t lens[GCM_BLOCK];
+
+    if (ctx->text_len) {
+        flush_partial(ctx, ctx->text_len);
+    } else {
+        flush_partial(ctx, ctx->aad_len);
+    }
+
+    store_be64(lens, ctx->aad_len * 8);
+    store_be64(lens + 8, ctx->text_len * 8);
+    impl->ghash(ctx->gcm, ctx->acc, lens, 1);
+
+    impl->ctr(ctx->gcm, ctx->iv, 1, ctx->acc, tag, 1);
+    puflib_wipe(ctx, sizeof(*ctx));
+}
+
+
+void puflib_gcm_finish(puflib_gcm_ctx * ctx, uint8_t tag[PUFLIB_GCM_TAG_LEN])
+{
+    compute_tag(ctx, tag);
+}
+
+
+bool puflib_gcm_verify(puflib_gcm_ctx * ctx, uint8_t const tag[PUFLIB_GCM_TAG_LEN])
+{
+    uint8_t expected[PUFLIB_GCM_TAG_LEN];
+    uint8_t diff = 0;
+
+    compute_tag(ctx, expected);
+    for (unsigned i = 0; i < PUFLIB_GCM_TAG_LEN; ++i) {
+        diff |= expected[i] ^ tag[i];
+    }
+    puflib_wipe(expected, sizeof(expected));
+
+    if (diff) {
+        errno = EBADMSG;
+        return true;
+    }
+    return false;
+}
+
+
+bool puflib_gcm_seal(puflib_gcm const * gcm, uint8_t const iv[PUFLIB_GCM_IV_LEN],
+        void const * aad, size_t aad_len, void const * in, size_t len, void * out,
+        uint8_t tag[PUFLIB_GCM_TAG_LEN])
+{
+    puflib_gcm_ctx ctx;
+
+    puflib_gcm_start(&ctx, gcm, iv);
+    if (puflib_gcm_aad(&ctx, aad, aad_len) || puflib_gcm_encrypt(&ctx, in, len, out)) {
+        puflib_wipe(&ctx, sizeof(ctx));
+        return true;
+    }
+    puflib_gcm_finish(&ctx, tag);
+    return false;
+}
+
+
+bool puflib_gcm_open(puflib_gcm const * gcm, uint8_t const iv[PUFLIB_GCM_IV_LEN],
+        void const * aad, size_t aad_len, void const * in, size_t len,
+        uint8_t const tag[PUFLIB_GCM_TAG_LEN], void * out)
+{
+    puflib_gcm_ctx ctx;
+
+    puflib_gcm_start(&ctx, gcm, iv);
+    if (puflib_gcm_aad(&ctx, aad, aad_len) || puflib_gcm_decrypt(&ctx, in, len, out)) {
+        puflib_wipe(&ctx, sizeof(ctx));
+        return true;
+    }
+    if (puflib_gcm_verify(&ctx, tag)) {
+        // Don't hand back unauthenticated plaintext
+        puflib_wipe(out, len);
+        return true;
+    }
+    return false;
+}
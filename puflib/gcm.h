@@ -0,0 +1,65 @@
+// PUFlib AES-256-GCM internals
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+// gcm.c implements the mode itself (counters, padding, lengths and the tag)
+// over a small set of block-level primitives, of which there is a portable
+// implementation and x86 ones, chosen at run time.
+//
+
+#ifndef _PUFLIB_GCM_H_
+#define _PUFLIB_GCM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define GCM_BLOCK 16
+#define GCM_ROUNDS 14
+
+struct gcm_impl;
+
+struct puflib_gcm_s {
+    uint8_t rk[GCM_ROUNDS + 1][GCM_BLOCK];  ///< AES-256 round keys, FIPS-197 byte order
+    uint8_t h[GCM_BLOCK];                   ///< Hash subkey, E(0)
+    uint8_t htable[8][GCM_BLOCK];           ///< Implementation's GHASH precomputation
+    struct gcm_impl const * impl;
+};
+
+struct gcm_impl {
+    char const * name;
+
+    /// Fill in htable from h
+    void (*init)(struct puflib_gcm_s * gcm);
+
+    /// Encrypt one block
+    void (*block)(struct puflib_gcm_s const * gcm, uint8_t const in[GCM_BLOCK],
+            uint8_t out[GCM_BLOCK]);
+
+    /**
+     * XOR whole blocks with the keystream for counter blocks iv || ctr,
+     * iv || ctr + 1, ..., the counter wrapping modulo 2^32. in may equal out.
+     */
+    void (*ctr)(struct puflib_gcm_s const * gcm, uint8_t const iv[12], uint32_t ctr,
+            uint8_t const * in, uint8_t * out, size_t nblocks);
+
+    /// Absorb whole blocks into a GHASH accumulator
+    void (*ghash)(struct puflib_gcm_s const * gcm, uint8_t acc[GCM_BLOCK],
+            uint8_t const * data, size_t nblocks);
+};
+
+#ifdef PUFLIB_CPU_X86
+/// AES-NI and PCLMULQDQ
+extern struct gcm_impl const puflib_gcm_aesni;
+
+/// As puflib_gcm_aesni, with counter mode two blocks per instruction in VAES
+extern struct gcm_impl const puflib_gcm_vaes;
+
+bool puflib_gcm_have_aesni(void);
+bool puflib_gcm_have_vaes(void);
+#endif
+
+#endif // _PUFLIB_GCM_H_
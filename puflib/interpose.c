@@ -0,0 +1,992 @@
+// PUFlib module interposition
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Module operations take no context, so layers cannot be modules themselves;
+// instead every call the library makes to a module goes through
+// puflib_module_call(), which runs it down the chain of layers interposed on
+// the module. The layers in effect are published as an immutable, reference
+// counted chain, rebuilt whenever one is added or removed, so calls never hold
+// a lock while they run and a layer outlives its removal until the last call
+// through it returns.
+//
+// Identical unseal calls, and challenges to deterministic modules, made at the
+// same time are coalesced before they reach the layers (see flight.c), so
+// layers see only the call that went to the module.
+//
+
+#define _GNU_SOURCE     // secure_getenv()
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define OPS 3
+
+struct puflib_layer_s {
+    module_info const * module;     ///< NULL for all modules
+    unsigned ops;
+    puflib_layer_fn fn;
+    void * ctx;
+    void (*free_ctx)(void * ctx);
+    unsigned refs;                  ///< Held by LAYERS and by each chain
+    struct puflib_layer_s * next;   ///< Next older layer in LAYERS
+};
+
+struct puflib_chain_s {
+    unsigned refs;                  ///< Held by CHAIN and by each call
+    size_t n_layers;
+    struct puflib_layer_s * layers[];   ///< Outermost first
+};
+
+// All layers, newest (outermost) first, and the chain built from them; NULL
+// while there are none. Both are protected by LAYERS_LOCK.
+static struct puflib_layer_s * LAYERS = NULL;
+static struct puflib_chain_s * CHAIN = NULL;
+static pthread_mutex_t LAYERS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t ENV_ONCE = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Drop a reference to a layer. Must be called with LAYERS_LOCK held.
+ * @return the layer if it is now unused, to be freed with free_layer() once
+ *  the lock is released
+ */
+static struct puflib_layer_s * unref_layer(struct puflib_layer_s * layer)
+{
+    return --layer->refs ? NULL : layer;
+}
+
+
+static void free_layer(struct puflib_layer_s * layer)
+{
+    if (layer) {
+        if (layer->free_ctx) {
+            layer->free_ctx(layer->ctx);
+        }
+        free(layer);
+    }
+}
+
+
+/**
+ * Drop a reference to a chain, and free it and any layers only it held.
+ */
+static void release_chain(struct puflib_chain_s * chain)
+{
+    if (!chain) {
+        return;
+    }
+
+    pthread_mutex_lock(&LAYERS_LOCK);
+    bool last = !--chain->refs;
+    if (last) {
+        for (size_t i = 0; i < chain->n_layers; ++i) {
+            chain->layers[i] = unref_layer(chain->layers[i]);
+        }
+    }
+    pthread_mutex_unlock(&LAYERS_LOCK);
+
+    if (last) {
+        for (size_t i = 0; i < chain->n_layers; ++i) {
+            free_layer(chain->layers[i]);
+        }
+        free(chain);
+    }
+}
+
+
+/**
+ * Rebuild CHAIN from LAYERS. Must be called with LAYERS_LOCK held; the old
+ * chain is returned, to be released once the lock is.
+ */
+static bool rebuild_chain(struct puflib_chain_s ** old)
+{
+    struct puflib_chain_s * chain = NULL;
+    size_t n = 0;
+
+    for (struct puflib_layer_s * l = LAYERS; l; l = l->next) {
+        ++n;
+    }
+
+    if (n) {
+        chain = malloc(sizeof(*chain) + n * sizeof(chain->layers[0]));
+        if (!chain) {
+            return true;
+        }
+        chain->refs = 1;
+        chain->n_layers = n;
+        n = 0;
+        for (struct puflib_layer_s * l = LAYERS; l; l = l->next) {
+            chain->layers[n++] = l;
+            ++l->refs;
+        }
+    }
+
+    *old = CHAIN;
+    CHAIN = chain;
+    return false;
+}
+
+
+static void load_env_layers(void);
+
+
+static void free_locked_ctx(void * ctx)
+{
+    // Each of the contexts here starts with its lock
+    pthread_mutex_destroy((pthread_mutex_t *) ctx);
+    free(ctx);
+}
+
+
+/**
+ * Add a layer. The public functions load the environment's layers first, so
+ * that they go innermost; loading them comes here directly.
+ */
+static puflib_layer * add_layer(module_info const * module, unsigned ops,
+        puflib_layer_fn fn, void * ctx, void (*free_ctx)(void * ctx))
+{
+    struct puflib_chain_s * old;
+
+    if (!fn || !(ops & PUFLIB_OP_ALL)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct puflib_layer_s * layer = malloc(sizeof(*layer));
+    if (!layer) {
+        return NULL;
+    }
+    *layer = (struct puflib_layer_s) {
+        .module = module,
+        .ops = ops & PUFLIB_OP_ALL,
+        .fn = fn,
+        .ctx = ctx,
+        .free_ctx = free_ctx,
+        .refs = 1,
+    };
+
+    pthread_mutex_lock(&LAYERS_LOCK);
+    layer->next = LAYERS;
+    LAYERS = layer;
+    if (rebuild_chain(&old)) {
+        LAYERS = layer->next;
+        pthread_mutex_unlock(&LAYERS_LOCK);
+        free(layer);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_unlock(&LAYERS_LOCK);
+
+    release_chain(old);
+    return layer;
+}
+
+
+puflib_layer * puflib_interpose(module_info const * module, unsigned ops,
+        puflib_layer_fn fn, void * ctx, void (*free_ctx)(void * ctx))
+{
+    pthread_once(&ENV_ONCE, &load_env_layers);
+    return add_layer(module, ops, fn, ctx, free_ctx);
+}
+
+
+/**
+ * Add a layer for one of the contexts here, freeing it if that fails.
+ */
+static puflib_layer * add_own_layer(module_info const * module, unsigned ops,
+        puflib_layer_fn fn, void * ctx, void (*free_ctx)(void * ctx))
+{
+    puflib_layer * layer = add_layer(module, ops, fn, ctx, free_ctx);
+    if (!layer) {
+        int errno_hold = errno;
+        free_ctx(ctx);
+        errno = errno_hold;
+    }
+    return layer;
+}
+
+
+bool puflib_remove_layer(puflib_layer * layer)
+{
+    struct puflib_chain_s * old;
+    struct puflib_layer_s ** link;
+
+    pthread_mutex_lock(&LAYERS_LOCK);
+    for (link = &LAYERS; *link && *link != layer; link = &(*link)->next);
+    if (!*link) {
+        pthread_mutex_unlock(&LAYERS_LOCK);
+        errno = ENOENT;
+        return true;
+    }
+
+    *link = layer->next;
+    if (rebuild_chain(&old)) {
+        layer->next = *link;
+        *link = layer;
+        pthread_mutex_unlock(&LAYERS_LOCK);
+        errno = ENOMEM;
+        return true;
+    }
+    struct puflib_layer_s * unused = unref_layer(layer);
+    pthread_mutex_unlock(&LAYERS_LOCK);
+
+    release_chain(old);
+    free_layer(unused);
+    return false;
+}
+
+
+static char const * op_name(enum puflib_op op)
+{
+    switch (op) {
+    case PUFLIB_OP_SEAL:        return "seal";
+    case PUFLIB_OP_UNSEAL:      return "unseal";
+    case PUFLIB_OP_CHAL_RESP:   return "chal_resp";
+    default:                    return "unknown operation";
+    }
+}
+
+
+/**
+ * Call the module itself, on its instance if it keeps one.
+ */
+static bool call_module(puflib_call * call)
+{
+    module_info const * module = call->module;
+    puflib_instance * instance;
+    uint8_t * out;
+    bool rv;
+
+    puflib_module_enter(call->plugin);
+    if (puflib_instance_acquire(call->plugin, &instance)) {
+        int errno_hold = errno;
+        puflib_module_leave(call->plugin);
+        errno = errno_hold;
+        return true;
+    }
+    void * handle = puflib_instance_handle(instance);
+
+    switch (call->op) {
+    case PUFLIB_OP_SEAL:
+        rv = instance
+            ? module->instance_seal(handle, call->data_in, call->data_in_len, &out, call->data_out_len)
+            : module->seal(call->data_in, call->data_in_len, &out, call->data_out_len);
+        if (!rv) {
+            *call->data_out = out;
+        }
+        break;
+
+    case PUFLIB_OP_UNSEAL:
+        rv = instance
+            ? module->instance_unseal(handle, call->data_in, call->data_in_len, &out, call->data_out_len)
+            : module->unseal(call->data_in, call->data_in_len, &out, call->data_out_len);
+        if (!rv) {
+            *call->data_out = out;
+        }
+        break;
+
+    case PUFLIB_OP_CHAL_RESP:
+        if (instance && module->instance_chal_resp) {
+            rv = module->instance_chal_resp(handle, call->data_in, call->data_in_len,
+                    call->data_out, call->data_out_len);
+        } else if (!instance && module->chal_resp) {
+            rv = module->chal_resp(call->data_in, call->data_in_len,
+                    call->data_out, call->data_out_len);
+        } else {
+            errno = ENOTSUP;
+            rv = true;
+        }
+        break;
+
+    default:
+        errno = EINVAL;
+        rv = true;
+    }
+
+    int errno_hold = errno;
+    puflib_instance_release(instance);
+    puflib_module_leave(call->plugin);
+    errno = errno_hold;
+    return rv;
+}
+
+
+bool puflib_call_next(puflib_call * call)
+{
+    struct puflib_chain_s const * chain = call->chain;
+
+    while (chain && call->depth < chain->n_layers) {
+        struct puflib_layer_s const * layer = chain->layers[call->depth++];
+        if ((layer->ops & call->op)
+                && (!layer->module || layer->module == call->module)) {
+            return layer->fn(layer->ctx, call);
+        }
+    }
+    return call_module(call);
+}
+
+
+/**
+ * Run a call down the chain of layers in effect.
+ */
+static bool call_chain(puflib_call * call)
+{
+    pthread_mutex_lock(&LAYERS_LOCK);
+    call->chain = CHAIN;
+    if (call->chain) {
+        ++call->chain->refs;
+    }
+    pthread_mutex_unlock(&LAYERS_LOCK);
+    call->depth = 0;
+
+    bool rv = puflib_call_next(call);
+
+    int errno_hold = errno;
+    release_chain(call->chain);
+    call->chain = NULL;
+    errno = errno_hold;
+    return rv;
+}
+
+
+bool puflib_module_call(module_info const * module, enum puflib_op op,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len)
+{
+    pthread_once(&ENV_ONCE, &load_env_layers);
+
+    puflib_call call = {
+        .module = module,
+        .op = op,
+        .data_in = data_in,
+        .data_in_len = data_in_len,
+        .data_out = data_out,
+        .data_out_len = data_out_len,
+        .plugin = puflib_find_plugin(module),
+    };
+
+    // Scheduling and instances are kept per plugin, so a module the registry
+    // did not load could only be run unscheduled, whatever its caps say
+    if (!call.plugin) {
+        puflib_report(module, STATUS_ERROR, "module was not loaded by puflib");
+        errno = EINVAL;
+        return true;
+    }
+    puflib_caps const * caps = puflib_plugin_caps(call.plugin);
+
+    // Sealed blobs come from the module, so only fresh input is limited
+    size_t const max_len = caps->max_input_len;
+    if (max_len && op != PUFLIB_OP_UNSEAL && data_in_len > max_len) {
+        puflib_report_fmt(module, STATUS_ERROR,
+                "%s input of %zu bytes is over the module's limit of %zu",
+                op_name(op), data_in_len, max_len);
+        errno = EMSGSIZE;
+        return true;
+    }
+
+    // Every seal needs its own randomness, and each read of a noisy module is
+    // a fresh sample, so only unseals and deterministic challenges share
+    if (op == PUFLIB_OP_SEAL
+            || (op == PUFLIB_OP_CHAL_RESP && !caps->deterministic)) {
+        return call_chain(&call);
+    }
+    return puflib_coalesce(&call, &call_chain);
+}
+
+
+/**
+ * Random number source for the layers that need one: cheap, and good enough
+ * to decide when to fail or how long to wait. Callers hold their own locks.
+ */
+static double next_uniform(uint64_t * state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return ((x * 0x2545f4914f6cdd1dull) >> 11) * 0x1.0p-53;
+}
+
+
+static void seed_uniform(uint64_t * state)
+{
+    if (puflib_random_bytes(state, sizeof(*state)) || !*state) {
+        *state = puflib_monotonic_us() | 1;
+    }
+}
+
+
+struct latency_layer {
+    pthread_mutex_t lock;
+    unsigned delay_us;
+    unsigned jitter_us;
+    uint64_t rng;
+};
+
+
+static bool latency_call(void * ctx, puflib_call * call)
+{
+    struct latency_layer * l = ctx;
+    double delay = l->delay_us;
+
+    if (l->jitter_us) {
+        pthread_mutex_lock(&l->lock);
+        delay += l->jitter_us * (2 * next_uniform(&l->rng) - 1);
+        pthread_mutex_unlock(&l->lock);
+    }
+    if (delay >= 1) {
+        puflib_sleep_us((uint64_t) delay);
+    }
+    return puflib_call_next(call);
+}
+
+
+static puflib_layer * new_latency_layer(module_info const * module, unsigned ops,
+        unsigned delay_us, unsigned jitter_us)
+{
+    struct latency_layer * l = malloc(sizeof(*l));
+    if (!l) {
+        return NULL;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    l->delay_us = delay_us;
+    l->jitter_us = jitter_us > delay_us ? delay_us : jitter_us;
+    seed_uniform(&l->rng);
+
+    return add_own_layer(module, ops, &latency_call, l, &free_locked_ctx);
+}
+
+
+puflib_layer * puflib_interpose_latency(module_info const * module, unsigned ops,
+        unsigned delay_us, unsigned jitter_us)
+{
+    pthread_once(&ENV_ONCE, &load_env_layers);
+    return new_latency_layer(module, ops, delay_us, jitter_us);
+}
+
+
+struct error_layer {
+    pthread_mutex_t lock;
+    double rate;
+    int error;
+    uint64_t rng;
+};
+
+
+static bool error_call(void * ctx, puflib_call * call)
+{
+    struct error_layer * l = ctx;
+
+    pthread_mutex_lock(&l->lock);
+    bool fail = next_uniform(&l->rng) < l->rate;
+    pthread_mutex_unlock(&l->lock);
+
+    if (fail) {
+        puflib_report_fmt(call->module, STATUS_DEBUG, "injected %s failure: %s",
+                op_name(call->op), strerror(l->error));
+        errno = l->error;
+        return true;
+    }
+    return puflib_call_next(call);
+}
+
+
+static puflib_layer * new_errors_layer(module_info const * module, unsigned ops,
+        double rate, int error)
+{
+    if (!(rate >= 0 && rate <= 1) || !error) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct error_layer * l = malloc(sizeof(*l));
+    if (!l) {
+        return NULL;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    l->rate = rate;
+    l->error = error;
+    seed_uniform(&l->rng);
+
+    return add_own_layer(module, ops, &error_call, l, &free_locked_ctx);
+}
+
+
+puflib_layer * puflib_interpose_errors(module_info const * module, unsigned ops,
+        double rate, int error)
+{
+    pthread_once(&ENV_ONCE, &load_env_layers);
+    return new_errors_layer(module, ops, rate, error);
+}
+
+
+struct stats_layer {
+    pthread_mutex_t lock;
+    puflib_op_stats stats[OPS];
+};
+
+
+static int op_index(enum puflib_op op)
+{
+    switch (op) {
+    case PUFLIB_OP_SEAL:        return 0;
+    case PUFLIB_OP_UNSEAL:      return 1;
+    case PUFLIB_OP_CHAL_RESP:   return 2;
+    default:                    return -1;
+    }
+}
+
+
+static bool stats_call(void * ctx, puflib_call * call)
+{
+    struct stats_layer * l = ctx;
+
+    uint64_t start = puflib_monotonic_us();
+    bool rv = puflib_call_next(call);
+    uint64_t elapsed = puflib_monotonic_us() - start;
+    int errno_hold = errno;
+
+    pthread_mutex_lock(&l->lock);
+    puflib_op_stats * s = &l->stats[op_index(call->op)];
+    ++s->calls;
+    s->bytes_in += call->data_in_len;
+    if (rv) {
+        ++s->errors;
+    } else {
+        s->bytes_out += *call->data_out_len;
+    }
+    s->total_us += elapsed;
+    if (elapsed > s->max_us) {
+        s->max_us = elapsed;
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    errno = errno_hold;
+    return rv;
+}
+
+
+static puflib_layer * new_stats_layer(module_info const * module, unsigned ops)
+{
+    struct stats_layer * l = calloc(1, sizeof(*l));
+    if (!l) {
+        return NULL;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+
+    return add_own_layer(module, ops, &stats_call, l, &free_locked_ctx);
+}
+
+
+puflib_layer * puflib_interpose_stats(module_info const * module, unsigned ops)
+{
+    pthread_once(&ENV_ONCE, &load_env_layers);
+    return new_stats_layer(module, ops);
+}
+
+
+bool puflib_layer_stats(puflib_layer const * layer, enum puflib_op op,
+        puflib_op_stats * stats)
+{
+    int i = op_index(op);
+    if (layer->fn != &stats_call || i < 0) {
+        errno = EINVAL;
+        return true;
+    }
+
+    struct stats_layer * l = layer->ctx;
+    pthread_mutex_lock(&l->lock);
+    *stats = l->stats[i];
+    pthread_mutex_unlock(&l->lock);
+    return false;
+}
+
+
+struct record_layer {
+    pthread_mutex_t lock;
+    FILE * file;
+    bool failed;            ///< Writing has failed, and the trace is cut short
+};
+
+
+static bool record_call(void * ctx, puflib_call * call)
+{
+    struct record_layer * l = ctx;
+    uint8_t header[PUFLIB_TRACE_RECORD_LEN];
+
+    uint64_t start = puflib_monotonic_us();
+    bool rv = puflib_call_next(call);
+    uint64_t elapsed = puflib_monotonic_us() - start;
+    int errno_hold = errno;
+
+    size_t name_len = strlen(call->module->name);
+    size_t out_len = rv ? 0 : *call->data_out_len;
+
+    header[0] = (uint8_t) call->op;
+    header[1] = rv;
+    header[2] = (uint8_t) name_len;
+    header[3] = (uint8_t) (name_len >> 8);
+    puflib_store_le32(&header[4], rv ? (uint32_t) errno_hold : 0);
+    puflib_store_le32(&header[8], elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed);
+    puflib_store_le32(&header[12], (uint32_t) call->data_in_len);
+    puflib_store_le32(&header[16], (uint32_t) out_len);
+
+    pthread_mutex_lock(&l->lock);
+    if (!l->failed) {
+        if (name_len > UINT16_MAX || call->data_in_len > UINT32_MAX || out_len > UINT32_MAX) {
+            errno = EFBIG;
+            l->failed = true;
+        } else {
+            // Flush every record, so that a trace survives a crash
+            l->failed = fwrite(header, sizeof(header), 1, l->file) != 1
+                || fwrite(call->module->name, 1, name_len, l->file) != name_len
+                || fwrite(call->data_in, 1, call->data_in_len, l->file) != call->data_in_len
+                || fwrite(*call->data_out, 1, out_len, l->file) != out_len
+                || fflush(l->file);
+        }
+        if (l->failed) {
+            puflib_report_fmt(call->module, STATUS_ERROR,
+                    "cannot record %s, trace is cut short: %s",
+                    op_name(call->op), strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    errno = errno_hold;
+    return rv;
+}
+
+
+static void free_record_ctx(void * ctx)
+{
+    struct record_layer * l = ctx;
+    if (l->file) {
+        fclose(l->file);
+    }
+    free_locked_ctx(l);
+}
+
+
+static puflib_layer * new_record_layer(module_info const * module, unsigned ops,
+        char const * path)
+{
+    uint8_t header[PUFLIB_TRACE_HEADER_LEN] = {0};
+
+    struct record_layer * l = calloc(1, sizeof(*l));
+    if (!l) {
+        return NULL;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+
+    // Append to an existing trace, so that one can span several processes
+    memcpy(header, PUFLIB_TRACE_MAGIC, strlen(PUFLIB_TRACE_MAGIC));
+    puflib_store_le32(&header[8], PUFLIB_TRACE_VERSION);
+    for (;;) {
+        l->file = puflib_open_existing(path, "a+b");
+        if (l->file || errno != ENOENT) {
+            break;
+        }
+        l->file = puflib_create_and_open(path, "a+b");
+        if (l->file || errno != EEXIST) {
+            break;
+        }
+    }
+    if (!l->file) {
+        goto err;
+    }
+
+    uint8_t existing[PUFLIB_TRACE_HEADER_LEN];
+    size_t existing_len = fread(existing, 1, sizeof(existing), l->file);
+    if (ferror(l->file) || fseek(l->file, 0, SEEK_END)) {
+        goto err;
+    }
+    if (existing_len) {
+        if (existing_len != sizeof(existing) || memcmp(existing, header, sizeof(header))) {
+            errno = EBADMSG;
+            goto err;
+        }
+    } else if (fwrite(header, sizeof(header), 1, l->file) != 1 || fflush(l->file)) {
+        goto err;
+    }
+
+    return add_own_layer(module, ops, &record_call, l, &free_record_ctx);
+
+err:;
+    int errno_hold = errno;
+    free_record_ctx(l);
+    errno = errno_hold;
+    return NULL;
+}
+
+
+puflib_layer * puflib_interpose_record(module_info const * module, unsigned ops,
+        char const * path)
+{
+    pthread_once(&ENV_ONCE, &load_env_layers);
+    return new_record_layer(module, ops, path);
+}
+
+
+#define DEFAULT_CACHE_ENTRIES 1024
+
+struct cache_entry {
+    module_info const * module;     ///< NULL while the slot is empty
+    uint64_t store;                 ///< Identity of the store it was answered on
+    uint8_t digest[PUFLIB_SHA256_LEN];  ///< Hash of the challenge
+    void * response;
+    size_t response_len;
+};
+
+struct cache_layer {
+    pthread_mutex_t lock;
+    size_t n_entries;
+    struct cache_entry entries[];
+};
+
+
+/**
+ * Copy a response out of an entry, if it answers this challenge. Must be
+ * called with the layer's lock held.
+ * @return true on a hit
+ */
+static bool cache_lookup(struct cache_entry const * e, puflib_call * call,
+        uint64_t store, uint8_t const * digest)
+{
+    if (e->module != call->module || e->store != store
+            || memcmp(e->digest, digest, PUFLIB_SHA256_LEN)) {
+        return false;
+    }
+
+    void * copy = malloc(e->response_len ? e->response_len : 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, e->response, e->response_len);
+    *call->data_out = copy;
+    *call->data_out_len = e->response_len;
+    return true;
+}
+
+
+static bool cache_call(void * ctx, puflib_call * call)
+{
+    struct cache_layer * l = ctx;
+    uint8_t digest[PUFLIB_SHA256_LEN];
+
+    if (call->op != PUFLIB_OP_CHAL_RESP || !puflib_plugin_caps(call->plugin)->deterministic) {
+        return puflib_call_next(call);
+    }
+
+    // A response only stands while the module keeps its provisioning
+    uint64_t store = puflib_store_identity(call->plugin);
+    if (!store) {
+        return puflib_call_next(call);
+    }
+
+    puflib_sha256(call->data_in, call->data_in_len, digest);
+    struct cache_entry * e = &l->entries[puflib_load_le64(digest) % l->n_entries];
+
+    pthread_mutex_lock(&l->lock);
+    bool hit = cache_lookup(e, call, store, digest);
+    pthread_mutex_unlock(&l->lock);
+    if (hit) {
+        return false;
+    }
+
+    if (puflib_call_next(call)) {
+        return true;
+    }
+
+    // Failing to keep a copy only costs the next call its hit
+    void * copy = malloc(*call->data_out_len ? *call->data_out_len : 1);
+    if (copy) {
+        memcpy(copy, *call->data_out, *call->data_out_len);
+        pthread_mutex_lock(&l->lock);
+        free(e->response);
+        e->module = call->module;
+        e->store = store;
+        memcpy(e->digest, digest, sizeof(digest));
+        e->response = copy;
+        e->response_len = *call->data_out_len;
+        pthread_mutex_unlock(&l->lock);
+    }
+    return false;
+}
+
+
+static void free_cache_ctx(void * ctx)
+{
+    struct cache_layer * l = ctx;
+    for (size_t i = 0; i < l->n_entries; ++i) {
+        free(l->entries[i].response);
+    }
+    free_locked_ctx(l);
+}
+
+
+static puflib_layer * new_cache_layer(module_info const * module, size_t entries)
+{
+    if (!entries) {
+        entries = DEFAULT_CACHE_ENTRIES;
+    }
+    if (entries > (SIZE_MAX - sizeof(struct cache_layer)) / sizeof(struct cache_entry)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct cache_layer * l = calloc(1, sizeof(*l) + entries * sizeof(l->entries[0]));
+    if (!l) {
+        return NULL;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    l->n_entries = entries;
+
+    return add_own_layer(module, PUFLIB_OP_CHAL_RESP, &cache_call, l, &free_cache_ctx);
+}
+
+
+puflib_layer * puflib_interpose_cache(module_info const * module, size_t entries)
+{
+    pthread_once(&ENV_ONCE, &load_env_layers);
+    return new_cache_layer(module, entries);
+}
+
+
+// Stats layers from the environment, reported at exit
+static puflib_layer * ENV_STATS[16];
+static size_t N_ENV_STATS = 0;
+
+
+static void report_env_stats(void)
+{
+    for (size_t i = 0; i < N_ENV_STATS; ++i) {
+        module_info const * module = ENV_STATS[i]->module;
+
+        for (unsigned op = PUFLIB_OP_SEAL; op & PUFLIB_OP_ALL; op <<= 1) {
+            puflib_op_stats s;
+            if (puflib_layer_stats(ENV_STATS[i], op, &s) || !s.calls) {
+                continue;
+            }
+            puflib_report_fmt(module, STATUS_INFO,
+                    "%s: %llu calls, %llu failed, %llu bytes in, %llu bytes out, "
+                    "mean %.3f ms, max %.3f ms", op_name(op),
+                    (unsigned long long) s.calls, (unsigned long long) s.errors,
+                    (unsigned long long) s.bytes_in, (unsigned long long) s.bytes_out,
+                    s.total_us / 1e3 / s.calls, s.max_us / 1e3);
+        }
+    }
+}
+
+
+/**
+ * Add one layer from PUFLIB_INTERPOSE, "[MODULE:]KIND[=ARGS]".
+ * @return true if it is not valid
+ */
+static bool add_env_layer(char * spec)
+{
+    module_info const * module = NULL;
+    puflib_layer * layer;
+    char * end;
+
+    // A colon after the '=' is part of the arguments (a path, say)
+    char * colon = strchr(spec, ':');
+    char * equals = strchr(spec, '=');
+    if (colon && (!equals || colon < equals)) {
+        *colon = 0;
+        module = puflib_get_module(spec);
+        if (!module) {
+            return true;
+        }
+        spec = colon + 1;
+    }
+
+    char * args = strchr(spec, '=');
+    if (args) {
+        *args++ = 0;
+    }
+
+    if (!strcmp(spec, "latency") && args) {
+        unsigned long delay = strtoul(args, &end, 10), jitter = 0;
+        if (*end == '/') {
+            jitter = strtoul(end + 1, &end, 10);
+        }
+        if (*end || delay > 60000000 || jitter > delay) {
+            return true;
+        }
+        layer = new_latency_layer(module, PUFLIB_OP_ALL, delay, jitter);
+    } else if (!strcmp(spec, "errors") && args) {
+        double rate = strtod(args, &end);
+        if (*end || !(rate >= 0 && rate <= 1)) {
+            return true;
+        }
+        layer = new_errors_layer(module, PUFLIB_OP_ALL, rate, EIO);
+    } else if (!strcmp(spec, "record") && args && *args) {
+        layer = new_record_layer(module, PUFLIB_OP_ALL, args);
+    } else if (!strcmp(spec, "cache")) {
+        unsigned long entries = 0;
+        if (args) {
+            entries = strtoul(args, &end, 10);
+            if (*end || !entries || entries > 1000000) {
+                return true;
+            }
+        }
+        layer = new_cache_layer(module, entries);
+    } else if (!strcmp(spec, "stats") && !args) {
+        if (N_ENV_STATS == sizeof(ENV_STATS) / sizeof(ENV_STATS[0])) {
+            return true;
+        }
+        layer = new_stats_layer(module, PUFLIB_OP_ALL);
+        if (layer) {
+            if (!N_ENV_STATS) {
+                atexit(&report_env_stats);
+            }
+            ENV_STATS[N_ENV_STATS++] = layer;
+        }
+    } else {
+        return true;
+    }
+
+    if (!layer) {
+        puflib_report_fmt(module, STATUS_ERROR, "PUFLIB_INTERPOSE: cannot add layer: %s",
+                strerror(errno));
+    }
+    return false;
+}
+
+
+static void load_env_layers(void)
+{
+    // Layers can record secrets and inject faults, so a privileged process
+    // must not take them from the environment
+    char const * env = secure_getenv("PUFLIB_INTERPOSE");
+    if (!env || !*env) {
+        return;
+    }
+
+    char * specs = puflib_duplicate_string(env);
+    if (!specs) {
+        return;
+    }
+
+    char * save;
+    for (char * spec = strtok_r(specs, ";", &save); spec; spec = strtok_r(NULL, ";", &save)) {
+        // add_env_layer() cuts the spec up; keep a copy for the message
+        char * copy = puflib_duplicate_string(spec);
+        if (add_env_layer(spec)) {
+            puflib_report_fmt(NULL, STATUS_ERROR, "PUFLIB_INTERPOSE: invalid layer '%s'",
+                    copy ? copy : spec);
+        }
+        free(copy);
+    }
+    free(specs);
+}
@@ -0,0 +1,199 @@
+// PUFlib key cache
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A small fixed table of keys in locked memory. Entries are found by a hash
+// of the module name and the module's key ID, so IDs themselves are not kept,
+// and are wiped as soon as they expire or run out of uses. When the table is
+// full, the entry closest to expiry makes way.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define KEY_CACHE_ENTRIES 64
+
+struct key_entry {
+    uint8_t tag[PUFLIB_SHA256_LEN];     ///< Hash of module name and key ID
+    uint8_t key[PUFLIB_KEY_CACHE_MAX];
+    size_t key_len;
+    uint64_t module;                    ///< Hash of module name, for dropping
+    uint64_t expires;                   ///< puflib_monotonic_ms() deadline
+    unsigned uses_left;                 ///< 0 for no limit
+    bool valid;
+};
+
+static pthread_mutex_t CACHE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static struct key_entry * CACHE = NULL;
+static unsigned TTL_MS = 0;
+static unsigned MAX_USES = 0;
+
+
+static void make_tag(module_info const * module, void const * id, size_t id_len,
+        uint8_t tag[PUFLIB_SHA256_LEN])
+{
+    puflib_sha256_ctx ctx;
+
+    puflib_sha256_init(&ctx);
+    // Include the terminator so "ab" + "c" and "a" + "bc" differ
+    puflib_sha256_update(&ctx, module->name, strlen(module->name) + 1);
+    puflib_sha256_update(&ctx, id, id_len);
+    puflib_sha256_final(&ctx, tag);
+}
+
+
+static uint64_t module_hash(module_info const * module)
+{
+    return puflib_hash(module->name, strlen(module->name), PUFLIB_HASH_INIT);
+}
+
+
+static void wipe_entry(struct key_entry * entry)
+{
+    puflib_wipe(entry, sizeof(*entry));
+}
+
+
+bool puflib_set_key_cache(unsigned ttl_ms, unsigned max_uses)
+{
+    bool rc = false;
+
+    pthread_mutex_lock(&CACHE_LOCK);
+
+    if (!ttl_ms) {
+        puflib_free_locked(CACHE, KEY_CACHE_ENTRIES * sizeof(*CACHE));
+        CACHE = NULL;
+    } else if (CACHE) {
+        puflib_wipe(CACHE, KEY_CACHE_ENTRIES * sizeof(*CACHE));
+    } else {
+        CACHE = puflib_alloc_locked(KEY_CACHE_ENTRIES * sizeof(*CACHE));
+        rc = !CACHE;
+    }
+
+    TTL_MS = CACHE ? ttl_ms : 0;
+    MAX_USES = max_uses;
+
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return rc;
+}
+
+
+void puflib_flush_keys()
+{
+    pthread_mutex_lock(&CACHE_LOCK);
+    if (CACHE) {
+        puflib_wipe(CACHE, KEY_CACHE_ENTRIES * sizeof(*CACHE));
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+    puflib_envelope_drop(NULL);
+}
+
+
+void puflib_key_cache_drop(module_info const * module)
+{
+    uint64_t const hash = module_hash(module);
+
+    pthread_mutex_lock(&CACHE_LOCK);
+    for (size_t i = 0; CACHE && i < KEY_CACHE_ENTRIES; ++i) {
+        if (CACHE[i].valid && CACHE[i].module == hash) {
+            wipe_entry(&CACHE[i]);
+        }
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+}
+
+
+bool puflib_key_cache_get(module_info const * module, void const * id, size_t id_len,
+        uint8_t * key, size_t key_len)
+{
+    uint8_t tag[PUFLIB_SHA256_LEN];
+    bool missed = true;
+
+    make_tag(module, id, id_len, tag);
+
+    pthread_mutex_lock(&CACHE_LOCK);
+    uint64_t const now = puflib_monotonic_ms();
+
+    for (size_t i = 0; CACHE && i < KEY_CACHE_ENTRIES; ++i) {
+        struct key_entry * entry = &CACHE[i];
+        if (!entry->valid || memcmp(entry->tag, tag, sizeof(tag))) {
+            continue;
+        }
+
+        if (now >= entry->expires || entry->key_len != key_len) {
+            wipe_entry(entry);
+            break;
+        }
+
+        memcpy(key, entry->key, key_len);
+        missed = false;
+        if (entry->uses_left && !--entry->uses_left) {
+            wipe_entry(entry);
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&CACHE_LOCK);
+
+    if (missed) {
+        errno = ENOENT;
+    }
+    return missed;
+}
+
+
+bool puflib_key_cache_put(module_info const * module, void const * id, size_t id_len,
+        uint8_t const * key, size_t key_len)
+{
+    uint8_t tag[PUFLIB_SHA256_LEN];
+
+    if (key_len > PUFLIB_KEY_CACHE_MAX) {
+        errno = EINVAL;
+        return true;
+    }
+
+    make_tag(module, id, id_len, tag);
+
+    pthread_mutex_lock(&CACHE_LOCK);
+    if (!CACHE) {
+        pthread_mutex_unlock(&CACHE_LOCK);
+        return false;
+    }
+
+    uint64_t const now = puflib_monotonic_ms();
+    struct key_entry * slot = NULL;
+
+    // Prefer the entry with this tag, then a free or expired one, then the
+    // one that would have expired soonest
+    for (size_t i = 0; i < KEY_CACHE_ENTRIES; ++i) {
+        struct key_entry * entry = &CACHE[i];
+        if (entry->valid && !memcmp(entry->tag, tag, sizeof(tag))) {
+            slot = entry;
+            break;
+        }
+        if (!entry->valid || now >= entry->expires) {
+            if (!slot || slot->valid) {
+                slot = entry;
+            }
+        } else if (!slot || (slot->valid && entry->expires < slot->expires)) {
+            slot = entry;
+        }
+    }
+
+    wipe_entry(slot);
+    memcpy(slot->tag, tag, sizeof(tag));
+    memcpy(slot->key, key, key_len);
+    slot->key_len = key_len;
+    slot->module = module_hash(module);
+    slot->expires = now + TTL_MS;
+    slot->uses_left = MAX_USES;
+    slot->valid = true;
+
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return false;
+}
@@ -0,0 +1,534 @@
+// PUFlib key/value stores
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A store is one file, mapped into memory and used in place. Stores are only
+// ever read by the host that wrote them, so the layout uses native byte order,
+// with a marker to reject foreign files:
+//
+//      header      struct kv_header
+//      index       n_buckets * struct kv_bucket, open addressing with linear
+//                  probing on the key hash
+//      records     struct kv_record, key, padding, value, padding; each
+//                  record starts on an 8-byte boundary
+//
+// Values are overwritten in place when they fit in the space reserved for
+// them, and otherwise appended as a new record. When the index fills up or too
+// much space is taken by dead records, the whole store is rewritten compactly
+// and atomically replaced.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <string.h>
+#include <errno.h>
+
+#define KV_MAGIC "PUFKV\0\0\0"
+#define KV_BYTE_ORDER 0x01020304u
+#define KV_FORMAT 1
+#define KV_SUFFIX ".kv"
+
+#define KV_MIN_BUCKETS 64
+#define KV_EMPTY 0
+#define KV_TOMBSTONE 1
+
+// Compact once dead records take more than this many bytes and more than half
+// of the record area.
+#define KV_COMPACT_MIN_DEAD (64 * 1024)
+
+struct kv_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t format;
+    uint64_t n_buckets;     ///< Size of the index, a power of two
+    uint64_t n_live;        ///< Buckets holding a live record
+    uint64_t n_used;        ///< Buckets holding a live record or a tombstone
+    uint64_t data_end;      ///< Offset of the end of the last record
+    uint64_t dead_bytes;    ///< Bytes taken by records no longer referenced
+    uint64_t reserved;
+};
+
+struct kv_bucket {
+    uint64_t hash;
+    uint64_t offset;        ///< Record offset, KV_EMPTY or KV_TOMBSTONE
+};
+
+struct kv_record {
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t capacity;      ///< Space reserved for the value
+    uint32_t reserved;
+};
+
+struct puflib_kv_s {
+    puflib_map map;
+    char * path;
+};
+
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t) 7;
+}
+
+
+static size_t data_start(uint64_t n_buckets)
+{
+    return sizeof(struct kv_header) + n_buckets * sizeof(struct kv_bucket);
+}
+
+
+static size_t record_value_offset(uint32_t key_len)
+{
+    return align8(sizeof(struct kv_record) + key_len);
+}
+
+
+static size_t record_size(uint32_t key_len, uint32_t capacity)
+{
+    return record_value_offset(key_len) + align8(capacity);
+}
+
+
+static struct kv_header * header(puflib_kv * kv)
+{
+    return kv->map.data;
+}
+
+
+static struct kv_bucket * buckets(puflib_kv * kv)
+{
+    return (struct kv_bucket *) ((char *) kv->map.data + sizeof(struct kv_header));
+}
+
+
+/**
+ * Return the record at an offset, or NULL if the offset does not point at a
+ * whole record inside the record area (i.e. the store is damaged).
+ */
+static struct kv_record * record_at(puflib_kv * kv, uint64_t offset)
+{
+    struct kv_header * hdr = header(kv);
+
+    if (offset < data_start(hdr->n_buckets) || offset % 8
+            || offset + sizeof(struct kv_record) > hdr->data_end) {
+        return NULL;
+    }
+
+    struct kv_record * rec = (struct kv_record *) ((char *) kv->map.data + offset);
+    if (rec->value_len > rec->capacity
+            || offset + record_size(rec->key_len, rec->capacity) > hdr->data_end) {
+        return NULL;
+    }
+    return rec;
+}
+
+
+static char * record_key(struct kv_record * rec)
+{
+    return (char *) rec + sizeof(struct kv_record);
+}
+
+
+static void * record_value(struct kv_record * rec)
+{
+    return (char *) rec + record_value_offset(rec->key_len);
+}
+
+
+/**
+ * Find the bucket for a key. If the key is present, *found is set and its
+ * bucket returned; otherwise, the bucket where it should be inserted (the
+ * first tombstone or empty bucket on its probe sequence).
+ * @return bucket, or NULL if the store is damaged
+ */
+static struct kv_bucket * find_bucket(puflib_kv * kv, char const * key, size_t key_len,
+        uint64_t hash, bool * found)
+{
+    struct kv_header * hdr = header(kv);
+    struct kv_bucket * table = buckets(kv);
+    struct kv_bucket * insert_at = NULL;
+    uint64_t mask = hdr->n_buckets - 1;
+
+    *found = false;
+
+    for (uint64_t i = 0; i < hdr->n_buckets; ++i) {
+        struct kv_bucket * bucket = &table[(hash + i) & mask];
+
+        if (bucket->offset == KV_EMPTY) {
+            return insert_at ? insert_at : bucket;
+        } else if (bucket->offset == KV_TOMBSTONE) {
+            if (!insert_at) insert_at = bucket;
+        } else if (bucket->hash == hash) {
+            struct kv_record * rec = record_at(kv, bucket->offset);
+            if (!rec) {
+                return NULL;
+            }
+            if (rec->key_len == key_len && !memcmp(record_key(rec), key, key_len)) {
+                *found = true;
+                return bucket;
+            }
+        }
+    }
+
+    return insert_at;
+}
+
+
+/**
+ * Build a store image holding the live records of kv (or no records, if kv is
+ * NULL), with an index of n_buckets.
+ * @return image, or NULL on error. Caller is responsible for freeing.
+ */
+static uint8_t * build_image(puflib_kv * kv, uint64_t n_buckets, size_t * image_len)
+{
+    size_t len = data_start(n_buckets);
+
+    if (kv) {
+        struct kv_bucket * table = buckets(kv);
+        for (uint64_t i = 0; i < header(kv)->n_buckets; ++i) {
+            if (table[i].offset > KV_TOMBSTONE) {
+                struct kv_record * rec = record_at(kv, table[i].offset);
+                if (!rec) goto corrupt;
+                len += record_size(rec->key_len, rec->capacity);
+            }
+        }
+    }
+
+    uint8_t * image = calloc(1, len);
+    if (!image) {
+        return NULL;
+    }
+
+    struct kv_header * hdr = (struct kv_header *) image;
+    struct kv_bucket * new_table = (struct kv_bucket *) (image + sizeof(*hdr));
+    memcpy(hdr->magic, KV_MAGIC, sizeof(hdr->magic));
+    hdr->byte_order = KV_BYTE_ORDER;
+    hdr->format = KV_FORMAT;
+    hdr->n_buckets = n_buckets;
+    hdr->data_end = data_start(n_buckets);
+
+    if (kv) {
+        struct kv_bucket * table = buckets(kv);
+        for (uint64_t i = 0; i < header(kv)->n_buckets; ++i) {
+            if (table[i].offset <= KV_TOMBSTONE) {
+                continue;
+            }
+
+            struct kv_record * rec = record_at(kv, table[i].offset);
+            size_t size = record_size(rec->key_len, rec->capacity);
+            memcpy(image + hdr->data_end, rec, size);
+
+            uint64_t j = table[i].hash & (n_buckets - 1);
+            while (new_table[j].offset != KV_EMPTY) {
+                j = (j + 1) & (n_buckets - 1);
+            }
+            new_table[j].hash = table[i].hash;
+            new_table[j].offset = hdr->data_end;
+
+            hdr->data_end += size;
+            ++hdr->n_live;
+        }
+        hdr->n_used = hdr->n_live;
+    }
+
+    *image_len = len;
+    return image;
+
+corrupt:
+    errno = EBADMSG;
+    return NULL;
+}
+
+
+/**
+ * Atomically replace the store file with an image and remap it.
+ * @return false on success, true on error
+ */
+static bool install_image(puflib_kv * kv, uint8_t const * image, size_t image_len)
+{
+    puflib_map new_map;
+
+    if (puflib_replace_file(kv->path, image, image_len)) {
+        return true;
+    }
+    if (puflib_map_open(kv->path, true, &new_map)) {
+        return true;
+    }
+
+    puflib_map_close(&kv->map);
+    kv->map = new_map;
+    return false;
+}
+
+
+/**
+ * Rewrite the store with only its live records, and an index big enough to
+ * hold at least min_live records.
+ * @return false on success, true on error
+ */
+static bool rebuild(puflib_kv * kv, uint64_t min_live)
+{
+    uint64_t n_buckets = KV_MIN_BUCKETS;
+    while (n_buckets < 2 * min_live) {
+        n_buckets *= 2;
+    }
+
+    size_t image_len;
+    uint8_t * image = build_image(kv, n_buckets, &image_len);
+    if (!image) {
+        return true;
+    }
+
+    bool rc = install_image(kv, image, image_len);
+    int errno_hold = errno;
+    free(image);
+    errno = errno_hold;
+    return rc;
+}
+
+
+static bool validate(puflib_kv * kv)
+{
+    struct kv_header * hdr = header(kv);
+
+    if (kv->map.len < sizeof(*hdr)
+            || memcmp(hdr->magic, KV_MAGIC, sizeof(hdr->magic))
+            || hdr->byte_order != KV_BYTE_ORDER
+            || hdr->format != KV_FORMAT
+            || hdr->n_buckets < KV_MIN_BUCKETS
+            || (hdr->n_buckets & (hdr->n_buckets - 1))
+            || hdr->n_buckets > kv->map.len / sizeof(struct kv_bucket)
+            || hdr->data_end < data_start(hdr->n_buckets)
+            || hdr->data_end > kv->map.len) {
+        errno = EBADMSG;
+        return true;
+    }
+    return false;
+}
+
+
+puflib_kv * puflib_kv_open(module_info const * module, enum puflib_storage_type type,
+        char const * name, bool writable)
+{
+    if (type != STORAGE_TEMP_DIR && type != STORAGE_FINAL_DIR) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    puflib_kv * kv = calloc(1, sizeof(*kv));
+    if (!kv) {
+        return NULL;
+    }
+
+    char * dir = puflib_get_nv_store(module, type);
+    if (!dir) {
+        goto err;
+    }
+    kv->path = puflib_concat(dir, puflib_get_path_sep(), name, KV_SUFFIX, NULL);
+    free(dir);
+    if (!kv->path) {
+        goto err;
+    }
+
+    if (puflib_map_open(kv->path, writable, &kv->map)) {
+        if (errno != ENOENT || !writable) {
+            goto err;
+        }
+
+        // New store. Another process may create it at the same time; whichever
+        // replaces the file last wins, and both start out empty anyway.
+        size_t image_len;
+        uint8_t * image = build_image(NULL, KV_MIN_BUCKETS, &image_len);
+        if (!image) {
+            goto err;
+        }
+        bool rc = puflib_replace_file(kv->path, image, image_len);
+        free(image);
+        if (rc || puflib_map_open(kv->path, writable, &kv->map)) {
+            goto err;
+        }
+    }
+
+    if (validate(kv)) {
+        puflib_report_fmt(module, STATUS_ERROR, "key/value store %s is damaged", name);
+        int errno_hold = errno;
+        puflib_map_close(&kv->map);
+        errno = errno_hold;
+        goto err;
+    }
+
+    return kv;
+
+err:
+    {
+        int errno_hold = errno;
+        free(kv->path);
+        free(kv);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+bool puflib_kv_get(puflib_kv * kv, char const * key,
+        void const ** value, size_t * value_len)
+{
+    size_t key_len = strlen(key);
+    uint64_t hash = puflib_hash(key, key_len, PUFLIB_HASH_INIT);
+    bool found;
+
+    struct kv_bucket * bucket = find_bucket(kv, key, key_len, hash, &found);
+    if (!bucket) {
+        errno = EBADMSG;
+        return true;
+    }
+    if (!found) {
+        errno = ENOENT;
+        return true;
+    }
+
+    struct kv_record * rec = record_at(kv, bucket->offset);
+    *value = record_value(rec);
+    *value_len = rec->value_len;
+    return false;
+}
+
+
+bool puflib_kv_put(puflib_kv * kv, char const * key,
+        void const * value, size_t value_len)
+{
+    size_t key_len = strlen(key);
+    uint64_t hash = puflib_hash(key, key_len, PUFLIB_HASH_INIT);
+    bool found;
+
+    if (!kv->map.writable) {
+        errno = EBADF;
+        return true;
+    }
+    if (key_len > UINT32_MAX / 2 || value_len > UINT32_MAX / 2) {
+        errno = EFBIG;
+        return true;
+    }
+
+    struct kv_bucket * bucket = find_bucket(kv, key, key_len, hash, &found);
+    if (!bucket) {
+        errno = EBADMSG;
+        return true;
+    }
+
+    if (found) {
+        struct kv_record * rec = record_at(kv, bucket->offset);
+        if (value_len <= rec->capacity) {
+            memcpy(record_value(rec), value, value_len);
+            rec->value_len = (uint32_t) value_len;
+            return false;
+        }
+    }
+
+    struct kv_header * hdr = header(kv);
+
+    // Keep the index at most half full, so probe sequences stay short.
+    if (!found && (hdr->n_used + 1) * 2 > hdr->n_buckets) {
+        if (rebuild(kv, header(kv)->n_live + 1)) {
+            return true;
+        }
+        return puflib_kv_put(kv, key, value, value_len);
+    }
+
+    // Leave room to grow in place, which is common for counters.
+    uint32_t capacity = (uint32_t) (value_len < 8 ? 8 : align8(value_len));
+    size_t size = record_size((uint32_t) key_len, capacity);
+
+    uint64_t offset = hdr->data_end;
+    if (offset + size > kv->map.len) {
+        size_t new_len = kv->map.len * 2;
+        while (new_len < offset + size) new_len *= 2;
+
+        uint64_t bucket_index = (uint64_t) (bucket - buckets(kv));
+        if (puflib_map_resize(&kv->map, new_len)) {
+            return true;
+        }
+        hdr = header(kv);
+        bucket = &buckets(kv)[bucket_index];
+    }
+
+    struct kv_record * rec = (struct kv_record *) ((char *) kv->map.data + offset);
+    rec->key_len = (uint32_t) key_len;
+    rec->value_len = (uint32_t) value_len;
+    rec->capacity = capacity;
+    rec->reserved = 0;
+    memcpy(record_key(rec), key, key_len);
+    memcpy(record_value(rec), value, value_len);
+    hdr->data_end = offset + size;
+
+    // Only point the index at the record once it is complete.
+    if (found) {
+        struct kv_record * old = record_at(kv, bucket->offset);
+        hdr->dead_bytes += record_size(old->key_len, old->capacity);
+    } else {
+        if (bucket->offset == KV_EMPTY) {
+            ++hdr->n_used;
+        }
+        ++hdr->n_live;
+        bucket->hash = hash;
+    }
+    bucket->offset = offset;
+
+    if (hdr->dead_bytes > KV_COMPACT_MIN_DEAD
+            && hdr->dead_bytes * 2 > hdr->data_end - data_start(hdr->n_buckets)) {
+        return rebuild(kv, hdr->n_live);
+    }
+
+    return false;
+}
+
+
+bool puflib_kv_delete(puflib_kv * kv, char const * key)
+{
+    size_t key_len = strlen(key);
+    uint64_t hash = puflib_hash(key, key_len, PUFLIB_HASH_INIT);
+    bool found;
+
+    if (!kv->map.writable) {
+        errno = EBADF;
+        return true;
+    }
+
+    struct kv_bucket * bucket = find_bucket(kv, key, key_len, hash, &found);
+    if (!bucket) {
+        errno = EBADMSG;
+        return true;
+    }
+    if (!found) {
+        return false;
+    }
+
+    struct kv_header * hdr = header(kv);
+    struct kv_record * rec = record_at(kv, bucket->offset);
+    hdr->dead_bytes += record_size(rec->key_len, rec->capacity);
+    --hdr->n_live;
+    bucket->offset = KV_TOMBSTONE;
+    return false;
+}
+
+
+bool puflib_kv_sync(puflib_kv * kv)
+{
+    if (!kv->map.writable) {
+        return false;
+    }
+    return puflib_map_sync(&kv->map);
+}
+
+
+void puflib_kv_close(puflib_kv * kv)
+{
+    if (kv) {
+        puflib_map_close(&kv->map);
+        free(kv->path);
+        free(kv);
+    }
+}
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
 
 char * puflib_duplicate_string(char const * src)
 {
@@ -106,19 +107,110 @@ char * puflib_concat(char const * first, ...)
 
     head = malloc(len + 1);
     if (!head) {
+        va_end(ap2);
         return NULL;
     }
     tail = head;
 
-    while ((each = va_arg(ap2, char const *))) {
+    each = first;
+    do {
         size_t each_len = strlen(each);
-        strncpy(tail, each, each_len);
+        memcpy(tail, each, each_len);
         len -= each_len;
         tail += each_len;
-    }
+    } while ((each = va_arg(ap2, char const *)));
     va_end(ap2);
 
     *tail = 0;
 
     return head;
 }
+
+
+uint64_t puflib_hash(void const * data, size_t len, uint64_t hash)
+{
+    unsigned char const * bytes = data;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+
+static uint32_t CRC32_TABLE[256];
+static pthread_once_t CRC32_ONCE = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320u : 0);
+        }
+        CRC32_TABLE[i] = crc;
+    }
+}
+
+
+uint32_t puflib_crc32(void const * data, size_t len, uint32_t crc)
+{
+    unsigned char const * bytes = data;
+
+    pthread_once(&CRC32_ONCE, &crc32_init);
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = CRC32_TABLE[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+void puflib_store_le32(uint8_t * dest, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        dest[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+void puflib_store_le64(uint8_t * dest, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        dest[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+uint32_t puflib_load_le32(uint8_t const * src)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= (uint32_t) src[i] << (8 * i);
+    }
+    return value;
+}
+
+
+uint64_t puflib_load_le64(uint8_t const * src)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= (uint64_t) src[i] << (8 * i);
+    }
+    return value;
+}
+
+
+void puflib_wipe(void * data, size_t len)
+{
+    // Through a volatile pointer, so the compiler cannot drop the stores as
+    // dead when the memory is about to be freed.
+    volatile uint8_t * p = data;
+    while (len--) {
+        *p++ = 0;
+    }
+}
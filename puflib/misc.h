@@ -9,6 +9,11 @@
 #define _PUFLIB_MISC_H_
 
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Initial value for puflib_hash()
+#define PUFLIB_HASH_INIT 0xcbf29ce484222325ull
 
 /**
  * Duplicate a string. This is equivalent to strdup() (which is not available
@@ -46,4 +51,48 @@ int puflib_asprintf(char **strp, const char *fmt, ...)
 char * puflib_concat(char const * first, ...)
     __attribute__((sentinel));
 
+/**
+ * Hash a block of data (64-bit FNV-1a). This is a cheap, non-cryptographic
+ * hash, for use as a cache key and similar. Hashes can be chained by passing
+ * the result of one call as the initial value of the next.
+ *
+ * @param data - data to hash
+ * @param len - length of data, in bytes
+ * @param hash - initial value; PUFLIB_HASH_INIT for a new hash
+ * @return hash value
+ */
+uint64_t puflib_hash(void const * data, size_t len, uint64_t hash);
+
+/// Initial value for puflib_crc32()
+#define PUFLIB_CRC32_INIT 0u
+
+/**
+ * Compute the CRC-32 (IEEE 802.3) of a block of data, used to detect
+ * corruption of stored records. CRCs can be chained by passing the result of
+ * one call as the initial value of the next.
+ *
+ * @param data - data to checksum
+ * @param len - length of data, in bytes
+ * @param crc - initial value; PUFLIB_CRC32_INIT for a new CRC
+ * @return CRC value
+ */
+uint32_t puflib_crc32(void const * data, size_t len, uint32_t crc);
+
+/**
+ * Store a 32- or 64-bit integer in little-endian byte order, and load it
+ * back. Used for on-disk formats, which must not depend on the host.
+ */
+/// @{
+void puflib_store_le32(uint8_t * dest, uint32_t value);
+void puflib_store_le64(uint8_t * dest, uint64_t value);
+uint32_t puflib_load_le32(uint8_t const * src);
+uint64_t puflib_load_le64(uint8_t const * src);
+/// @}
+
+/**
+ * Zero memory that held secrets. Unlike memset(), this is not optimized away
+ * when the memory is not used again.
+ */
+void puflib_wipe(void * data, size_t len);
+
 #endif // _PUFLIB_MISC_H_
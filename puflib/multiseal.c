@@ -0,0 +1,323 @@
+// PUFlib multi-module sealing
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A secret sealed to several modules is stored as one container holding an
+// ordinary sealed blob per module, so any one healthy module can recover it:
+//
+//      PUFLIB_MULTI_HEADER
+//      count of sections, 4 bytes little-endian
+//      length of each section, 8 bytes little-endian each
+//      sections, concatenated
+//
+// Sealing runs every module at once. Unsealing races all sections and returns
+// as soon as one succeeds; the rest finish in the background and their
+// results are discarded.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Sanity limit on sections, so a damaged count cannot start unbounded threads
+#define MULTI_MAX_SECTIONS 64
+
+struct seal_job {
+    module_info const * module;
+    uint8_t const * data_in;
+    size_t data_in_len;
+    uint8_t * data_out;
+    size_t data_out_len;
+    enum puflib_priority priority;  ///< Of the thread that asked
+    bool failed;
+    int errno_result;
+};
+
+
+static void * seal_worker(void * arg)
+{
+    struct seal_job * job = arg;
+
+    puflib_set_priority(job->priority);
+    job->failed = puflib_seal(job->module, job->data_in, job->data_in_len,
+            &job->data_out, &job->data_out_len);
+    job->errno_result = errno;
+    return NULL;
+}
+
+
+bool puflib_seal_multi(module_info const * const * modules, size_t n_modules,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    size_t const magic_len = strlen(PUFLIB_MULTI_HEADER);
+
+    if (!n_modules || n_modules > MULTI_MAX_SECTIONS) {
+        errno = EINVAL;
+        return true;
+    }
+
+    struct seal_job jobs[n_modules];
+    pthread_t threads[n_modules];
+    bool started[n_modules];
+
+    for (size_t i = 0; i < n_modules; ++i) {
+        jobs[i] = (struct seal_job) {
+            .module = modules[i],
+            .data_in = data_in,
+            .data_in_len = data_in_len,
+            .priority = puflib_get_priority(),
+        };
+        started[i] = !pthread_create(&threads[i], NULL, &seal_worker, &jobs[i]);
+        if (!started[i]) {
+            seal_worker(&jobs[i]);
+        }
+    }
+
+    bool failed = false;
+    int errno_hold = 0;
+    size_t total = magic_len + 4 + 8 * n_modules;
+
+    for (size_t i = 0; i < n_modules; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (jobs[i].failed) {
+            // Every module was asked for; a container missing some of them
+            // would silently reduce the redundancy the caller wanted.
+            puflib_report_fmt(modules[i], STATUS_ERROR, "cannot seal: %s",
+                    strerror(jobs[i].errno_result));
+            if (!failed) {
+                errno_hold = jobs[i].errno_result;
+            }
+            failed = true;
+        } else {
+            total += jobs[i].data_out_len;
+        }
+    }
+
+    uint8_t * buf = NULL;
+    if (!failed) {
+        buf = malloc(total);
+        if (!buf) {
+            errno_hold = errno;
+            failed = true;
+        }
+    }
+
+    if (!failed) {
+        uint8_t * p = buf;
+        memcpy(p, PUFLIB_MULTI_HEADER, magic_len);
+        p += magic_len;
+        puflib_store_le32(p, (uint32_t) n_modules);
+        p += 4;
+        for (size_t i = 0; i < n_modules; ++i) {
+            puflib_store_le64(p, jobs[i].data_out_len);
+            p += 8;
+        }
+        for (size_t i = 0; i < n_modules; ++i) {
+            memcpy(p, jobs[i].data_out, jobs[i].data_out_len);
+            p += jobs[i].data_out_len;
+        }
+
+        *data_out = buf;
+        *data_out_len = total;
+    }
+
+    for (size_t i = 0; i < n_modules; ++i) {
+        free(jobs[i].data_out);
+    }
+
+    errno = errno_hold;
+    return failed;
+}
+
+
+bool puflib_is_multi_sealed(uint8_t const * data, size_t len)
+{
+    size_t const magic_len = strlen(PUFLIB_MULTI_HEADER);
+    return len >= magic_len && !memcmp(data, PUFLIB_MULTI_HEADER, magic_len);
+}
+
+
+/**
+ * State shared between an unseal call and its section workers. Workers
+ * outlive the call when it returns early, so this is freed by whoever drops
+ * the last reference.
+ */
+struct unseal_race {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned refs;
+    size_t pending;         ///< Sections still being tried
+    bool won;               ///< A section has been unsealed
+    uint8_t * result;
+    size_t result_len;
+    uint8_t * data;         ///< Private copy of the container
+};
+
+struct unseal_section {
+    struct unseal_race * race;
+    uint8_t const * data;
+    size_t len;
+    enum puflib_priority priority;  ///< Of the thread that asked
+};
+
+
+static void release_race(struct unseal_race * race)
+{
+    // Called with race->lock held
+    bool last = !--race->refs;
+    pthread_mutex_unlock(&race->lock);
+
+    if (last) {
+        pthread_mutex_destroy(&race->lock);
+        pthread_cond_destroy(&race->cond);
+        free(race->result);
+        free(race->data);
+        free(race);
+    }
+}
+
+
+static void * unseal_worker(void * arg)
+{
+    struct unseal_section * section = arg;
+    struct unseal_race * race = section->race;
+    uint8_t * out = NULL;
+    size_t out_len = 0;
+
+    puflib_set_priority(section->priority);
+    bool failed = puflib_unseal(section->data, section->len, &out, &out_len);
+
+    pthread_mutex_lock(&race->lock);
+    if (!failed && !race->won) {
+        race->won = true;
+        race->result = out;
+        race->result_len = out_len;
+        out = NULL;
+    }
+    --race->pending;
+    pthread_cond_broadcast(&race->cond);
+    free(out);
+    free(section);
+    release_race(race);
+    return NULL;
+}
+
+
+bool puflib_unseal_multi(uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    size_t const magic_len = strlen(PUFLIB_MULTI_HEADER);
+    uint64_t lens[MULTI_MAX_SECTIONS];
+    uint8_t const * p = data_in + magic_len;
+    size_t remaining = data_in_len - magic_len;
+
+    if (remaining < 4) {
+        goto malformed;
+    }
+    uint32_t count = puflib_load_le32(p);
+    p += 4;
+    remaining -= 4;
+
+    if (!count || count > MULTI_MAX_SECTIONS || remaining < 8 * (size_t) count) {
+        goto malformed;
+    }
+
+    size_t sum = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        lens[i] = puflib_load_le64(p + 8 * i);
+        if (lens[i] > remaining - 8 * count - sum) {
+            goto malformed;
+        }
+        sum += lens[i];
+    }
+    p += 8 * count;
+    size_t body_offset = p - data_in;
+
+    struct unseal_race * race = calloc(1, sizeof(*race));
+    if (!race) {
+        return true;
+    }
+    race->data = malloc(data_in_len);
+    if (!race->data) {
+        free(race);
+        errno = ENOMEM;
+        return true;
+    }
+    memcpy(race->data, data_in, data_in_len);
+    pthread_mutex_init(&race->lock, NULL);
+    pthread_cond_init(&race->cond, NULL);
+    race->refs = 1;
+
+    size_t offset = body_offset;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t const * section_data = race->data + offset;
+        offset += lens[i];
+
+        if (puflib_is_multi_sealed(section_data, lens[i])) {
+            puflib_report(NULL, STATUS_WARN, "ignoring nested multi-module container");
+            continue;
+        }
+
+        struct unseal_section * section = malloc(sizeof(*section));
+        if (!section) {
+            continue;
+        }
+        *section = (struct unseal_section) {
+            .race = race, .data = section_data, .len = lens[i],
+            .priority = puflib_get_priority(),
+        };
+
+        pthread_mutex_lock(&race->lock);
+        ++race->refs;
+        ++race->pending;
+        pthread_mutex_unlock(&race->lock);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, &unseal_worker, section)) {
+            // Try this section here instead; nothing is lost but speed.
+            unseal_worker(section);
+        }
+        pthread_attr_destroy(&attr);
+
+        pthread_mutex_lock(&race->lock);
+        bool won = race->won;
+        pthread_mutex_unlock(&race->lock);
+        if (won) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&race->lock);
+    while (!race->won && race->pending) {
+        pthread_cond_wait(&race->cond, &race->lock);
+    }
+
+    bool failed = !race->won;
+    if (!failed) {
+        *data_out = race->result;
+        *data_out_len = race->result_len;
+        race->result = NULL;
+    }
+    release_race(race);
+
+    if (failed) {
+        puflib_report(NULL, STATUS_ERROR, "cannot unseal blob with any of its modules");
+        errno = EBADMSG;
+    }
+    return failed;
+
+malformed:
+    puflib_report(NULL, STATUS_ERROR, "malformed multi-module container");
+    errno = EBADMSG;
+    return true;
+}
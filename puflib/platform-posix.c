@@ -5,6 +5,7 @@
 //
 
 #define _XOPEN_SOURCE 700
+#define _GNU_SOURCE         // flock(), secure_getenv()
 
 #include <puflib_internal.h>
 #include "misc.h"
@@ -15,8 +16,23 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
-#include <ftw.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+#ifndef PUFLIB_PLUGIN_DIR
+#define PUFLIB_PLUGIN_DIR "/usr/lib/puflib"
+#endif
 
 
 char const * puflib_get_path_sep()
@@ -25,41 +41,203 @@ char const * puflib_get_path_sep()
 }
 
 
-char * puflib_get_nv_store_path(char const * module_name, enum puflib_storage_type type)
+char * puflib_get_state_dir()
 {
-    char const * typedir;
+    if (getuid() == 0) {
+        return puflib_duplicate_string("/var/lib/puflib");
+    } else {
+        char const * home = getenv("HOME");
+        if (!home) {
+            errno = ENOENT;
+            return NULL;
+        }
+        return puflib_concat(home, "/.local/lib/puflib", NULL);
+    }
+}
+
 
+/**
+ * Return the subdirectory of the state directory holding stores of a type,
+ * or NULL for an invalid type.
+ */
+static char const * store_type_dir(enum puflib_storage_type type)
+{
     switch (type) {
     case STORAGE_TEMP_FILE:
     case STORAGE_TEMP_DIR:
-        typedir = "temp/";
-        break;
+        return "temp";
 
     case STORAGE_FINAL_FILE:
     case STORAGE_FINAL_DIR:
-        typedir = "final/";
-        break;
+        return "final";
 
     case STORAGE_DISABLED_FILE:
     case STORAGE_DISABLED_DIR:
-        typedir = "disabled/";
-        break;
+        return "disabled";
+
+    case STORAGE_ENVELOPE_DIR:
+        return "envelope";
 
     default:
         return NULL;
     }
+}
 
-    if (getuid() == 0) {
-        return puflib_concat("/var/lib/puflib/", typedir, module_name, NULL);
-    } else {
-        char const * home = getenv("HOME");
-        char const * subdir = "/.local/lib/puflib/";
-        if (!home) {
-            errno = ENOENT;
-            return NULL;
+
+char * puflib_get_nv_store_path(char const * module_name, enum puflib_storage_type type)
+{
+    char const * typedir = store_type_dir(type);
+    if (!typedir) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    char * state_dir = puflib_get_state_dir();
+    if (!state_dir) {
+        return NULL;
+    }
+
+    char * path = puflib_concat(state_dir, "/", typedir, "/", module_name, NULL);
+    free(state_dir);
+    return path;
+}
+
+
+// Stores being deleted are first renamed into this subdirectory of the state
+// directory, then deleted by a background thread. Anything left in it (e.g.
+// after a crash, or by a process that exited before its sweep finished) is
+// swept up when a later process opens the state directory.
+#define TRASH_DIR "trash"
+
+static void request_sweep(void);
+
+
+// Directory descriptor for the state directory, kept between uses so that
+// operations within it act on one directory throughout. Each use checks it
+// against the path, and reopens it if the state directory has been removed
+// or replaced since (everything deprovisioned, or a different HOME), so that
+// nothing is renamed inside an unlinked directory. Whenever it is opened,
+// trash left behind by earlier processes is swept, rather than leaving key
+// material on disk until the next deprovision.
+static int STATE_DIRFD = -1;
+static dev_t STATE_DEV;
+static ino_t STATE_INO;
+static pthread_mutex_t STATE_DIRFD_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Return a descriptor for the state directory, to be closed by the caller, or
+ * -1 on error (with errno set). A state directory that does not exist yet is
+ * not created; the next call will try again.
+ */
+static int state_dirfd(void)
+{
+    struct stat st;
+    int fd = -1;
+    int errno_hold = 0;
+    bool sweep = false;
+
+    char * state_dir = puflib_get_state_dir();
+    if (!state_dir) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&STATE_DIRFD_LOCK);
+    if (stat(state_dir, &st)) {
+        errno_hold = errno;
+        goto out;
+    }
+
+    if (STATE_DIRFD < 0 || st.st_dev != STATE_DEV || st.st_ino != STATE_INO) {
+        if (STATE_DIRFD >= 0) {
+            close(STATE_DIRFD);
         }
-        return puflib_concat(home, subdir, typedir, module_name, NULL);
+        // Record what was opened, in case the path changed again meanwhile
+        STATE_DIRFD = open(state_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (STATE_DIRFD < 0 || fstat(STATE_DIRFD, &st)) {
+            errno_hold = errno;
+            if (STATE_DIRFD >= 0) {
+                close(STATE_DIRFD);
+                STATE_DIRFD = -1;
+            }
+            goto out;
+        }
+        STATE_DEV = st.st_dev;
+        STATE_INO = st.st_ino;
+        sweep = !faccessat(STATE_DIRFD, TRASH_DIR, F_OK, AT_SYMLINK_NOFOLLOW);
     }
+
+    // Another thread may replace the cached descriptor while this one is used
+    fd = fcntl(STATE_DIRFD, F_DUPFD_CLOEXEC, 0);
+    errno_hold = errno;
+
+out:
+    pthread_mutex_unlock(&STATE_DIRFD_LOCK);
+    free(state_dir);
+    if (sweep) {
+        request_sweep();
+    }
+    errno = errno_hold;
+    return fd;
+}
+
+
+/**
+ * Rename within a directory, failing with EEXIST rather than replacing an
+ * existing destination.
+ * @return true on error (with errno set)
+ */
+static bool rename_noreplace(int dirfd, char const * from, char const * to)
+{
+#ifdef SYS_renameat2
+    if (!syscall(SYS_renameat2, dirfd, from, dirfd, to, RENAME_NOREPLACE)) {
+        return false;
+    } else if (errno != ENOSYS && errno != EINVAL) {
+        return true;
+    }
+#endif
+
+    // The kernel or file system does not support renameat2(); check for the
+    // destination separately. This leaves a small window in which a file
+    // created concurrently at the destination could be replaced.
+    if (!faccessat(dirfd, to, F_OK, AT_SYMLINK_NOFOLLOW)) {
+        errno = EEXIST;
+        return true;
+    }
+    return renameat(dirfd, from, dirfd, to) != 0;
+}
+
+
+bool puflib_move_nv_store(char const * module_name, enum puflib_storage_type from,
+        enum puflib_storage_type to)
+{
+    char from_path[NAME_MAX * 2], to_path[NAME_MAX * 2];
+    char const * from_dir = store_type_dir(from);
+    char const * to_dir = store_type_dir(to);
+
+    if (!from_dir || !to_dir) {
+        errno = EINVAL;
+        return true;
+    }
+    if ((size_t) snprintf(from_path, sizeof(from_path), "%s/%s", from_dir, module_name)
+                >= sizeof(from_path)
+            || (size_t) snprintf(to_path, sizeof(to_path), "%s/%s", to_dir, module_name)
+                >= sizeof(to_path)) {
+        errno = ENAMETOOLONG;
+        return true;
+    }
+
+    int dirfd = state_dirfd();
+    if (dirfd < 0) {
+        // No state directory means nothing has been provisioned.
+        return true;
+    }
+
+    bool rv = (mkdirat(dirfd, to_dir, 0777) && errno != EEXIST)
+        || rename_noreplace(dirfd, from_path, to_path);
+    int errno_hold = errno;
+    close(dirfd);
+    errno = errno_hold;
+    return rv;
 }
 
 
@@ -116,12 +294,24 @@ FILE * puflib_create_and_open(char const * path, char const * mode)
 
 FILE * puflib_open_existing(char const * path, char const * mode)
 {
-    int fd = open(path, O_RDWR, S_IRUSR | S_IWUSR);
+    struct stat sbuf;
+
+    int fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
     if (fd < 0) {
         return NULL;
-    } else {
-        return fdopen(fd, mode);
     }
+    if (fstat(fd, &sbuf)) {
+        int errno_hold = errno;
+        close(fd);
+        errno = errno_hold;
+        return NULL;
+    }
+    if (sbuf.st_uid != geteuid()) {
+        close(fd);
+        errno = EPERM;
+        return NULL;
+    }
+    return fdopen(fd, mode);
 }
 
 
@@ -144,33 +334,875 @@ bool puflib_check_access(char const * path, bool isdirectory)
 }
 
 
-static int delete_tree_callback(char const * fpath, struct stat const * sb,
-        int typeflag, struct FTW * ftwbuf)
+/**
+ * Flush a rename or creation in a directory to stable storage, given the path
+ * of a file in it. Failing to open the directory is not treated as an error;
+ * the file itself is already in place.
+ */
+static void sync_parent_dir(char const * path)
 {
-    (void) sb;
-    (void) typeflag;
-    (void) ftwbuf;
+    char * dir = puflib_duplicate_string(path);
+    if (!dir) {
+        return;
+    }
 
-    if (remove(fpath)) {
-        return errno;
-    } else {
-        return 0;
+    char * slash = strrchr(dir, '/');
+    if (slash) {
+        *(slash == dir ? slash + 1 : slash) = 0;
+        int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dirfd >= 0) {
+            fsync(dirfd);
+            close(dirfd);
+        }
     }
+
+    free(dir);
 }
 
 
-bool puflib_delete_tree(char const * path)
+static uint64_t file_identity(struct stat const * sbuf)
 {
-    int rv = nftw(path, &delete_tree_callback, 10, FTW_DEPTH | FTW_PHYS);
+    uint64_t id[5] = {
+        (uint64_t) sbuf->st_dev, (uint64_t) sbuf->st_ino, (uint64_t) sbuf->st_size,
+        (uint64_t) sbuf->st_mtim.tv_sec, (uint64_t) sbuf->st_mtim.tv_nsec,
+    };
+    return puflib_hash(id, sizeof(id), PUFLIB_HASH_INIT);
+}
+
 
-    if (rv < 0) {
-        // nftw itself failed, and there is an error in errno
+bool puflib_file_identity(char const * path, uint64_t * identity)
+{
+    struct stat sbuf;
+    if (stat(path, &sbuf)) {
         return true;
-    } else if (rv > 0) {
-        // the callback passed an errno error in the return value
-        errno = rv;
+    }
+    *identity = file_identity(&sbuf);
+    return false;
+}
+
+
+bool puflib_replace_file(char const * path, void const * data, size_t len)
+{
+    char * temp_path = puflib_concat(path, ".XXXXXX", NULL);
+    if (!temp_path) {
         return true;
-    } else {
+    }
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        goto err;
+    }
+
+    uint8_t const * cursor = data;
+    while (len) {
+        ssize_t n = write(fd, cursor, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            goto err_close;
+        }
+        cursor += n;
+        len -= (size_t) n;
+    }
+
+    if (fsync(fd)) {
+        goto err_close;
+    }
+    if (close(fd)) {
+        fd = -1;
+        goto err_unlink;
+    }
+
+    if (rename(temp_path, path)) {
+        goto err_unlink;
+    }
+
+    sync_parent_dir(temp_path);
+    free(temp_path);
+    return false;
+
+err_close:
+    {
+        int errno_hold = errno;
+        close(fd);
+        errno = errno_hold;
+    }
+err_unlink:
+    {
+        int errno_hold = errno;
+        unlink(temp_path);
+        errno = errno_hold;
+    }
+err:
+    {
+        int errno_hold = errno;
+        free(temp_path);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+bool puflib_map_open(char const * path, bool writable, puflib_map * map)
+{
+    struct stat sbuf, path_sbuf;
+    int fd;
+
+    for (;;) {
+        fd = open(path, writable ? O_RDWR : O_RDONLY);
+        if (fd < 0) {
+            return true;
+        }
+
+        if (flock(fd, writable ? LOCK_EX : LOCK_SH) || fstat(fd, &sbuf)) {
+            goto err;
+        }
+
+        // If the file was atomically replaced while we waited for the lock,
+        // we hold a lock on the old copy; start over with the new one.
+        if (!stat(path, &path_sbuf) && path_sbuf.st_dev == sbuf.st_dev
+                && path_sbuf.st_ino == sbuf.st_ino) {
+            break;
+        }
+        close(fd);
+    }
+
+    map->data = NULL;
+    map->len = (size_t) sbuf.st_size;
+    map->writable = writable;
+    map->identity = file_identity(&sbuf);
+    map->handle = fd;
+    map->temp_path = NULL;
+
+    if (map->len) {
+        void * data = mmap(NULL, map->len, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            goto err;
+        }
+        map->data = data;
+    }
+
+    return false;
+
+err:
+    {
+        int errno_hold = errno;
+        close(fd);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+bool puflib_map_resize(puflib_map * map, size_t len)
+{
+    if (!map->writable) {
+        errno = EBADF;
+        return true;
+    }
+
+    int fd = (int) map->handle;
+
+    if (ftruncate(fd, (off_t) len)) {
+        return true;
+    }
+
+    void * data = NULL;
+    if (len) {
+        data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            int errno_hold = errno;
+            if (ftruncate(fd, (off_t) map->len)) {
+                // Nothing more can be done; the old mapping is still valid
+                // for the length it had.
+            }
+            errno = errno_hold;
+            return true;
+        }
+    }
+
+    if (map->data) {
+        munmap(map->data, map->len);
+    }
+    map->data = data;
+    map->len = len;
+    return false;
+}
+
+
+bool puflib_map_create_temp(char const * path, size_t len, puflib_map * map)
+{
+    char * temp_path = puflib_concat(path, ".XXXXXX", NULL);
+    if (!temp_path) {
+        return true;
+    }
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        goto err;
+    }
+
+    // Reserve the space up front, so that running out of disk is reported
+    // here rather than as SIGBUS when the mapping is written.
+    if (len) {
+        int rc = posix_fallocate(fd, 0, (off_t) len);
+        if (rc) {
+            errno = rc;
+            goto err_unlink;
+        }
+    }
+
+    map->data = NULL;
+    map->len = len;
+    map->writable = true;
+    map->identity = 0;
+    map->handle = fd;
+    map->temp_path = temp_path;
+
+    if (len) {
+        void * data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            goto err_unlink;
+        }
+        map->data = data;
+    }
+
+    return false;
+
+err_unlink:
+    {
+        int errno_hold = errno;
+        close(fd);
+        unlink(temp_path);
+        errno = errno_hold;
+    }
+err:
+    {
+        int errno_hold = errno;
+        free(temp_path);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+bool puflib_map_commit_temp(puflib_map * map, char const * path)
+{
+    if (puflib_map_sync(map)) {
+        goto err;
+    }
+    if (rename(map->temp_path, path)) {
+        goto err;
+    }
+    sync_parent_dir(path);
+
+    free(map->temp_path);
+    map->temp_path = NULL;
+    puflib_map_close(map);
+    return false;
+
+err:
+    {
+        int errno_hold = errno;
+        puflib_map_discard_temp(map);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+void puflib_map_discard_temp(puflib_map * map)
+{
+    if (map->temp_path) {
+        unlink(map->temp_path);
+        free(map->temp_path);
+        map->temp_path = NULL;
+    }
+    puflib_map_close(map);
+}
+
+
+bool puflib_map_sync(puflib_map * map)
+{
+    if (map->data && msync(map->data, map->len, MS_SYNC)) {
+        return true;
+    }
+    return fsync((int) map->handle) != 0;
+}
+
+
+void puflib_map_close(puflib_map * map)
+{
+    if (map->data) {
+        munmap(map->data, map->len);
+    }
+    close((int) map->handle);
+    map->data = NULL;
+    map->len = 0;
+    map->handle = -1;
+}
+
+
+intptr_t puflib_lock_file(char const * path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (flock(fd, LOCK_EX)) {
+        int errno_hold = errno;
+        close(fd);
+        errno = errno_hold;
+        return -1;
+    }
+
+    return fd;
+}
+
+
+void puflib_unlock_file(intptr_t handle)
+{
+    close((int) handle);
+}
+
+
+char * puflib_get_platform_fingerprint()
+{
+    // uname() covers the kernel and host; the DMI names are world-readable on
+    // Linux and change when the board does. Missing DMI files are fine.
+    static char const * const dmi_files[] = {
+        "/sys/class/dmi/id/sys_vendor",
+        "/sys/class/dmi/id/product_name",
+        "/sys/class/dmi/id/board_name",
+    };
+
+    struct utsname uts;
+    if (uname(&uts)) {
+        return NULL;
+    }
+
+    char dmi[3][128] = {{0}};
+    for (size_t i = 0; i < sizeof(dmi_files)/sizeof(dmi_files[0]); ++i) {
+        FILE * f = fopen(dmi_files[i], "r");
+        if (f) {
+            if (fgets(dmi[i], sizeof(dmi[i]), f)) {
+                dmi[i][strcspn(dmi[i], "\n")] = 0;
+            }
+            fclose(f);
+        }
+    }
+
+    char * fingerprint = NULL;
+    if (puflib_asprintf(&fingerprint, "%s|%s|%s|%s|%s|%s|%s|%s",
+                uts.sysname, uts.nodename, uts.release, uts.version, uts.machine,
+                dmi[0], dmi[1], dmi[2]) < 0) {
+        return NULL;
+    }
+    return fingerprint;
+}
+
+
+bool puflib_random_bytes(void * buf, size_t len)
+{
+    uint8_t * p = buf;
+
+#ifdef SYS_getrandom
+    while (len) {
+        long rv = syscall(SYS_getrandom, p, len, 0);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOSYS) {
+                break;
+            }
+            return true;
+        }
+        p += rv;
+        len -= (size_t) rv;
+    }
+    if (!len) {
         return false;
     }
+#endif
+
+    // No getrandom(); fall back on the device.
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return true;
+    }
+    while (len) {
+        ssize_t rv = read(fd, p, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        } else if (rv <= 0) {
+            int errno_hold = rv ? errno : EIO;
+            close(fd);
+            errno = errno_hold;
+            return true;
+        }
+        p += rv;
+        len -= (size_t) rv;
+    }
+    close(fd);
+    return false;
+}
+
+
+void * puflib_alloc_locked(size_t len)
+{
+    void * data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (mlock(data, len)) {
+        int errno_hold = errno;
+        munmap(data, len);
+        errno = errno_hold;
+        return NULL;
+    }
+
+    // Best effort: keep the contents out of core dumps and forked children
+#ifdef MADV_DONTDUMP
+    madvise(data, len, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+    madvise(data, len, MADV_WIPEONFORK);
+#endif
+
+    return data;
+}
+
+
+void puflib_free_locked(void * data, size_t len)
+{
+    if (data) {
+        puflib_wipe(data, len);
+        munlock(data, len);
+        munmap(data, len);
+    }
+}
+
+
+uint64_t puflib_monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+
+uint64_t puflib_monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+
+void puflib_sleep_us(uint64_t us)
+{
+    struct timespec ts = {
+        .tv_sec = (time_t) (us / 1000000),
+        .tv_nsec = (long) (us % 1000000) * 1000,
+    };
+    while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+
+// Number of threads (including the caller) deleting sibling subdirectories
+// at once.
+#define DELETE_THREADS 4
+
+static int delete_dir_contents(int fd, unsigned parallel_levels);
+
+/**
+ * Delete a file or directory tree relative to a directory descriptor. Entries
+ * that have already disappeared are not an error, as another process may be
+ * cleaning up the same tree.
+ * @return 0 on success, or an errno value
+ */
+static int delete_at(int dirfd, char const * name, unsigned parallel_levels)
+{
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOTDIR || errno == ELOOP) {
+            if (unlinkat(dirfd, name, 0) && errno != ENOENT) {
+                return errno;
+            }
+            return 0;
+        }
+        return errno == ENOENT ? 0 : errno;
+    }
+
+    int rv = delete_dir_contents(fd, parallel_levels);
+    if (!rv && unlinkat(dirfd, name, AT_REMOVEDIR) && errno != ENOENT) {
+        rv = errno;
+    }
+    return rv;
+}
+
+
+struct delete_job {
+    int dirfd;
+    char ** names;
+    size_t n_names;
+    size_t next;
+    unsigned parallel_levels;
+    int error;
+    pthread_mutex_t lock;
+};
+
+static void * delete_worker(void * arg)
+{
+    struct delete_job * job = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (i >= job->n_names) {
+            return NULL;
+        }
+
+        int rv = delete_at(job->dirfd, job->names[i], job->parallel_levels);
+        if (rv) {
+            pthread_mutex_lock(&job->lock);
+            if (!job->error) {
+                job->error = rv;
+            }
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+}
+
+
+/**
+ * Delete the subdirectories named in a job, several at a time.
+ * @return 0 on success, or an errno value
+ */
+static int delete_subdirs(struct delete_job * job)
+{
+    pthread_t threads[DELETE_THREADS - 1];
+    size_t n_threads = 0;
+
+    pthread_mutex_init(&job->lock, NULL);
+
+    // The calling thread works too, so a failure to start helpers only costs
+    // speed.
+    while (n_threads + 1 < job->n_names && n_threads < DELETE_THREADS - 1) {
+        if (pthread_create(&threads[n_threads], NULL, &delete_worker, job)) {
+            break;
+        }
+        ++n_threads;
+    }
+    delete_worker(job);
+
+    for (size_t i = 0; i < n_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job->lock);
+    return job->error;
+}
+
+
+/**
+ * Delete everything inside a directory, closing its descriptor. If
+ * parallel_levels is nonzero, subdirectories are deleted concurrently, each
+ * with parallel_levels - 1.
+ * @return 0 on success, or an errno value
+ */
+static int delete_dir_contents(int fd, unsigned parallel_levels)
+{
+    struct delete_job job = { .dirfd = fd, .parallel_levels = 0 };
+    size_t names_cap = 0;
+    int rv = 0;
+
+    DIR * dir = fdopendir(fd);
+    if (!dir) {
+        rv = errno;
+        close(fd);
+        return rv;
+    }
+
+    if (parallel_levels) {
+        job.parallel_levels = parallel_levels - 1;
+    }
+
+    struct dirent * ent;
+    while (!rv && (errno = 0, ent = readdir(dir))) {
+        char const * name = ent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..")) {
+            continue;
+        }
+
+        bool is_dir;
+        if (ent->d_type == DT_UNKNOWN) {
+            struct stat sbuf;
+            if (fstatat(fd, name, &sbuf, AT_SYMLINK_NOFOLLOW)) {
+                if (errno != ENOENT) {
+                    rv = errno;
+                }
+                continue;
+            }
+            is_dir = S_ISDIR(sbuf.st_mode);
+        } else {
+            is_dir = ent->d_type == DT_DIR;
+        }
+
+        if (!is_dir) {
+            if (unlinkat(fd, name, 0) && errno != ENOENT) {
+                rv = errno;
+            }
+        } else if (!parallel_levels) {
+            rv = delete_at(fd, name, 0);
+        } else {
+            // Collect subdirectories to delete together once the listing is
+            // done.
+            if (job.n_names == names_cap) {
+                size_t new_cap = names_cap ? 2 * names_cap : 16;
+                char ** new_names = realloc(job.names, new_cap * sizeof(*new_names));
+                if (!new_names) {
+                    rv = errno;
+                    break;
+                }
+                job.names = new_names;
+                names_cap = new_cap;
+            }
+            job.names[job.n_names] = puflib_duplicate_string(name);
+            if (!job.names[job.n_names]) {
+                rv = errno;
+                break;
+            }
+            ++job.n_names;
+        }
+    }
+    if (!rv && errno) {
+        // readdir() failed
+        rv = errno;
+    }
+
+    if (!rv && job.n_names) {
+        rv = delete_subdirs(&job);
+    }
+
+    for (size_t i = 0; i < job.n_names; ++i) {
+        free(job.names[i]);
+    }
+    free(job.names);
+    closedir(dir);
+    return rv;
+}
+
+
+bool puflib_delete_tree(char const * path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOTDIR || errno == ELOOP) {
+            return remove(path) != 0;
+        }
+        return true;
+    }
+
+    int rv = delete_dir_contents(fd, 1);
+    if (!rv && rmdir(path)) {
+        rv = errno;
+    }
+
+    if (rv) {
+        errno = rv;
+        return true;
+    }
+    return false;
+}
+
+
+
+static pthread_mutex_t TRASH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t TRASH_COND = PTHREAD_COND_INITIALIZER;
+static unsigned long TRASH_REQUESTED = 0;   // sweeps requested
+static unsigned long TRASH_DONE = 0;        // sweeps completed
+static bool TRASH_RUNNING = false;
+static unsigned long TRASH_SEQ = 0;
+
+
+/**
+ * Delete everything in the trash directory.
+ * @return 0 on success, or an errno value
+ */
+static int sweep_trash(void)
+{
+    int dirfd = state_dirfd();
+    if (dirfd < 0) {
+        return errno;
+    }
+
+    int fd = openat(dirfd, TRASH_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    close(dirfd);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : errno;
+    }
+
+    // Each entry is a whole store; delete several at a time, and within each,
+    // several of its subdirectories.
+    return delete_dir_contents(fd, 2);
+}
+
+
+static void * trash_thread(void * arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&TRASH_LOCK);
+    while (TRASH_DONE != TRASH_REQUESTED) {
+        unsigned long target = TRASH_REQUESTED;
+        pthread_mutex_unlock(&TRASH_LOCK);
+
+        int rv = sweep_trash();
+        if (rv) {
+            puflib_report_fmt(NULL, STATUS_WARN, "cannot empty trash: %s", strerror(rv));
+        }
+
+        pthread_mutex_lock(&TRASH_LOCK);
+        TRASH_DONE = target;
+    }
+    TRASH_RUNNING = false;
+    pthread_cond_broadcast(&TRASH_COND);
+    pthread_mutex_unlock(&TRASH_LOCK);
+    return NULL;
+}
+
+
+/**
+ * Ask the background thread to empty the trash, starting it if needed. If it
+ * cannot be started, empty the trash synchronously.
+ */
+static void request_sweep(void)
+{
+    pthread_mutex_lock(&TRASH_LOCK);
+    ++TRASH_REQUESTED;
+    if (!TRASH_RUNNING) {
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        TRASH_RUNNING = !pthread_create(&thread, &attr, &trash_thread, NULL);
+        pthread_attr_destroy(&attr);
+
+        if (!TRASH_RUNNING) {
+            unsigned long target = TRASH_REQUESTED;
+            pthread_mutex_unlock(&TRASH_LOCK);
+            int rv = sweep_trash();
+            if (rv) {
+                puflib_report_fmt(NULL, STATUS_WARN, "cannot empty trash: %s",
+                        strerror(rv));
+            }
+            pthread_mutex_lock(&TRASH_LOCK);
+            if (TRASH_DONE < target) {
+                TRASH_DONE = target;
+            }
+            pthread_cond_broadcast(&TRASH_COND);
+        }
+    }
+    pthread_mutex_unlock(&TRASH_LOCK);
+}
+
+
+bool puflib_trash_nv_store(char const * module_name, enum puflib_storage_type type)
+{
+    char from_path[NAME_MAX * 2], to_path[NAME_MAX * 2];
+    char const * from_dir = store_type_dir(type);
+
+    if (!from_dir) {
+        errno = EINVAL;
+        return true;
+    }
+    if ((size_t) snprintf(from_path, sizeof(from_path), "%s/%s", from_dir, module_name)
+            >= sizeof(from_path)) {
+        errno = ENAMETOOLONG;
+        return true;
+    }
+
+    int dirfd = state_dirfd();
+    if (dirfd < 0) {
+        return true;
+    }
+
+    int errno_hold;
+    if (mkdirat(dirfd, TRASH_DIR, 0700) && errno != EEXIST) {
+        goto err;
+    }
+
+    // Trash names only need to be unique; a leftover from an earlier process
+    // with the same pid just means trying the next one.
+    for (;;) {
+        pthread_mutex_lock(&TRASH_LOCK);
+        unsigned long seq = TRASH_SEQ++;
+        pthread_mutex_unlock(&TRASH_LOCK);
+
+        if ((size_t) snprintf(to_path, sizeof(to_path), TRASH_DIR "/%s.%s.%ld.%lu",
+                    from_dir, module_name, (long) getpid(), seq) >= sizeof(to_path)) {
+            errno = ENAMETOOLONG;
+            goto err;
+        }
+
+        if (!rename_noreplace(dirfd, from_path, to_path)) {
+            break;
+        } else if (errno != EEXIST) {
+            goto err;
+        }
+    }
+
+    close(dirfd);
+    request_sweep();
+    return false;
+
+err:
+    errno_hold = errno;
+    close(dirfd);
+    errno = errno_hold;
+    return true;
+}
+
+
+void puflib_wait_trash()
+{
+    pthread_mutex_lock(&TRASH_LOCK);
+    while (TRASH_RUNNING || TRASH_DONE != TRASH_REQUESTED) {
+        pthread_cond_wait(&TRASH_COND, &TRASH_LOCK);
+    }
+    pthread_mutex_unlock(&TRASH_LOCK);
+}
+
+
+char * puflib_get_plugin_dir()
+{
+    // This decides what gets dlopen()ed, so a privileged caller must not
+    // take it from the environment
+    char const * dir = secure_getenv("PUFLIB_PLUGIN_DIR");
+    return puflib_duplicate_string((dir && *dir) ? dir : PUFLIB_PLUGIN_DIR);
+}
+
+
+void * puflib_plugin_open(char const * path)
+{
+    return dlopen(path, RTLD_NOW | RTLD_LOCAL);
+}
+
+
+void * puflib_plugin_symbol(void * handle, char const * symbol)
+{
+    return dlsym(handle, symbol);
+}
+
+
+char const * puflib_plugin_error()
+{
+    char const * err = dlerror();
+    return err ? err : "unknown error";
 }
@@ -0,0 +1,299 @@
+// PUFlib hardware probe cache
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Caches the results of each module's is_hw_supported() in the state
+// directory. The whole cache is tied to a fingerprint of the platform, and
+// each entry to the version string and plugin file of the module that
+// produced it, so rebuilding a plugin is enough to probe it again. Modules
+// that declare a volatile probe are never cached.
+//
+// Several processes may probe at once, so updates take a lock file, reread
+// the cache and merge into it.
+//
+// File format (text):
+//      puflib-probe-cache 1 <platform hash>
+//      <module name> <version hash> <0|1>
+//      ...
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#define PROBE_CACHE_NAME "probe.cache"
+#define PROBE_LOCK_NAME "probe.lock"
+#define PROBE_CACHE_MAGIC "puflib-probe-cache"
+#define PROBE_CACHE_VERSION 1
+#define PROBE_LINE_MAX 256
+
+struct probe_entry {
+    char * name;
+    uint64_t version;
+    bool supported;
+};
+
+static struct probe_entry * ENTRIES = NULL;
+static size_t N_ENTRIES = 0;
+static uint64_t PLATFORM = 0;
+static bool LOADED = false;
+static bool volatile REPROBE = false;
+
+static pthread_mutex_t PROBE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t module_version_hash(module_info const * module, puflib_plugin const * plugin)
+{
+    char const * version = module->version ? module->version : "";
+    uint64_t file = puflib_plugin_file_identity(plugin);
+    uint64_t hash = puflib_hash(version, strlen(version), PUFLIB_HASH_INIT);
+    return puflib_hash(&file, sizeof(file), hash);
+}
+
+
+static char * cache_path(char const * name)
+{
+    char * state_dir = puflib_get_state_dir();
+    if (!state_dir) {
+        return NULL;
+    }
+
+    char * path = puflib_concat(state_dir, puflib_get_path_sep(), name, NULL);
+    free(state_dir);
+    return path;
+}
+
+
+static struct probe_entry * find_entry(char const * name)
+{
+    for (size_t i = 0; i < N_ENTRIES; ++i) {
+        if (!strcmp(ENTRIES[i].name, name)) {
+            return &ENTRIES[i];
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Add an entry, or update it if one exists for the module.
+ * @return true on error
+ */
+static bool set_entry(char const * name, uint64_t version, bool supported)
+{
+    struct probe_entry * entry = find_entry(name);
+
+    if (!entry) {
+        struct probe_entry * new_entries =
+            realloc(ENTRIES, (N_ENTRIES + 1) * sizeof(*ENTRIES));
+        if (!new_entries) {
+            return true;
+        }
+        ENTRIES = new_entries;
+
+        entry = &ENTRIES[N_ENTRIES];
+        entry->name = puflib_duplicate_string(name);
+        if (!entry->name) {
+            return true;
+        }
+        ++N_ENTRIES;
+    }
+
+    entry->version = version;
+    entry->supported = supported;
+    return false;
+}
+
+
+/**
+ * Load the cache from disk, if it matches this platform, over any entries
+ * already in memory. Must be called with PROBE_LOCK held. A missing or stale
+ * cache simply leaves the entries as they were.
+ */
+static void load_cache(void)
+{
+    LOADED = true;
+
+    char * fingerprint = puflib_get_platform_fingerprint();
+    if (!fingerprint) {
+        return;
+    }
+    PLATFORM = puflib_hash(fingerprint, strlen(fingerprint), PUFLIB_HASH_INIT);
+    free(fingerprint);
+
+    char * path = cache_path(PROBE_CACHE_NAME);
+    if (!path) {
+        return;
+    }
+
+    FILE * f = fopen(path, "r");
+    free(path);
+    if (!f) {
+        return;
+    }
+
+    char line[PROBE_LINE_MAX];
+    unsigned file_version;
+    uint64_t file_platform;
+
+    if (!fgets(line, sizeof(line), f)
+            || sscanf(line, PROBE_CACHE_MAGIC " %u %" SCNx64,
+                &file_version, &file_platform) != 2
+            || file_version != PROBE_CACHE_VERSION
+            || file_platform != PLATFORM) {
+        puflib_report(NULL, STATUS_DEBUG, "probe cache is stale, ignoring");
+        fclose(f);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char name[PROBE_LINE_MAX];
+        uint64_t version;
+        int supported;
+
+        if (sscanf(line, "%255s %" SCNx64 " %d", name, &version, &supported) != 3) {
+            continue;
+        }
+        if (set_entry(name, version, supported)) {
+            break;
+        }
+    }
+
+    fclose(f);
+}
+
+
+/**
+ * Write the cache back to disk. Must be called with PROBE_LOCK and the lock
+ * file held.
+ * @return true on error
+ */
+static bool save_cache(void)
+{
+    char * path = NULL;
+    char * contents = NULL;
+    bool rc = true;
+
+    path = cache_path(PROBE_CACHE_NAME);
+    if (!path) {
+        goto out;
+    }
+
+    if (puflib_asprintf(&contents, PROBE_CACHE_MAGIC " %u %016" PRIx64 "\n",
+                PROBE_CACHE_VERSION, PLATFORM) < 0) {
+        contents = NULL;
+        goto out;
+    }
+
+    for (size_t i = 0; i < N_ENTRIES; ++i) {
+        char * line = NULL;
+        if (puflib_asprintf(&line, "%s %016" PRIx64 " %d\n", ENTRIES[i].name,
+                    ENTRIES[i].version, ENTRIES[i].supported ? 1 : 0) < 0) {
+            goto out;
+        }
+        char * new_contents = puflib_concat(contents, line, NULL);
+        free(line);
+        if (!new_contents) {
+            goto out;
+        }
+        free(contents);
+        contents = new_contents;
+    }
+
+    rc = puflib_replace_file(path, contents, strlen(contents));
+
+out:
+    free(path);
+    free(contents);
+    return rc;
+}
+
+
+/**
+ * Record a probe result. The cache is reread under the lock file first, so
+ * entries written by other processes since it was loaded are kept, and it is
+ * only rewritten if the result is new. Must be called with PROBE_LOCK held.
+ * @return true on error
+ */
+static bool update_cache(char const * name, uint64_t version, bool supported)
+{
+    char * lock_path = cache_path(PROBE_LOCK_NAME);
+    if (!lock_path) {
+        return true;
+    }
+
+    if (puflib_create_directory_tree(lock_path, true)) {
+        free(lock_path);
+        return true;
+    }
+
+    intptr_t lock = puflib_lock_file(lock_path);
+    free(lock_path);
+    if (lock < 0) {
+        return true;
+    }
+
+    load_cache();
+
+    bool rc = false;
+    struct probe_entry * entry = find_entry(name);
+    if (!entry || entry->version != version || entry->supported != supported) {
+        rc = set_entry(name, version, supported) || save_cache();
+    }
+
+    int errno_hold = errno;
+    puflib_unlock_file(lock);
+    errno = errno_hold;
+    return rc;
+}
+
+
+bool puflib_is_hw_supported(module_info const * module)
+{
+    puflib_plugin const * plugin = puflib_find_plugin(module);
+    if (puflib_plugin_caps(plugin)->volatile_probe) {
+        return module->is_hw_supported();
+    }
+
+    uint64_t version = module_version_hash(module, plugin);
+
+    pthread_mutex_lock(&PROBE_LOCK);
+    if (!LOADED) {
+        load_cache();
+    }
+    if (!REPROBE) {
+        struct probe_entry * entry = find_entry(module->name);
+        if (entry && entry->version == version) {
+            bool supported = entry->supported;
+            pthread_mutex_unlock(&PROBE_LOCK);
+            return supported;
+        }
+    }
+    pthread_mutex_unlock(&PROBE_LOCK);
+
+    // Probe without holding the lock: probes can be slow, and there is no
+    // harm in two threads probing the same module at once.
+    bool supported = module->is_hw_supported();
+
+    pthread_mutex_lock(&PROBE_LOCK);
+    if (update_cache(module->name, version, supported)) {
+        // The cache is only an optimization; e.g. an unprivileged user may
+        // not be able to write it.
+        puflib_report_fmt(NULL, STATUS_DEBUG, "cannot update probe cache: %s",
+                strerror(errno));
+    }
+    pthread_mutex_unlock(&PROBE_LOCK);
+
+    return supported;
+}
+
+
+void puflib_set_reprobe(bool reprobe)
+{
+    REPROBE = reprobe;
+}
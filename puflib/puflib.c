@@ -13,7 +13,6 @@
 #include <assert.h>
 #include <stddef.h>
 
-extern module_info const * const PUFLIB_MODULES[];
 static puflib_status_handler_p volatile STATUS_CALLBACK = NULL;
 static puflib_query_handler_p volatile QUERY_CALLBACK = NULL;
 
@@ -21,26 +20,10 @@ static bool storage_type_is_dir(enum puflib_storage_type type)
 {
     return type == STORAGE_TEMP_DIR
         || type == STORAGE_FINAL_DIR
-        || type == STORAGE_DISABLED_DIR;
+        || type == STORAGE_DISABLED_DIR
+        || type == STORAGE_ENVELOPE_DIR;
 }
 
-module_info const * const * puflib_get_modules()
-{
-    return PUFLIB_MODULES;
-}
-
-
-module_info const * puflib_get_module( char const * name )
-{
-    for (size_t i = 0; PUFLIB_MODULES[i]; ++i) {
-        if (!strcmp(PUFLIB_MODULES[i]->name, name)) {
-            return PUFLIB_MODULES[i];
-        }
-    }
-    return NULL;
-}
-
-
 enum module_status puflib_module_status(module_info const * module)
 {
     static const struct {
@@ -99,7 +82,8 @@ bool puflib_seal(module_info const * module,
         goto err;
     }
 
-    if (module->seal(data_in, data_in_len, &rawbuffer, &rawbuflen)) {
+    if (puflib_module_call(module, PUFLIB_OP_SEAL, data_in, data_in_len,
+                (void **) &rawbuffer, &rawbuflen)) {
         goto err;
     }
 
@@ -134,6 +118,13 @@ bool puflib_unseal(
 {
     char * module_name = NULL;
 
+    if (puflib_is_multi_sealed(data_in, data_in_len)) {
+        return puflib_unseal_multi(data_in, data_in_len, data_out, data_out_len);
+    }
+    if (puflib_is_envelope_sealed(data_in, data_in_len)) {
+        return puflib_unseal_envelope(data_in, data_in_len, data_out, data_out_len);
+    }
+
     if (data_in_len < strlen(PUFLIB_HEADER)) {
         puflib_report(NULL, STATUS_ERROR,
                 "malformed header: too short for puflib magic prefix");
@@ -183,7 +174,8 @@ bool puflib_unseal(
     size_t data_raw_len = data_in_len - header_len - 1;
     free(module_name);
 
-    return module->unseal(data_raw, data_raw_len, data_out, data_out_len);
+    return puflib_module_call(module, PUFLIB_OP_UNSEAL, data_raw, data_raw_len,
+            (void **) data_out, data_out_len);
 
 err:
     free(module_name);
@@ -195,110 +187,101 @@ bool puflib_chal_resp(module_info const * module,
         void const * data_in, size_t data_in_len,
         void ** data_out, size_t * data_out_len)
 {
-    if (module && module->chal_resp) {
-        return module->chal_resp(data_in, data_in_len, data_out, data_out_len);
+    if (module) {
+        return puflib_module_call(module, PUFLIB_OP_CHAL_RESP, data_in, data_in_len,
+                data_out, data_out_len);
     } else {
         return true;
     }
 }
 
 
-bool puflib_deprovision(module_info const * module)
+bool puflib_warmup(module_info const * module)
 {
-    static const struct {
-        enum puflib_storage_type stype;
-        bool is_dir;
-    } paths[] = {
-        { STORAGE_FINAL_FILE, false },
-        { STORAGE_FINAL_DIR, true },
-        { STORAGE_DISABLED_FILE, false },
-        { STORAGE_DISABLED_DIR, true },
-        { STORAGE_TEMP_FILE, false },
-        { STORAGE_TEMP_DIR, true },
-    };
-
-    for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]); ++i) {
-        char * path = puflib_get_nv_store_path(module->name, paths[i].stype);
-        if (!path) {
-            return true;
-        }
+    puflib_instance * instance;
 
-        if (!puflib_check_access(path, paths[i].is_dir)) {
-            if (paths[i].is_dir ? puflib_delete_tree(path) : remove(path)) {
-                goto err;
-            }
-        }
-
-        free(path);
-        continue;
-err:
-        free(path);
+    if (puflib_instance_acquire(puflib_find_plugin(module), &instance)) {
         return true;
     }
-
+    puflib_instance_release(instance);
     return false;
 }
 
 
-static bool puflib_en_dis(module_info const * module, bool enable)
+bool puflib_deprovision(module_info const * module)
 {
-    static const struct {
-        enum puflib_storage_type stype_en;
-        enum puflib_storage_type stype_dis;
-        bool is_dir;
-    } paths[] = {
-        { STORAGE_FINAL_FILE, STORAGE_DISABLED_FILE, false },
-        { STORAGE_FINAL_DIR,  STORAGE_DISABLED_DIR,  true },
+    // File and directory stores of each kind share a location, so one move
+    // per kind covers both.
+    static const enum puflib_storage_type stypes[] = {
+        STORAGE_FINAL_DIR,
+        STORAGE_DISABLED_DIR,
+        STORAGE_TEMP_DIR,
+        STORAGE_ENVELOPE_DIR,
     };
 
-    for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]); ++i) {
-
-        char * en_path = NULL, * dis_path = NULL;
+    puflib_key_cache_drop(module);
+    puflib_envelope_drop(module);
+    puflib_instance_reset(module);
 
-        en_path  = puflib_get_nv_store_path(module->name, paths[i].stype_en);
-        dis_path = puflib_get_nv_store_path(module->name, paths[i].stype_dis);
+    for (size_t i = 0; i < sizeof(stypes)/sizeof(stypes[0]); ++i) {
+        if (puflib_trash_nv_store(module->name, stypes[i]) && errno != ENOENT) {
+            return true;
+        }
+    }
 
-        if (!en_path)  goto err;
-        if (!dis_path) goto err;
+    return false;
+}
 
-        char * old_path = enable ? dis_path : en_path;
-        char * new_path = enable ? en_path : dis_path;
 
-        bool acc_old = !puflib_check_access(old_path, paths[i].is_dir);
-        bool acc_new = !puflib_check_access(new_path, paths[i].is_dir);
+void puflib_wait_cleanup()
+{
+    puflib_wait_trash();
+}
 
-        if (acc_old) {
-            if (puflib_create_directory_tree(new_path, true)) {
-                goto err;
-            }
-        }
 
-        if (acc_old && acc_new) {
-            puflib_report_fmt(module, STATUS_ERROR,
-                    "cannot %s module - both enabled and disabled stores exist",
-                    enable ? "enable" : "disable");
-            goto err;
+static bool puflib_en_dis(module_info const * module, bool enable)
+{
+    enum puflib_storage_type from = enable ? STORAGE_DISABLED_DIR : STORAGE_FINAL_DIR;
+    enum puflib_storage_type to   = enable ? STORAGE_FINAL_DIR : STORAGE_DISABLED_DIR;
+
+    // A single rename that refuses to replace an existing store, so there is
+    // no window in which both (or neither) store exists.
+    if (!puflib_move_nv_store(module->name, from, to)) {
+        if (!enable) {
+            puflib_key_cache_drop(module);
+            puflib_envelope_drop(module);
         }
+        puflib_instance_reset(module);
+        return false;
+    }
 
-        if (acc_new) {
-            free(en_path);
-            free(dis_path);
-            continue;
+    switch (errno) {
+    case ENOENT: {
+        // Already in the requested state is fine; never provisioned is not.
+        // File and directory stores share a path, so check for either.
+        char * path = puflib_get_nv_store_path(module->name, to);
+        bool done = path
+            && (!puflib_check_access(path, true) || !puflib_check_access(path, false));
+        free(path);
+        if (done) {
+            return false;
         }
+        puflib_report_fmt(module, STATUS_ERROR, "cannot %s module - not provisioned",
+                enable ? "enable" : "disable");
+        errno = ENOENT;
+        return true;
+    }
 
-        if (acc_old) {
-            if (rename(old_path, new_path)) {
-                goto err;
-            }
-        }
+    case EEXIST:
+        puflib_report_fmt(module, STATUS_ERROR,
+                "cannot %s module - both enabled and disabled stores exist",
+                enable ? "enable" : "disable");
+        errno = EEXIST;
+        return true;
 
-err:
-        if (en_path)  free(en_path);
-        if (dis_path) free(dis_path);
+    default:
         return true;
     }
-
-    return false;
 }
 
 
@@ -431,6 +414,10 @@ void puflib_report(module_info const * module, enum puflib_status_level level,
     }
 #endif
 
+    if (!STATUS_CALLBACK) {
+        return;
+    }
+
     char *formatted = NULL;
     char const * name = module ? module->name : "puflib";
 
@@ -451,6 +438,11 @@ void puflib_report_fmt(module_info const * module, enum puflib_status_level leve
     va_list ap;
     va_start(ap, fmt);
 
+    if (!STATUS_CALLBACK) {
+        va_end(ap);
+        return;
+    }
+
     char *formatted = NULL;
     if (puflib_vasprintf(&formatted, fmt, ap) < 0) {
         if (formatted) free(formatted);
@@ -0,0 +1,495 @@
+// PUFlib module registry
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Modules are shipped as plugins in a single directory, alongside a manifest
+// (modules.list) naming each module and the plugin file providing it. Only the
+// manifest is read up front; a plugin is loaded the first time its module is
+// looked up, so processes only map the modules they actually use.
+//
+// The registry also keeps the open instance of each module that has one. An
+// instance belongs to the store it was opened on: when the store's identity
+// changes (the module was provisioned again, disabled or deprovisioned, maybe
+// by another process), the next call opens a new instance, and the old one is
+// closed once the calls still using it return.
+//
+// Modules that cannot run calls in parallel (puflib_caps.threading) are given
+// a queue here, which their calls wait in (see sched.c).
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MANIFEST_NAME "modules.list"
+#define MANIFEST_LINE_MAX 512
+
+struct puflib_instance_s {
+    unsigned refs;              ///< Held by the plugin while current, and by calls
+    module_info const * module;
+    void * handle;              ///< From module_info.open
+    uint64_t store;             ///< Identity of the store it was opened on
+};
+
+struct puflib_plugin_s {
+    char * name;                ///< Module name, as listed in the manifest
+    char * path;                ///< Full path to the plugin file
+    char * store_path;          ///< Module's final store, once loaded
+    uint64_t file_identity;     ///< Identity of the plugin file when loaded, or 0
+    void * handle;              ///< Plugin handle once loaded
+    module_info const * info;   ///< Module info once loaded
+    unsigned abi;               ///< Module ABI version once loaded
+    puflib_caps const * caps;   ///< Module capabilities once loaded
+    puflib_queue * queue;       ///< Calls waiting for the module, if it is not parallel
+    bool failed;                ///< Loading was attempted and failed
+    puflib_instance * instance; ///< Current instance, if open
+    bool opening;               ///< An instance is being opened
+};
+
+static puflib_plugin * PLUGINS = NULL;
+static size_t N_PLUGINS = 0;
+
+// NULL-terminated list of every module that loaded, built on the first call
+// to puflib_get_modules().
+static module_info const ** MODULE_LIST = NULL;
+
+static pthread_once_t MANIFEST_ONCE = PTHREAD_ONCE_INIT;
+static pthread_mutex_t LOAD_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the instance fields of every plugin. Instances are opened and
+// closed without it held; INSTANCE_COND signals the end of an open.
+static pthread_mutex_t INSTANCE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t INSTANCE_COND = PTHREAD_COND_INITIALIZER;
+
+// Capabilities of a module that declares none
+static puflib_caps const DEFAULT_CAPS = { .threading = PUFLIB_THREADS_SERIAL };
+
+
+/**
+ * Add one manifest entry to the plugin list.
+ * @return true on error
+ */
+static bool add_plugin(char const * dir, char const * name, char const * file)
+{
+    puflib_plugin * new_plugins = realloc(PLUGINS, (N_PLUGINS + 1) * sizeof(*PLUGINS));
+    if (!new_plugins) {
+        return true;
+    }
+    PLUGINS = new_plugins;
+
+    puflib_plugin * plugin = &PLUGINS[N_PLUGINS];
+    memset(plugin, 0, sizeof(*plugin));
+
+    plugin->name = puflib_duplicate_string(name);
+    if (file[0] == '/') {
+        plugin->path = puflib_duplicate_string(file);
+    } else {
+        plugin->path = puflib_concat(dir, puflib_get_path_sep(), file, NULL);
+    }
+
+    if (!plugin->name || !plugin->path) {
+        free(plugin->name);
+        free(plugin->path);
+        return true;
+    }
+
+    ++N_PLUGINS;
+    return false;
+}
+
+
+/**
+ * Split the next whitespace-delimited field off a manifest line, terminating
+ * it in place.
+ * @return start of the field, or NULL if there are no more fields
+ */
+static char * next_field(char ** cursor)
+{
+    char * start = *cursor;
+
+    while (*start && isspace((unsigned char) *start)) ++start;
+    if (!*start || *start == '#') {
+        return NULL;
+    }
+
+    char * end = start;
+    while (*end && !isspace((unsigned char) *end)) ++end;
+    if (*end) {
+        *end++ = 0;
+    }
+
+    *cursor = end;
+    return start;
+}
+
+
+static void read_manifest(void)
+{
+    char * dir = puflib_get_plugin_dir();
+    if (!dir) {
+        puflib_report(NULL, STATUS_ERROR, "cannot locate plugin directory");
+        return;
+    }
+
+    char * manifest = puflib_concat(dir, puflib_get_path_sep(), MANIFEST_NAME, NULL);
+    if (!manifest) {
+        free(dir);
+        return;
+    }
+
+    FILE * f = fopen(manifest, "r");
+    if (!f) {
+        puflib_report_fmt(NULL, STATUS_ERROR, "cannot open module manifest %s: %s",
+                manifest, strerror(errno));
+        goto out;
+    }
+
+    char line[MANIFEST_LINE_MAX];
+    unsigned lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineno;
+
+        char * cursor = line;
+        char * name = next_field(&cursor);
+        if (!name) {
+            continue;
+        }
+        char * file = next_field(&cursor);
+        if (!file) {
+            puflib_report_fmt(NULL, STATUS_WARN, "%s:%u: no plugin file for module %s",
+                    manifest, lineno, name);
+            continue;
+        }
+
+        if (add_plugin(dir, name, file)) {
+            puflib_report(NULL, STATUS_ERROR, strerror(errno));
+            break;
+        }
+    }
+
+    fclose(f);
+out:
+    free(manifest);
+    free(dir);
+}
+
+
+/**
+ * Load a plugin if it hasn't been loaded yet. Must be called with LOAD_LOCK
+ * held.
+ * @return the module, or NULL if it could not be loaded
+ */
+static module_info const * load_plugin(puflib_plugin * plugin)
+{
+    if (plugin->info || plugin->failed) {
+        return plugin->info;
+    }
+
+    plugin->handle = puflib_plugin_open(plugin->path);
+    if (!plugin->handle) {
+        puflib_report_fmt(NULL, STATUS_ERROR, "cannot load module %s: %s",
+                plugin->name, puflib_plugin_error());
+        plugin->failed = true;
+        return NULL;
+    }
+
+    module_info const * info = puflib_plugin_symbol(plugin->handle, "MODULE_INFO");
+    if (!info) {
+        puflib_report_fmt(NULL, STATUS_ERROR, "cannot load module %s: %s",
+                plugin->name, puflib_plugin_error());
+        plugin->failed = true;
+        return NULL;
+    }
+
+    if (!info->name || strcmp(info->name, plugin->name)) {
+        puflib_report_fmt(NULL, STATUS_ERROR,
+                "cannot load module %s: plugin %s provides module %s instead",
+                plugin->name, plugin->path, info->name ? info->name : "(null)");
+        plugin->failed = true;
+        return NULL;
+    }
+
+    // Modules from before the ABI was versioned don't export it
+    unsigned const * abi = puflib_plugin_symbol(plugin->handle, "MODULE_ABI_VERSION");
+    plugin->abi = abi ? *abi : 1;
+    if (plugin->abi > PUFLIB_MODULE_ABI_VERSION) {
+        puflib_report_fmt(NULL, STATUS_ERROR,
+                "cannot load module %s: built for module ABI version %u, newer than %u",
+                plugin->name, plugin->abi, PUFLIB_MODULE_ABI_VERSION);
+        plugin->failed = true;
+        return NULL;
+    }
+    if (plugin->abi >= 2 && info->open
+            && (!info->close || !info->instance_seal || !info->instance_unseal)) {
+        puflib_report_fmt(NULL, STATUS_ERROR,
+                "cannot load module %s: open() without close() and instance operations",
+                plugin->name);
+        plugin->failed = true;
+        return NULL;
+    }
+
+    plugin->caps = (plugin->abi >= 3 && info->caps) ? info->caps : &DEFAULT_CAPS;
+
+    // Only used to notice rebuilt plugins, so failing to stat it is harmless
+    if (puflib_file_identity(plugin->path, &plugin->file_identity)) {
+        plugin->file_identity = 0;
+    }
+
+    plugin->store_path = puflib_get_nv_store_path(plugin->name, STORAGE_FINAL_DIR);
+    if (!plugin->store_path) {
+        puflib_report_fmt(NULL, STATUS_ERROR, "cannot load module %s: %s",
+                plugin->name, strerror(errno));
+        plugin->failed = true;
+        return NULL;
+    }
+
+    if (plugin->caps->threading != PUFLIB_THREADS_PARALLEL) {
+        plugin->queue = puflib_queue_new();
+        if (!plugin->queue) {
+            puflib_report_fmt(NULL, STATUS_ERROR, "cannot load module %s: %s",
+                    plugin->name, strerror(errno));
+            plugin->failed = true;
+            return NULL;
+        }
+    }
+
+    plugin->info = info;
+    return info;
+}
+
+
+module_info const * const * puflib_get_modules()
+{
+    pthread_once(&MANIFEST_ONCE, &read_manifest);
+    pthread_mutex_lock(&LOAD_LOCK);
+
+    if (!MODULE_LIST) {
+        module_info const ** list = malloc((N_PLUGINS + 1) * sizeof(*list));
+        if (list) {
+            size_t n = 0;
+            for (size_t i = 0; i < N_PLUGINS; ++i) {
+                module_info const * info = load_plugin(&PLUGINS[i]);
+                if (info) {
+                    list[n++] = info;
+                }
+            }
+            list[n] = NULL;
+            MODULE_LIST = list;
+        }
+    }
+
+    pthread_mutex_unlock(&LOAD_LOCK);
+
+    if (!MODULE_LIST) {
+        static module_info const * const empty[] = { NULL };
+        return empty;
+    }
+    return MODULE_LIST;
+}
+
+
+module_info const * puflib_get_module(char const * name)
+{
+    module_info const * info = NULL;
+
+    pthread_once(&MANIFEST_ONCE, &read_manifest);
+    pthread_mutex_lock(&LOAD_LOCK);
+
+    for (size_t i = 0; i < N_PLUGINS; ++i) {
+        if (!strcmp(PLUGINS[i].name, name)) {
+            info = load_plugin(&PLUGINS[i]);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&LOAD_LOCK);
+    return info;
+}
+
+
+puflib_plugin * puflib_find_plugin(module_info const * module)
+{
+    // The plugin list is fixed once the manifest is read, and a plugin's name
+    // never changes, nor its module once it has loaded; and the caller's
+    // module pointer came from a lookup made after that. So every call can
+    // find its plugin without taking LOAD_LOCK, by name rather than by
+    // reading the module of plugins that may be loading.
+    if (!module || !module->name) {
+        return NULL;
+    }
+    pthread_once(&MANIFEST_ONCE, &read_manifest);
+    for (size_t i = 0; i < N_PLUGINS; ++i) {
+        if (!strcmp(PLUGINS[i].name, module->name)) {
+            return PLUGINS[i].info == module ? &PLUGINS[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Drop a reference to an instance. Must be called with INSTANCE_LOCK held.
+ * @return the instance if it is now unused, to be closed with close_instance()
+ *  once the lock is released
+ */
+static puflib_instance * unref_instance(puflib_instance * instance)
+{
+    return (instance && !--instance->refs) ? instance : NULL;
+}
+
+
+static void close_instance(puflib_instance * instance)
+{
+    if (instance) {
+        instance->module->close(instance->handle);
+        free(instance);
+    }
+}
+
+
+uint64_t puflib_store_identity(puflib_plugin const * plugin)
+{
+    uint64_t store;
+
+    if (!plugin || puflib_file_identity(plugin->store_path, &store)) {
+        store = 0;
+    }
+    return store;
+}
+
+
+bool puflib_instance_acquire(puflib_plugin * plugin, puflib_instance ** instance)
+{
+    puflib_instance * stale = NULL;
+
+    *instance = NULL;
+    if (!plugin || plugin->abi < 2 || !plugin->info->open) {
+        return false;
+    }
+    module_info const * module = plugin->info;
+
+    // An unprovisioned module has no store; leave it to open() to say so
+    uint64_t store = puflib_store_identity(plugin);
+
+    pthread_mutex_lock(&INSTANCE_LOCK);
+    while (plugin->opening) {
+        pthread_cond_wait(&INSTANCE_COND, &INSTANCE_LOCK);
+    }
+
+    if (plugin->instance && plugin->instance->store == store) {
+        ++plugin->instance->refs;
+        *instance = plugin->instance;
+        pthread_mutex_unlock(&INSTANCE_LOCK);
+        return false;
+    }
+
+    stale = unref_instance(plugin->instance);
+    plugin->instance = NULL;
+    plugin->opening = true;
+    pthread_mutex_unlock(&INSTANCE_LOCK);
+
+    close_instance(stale);
+
+    puflib_instance * new_instance = malloc(sizeof(*new_instance));
+    bool failed = !new_instance || module->open(&new_instance->handle);
+    int errno_hold = errno;
+
+    pthread_mutex_lock(&INSTANCE_LOCK);
+    plugin->opening = false;
+    if (!failed) {
+        new_instance->refs = 2;
+        new_instance->module = module;
+        new_instance->store = store;
+        plugin->instance = new_instance;
+        *instance = new_instance;
+    }
+    pthread_cond_broadcast(&INSTANCE_COND);
+    pthread_mutex_unlock(&INSTANCE_LOCK);
+
+    if (failed) {
+        free(new_instance);
+        errno = errno_hold;
+        return true;
+    }
+    return false;
+}
+
+
+void * puflib_instance_handle(puflib_instance const * instance)
+{
+    return instance ? instance->handle : NULL;
+}
+
+
+void puflib_instance_release(puflib_instance * instance)
+{
+    if (!instance) {
+        return;
+    }
+
+    int errno_hold = errno;
+    pthread_mutex_lock(&INSTANCE_LOCK);
+    puflib_instance * unused = unref_instance(instance);
+    pthread_mutex_unlock(&INSTANCE_LOCK);
+
+    close_instance(unused);
+    errno = errno_hold;
+}
+
+
+void puflib_instance_reset(module_info const * module)
+{
+    puflib_plugin * plugin = puflib_find_plugin(module);
+    if (!plugin) {
+        return;
+    }
+
+    pthread_mutex_lock(&INSTANCE_LOCK);
+    while (plugin->opening) {
+        pthread_cond_wait(&INSTANCE_COND, &INSTANCE_LOCK);
+    }
+    puflib_instance * unused = unref_instance(plugin->instance);
+    plugin->instance = NULL;
+    pthread_mutex_unlock(&INSTANCE_LOCK);
+
+    close_instance(unused);
+}
+
+
+puflib_caps const * puflib_plugin_caps(puflib_plugin const * plugin)
+{
+    return plugin ? plugin->caps : &DEFAULT_CAPS;
+}
+
+
+uint64_t puflib_plugin_file_identity(puflib_plugin const * plugin)
+{
+    return plugin ? plugin->file_identity : 0;
+}
+
+
+puflib_caps const * puflib_get_caps(module_info const * module)
+{
+    return puflib_plugin_caps(puflib_find_plugin(module));
+}
+
+
+void puflib_module_enter(puflib_plugin * plugin)
+{
+    if (plugin && plugin->queue) {
+        puflib_queue_enter(plugin->queue);
+    }
+}
+
+
+void puflib_module_leave(puflib_plugin * plugin)
+{
+    if (plugin && plugin->queue) {
+        puflib_queue_leave(plugin->queue);
+    }
+}
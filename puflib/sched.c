@@ -0,0 +1,193 @@
+// PUFlib module call scheduler
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A module that cannot run calls in parallel (PUFLIB_THREADS_SERIAL, or
+// PUFLIB_THREADS_SAFE, which serializes its hardware itself) gets a queue, and
+// its calls hold the module one at a time, in the order the queue picks. Calls
+// to other modules, and to parallel ones, run concurrently.
+//
+// Each thread's calls are in a priority class (puflib_set_priority()), and the
+// classes share a busy module by weighted fair queuing: each class is charged
+// for the time its calls hold the module, scaled by its stride, and whichever
+// waiting class has been charged least goes next. Interactive calls get most
+// of a contended module, and bulk calls still get their share rather than
+// starving. A class that has been idle starts from the current charge, so it
+// cannot save up time while nobody waits. Within a class, calls go in order
+// of arrival, so threads that keep calling take turns.
+//
+// Waiters sleep on their own condition variables, so a call that finishes
+// wakes only the call it hands the module to.
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define CLASSES 2
+
+// Charge per microsecond of holding the module. Interactive calls get eight
+// times the share of bulk ones when both are waiting.
+static uint64_t const STRIDE[CLASSES] = {
+    [PUFLIB_PRIORITY_INTERACTIVE] = 1,
+    [PUFLIB_PRIORITY_BULK] = 8,
+};
+
+struct waiter {
+    pthread_cond_t cond;
+    bool granted;               ///< The module has been handed to this call
+    struct waiter * next;
+};
+
+struct puflib_queue_s {
+    pthread_mutex_t lock;
+    bool busy;                  ///< A call holds the module
+    enum puflib_priority running;   ///< Class of that call
+    uint64_t start_us;          ///< When it was given the module
+    uint64_t vtime;             ///< Charge of the class that went last
+    uint64_t charge[CLASSES];
+    struct waiter * head[CLASSES];
+    struct waiter ** tail[CLASSES];
+};
+
+static pthread_once_t KEY_ONCE = PTHREAD_ONCE_INIT;
+static pthread_key_t PRIORITY_KEY;
+static bool HAVE_KEY = false;
+
+
+static void create_key(void)
+{
+    HAVE_KEY = !pthread_key_create(&PRIORITY_KEY, NULL);
+}
+
+
+bool puflib_set_priority(enum puflib_priority priority)
+{
+    if ((unsigned) priority >= CLASSES) {
+        errno = EINVAL;
+        return true;
+    }
+
+    pthread_once(&KEY_ONCE, &create_key);
+    if (!HAVE_KEY) {
+        errno = EAGAIN;
+        return true;
+    }
+
+    int rc = pthread_setspecific(PRIORITY_KEY, (void *) (uintptr_t) priority);
+    if (rc) {
+        errno = rc;
+        return true;
+    }
+    return false;
+}
+
+
+enum puflib_priority puflib_get_priority()
+{
+    // Threads that never set one read NULL, which is interactive
+    pthread_once(&KEY_ONCE, &create_key);
+    if (!HAVE_KEY) {
+        return PUFLIB_PRIORITY_INTERACTIVE;
+    }
+    return (enum puflib_priority) (uintptr_t) pthread_getspecific(PRIORITY_KEY);
+}
+
+
+puflib_queue * puflib_queue_new()
+{
+    puflib_queue * queue = calloc(1, sizeof(*queue));
+    if (!queue) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    for (size_t c = 0; c < CLASSES; ++c) {
+        queue->tail[c] = &queue->head[c];
+    }
+    return queue;
+}
+
+
+/**
+ * Hand the module to a call of class c. Must be called with the queue's lock
+ * held.
+ */
+static void grant(puflib_queue * queue, enum puflib_priority c)
+{
+    if (queue->charge[c] < queue->vtime) {
+        queue->charge[c] = queue->vtime;
+    }
+    queue->vtime = queue->charge[c];
+    queue->busy = true;
+    queue->running = c;
+    queue->start_us = puflib_monotonic_us();
+}
+
+
+void puflib_queue_enter(puflib_queue * queue)
+{
+    enum puflib_priority c = puflib_get_priority();
+    struct waiter self = { .granted = false, .next = NULL };
+
+    pthread_mutex_lock(&queue->lock);
+
+    // Nobody waits while the module is free
+    if (!queue->busy) {
+        grant(queue, c);
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    pthread_cond_init(&self.cond, NULL);
+    if (!queue->head[c] && queue->charge[c] < queue->vtime) {
+        queue->charge[c] = queue->vtime;
+    }
+    *queue->tail[c] = &self;
+    queue->tail[c] = &self.next;
+
+    while (!self.granted) {
+        pthread_cond_wait(&self.cond, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    pthread_cond_destroy(&self.cond);
+}
+
+
+void puflib_queue_leave(puflib_queue * queue)
+{
+    int next = -1;
+
+    pthread_mutex_lock(&queue->lock);
+
+    // Even the quickest call costs something, or it could go on forever
+    uint64_t held = puflib_monotonic_us() - queue->start_us;
+    queue->charge[queue->running] += (held ? held : 1) * STRIDE[queue->running];
+
+    for (int c = 0; c < CLASSES; ++c) {
+        if (queue->head[c] && (next < 0 || queue->charge[c] < queue->charge[next])) {
+            next = c;
+        }
+    }
+
+    if (next < 0) {
+        queue->busy = false;
+    } else {
+        struct waiter * w = queue->head[next];
+        queue->head[next] = w->next;
+        if (!w->next) {
+            queue->tail[next] = &queue->head[next];
+        }
+        grant(queue, next);
+        w->granted = true;
+        pthread_cond_signal(&w->cond);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+}
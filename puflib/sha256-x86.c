@@ -0,0 +1,199 @@
+// PUFlib SHA-256, x86 implementations
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Compression with the SHA extensions, and eight-lane compression of
+// independent messages with AVX2. Both are compiled with function target
+// attributes so the rest of the library keeps the baseline instruction set;
+// sha256.c only calls them after checking the CPU supports them.
+//
+
+#include "sha256.h"
+
+#ifdef PUFLIB_SHA256_X86
+
+#include "cpu.h"
+#include <immintrin.h>
+
+#define TARGET_SHANI __attribute__((target("sha,sse4.1,ssse3")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+
+
+bool puflib_sha256_have_shani(void)
+{
+    return cpu_x86_has(1, CPU_X86_ECX, CPU_X86_1C_SSSE3 | CPU_X86_1C_SSE41)
+        && cpu_x86_has(7, CPU_X86_EBX, CPU_X86_7B_SHA);
+}
+
+
+bool puflib_sha256_have_avx2(void)
+{
+    return cpu_x86_os_avx() && cpu_x86_has(7, CPU_X86_EBX, CPU_X86_7B_AVX2);
+}
+
+
+TARGET_SHANI
+void puflib_sha256_blocks_shani(uint32_t state[8], uint8_t const * data, size_t nblocks)
+{
+    __m128i const bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bll, 0x0405060700010203ll);
+    __m128i state0, state1, tmp;
+
+    // The rounds instruction wants the state as ABEF and CDGH
+    tmp = _mm_loadu_si128((__m128i const *) &state[0]);
+    state1 = _mm_loadu_si128((__m128i const *) &state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; nblocks; --nblocks, data += 64) {
+        __m128i const save0 = state0, save1 = state1;
+        __m128i m[4];
+
+        for (unsigned i = 0; i < 4; ++i) {
+            m[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (data + 16 * i)), bswap);
+        }
+
+        // Sixteen groups of four rounds. The schedule for group g + 1 is
+        // finished during group g, and started during group g - 2.
+        for (unsigned g = 0; g < 16; ++g) {
+            __m128i msg = _mm_add_epi32(m[g % 4],
+                    _mm_loadu_si128((__m128i const *) &puflib_sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+            if (g >= 3 && g <= 14) {
+                tmp = _mm_alignr_epi8(m[g % 4], m[(g + 3) % 4], 4);
+                m[(g + 1) % 4] = _mm_add_epi32(m[(g + 1) % 4], tmp);
+                m[(g + 1) % 4] = _mm_sha256msg2_epu32(m[(g + 1) % 4], m[g % 4]);
+            }
+
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            if (g >= 1 && g <= 12) {
+                m[(g - 1) % 4] = _mm_sha256msg1_epu32(m[(g - 1) % 4], m[g % 4]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+
+TARGET_AVX2
+static inline __m256i rotr8(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+
+/**
+ * Transpose an 8x8 matrix of 32-bit words held one row per register.
+ */
+TARGET_AVX2
+static inline void transpose8(__m256i r[8])
+{
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+
+TARGET_AVX2
+void puflib_sha256_x8_avx2(uint32_t state[8][8], uint8_t const * const blocks[8])
+{
+    __m256i const bswap = _mm256_set_epi64x(
+            0x0c0d0e0f08090a0bll, 0x0405060700010203ll,
+            0x0c0d0e0f08090a0bll, 0x0405060700010203ll);
+    __m256i w[16], s[8], v[8];
+
+    // Load each lane's block as a row, then transpose so w[i] holds word i
+    // of every lane
+    for (unsigned half = 0; half < 2; ++half) {
+        for (unsigned lane = 0; lane < 8; ++lane) {
+            w[8 * half + lane] = _mm256_shuffle_epi8(_mm256_loadu_si256(
+                        (__m256i const *) (blocks[lane] + 32 * half)), bswap);
+        }
+        transpose8(&w[8 * half]);
+    }
+
+    for (unsigned i = 0; i < 8; ++i) {
+        s[i] = v[i] = _mm256_loadu_si256((__m256i const *) state[i]);
+    }
+
+    for (unsigned i = 0; i < 64; ++i) {
+        __m256i wi;
+
+        if (i < 16) {
+            wi = w[i];
+        } else {
+            __m256i w15 = w[(i - 15) % 16], w2 = w[(i - 2) % 16];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w15, 7), rotr8(w15, 18)),
+                    _mm256_srli_epi32(w15, 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w2, 17), rotr8(w2, 19)),
+                    _mm256_srli_epi32(w2, 10));
+            wi = _mm256_add_epi32(_mm256_add_epi32(w[i % 16], s0),
+                    _mm256_add_epi32(w[(i - 7) % 16], s1));
+            w[i % 16] = wi;
+        }
+
+        __m256i e = v[4], a = v[0];
+        __m256i sig1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(e, 6), rotr8(e, 11)),
+                rotr8(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, v[5]), _mm256_andnot_si256(e, v[6]));
+        __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(v[7], sig1),
+                _mm256_add_epi32(_mm256_add_epi32(ch, wi),
+                    _mm256_set1_epi32((int) puflib_sha256_k[i])));
+        __m256i sig0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(a, 2), rotr8(a, 13)),
+                rotr8(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, v[1]),
+                _mm256_and_si256(v[2], _mm256_or_si256(a, v[1])));
+        __m256i t2 = _mm256_add_epi32(sig0, maj);
+
+        v[7] = v[6];
+        v[6] = v[5];
+        v[5] = v[4];
+        v[4] = _mm256_add_epi32(v[3], t1);
+        v[3] = v[2];
+        v[2] = v[1];
+        v[1] = v[0];
+        v[0] = _mm256_add_epi32(t1, t2);
+    }
+
+    for (unsigned i = 0; i < 8; ++i) {
+        _mm256_storeu_si256((__m256i *) state[i], _mm256_add_epi32(s[i], v[i]));
+    }
+}
+
+#endif // PUFLIB_SHA256_X86
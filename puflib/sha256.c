@@ -0,0 +1,313 @@
+// PUFlib SHA-256
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Message padding, the streaming and multi-message interfaces, and selection
+// of the compression function. The compression function is chosen once per
+// process: the SHA extensions where available, otherwise portable C, with
+// independent messages hashed eight at a time in AVX2 lanes where the SHA
+// extensions are missing but AVX2 is present. PUFLIB_SHA256=scalar, sha-ni or
+// avx2 in the environment restricts the choice, for benchmarking.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+#include "sha256.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+uint32_t const puflib_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t const IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static void (*BLOCKS)(uint32_t state[8], uint8_t const * data, size_t nblocks)
+    = &puflib_sha256_blocks_scalar;
+static bool USE_X8 = false;
+static char const * IMPL_NAME = "scalar";
+static pthread_once_t IMPL_ONCE = PTHREAD_ONCE_INIT;
+
+
+static inline uint32_t rotr(uint32_t x, unsigned n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+
+static inline uint32_t load_be32(uint8_t const * p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+
+static inline void store_be32(uint8_t * p, uint32_t v)
+{
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+
+void puflib_sha256_blocks_scalar(uint32_t state[8], uint8_t const * data, size_t nblocks)
+{
+    uint32_t w[64];
+
+    for (; nblocks; --nblocks, data += 64) {
+        for (unsigned i = 0; i < 16; ++i) {
+            w[i] = load_be32(data + 4 * i);
+        }
+        for (unsigned i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (unsigned i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25))
+                + ((e & f) ^ (~e & g)) + puflib_sha256_k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22))
+                + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    puflib_wipe(w, sizeof(w));
+}
+
+
+static void choose_impl(void)
+{
+#ifdef PUFLIB_SHA256_X86
+    char const * want = getenv("PUFLIB_SHA256");
+    bool shani = puflib_sha256_have_shani();
+    bool avx2 = puflib_sha256_have_avx2();
+
+    if (want && !strcmp(want, "scalar")) {
+        shani = avx2 = false;
+    } else if (want && !strcmp(want, "avx2")) {
+        shani = false;
+    } else if (want && !strcmp(want, "sha-ni")) {
+        avx2 = false;
+    }
+
+    if (shani) {
+        BLOCKS = &puflib_sha256_blocks_shani;
+        IMPL_NAME = "sha-ni";
+    } else if (avx2) {
+        USE_X8 = true;
+        IMPL_NAME = "avx2";
+    }
+#endif
+}
+
+
+char const * puflib_sha256_impl(void)
+{
+    pthread_once(&IMPL_ONCE, &choose_impl);
+    return IMPL_NAME;
+}
+
+
+void puflib_sha256_init(puflib_sha256_ctx * ctx)
+{
+    pthread_once(&IMPL_ONCE, &choose_impl);
+    memcpy(ctx->state, IV, sizeof(IV));
+    ctx->len = 0;
+}
+
+
+void puflib_sha256_update(puflib_sha256_ctx * ctx, void const * data, size_t len)
+{
+    uint8_t const * p = data;
+    size_t used = ctx->len % 64;
+
+    ctx->len += len;
+
+    if (used) {
+        size_t take = 64 - used < len ? 64 - used : len;
+        memcpy(ctx->buf + used, p, take);
+        if (used + take < 64) {
+            return;
+        }
+        BLOCKS(ctx->state, ctx->buf, 1);
+        p += take;
+        len -= take;
+    }
+
+    if (len >= 64) {
+        BLOCKS(ctx->state, p, len / 64);
+        p += len - len % 64;
+        len %= 64;
+    }
+
+    if (len) {
+        memcpy(ctx->buf, p, len);
+    }
+}
+
+
+/**
+ * Write the padding for a message of len bytes, of which the final partial
+ * block (len % 64 bytes) is already at the start of block.
+ * @return number of padded blocks, 1 or 2
+ */
+static unsigned pad(uint8_t block[128], uint64_t len)
+{
+    size_t used = len % 64;
+    unsigned nblocks = used < 56 ? 1 : 2;
+
+    block[used] = 0x80;
+    memset(block + used + 1, 0, 64 * nblocks - used - 1);
+    store_be32(block + 64 * nblocks - 8, (uint32_t) (len >> 29));
+    store_be32(block + 64 * nblocks - 4, (uint32_t) (len << 3));
+    return nblocks;
+}
+
+
+void puflib_sha256_final(puflib_sha256_ctx * ctx, uint8_t digest[PUFLIB_SHA256_LEN])
+{
+    uint8_t block[128];
+
+    memcpy(block, ctx->buf, ctx->len % 64);
+    BLOCKS(ctx->state, block, pad(block, ctx->len));
+
+    for (unsigned i = 0; i < 8; ++i) {
+        store_be32(digest + 4 * i, ctx->state[i]);
+    }
+
+    puflib_wipe(block, sizeof(block));
+    puflib_wipe(ctx, sizeof(*ctx));
+}
+
+
+void puflib_sha256(void const * data, size_t len, uint8_t digest[PUFLIB_SHA256_LEN])
+{
+    puflib_sha256_ctx ctx;
+    puflib_sha256_init(&ctx);
+    puflib_sha256_update(&ctx, data, len);
+    puflib_sha256_final(&ctx, digest);
+}
+
+
+#ifdef PUFLIB_SHA256_X86
+/**
+ * Hash up to eight messages in AVX2 lanes. Each lane runs through its own
+ * message blocks then its padding; the group runs until the longest message
+ * is done, lanes that finish early hashing a dummy block.
+ */
+static void hash_x8(size_t n, void const * const * data, size_t const * lens, uint8_t * digests)
+{
+    static uint8_t const dummy[64];
+    uint32_t state[8][8];
+    uint8_t tail[8][128];
+    size_t full[8], total[8] = {0}, max_total = 0;
+
+    for (unsigned i = 0; i < 8; ++i) {
+        for (unsigned lane = 0; lane < 8; ++lane) {
+            state[i][lane] = IV[i];
+        }
+    }
+
+    for (size_t lane = 0; lane < n; ++lane) {
+        full[lane] = lens[lane] / 64;
+        memcpy(tail[lane], (uint8_t const *) data[lane] + 64 * full[lane], lens[lane] % 64);
+        total[lane] = full[lane] + pad(tail[lane], lens[lane]);
+        if (total[lane] > max_total) {
+            max_total = total[lane];
+        }
+    }
+
+    for (size_t b = 0; b < max_total; ++b) {
+        uint8_t const * blocks[8];
+
+        for (size_t lane = 0; lane < 8; ++lane) {
+            if (lane >= n || b >= total[lane]) {
+                blocks[lane] = dummy;
+            } else if (b < full[lane]) {
+                blocks[lane] = (uint8_t const *) data[lane] + 64 * b;
+            } else {
+                blocks[lane] = tail[lane] + 64 * (b - full[lane]);
+            }
+        }
+
+        puflib_sha256_x8_avx2(state, blocks);
+
+        for (size_t lane = 0; lane < n; ++lane) {
+            if (b + 1 == total[lane]) {
+                for (unsigned i = 0; i < 8; ++i) {
+                    store_be32(digests + PUFLIB_SHA256_LEN * lane + 4 * i, state[i][lane]);
+                }
+            }
+        }
+    }
+
+    puflib_wipe(state, sizeof(state));
+    puflib_wipe(tail, sizeof(tail));
+}
+#endif
+
+
+void puflib_sha256_many(size_t count, void const * const * data, size_t const * lens,
+        uint8_t * digests)
+{
+    pthread_once(&IMPL_ONCE, &choose_impl);
+
+    size_t i = 0;
+#ifdef PUFLIB_SHA256_X86
+    if (USE_X8) {
+        for (; count - i >= 2; i += 8) {
+            size_t n = count - i < 8 ? count - i : 8;
+            hash_x8(n, data + i, lens + i, digests + PUFLIB_SHA256_LEN * i);
+            if (n < 8) {
+                i += n;
+                break;
+            }
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        puflib_sha256(data[i], lens[i], digests + PUFLIB_SHA256_LEN * i);
+    }
+}
+
+
+void puflib_sha256_batch(void const * data, size_t len, size_t count, uint8_t * digests)
+{
+    uint8_t const * p = data;
+    void const * ptrs[8];
+    size_t lens[8];
+
+    for (size_t i = 0; i < 8; ++i) {
+        lens[i] = len;
+    }
+
+    for (size_t i = 0; i < count; i += 8) {
+        size_t n = count - i < 8 ? count - i : 8;
+        for (size_t j = 0; j < n; ++j) {
+            ptrs[j] = p + len * (i + j);
+        }
+        puflib_sha256_many(n, ptrs, lens, digests + PUFLIB_SHA256_LEN * i);
+    }
+}
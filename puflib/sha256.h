@@ -0,0 +1,50 @@
+// PUFlib SHA-256 compression functions
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+// Each implementation of the SHA-256 compression function, selected at run
+// time by sha256.c according to what the CPU supports.
+//
+
+#ifndef _PUFLIB_SHA256_H_
+#define _PUFLIB_SHA256_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Round constants
+extern uint32_t const puflib_sha256_k[64];
+
+/**
+ * Compress whole 64-byte blocks into a state, portably.
+ */
+void puflib_sha256_blocks_scalar(uint32_t state[8], uint8_t const * data, size_t nblocks);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PUFLIB_SHA256_X86 1
+
+/// Whether the CPU and OS support the SHA extensions path
+bool puflib_sha256_have_shani(void);
+
+/// Whether the CPU and OS support the AVX2 path
+bool puflib_sha256_have_avx2(void);
+
+/**
+ * Compress whole 64-byte blocks into a state with the SHA extensions.
+ */
+void puflib_sha256_blocks_shani(uint32_t state[8], uint8_t const * data, size_t nblocks);
+
+/**
+ * Compress one 64-byte block into each of eight independent states at once
+ * with AVX2.
+ *
+ * @param state - states, transposed: state[i][lane] is word i of a lane
+ * @param blocks - one block for each lane
+ */
+void puflib_sha256_x8_avx2(uint32_t state[8][8], uint8_t const * const blocks[8]);
+#endif
+
+#endif // _PUFLIB_SHA256_H_
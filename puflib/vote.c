@@ -0,0 +1,198 @@
+// PUFlib response stabilization
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Repeated reads of a response are accumulated in bit-sliced counters (see
+// bitslice.h), word-major: the counter for word w of the response is words
+// w * width to w * width + width - 1. Adding a read, voting and masking then
+// each cost a few logic operations per 64 bits, and totals over the response
+// reduce to popcounts of the counter words.
+//
+
+#include <puflib.h>
+#include <puflib_internal.h>
+#include "misc.h"
+#include "bitslice.h"
+
+#include <string.h>
+#include <errno.h>
+
+#define MAX_SAMPLES 65535
+
+struct puflib_voter_s {
+    size_t nbits;
+    unsigned width;         ///< Counter width, in bits
+    unsigned max_samples;
+    unsigned samples;
+    uint64_t counters[];
+};
+
+
+puflib_voter * puflib_voter_new(size_t nbits, unsigned max_samples)
+{
+    if (!nbits || !max_samples || max_samples > MAX_SAMPLES) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    unsigned width = bitslice_width(max_samples);
+    size_t n_counters = BITS_WORDS(nbits) * width;
+
+    puflib_voter * voter = calloc(1, sizeof(*voter) + n_counters * sizeof(uint64_t));
+    if (!voter) {
+        return NULL;
+    }
+
+    voter->nbits = nbits;
+    voter->width = width;
+    voter->max_samples = max_samples;
+    return voter;
+}
+
+
+void puflib_voter_free(puflib_voter * voter)
+{
+    if (voter) {
+        puflib_wipe(voter->counters,
+                BITS_WORDS(voter->nbits) * voter->width * sizeof(uint64_t));
+        free(voter);
+    }
+}
+
+
+bool puflib_voter_add(puflib_voter * voter, uint8_t const * sample)
+{
+    if (voter->samples == voter->max_samples) {
+        errno = EOVERFLOW;
+        return true;
+    }
+
+    for (size_t w = 0; w < BITS_WORDS(voter->nbits); ++w) {
+        bitslice_add(&voter->counters[w * voter->width], voter->width,
+                bits_load_word(sample, voter->nbits, w));
+    }
+
+    ++voter->samples;
+    return false;
+}
+
+
+unsigned puflib_voter_samples(puflib_voter const * voter)
+{
+    return voter->samples;
+}
+
+
+/**
+ * Mask of the bits in word w that were 1 in more than half the samples.
+ */
+static uint64_t majority_word(puflib_voter const * voter, size_t w)
+{
+    return bitslice_ge(&voter->counters[w * voter->width], voter->width,
+            voter->samples / 2 + 1);
+}
+
+
+void puflib_voter_majority(puflib_voter const * voter, uint8_t * majority)
+{
+    size_t const nw = BITS_WORDS(voter->nbits);
+    uint64_t words[nw];
+
+    for (size_t w = 0; w < nw; ++w) {
+        words[w] = majority_word(voter, w);
+    }
+    bits_to_bytes(majority, words, voter->nbits);
+    puflib_wipe(words, sizeof(words));
+}
+
+
+size_t puflib_voter_mask(puflib_voter const * voter, unsigned max_minority, uint8_t * mask)
+{
+    size_t const nw = BITS_WORDS(voter->nbits);
+    unsigned const samples = voter->samples;
+    uint64_t words[nw];
+    size_t stable = 0;
+
+    for (size_t w = 0; w < nw; ++w) {
+        uint64_t const * counter = &voter->counters[w * voter->width];
+        uint64_t m;
+
+        if (2 * max_minority >= samples) {
+            // Every bit has a minority of at most half the samples
+            m = ~(uint64_t) 0;
+        } else {
+            // Stable if nearly always 0 (count <= max_minority) or nearly
+            // always 1 (count >= samples - max_minority)
+            m = ~bitslice_ge(counter, voter->width, max_minority + 1)
+                | bitslice_ge(counter, voter->width, samples - max_minority);
+        }
+        if (w == nw - 1) {
+            m &= bits_tail_mask(voter->nbits);
+        }
+
+        words[w] = m;
+        stable += __builtin_popcountll(m);
+    }
+
+    if (mask) {
+        bits_to_bytes(mask, words, voter->nbits);
+    }
+    return stable;
+}
+
+
+double puflib_voter_error_rate(puflib_voter const * voter)
+{
+    if (!voter->samples) {
+        return 0.0;
+    }
+
+    // Total of the minority counts, i.e. of the disagreements with the vote:
+    // the counts where the majority is 0, plus samples - count where it is 1.
+    uint64_t total = 0;
+    for (size_t w = 0; w < BITS_WORDS(voter->nbits); ++w) {
+        uint64_t const * counter = &voter->counters[w * voter->width];
+        uint64_t maj = majority_word(voter, w);
+
+        total += (uint64_t) voter->samples * __builtin_popcountll(maj);
+        for (unsigned b = 0; b < voter->width; ++b) {
+            total += ((uint64_t) __builtin_popcountll(counter[b] & ~maj)) << b;
+            total -= ((uint64_t) __builtin_popcountll(counter[b] & maj)) << b;
+        }
+    }
+
+    return (double) total / ((double) voter->samples * (double) voter->nbits);
+}
+
+
+size_t puflib_bits_select(uint8_t const * bits, uint8_t const * mask, size_t nbits,
+        uint8_t * out)
+{
+    size_t n = 0;
+    uint64_t acc = 0;
+    unsigned acc_bits = 0;
+
+    for (size_t w = 0; w < BITS_WORDS(nbits); ++w) {
+        uint64_t v = bits_load_word(bits, nbits, w);
+        uint64_t m = bits_load_word(mask, nbits, w);
+
+        while (m) {
+            unsigned i = __builtin_ctzll(m);
+            m &= m - 1;
+            acc |= ((v >> i) & 1) << acc_bits;
+            if (++acc_bits == 64) {
+                for (unsigned b = 0; b < 8; ++b) {
+                    out[n / 8 + b] = (uint8_t) (acc >> (8 * b));
+                }
+                n += 64;
+                acc = 0;
+                acc_bits = 0;
+            }
+        }
+    }
+
+    for (unsigned b = 0; 8 * b < acc_bits; ++b) {
+        out[n / 8 + b] = (uint8_t) (acc >> (8 * b));
+    }
+    return n + acc_bits;
+}
@@ -14,10 +14,13 @@
 #include "optparse.h"
 #include "base64.h"
 
+#define PUF_MAX_MODULES 64
+
 struct opts {
     bool help;
     bool input_base64;
     bool output_base64;
+    bool envelope;
     char * output;
     int argc;
     char ** argv;
@@ -34,9 +37,12 @@ static void usage(void)
     printf("  -I, --input-base64    input is base64-encoded\n");
     printf("  -O, --output-base64   output is base64-encoded\n");
     printf("  -o OUT, --output=OUT  output to OUT instead of stdout\n");
+    printf("  -e, --envelope        seal in envelope mode: encrypt in software under\n");
+    printf("                        a data key that the module seals once\n");
     printf("\n");
     printf("commands:\n");
-    printf("  seal MOD IN       Seal IN using MOD\n");
+    printf("  seal MOD[,MOD...] IN\n");
+    printf("                    Seal IN using MOD, or so any one of several can unseal it\n");
     printf("  unseal IN         Unseal IN\n");
     printf("  chal MOD IN       Use MOD's raw challenge-response interface\n");
 }
@@ -47,7 +53,8 @@ static void status_handler(module_info const * module,
 {
     (void) module;
     (void) level;
-    printf("%s\n", message);
+    // stdout may be the output data
+    fprintf(stderr, "%s\n", message);
 }
 
 
@@ -293,24 +300,47 @@ int do_action(struct opts opts)
     uint8_t * in_buf = NULL;
     uint8_t * out_buf = NULL;
 
-    // Load and check the module
-    module_info const * mod = puflib_get_module(argv[1]);
-    if (!mod) {
-        fprintf(stderr, "puf: cannot use module \"%s\": does not exist\n", argv[1]);
-        goto err;
-    }
+    // Load and check the modules. seal accepts a comma-separated list, to
+    // seal to several modules at once.
+    module_info const * mods[PUF_MAX_MODULES];
+    size_t n_mods = 0;
+    for (char * name = strtok(argv[1], ","); name; name = strtok(NULL, ",")) {
+        if (n_mods == PUF_MAX_MODULES) {
+            fprintf(stderr, "puf: too many modules (at most %d)\n", PUF_MAX_MODULES);
+            goto err;
+        }
 
-    enum module_status status = puflib_module_status(mod);
-    if (status == MODULE_STATUS_ERROR) {
-        goto perr;
+        module_info const * mod = puflib_get_module(name);
+        if (!mod) {
+            fprintf(stderr, "puf: cannot use module \"%s\": does not exist\n", name);
+            goto err;
+        }
+
+        enum module_status status = puflib_module_status(mod);
+        if (status == MODULE_STATUS_ERROR) {
+            goto perr;
+        }
+        if (status & MODULE_DISABLED) {
+            fprintf(stderr, "puf: cannot use module \"%s\": module is disabled\n", mod->name);
+            goto err;
+        }
+        if (!(status & MODULE_PROVISIONED)) {
+            fprintf(stderr, "puf: cannot use module \"%s\": module has not been provisioned\n",
+                    mod->name);
+            goto err;
+        }
+
+        mods[n_mods++] = mod;
     }
-    if (status & MODULE_DISABLED) {
-        fprintf(stderr, "puf: cannot use module \"%s\": module is disabled\n", mod->name);
+
+    if (!n_mods) {
+        fprintf(stderr, "puf: no module given to command \"%s\"\n", argv[0]);
         goto err;
-    }
-    if (!(status & MODULE_PROVISIONED)) {
-        fprintf(stderr, "puf: cannot use module \"%s\": module has not been provisioned\n",
-                mod->name);
+    } else if (n_mods > 1 && strcmp(argv[0], "seal")) {
+        fprintf(stderr, "puf: command \"%s\" takes only one module\n", argv[0]);
+        goto err;
+    } else if (n_mods > 1 && opts.envelope) {
+        fprintf(stderr, "puf: envelope mode takes only one module\n");
         goto err;
     }
 
@@ -322,9 +352,15 @@ int do_action(struct opts opts)
     // Seal or unseal
     bool rc = false;
     if (!strcmp(argv[0], "seal")) {
-        rc = puflib_seal(mod, in_buf, in_buf_len, &out_buf, &out_buf_len);
+        if (opts.envelope) {
+            rc = puflib_seal_envelope(mods[0], in_buf, in_buf_len, &out_buf, &out_buf_len);
+        } else if (n_mods == 1) {
+            rc = puflib_seal(mods[0], in_buf, in_buf_len, &out_buf, &out_buf_len);
+        } else {
+            rc = puflib_seal_multi(mods, n_mods, in_buf, in_buf_len, &out_buf, &out_buf_len);
+        }
     } else if (!strcmp(argv[0], "chal")) {
-        rc = puflib_chal_resp(mod, (void const *) in_buf, in_buf_len,
+        rc = puflib_chal_resp(mods[0], (void const *) in_buf, in_buf_len,
                 (void **) &out_buf, &out_buf_len);
     } else {
         assert(false && "unexpected command name passed to do_action");
@@ -415,6 +451,7 @@ int main(int argc, char ** argv)
         {"input-base64",    'I',    OPTPARSE_NONE},
         {"output-base64",   'O',    OPTPARSE_NONE},
         {"output",          'o',    OPTPARSE_REQUIRED},
+        {"envelope",        'e',    OPTPARSE_NONE},
         {0}
     };
 
@@ -433,6 +470,9 @@ int main(int argc, char ** argv)
         case 'o':
             opts.output = options.optarg;
             break;
+        case 'e':
+            opts.envelope = true;
+            break;
         case '?':
             fprintf(stderr, "%s: %s\n", argv[0], options.errmsg);
             return 1;
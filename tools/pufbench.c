@@ -0,0 +1,970 @@
+// pufbench - benchmark PUFlib's shared primitives
+//
+// Copyright (C) 2016 Assured Information Security, Inc.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <puflib_module.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "optparse.h"
+
+#define DEFAULT_ITERATIONS 1000
+#define DEFAULT_ERROR_RATE 0.05
+
+struct opts {
+    bool help;
+    long iterations;
+    bool iterations_set;    ///< -n was given
+    double error_rate;
+    int argc;
+    char ** argv;
+};
+
+// Codes benchmarked by "fe" when none are given
+static char const * const DEFAULT_CODES[] = {
+    "rep:rep=11,blocks=128",
+    "rm:m=6,rep=5,blocks=19",
+    "bch:m=7,t=10,rep=5,blocks=2",
+    "bch:m=10,t=40,rep=3,blocks=1",
+    NULL
+};
+
+// Message sizes benchmarked by "sha256" when none are given
+static char const * const DEFAULT_SIZES[] = { "32", "64", "1024", "65536", NULL };
+
+// Message sizes benchmarked by "gcm" when none are given
+static char const * const DEFAULT_GCM_SIZES[] = { "64", "1024", "16384", "1048576", NULL };
+
+// Challenge sizes benchmarked by "chal" when none are given
+static char const * const DEFAULT_CHAL_SIZES[] = { "8", "64", "4096", "65536", NULL };
+
+// Messages hashed per call when benchmarking puflib_sha256_batch()
+#define SHA256_BATCH 64
+
+// Threads started by "contend" when not given, and its challenge size
+#define DEFAULT_BULK_THREADS 2
+#define DEFAULT_INTERACTIVE_THREADS 1
+#define CONTEND_CHAL_LEN 8
+#define MAX_CONTEND_THREADS 64
+
+// Threads started by "herd" when not given
+#define DEFAULT_HERD_THREADS 8
+
+
+static void usage(void)
+{
+    printf("pufbench [OPTIONS] COMMAND [...]\n");
+    printf("benchmark PUFlib's shared primitives.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -n N, --iterations=N  Run each benchmark N times (default %d)\n",
+            DEFAULT_ITERATIONS);
+    printf("  -e P, --error-rate=P  Flip each response bit with probability P\n");
+    printf("                        (default %g)\n", DEFAULT_ERROR_RATE);
+    printf("\n");
+    printf("commands:\n");
+    printf("  fe [CODE...]          Fuzzy extractor enrollment and reconstruction.\n");
+    printf("                        CODE is e.g. bch:m=7,t=10,rep=5,blocks=2, or\n");
+    printf("                        rm:m=6,rep=5,blocks=19, or rep:rep=11,blocks=128\n");
+    printf("  sha256 [SIZE...]      SHA-256 of single messages and of batches of\n");
+    printf("                        messages, SIZE bytes each\n");
+    printf("  gcm [SIZE...]         AES-256-GCM sealing and opening of SIZE-byte\n");
+    printf("                        messages\n");
+    printf("  chal MOD [SIZE...]    MOD's challenge-response interface, with SIZE\n");
+    printf("                        bytes of challenges per call. Without -n, slow\n");
+    printf("                        modules are run fewer times\n");
+    printf("  contend MOD [BULK [INTERACTIVE]]\n");
+    printf("                        Interactive challenge latency while BULK threads\n");
+    printf("                        (default %d) keep MOD busy, with and without\n",
+            DEFAULT_BULK_THREADS);
+    printf("                        their calls in the bulk priority class\n");
+    printf("  herd MOD [THREADS]    THREADS threads (default %d) asking MOD the same\n",
+            DEFAULT_HERD_THREADS);
+    printf("                        challenge at once, and how many calls reach it\n");
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Benchmarks only need fast, repeatable noise, not good randomness
+static uint64_t RNG_STATE = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng_next(void)
+{
+    RNG_STATE ^= RNG_STATE >> 12;
+    RNG_STATE ^= RNG_STATE << 25;
+    RNG_STATE ^= RNG_STATE >> 27;
+    return RNG_STATE * 0x2545f4914f6cdd1dull;
+}
+
+static void rng_fill(uint8_t * buf, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        buf[i] = (uint8_t) (rng_next() >> 56);
+    }
+}
+
+/// Flip each of nbits bits with probability p
+static void add_noise(uint8_t * buf, size_t nbits, double p)
+{
+    uint64_t const threshold = (uint64_t) (p * 18446744073709551616.0);
+    for (size_t i = 0; i < nbits; ++i) {
+        if (rng_next() < threshold) {
+            buf[i / 8] ^= 1u << (i % 8);
+        }
+    }
+}
+
+
+/**
+ * Parse a code description like "bch:m=7,t=10,rep=5,blocks=2".
+ * @return true on error
+ */
+static bool parse_code(char const * desc, puflib_ecc_params * params)
+{
+    char buf[128];
+    if (strlen(desc) >= sizeof(buf)) {
+        return true;
+    }
+    strcpy(buf, desc);
+
+    *params = (puflib_ecc_params) { .repetition = 1, .blocks = 1 };
+
+    char * fields = strchr(buf, ':');
+    if (fields) {
+        *fields++ = 0;
+    }
+
+    if (!strcmp(buf, "rep")) {
+        params->code = PUFLIB_ECC_REPETITION;
+    } else if (!strcmp(buf, "bch")) {
+        params->code = PUFLIB_ECC_BCH;
+    } else if (!strcmp(buf, "rm")) {
+        params->code = PUFLIB_ECC_REED_MULLER;
+    } else {
+        return true;
+    }
+
+    for (char * field = fields ? strtok(fields, ",") : NULL; field;
+            field = strtok(NULL, ",")) {
+        char * value = strchr(field, '=');
+        if (!value) {
+            return true;
+        }
+        *value++ = 0;
+
+        char * end;
+        unsigned long v = strtoul(value, &end, 10);
+        if (*end || !*value) {
+            return true;
+        }
+
+        if (!strcmp(field, "m")) {
+            params->m = v;
+        } else if (!strcmp(field, "t")) {
+            params->t = v;
+        } else if (!strcmp(field, "rep")) {
+            params->repetition = v;
+        } else if (!strcmp(field, "blocks")) {
+            params->blocks = v;
+        } else {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static int bench_fe_code(char const * desc, struct opts const * opts)
+{
+    puflib_ecc_params params;
+    uint8_t * response = NULL, * noisy = NULL, * helper = NULL;
+    uint8_t * key = NULL, * key2 = NULL;
+    int rc = 1;
+
+    if (parse_code(desc, &params)) {
+        fprintf(stderr, "pufbench: invalid code '%s'\n", desc);
+        return 1;
+    }
+
+    puflib_fe * fe = puflib_fe_new(&params);
+    if (!fe) {
+        fprintf(stderr, "pufbench: cannot use code '%s': %s\n", desc, strerror(errno));
+        return 1;
+    }
+
+    size_t const resp_bytes = (puflib_fe_response_bits(fe) + 7) / 8;
+    size_t const key_bytes = (puflib_fe_key_bits(fe) + 7) / 8;
+    size_t const helper_len = puflib_fe_helper_len(fe);
+
+    response = malloc(resp_bytes);
+    noisy = malloc(resp_bytes);
+    helper = malloc(helper_len);
+    key = malloc(key_bytes);
+    key2 = malloc(key_bytes);
+    if (!response || !noisy || !helper || !key || !key2) {
+        perror("pufbench");
+        goto out;
+    }
+
+    rng_fill(response, resp_bytes);
+
+    double start = now();
+    for (long i = 0; i < opts->iterations; ++i) {
+        if (puflib_fe_enroll(fe, response, key, helper)) {
+            perror("pufbench: puflib_fe_enroll");
+            goto out;
+        }
+    }
+    double enroll_time = now() - start;
+
+    double reproduce_time = 0;
+    long failures = 0, wrong = 0;
+    for (long i = 0; i < opts->iterations; ++i) {
+        memcpy(noisy, response, resp_bytes);
+        add_noise(noisy, puflib_fe_response_bits(fe), opts->error_rate);
+
+        start = now();
+        bool failed = puflib_fe_reproduce(fe, noisy, helper, helper_len, key2);
+        reproduce_time += now() - start;
+
+        if (failed) {
+            ++failures;
+        } else if (memcmp(key, key2, key_bytes)) {
+            ++wrong;
+        }
+    }
+
+    printf("%-30s %6zu %5zu %6zu %10.0f %11.0f %8ld %6ld\n", desc,
+            puflib_fe_response_bits(fe), puflib_fe_key_bits(fe), helper_len,
+            opts->iterations / enroll_time, opts->iterations / reproduce_time,
+            failures, wrong);
+    rc = 0;
+
+out:
+    free(response);
+    free(noisy);
+    free(helper);
+    free(key);
+    free(key2);
+    puflib_fe_free(fe);
+    return rc;
+}
+
+
+static int do_fe(int argc, char ** argv, struct opts const * opts)
+{
+    int rc = 0;
+
+    printf("bit error rate %g, %ld iterations\n", opts->error_rate, opts->iterations);
+    printf("%-30s %6s %5s %6s %10s %11s %8s %6s\n", "CODE", "RESP", "KEY", "HELPER",
+            "ENROLL/s", "REPRODUCE/s", "FAILURES", "WRONG");
+
+    if (argc) {
+        for (int i = 0; i < argc; ++i) {
+            rc |= bench_fe_code(argv[i], opts);
+        }
+    } else {
+        for (size_t i = 0; DEFAULT_CODES[i]; ++i) {
+            rc |= bench_fe_code(DEFAULT_CODES[i], opts);
+        }
+    }
+
+    return rc;
+}
+
+
+static int bench_sha256_size(char const * desc, struct opts const * opts)
+{
+    char * end;
+    unsigned long size = strtoul(desc, &end, 10);
+    if (*end || !*desc || size > (1ul << 24)) {
+        fprintf(stderr, "pufbench: invalid size '%s'\n", desc);
+        return 1;
+    }
+
+    uint8_t * data = malloc(size * SHA256_BATCH + 1);
+    uint8_t digests[PUFLIB_SHA256_LEN * SHA256_BATCH];
+    if (!data) {
+        perror("pufbench");
+        return 1;
+    }
+    rng_fill(data, size * SHA256_BATCH);
+
+    double start = now();
+    for (long i = 0; i < opts->iterations; ++i) {
+        puflib_sha256(data + size * (i % SHA256_BATCH), size, digests);
+    }
+    double single_time = now() - start;
+
+    start = now();
+    for (long i = 0; i < opts->iterations; ++i) {
+        puflib_sha256_batch(data, size, SHA256_BATCH, digests);
+    }
+    double batch_time = now() - start;
+
+    double const batch_count = (double) opts->iterations * SHA256_BATCH;
+    printf("%10lu %12.0f %10.1f %12.0f %10.1f\n", size,
+            opts->iterations / single_time, opts->iterations * size / single_time / 1e6,
+            batch_count / batch_time, batch_count * size / batch_time / 1e6);
+
+    free(data);
+    return 0;
+}
+
+
+static int do_sha256(int argc, char ** argv, struct opts const * opts)
+{
+    int rc = 0;
+
+    printf("implementation %s, %ld iterations, batches of %d\n", puflib_sha256_impl(),
+            opts->iterations, SHA256_BATCH);
+    printf("%10s %12s %10s %12s %10s\n", "SIZE", "SINGLE/s", "MB/s", "BATCHED/s", "MB/s");
+
+    if (argc) {
+        for (int i = 0; i < argc; ++i) {
+            rc |= bench_sha256_size(argv[i], opts);
+        }
+    } else {
+        for (size_t i = 0; DEFAULT_SIZES[i]; ++i) {
+            rc |= bench_sha256_size(DEFAULT_SIZES[i], opts);
+        }
+    }
+
+    return rc;
+}
+
+
+static int bench_gcm_size(char const * desc, puflib_gcm const * gcm, struct opts const * opts)
+{
+    char * end;
+    unsigned long size = strtoul(desc, &end, 10);
+    if (*end || !*desc || size > (1ul << 28)) {
+        fprintf(stderr, "pufbench: invalid size '%s'\n", desc);
+        return 1;
+    }
+
+    uint8_t iv[PUFLIB_GCM_IV_LEN] = {0};
+    uint8_t aad[16], tag[PUFLIB_GCM_TAG_LEN];
+    uint8_t * data = malloc(size + 1);
+    if (!data) {
+        perror("pufbench");
+        return 1;
+    }
+    rng_fill(data, size);
+    rng_fill(aad, sizeof(aad));
+
+    // Seal in place over and over; the IV is only reused because the output
+    // is thrown away
+    double start = now();
+    for (long i = 0; i < opts->iterations; ++i) {
+        if (puflib_gcm_seal(gcm, iv, aad, sizeof(aad), data, size, data, tag)) {
+            perror("pufbench: puflib_gcm_seal");
+            free(data);
+            return 1;
+        }
+    }
+    double seal_time = now() - start;
+
+    // Only the first tag check passes, but each does the same work
+    start = now();
+    for (long i = 0; i < opts->iterations; ++i) {
+        puflib_gcm_ctx ctx;
+        puflib_gcm_start(&ctx, gcm, iv);
+        puflib_gcm_aad(&ctx, aad, sizeof(aad));
+        puflib_gcm_decrypt(&ctx, data, size, data);
+        puflib_gcm_verify(&ctx, tag);
+    }
+    double open_time = now() - start;
+
+    printf("%10lu %12.0f %10.1f %12.0f %10.1f\n", size,
+            opts->iterations / seal_time, opts->iterations * size / seal_time / 1e6,
+            opts->iterations / open_time, opts->iterations * size / open_time / 1e6);
+
+    free(data);
+    return 0;
+}
+
+
+static int do_gcm(int argc, char ** argv, struct opts const * opts)
+{
+    uint8_t key[PUFLIB_GCM_KEY_LEN];
+    int rc = 0;
+
+    rng_fill(key, sizeof(key));
+    puflib_gcm * gcm = puflib_gcm_new(key);
+    if (!gcm) {
+        perror("pufbench: puflib_gcm_new");
+        return 1;
+    }
+
+    printf("implementation %s, %ld iterations\n", puflib_gcm_impl(), opts->iterations);
+    printf("%10s %12s %10s %12s %10s\n", "SIZE", "SEAL/s", "MB/s", "OPEN/s", "MB/s");
+
+    if (argc) {
+        for (int i = 0; i < argc; ++i) {
+            rc |= bench_gcm_size(argv[i], gcm, opts);
+        }
+    } else {
+        for (size_t i = 0; DEFAULT_GCM_SIZES[i]; ++i) {
+            rc |= bench_gcm_size(DEFAULT_GCM_SIZES[i], gcm, opts);
+        }
+    }
+
+    puflib_gcm_free(gcm);
+    return rc;
+}
+
+
+static int bench_chal_size(module_info const * module, char const * desc,
+        struct opts const * opts)
+{
+    puflib_caps const * caps = puflib_get_caps(module);
+    char * end;
+    unsigned long size = strtoul(desc, &end, 10);
+    if (*end || !size || size > (1ul << 28)) {
+        fprintf(stderr, "pufbench: invalid size '%s'\n", desc);
+        return 1;
+    }
+    if (caps->batch_len && size % caps->batch_len) {
+        fprintf(stderr, "pufbench: size %lu is not a whole number of %zu-byte challenges\n",
+                size, caps->batch_len);
+        return 1;
+    }
+    if (caps->max_input_len && size > caps->max_input_len) {
+        printf("%10lu skipped, over the module's limit of %zu bytes\n", size,
+                caps->max_input_len);
+        return 0;
+    }
+
+    // Modules without batches take the whole input as one challenge
+    size_t const challenges = caps->batch_len ? size / caps->batch_len : 1;
+
+    uint8_t * data = malloc(size);
+    if (!data) {
+        perror("pufbench");
+        return 1;
+    }
+    rng_fill(data, size);
+
+    size_t resp_len = 0;
+    double start = now();
+    for (long i = 0; i < opts->iterations; ++i) {
+        void * resp;
+        if (puflib_chal_resp(module, data, size, &resp, &resp_len)) {
+            perror("pufbench: puflib_chal_resp");
+            free(data);
+            return 1;
+        }
+        free(resp);
+    }
+    double time = now() - start;
+
+    printf("%10lu %10zu %12.0f %12.0f %10.1f %10.1f\n", size, resp_len,
+            opts->iterations / time, opts->iterations * challenges / time,
+            opts->iterations * size / time / 1e6, opts->iterations * resp_len / time / 1e6);
+
+    free(data);
+    return 0;
+}
+
+
+/**
+ * Iterations to call a module for: as given, or for a slow module without -n,
+ * as many as take about a second.
+ */
+static long module_iterations(module_info const * module, struct opts const * opts)
+{
+    puflib_caps const * caps = puflib_get_caps(module);
+    long iterations = opts->iterations;
+
+    if (!opts->iterations_set && caps->typical_us) {
+        long budget = 1000000 / caps->typical_us;
+        if (budget < 10) {
+            budget = 10;
+        }
+        if (budget < iterations) {
+            iterations = budget;
+        }
+    }
+    return iterations;
+}
+
+
+static char const * threading_name(enum puflib_threading threading)
+{
+    switch (threading) {
+    case PUFLIB_THREADS_SERIAL:     return "serial";
+    case PUFLIB_THREADS_SAFE:       return "thread-safe";
+    case PUFLIB_THREADS_PARALLEL:   return "parallel";
+    default:                        return "unknown";
+    }
+}
+
+
+static int do_chal(int argc, char ** argv, struct opts const * opts)
+{
+    struct opts chal_opts = *opts;
+    int rc = 0;
+
+    if (!argc) {
+        fprintf(stderr, "pufbench: chal needs a module name\n");
+        return 1;
+    }
+
+    module_info const * module = puflib_get_module(argv[0]);
+    if (!module) {
+        fprintf(stderr, "pufbench: module '%s' not found\n", argv[0]);
+        return 1;
+    }
+
+    // Open the module's instance up front, so the first size doesn't pay for it
+    double start = now();
+    if (puflib_warmup(module)) {
+        perror("pufbench: puflib_warmup");
+        return 1;
+    }
+    double const warmup = now() - start;
+
+    puflib_caps const * caps = puflib_get_caps(module);
+    chal_opts.iterations = module_iterations(module, opts);
+
+    printf("module %s, %ld iterations, warmup %.3f ms\n", module->name, chal_opts.iterations,
+            warmup * 1e3);
+    printf("%s, %s", threading_name(caps->threading),
+            caps->deterministic ? "deterministic" : "not deterministic");
+    if (caps->response_len) {
+        printf(", %zu-byte responses", caps->response_len);
+    }
+    if (caps->batch_len) {
+        printf(", batches of %zu-byte challenges", caps->batch_len);
+    }
+    if (caps->typical_us) {
+        printf(", typically %u us", caps->typical_us);
+    }
+    printf("\n");
+    printf("%10s %10s %12s %12s %10s %10s\n", "SIZE", "RESPONSE", "CALLS/s", "CHALS/s",
+            "MB/s IN", "MB/s OUT");
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            rc |= bench_chal_size(module, argv[i], &chal_opts);
+        }
+    } else {
+        for (size_t i = 0; DEFAULT_CHAL_SIZES[i]; ++i) {
+            rc |= bench_chal_size(module, DEFAULT_CHAL_SIZES[i], &chal_opts);
+        }
+    }
+
+    return rc;
+}
+
+
+struct contender {
+    module_info const * module;
+    pthread_t thread;
+    enum puflib_priority priority;
+    unsigned index;
+    long iterations;        ///< Calls to make, or 0 to call until stopped
+    double * latencies;     ///< Duration of each call, for interactive threads
+    long calls;             ///< Calls made
+    bool failed;
+    int errno_result;
+};
+
+static pthread_mutex_t CONTEND_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static bool CONTEND_STOP = false;
+
+
+static bool contend_stopped(void)
+{
+    pthread_mutex_lock(&CONTEND_LOCK);
+    bool stop = CONTEND_STOP;
+    pthread_mutex_unlock(&CONTEND_LOCK);
+    return stop;
+}
+
+
+static void * contend_worker(void * arg)
+{
+    struct contender * c = arg;
+    uint8_t chal[CONTEND_CHAL_LEN];
+
+    if (puflib_set_priority(c->priority)) {
+        c->failed = true;
+        c->errno_result = errno;
+        return NULL;
+    }
+
+    while (c->iterations ? c->calls < c->iterations : !contend_stopped()) {
+        void * resp;
+        size_t resp_len;
+
+        // Distinct challenges, so that nothing could be answered from a cache
+        memset(chal, 0, sizeof(chal));
+        memcpy(chal, &c->calls, sizeof(c->calls));
+        chal[sizeof(chal) - 1] = (uint8_t) c->index;
+
+        double start = now();
+        if (puflib_chal_resp(c->module, chal, sizeof(chal), &resp, &resp_len)) {
+            c->failed = true;
+            c->errno_result = errno;
+            return NULL;
+        }
+        if (c->latencies) {
+            c->latencies[c->calls] = now() - start;
+        }
+        free(resp);
+        ++c->calls;
+    }
+    return NULL;
+}
+
+
+static int compare_double(void const * a, void const * b)
+{
+    double x = *(double const *) a, y = *(double const *) b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Run the interactive threads to completion while the bulk ones keep the
+ * module busy, and print the latency and rates seen.
+ */
+static int contend_round(module_info const * module, char const * label,
+        enum puflib_priority bulk_priority, unsigned n_bulk, unsigned n_interactive,
+        long iterations)
+{
+    struct contender c[MAX_CONTEND_THREADS * 2];
+    unsigned const n = n_bulk + n_interactive;
+    unsigned started = 0;
+    int rc = 0;
+
+    double * latencies = malloc(n_interactive * iterations * sizeof(*latencies));
+    if (!latencies) {
+        perror("pufbench");
+        return 1;
+    }
+
+    CONTEND_STOP = false;
+    for (unsigned i = 0; i < n; ++i) {
+        bool bulk = i < n_bulk;
+        c[i] = (struct contender) {
+            .module = module,
+            .priority = bulk ? bulk_priority : PUFLIB_PRIORITY_INTERACTIVE,
+            .index = i,
+            .iterations = bulk ? 0 : iterations,
+            .latencies = bulk ? NULL : latencies + (i - n_bulk) * iterations,
+        };
+    }
+
+    double start = now();
+    for (; started < n; ++started) {
+        int err = pthread_create(&c[started].thread, NULL, &contend_worker, &c[started]);
+        if (err) {
+            fprintf(stderr, "pufbench: cannot start thread: %s\n", strerror(err));
+            rc = 1;
+            break;
+        }
+    }
+
+    // Interactive threads finish on their own; then stop the bulk ones
+    for (unsigned i = n_bulk; i < started; ++i) {
+        pthread_join(c[i].thread, NULL);
+    }
+    double const time = now() - start;
+    pthread_mutex_lock(&CONTEND_LOCK);
+    CONTEND_STOP = true;
+    pthread_mutex_unlock(&CONTEND_LOCK);
+    for (unsigned i = 0; i < n_bulk && i < started; ++i) {
+        pthread_join(c[i].thread, NULL);
+    }
+
+    long bulk_calls = 0;
+    for (unsigned i = 0; i < started; ++i) {
+        if (c[i].failed) {
+            fprintf(stderr, "pufbench: puflib_chal_resp: %s\n", strerror(c[i].errno_result));
+            rc = 1;
+        }
+        if (i < n_bulk) {
+            bulk_calls += c[i].calls;
+        }
+    }
+
+    if (!rc) {
+        size_t const total = (size_t) n_interactive * iterations;
+        qsort(latencies, total, sizeof(*latencies), &compare_double);
+        printf("%-12s %10.3f %10.3f %10.3f %12.0f %12.0f\n", label,
+                latencies[total / 2] * 1e3, latencies[total * 99 / 100] * 1e3,
+                latencies[total - 1] * 1e3, total / time, bulk_calls / time);
+    }
+
+    free(latencies);
+    return rc;
+}
+
+
+static bool parse_threads(char const * desc, unsigned * threads)
+{
+    char * end;
+    unsigned long n = strtoul(desc, &end, 10);
+    if (*end || n > MAX_CONTEND_THREADS) {
+        fprintf(stderr, "pufbench: invalid thread count '%s'\n", desc);
+        return true;
+    }
+    *threads = (unsigned) n;
+    return false;
+}
+
+
+static int do_contend(int argc, char ** argv, struct opts const * opts)
+{
+    unsigned n_bulk = DEFAULT_BULK_THREADS, n_interactive = DEFAULT_INTERACTIVE_THREADS;
+
+    if (!argc || argc > 3) {
+        fprintf(stderr, "pufbench: contend needs a module name, and at most two thread counts\n");
+        return 1;
+    }
+    if ((argc > 1 && parse_threads(argv[1], &n_bulk))
+            || (argc > 2 && parse_threads(argv[2], &n_interactive))) {
+        return 1;
+    }
+    if (!n_interactive) {
+        fprintf(stderr, "pufbench: contend needs at least one interactive thread\n");
+        return 1;
+    }
+
+    module_info const * module = puflib_get_module(argv[0]);
+    if (!module) {
+        fprintf(stderr, "pufbench: module '%s' not found\n", argv[0]);
+        return 1;
+    }
+    if (puflib_warmup(module)) {
+        perror("pufbench: puflib_warmup");
+        return 1;
+    }
+
+    long const iterations = module_iterations(module, opts);
+    printf("module %s (%s), %u bulk and %u interactive threads, %ld iterations each\n",
+            module->name, threading_name(puflib_get_caps(module)->threading),
+            n_bulk, n_interactive, iterations);
+    printf("%-12s %10s %10s %10s %12s %12s\n", "BULK CLASS", "P50 ms", "P99 ms", "MAX ms",
+            "INTER/s", "BULK/s");
+
+    int rc = contend_round(module, "interactive", PUFLIB_PRIORITY_INTERACTIVE,
+            n_bulk, n_interactive, iterations);
+    if (!rc) {
+        rc = contend_round(module, "bulk", PUFLIB_PRIORITY_BULK,
+                n_bulk, n_interactive, iterations);
+    }
+    return rc;
+}
+
+
+struct herd_thread {
+    module_info const * module;
+    pthread_t thread;
+    pthread_barrier_t * barrier;
+    long iterations;
+    bool failed;
+    int errno_result;
+};
+
+
+static void * herd_worker(void * arg)
+{
+    struct herd_thread * h = arg;
+    uint8_t chal[CONTEND_CHAL_LEN];
+
+    for (long i = 0; i < h->iterations; ++i) {
+        void * resp;
+        size_t resp_len;
+
+        // Every thread asks the same thing in each round
+        memset(chal, 0, sizeof(chal));
+        memcpy(chal, &i, sizeof(i));
+        pthread_barrier_wait(h->barrier);
+        if (puflib_chal_resp(h->module, chal, sizeof(chal), &resp, &resp_len)) {
+            h->failed = true;
+            h->errno_result = errno;
+        } else {
+            free(resp);
+        }
+    }
+    return NULL;
+}
+
+
+static int do_herd(int argc, char ** argv, struct opts const * opts)
+{
+    unsigned n_threads = DEFAULT_HERD_THREADS;
+    struct herd_thread h[MAX_CONTEND_THREADS];
+    pthread_barrier_t barrier;
+    puflib_op_stats stats;
+    unsigned started = 0;
+    int rc = 0;
+
+    if (!argc || argc > 2) {
+        fprintf(stderr, "pufbench: herd needs a module name, and at most a thread count\n");
+        return 1;
+    }
+    if (argc > 1 && parse_threads(argv[1], &n_threads)) {
+        return 1;
+    }
+    if (!n_threads) {
+        fprintf(stderr, "pufbench: herd needs at least one thread\n");
+        return 1;
+    }
+
+    module_info const * module = puflib_get_module(argv[0]);
+    if (!module) {
+        fprintf(stderr, "pufbench: module '%s' not found\n", argv[0]);
+        return 1;
+    }
+    if (puflib_warmup(module)) {
+        perror("pufbench: puflib_warmup");
+        return 1;
+    }
+
+    // Count the calls that get past coalescing
+    puflib_layer * layer = puflib_interpose_stats(module, PUFLIB_OP_CHAL_RESP);
+    if (!layer) {
+        perror("pufbench: puflib_interpose_stats");
+        return 1;
+    }
+
+    long const iterations = module_iterations(module, opts);
+    pthread_barrier_init(&barrier, NULL, n_threads);
+
+    double start = now();
+    for (; started < n_threads; ++started) {
+        h[started] = (struct herd_thread) {
+            .module = module,
+            .barrier = &barrier,
+            .iterations = iterations,
+        };
+        int err = pthread_create(&h[started].thread, NULL, &herd_worker, &h[started]);
+        if (err) {
+            // The others would wait at the barrier for ever
+            fprintf(stderr, "pufbench: cannot start thread: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(h[i].thread, NULL);
+        if (h[i].failed) {
+            fprintf(stderr, "pufbench: puflib_chal_resp: %s\n", strerror(h[i].errno_result));
+            rc = 1;
+        }
+    }
+    double const time = now() - start;
+
+    puflib_layer_stats(layer, PUFLIB_OP_CHAL_RESP, &stats);
+    puflib_remove_layer(layer);
+    pthread_barrier_destroy(&barrier);
+
+    printf("module %s, %u threads, %ld rounds\n", module->name, n_threads, iterations);
+    printf("%12s %12s %12s %12s\n", "REQUESTS", "CALLS", "ROUNDS/s", "REQUESTS/s");
+    printf("%12ld %12llu %12.0f %12.0f\n", iterations * n_threads,
+            (unsigned long long) stats.calls, iterations / time,
+            iterations * n_threads / time);
+    return rc;
+}
+
+
+int main(int argc, char ** argv)
+{
+    struct opts opts = {0};
+    opts.iterations = DEFAULT_ITERATIONS;
+    opts.error_rate = DEFAULT_ERROR_RATE;
+
+    struct optparse options;
+    optparse_init(&options, argv);
+    struct optparse_long longopts[] = {
+        {"help",            'h',    OPTPARSE_NONE},
+        {"iterations",      'n',    OPTPARSE_REQUIRED},
+        {"error-rate",      'e',    OPTPARSE_REQUIRED},
+        {0}
+    };
+
+    int option;
+    while ((option = optparse_long(&options, longopts, NULL)) != -1) {
+        switch (option) {
+        case 'h':
+            opts.help = true;
+            break;
+        case 'n':
+            {
+                char * end;
+                opts.iterations = strtol(options.optarg, &end, 10);
+                if (*end || opts.iterations < 1) {
+                    fprintf(stderr, "%s: invalid iteration count '%s'\n", argv[0],
+                            options.optarg);
+                    return 1;
+                }
+                opts.iterations_set = true;
+            }
+            break;
+        case 'e':
+            {
+                char * end;
+                opts.error_rate = strtod(options.optarg, &end);
+                if (*end || !(opts.error_rate >= 0 && opts.error_rate < 1)) {
+                    fprintf(stderr, "%s: invalid error rate '%s'\n", argv[0],
+                            options.optarg);
+                    return 1;
+                }
+            }
+            break;
+        case '?':
+            fprintf(stderr, "%s: %s\n", argv[0], options.errmsg);
+            return 1;
+        }
+    }
+
+    char *argv_final[argc];
+    char *arg;
+    while ((arg = optparse_arg(&options))) {
+        argv_final[opts.argc++] = arg;
+    }
+    opts.argv = &argv_final[0];
+
+    if (opts.help) {
+        usage();
+        return 0;
+    }
+
+    if (opts.argc == 0) {
+        fprintf(stderr, "pufbench: expected a command. Try --help\n");
+        return 1;
+    } else if (!strcmp(opts.argv[0], "fe")) {
+        return do_fe(opts.argc - 1, opts.argv + 1, &opts);
+    } else if (!strcmp(opts.argv[0], "sha256")) {
+        return do_sha256(opts.argc - 1, opts.argv + 1, &opts);
+    } else if (!strcmp(opts.argv[0], "gcm")) {
+        return do_gcm(opts.argc - 1, opts.argv + 1, &opts);
+    } else if (!strcmp(opts.argv[0], "chal")) {
+        return do_chal(opts.argc - 1, opts.argv + 1, &opts);
+    } else if (!strcmp(opts.argv[0], "contend")) {
+        return do_contend(opts.argc - 1, opts.argv + 1, &opts);
+    } else if (!strcmp(opts.argv[0], "herd")) {
+        return do_herd(opts.argc - 1, opts.argv + 1, &opts);
+    } else {
+        fprintf(stderr, "pufbench: unrecognized command '%s'\n", opts.argv[0]);
+        return 1;
+    }
+}
@@ -2,16 +2,28 @@
 //
 // Copyright (C) 2016 Assured Information Security, Inc.
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <puflib.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <readline/readline.h>
 #include "optparse.h"
 
+#define DEFAULT_PROBE_JOBS 8
+#define DEFAULT_PROBE_TIMEOUT 10.0
+
 struct opts {
     bool help;
+    bool reprobe;
+    long jobs;
+    double probe_timeout;
     int argc;
     char ** argv;
 };
@@ -22,54 +34,302 @@ static void usage(void)
     printf("pufctl [OPTIONS] COMMAND [...]\n");
     printf("manage and provision PUFlib PUFs.\n");
     printf("\n");
+    printf("options:\n");
+    printf("  -r, --reprobe         Probe hardware support again, ignoring cached results\n");
+    printf("  -j N, --jobs=N        Probe up to N modules at once (default %d)\n",
+            DEFAULT_PROBE_JOBS);
+    printf("  -t SEC, --probe-timeout=SEC\n");
+    printf("                        Give up on a module's hardware probe after SEC\n");
+    printf("                        seconds (default %g)\n", DEFAULT_PROBE_TIMEOUT);
+    printf("\n");
     printf("commands:\n");
     printf("  list                  List all PUF modules\n");
     printf("  provisioned           List all provisioned PUF modules\n");
-    printf("  provision MOD         Provision MOD. May be interactive.\n");
-    printf("  continue MOD          Continue provisioning MOD.\n");
+    printf("  provision MOD...      Provision modules, concurrently. May be interactive.\n");
+    printf("  continue MOD...       Continue provisioning modules.\n");
     printf("  deprovision MOD...    Deprovision modules.\n");
     printf("  disable MOD...        Temporarily disable modules.\n");
     printf("  enable MOD...         Re-enable modules.\n");
 }
 
 
+enum probe_state { PROBE_PENDING, PROBE_RUNNING, PROBE_DONE, PROBE_TIMEOUT };
+
+struct probe {
+    module_info const * module;
+    enum probe_state state;
+    bool supported;
+    struct timespec deadline;
+};
+
+/**
+ * Hardware probes run on a small pool of worker threads. A probe that runs
+ * past its deadline is marked PROBE_TIMEOUT and its worker is abandoned (it
+ * cannot be safely cancelled); a replacement worker is started so the
+ * remaining probes are not held up.
+ */
+struct probe_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct probe * probes;
+    size_t n_probes;
+    size_t next;            ///< Index of the next probe to hand out
+    size_t n_finished;      ///< Number of probes done or timed out
+    size_t n_abandoned;     ///< Number of workers stuck in a timed-out probe
+    double timeout;
+};
+
+
+static void timespec_add(struct timespec * ts, double seconds)
+{
+    time_t whole = (time_t) seconds;
+    long nsec = ts->tv_nsec + (long) ((seconds - (double) whole) * 1e9);
+
+    ts->tv_sec += whole + nsec / 1000000000L;
+    ts->tv_nsec = nsec % 1000000000L;
+}
+
+
+static bool timespec_before(struct timespec const * a, struct timespec const * b)
+{
+    return a->tv_sec < b->tv_sec ||
+        (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+
+static void * probe_worker(void * arg)
+{
+    struct probe_pool * pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->n_probes) {
+        struct probe * probe = &pool->probes[pool->next++];
+        probe->state = PROBE_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &probe->deadline);
+        timespec_add(&probe->deadline, pool->timeout);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        bool supported = puflib_is_hw_supported(probe->module);
+
+        pthread_mutex_lock(&pool->lock);
+        if (probe->state == PROBE_TIMEOUT) {
+            // Too late - a replacement worker has already taken over.
+            break;
+        }
+        probe->supported = supported;
+        probe->state = PROBE_DONE;
+        ++pool->n_finished;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+/**
+ * Start a detached probe worker.
+ * @return false on success, true on error
+ */
+static bool start_probe_worker(struct probe_pool * pool)
+{
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &probe_worker, pool);
+    if (rc) {
+        errno = rc;
+        return true;
+    }
+    pthread_detach(thread);
+    return false;
+}
+
+
+/**
+ * Probe hardware support for every module concurrently, filling in the state
+ * and result of each probe.
+ * @return the pool, or NULL on error. If no probe timed out, the caller must
+ *  free the pool and its probes; otherwise they are still in use by the
+ *  abandoned workers and must be leaked.
+ */
+static struct probe_pool * run_probes(module_info const * const * modules,
+        size_t n_modules, long jobs, double timeout)
+{
+    struct probe_pool * pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->probes = calloc(n_modules ? n_modules : 1, sizeof(*pool->probes));
+    if (!pool->probes) {
+        free(pool);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n_modules; ++i) {
+        pool->probes[i].module = modules[i];
+        pool->probes[i].state = PROBE_PENDING;
+    }
+    pool->n_probes = n_modules;
+    pool->timeout = timeout;
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    pthread_mutex_lock(&pool->lock);
+
+    size_t n_workers = 0;
+    for (long i = 0; i < jobs && (size_t) i < n_modules; ++i) {
+        if (start_probe_worker(pool)) {
+            if (!n_workers) {
+                pthread_mutex_unlock(&pool->lock);
+                perror("pufctl: cannot start probe");
+                free(pool->probes);
+                free(pool);
+                return NULL;
+            }
+            break;
+        }
+        ++n_workers;
+    }
+
+    while (pool->n_finished < pool->n_probes) {
+        struct timespec const * earliest = NULL;
+        for (size_t i = 0; i < pool->n_probes; ++i) {
+            struct probe const * probe = &pool->probes[i];
+            if (probe->state == PROBE_RUNNING &&
+                    (!earliest || timespec_before(&probe->deadline, earliest))) {
+                earliest = &probe->deadline;
+            }
+        }
+
+        if (earliest) {
+            struct timespec deadline = *earliest;
+            pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline);
+        } else {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (size_t i = 0; i < pool->n_probes; ++i) {
+            struct probe * probe = &pool->probes[i];
+            if (probe->state == PROBE_RUNNING && !timespec_before(&now, &probe->deadline)) {
+                probe->state = PROBE_TIMEOUT;
+                ++pool->n_finished;
+                ++pool->n_abandoned;
+                if (pool->next < pool->n_probes && start_probe_worker(pool)) {
+                    perror("pufctl: cannot start probe");
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return pool;
+}
+
+
 /**
  * Command to emit a list of modules.
  * @param include_all - list all compiled modules. If false, only list
  *  provisioned modules.
+ * @param jobs - maximum number of hardware probes to run at once
+ * @param timeout - time allowed for each hardware probe, in seconds
  * @return exit code
  */
-static int do_list(bool include_all)
+static int do_list(bool include_all, long jobs, double timeout)
 {
     char const * fmt = "%-20s %-15s %-15s %-15s\n";
-    printf(fmt, "MODULE", "HWSUPPORT", "PROVISIONED", "ENABLED");
 
     module_info const * const * modules = puflib_get_modules();
+    size_t n_modules = 0;
+    while (modules[n_modules]) ++n_modules;
+
+    struct probe_pool * pool = run_probes(modules, n_modules, jobs, timeout);
+    if (!pool) {
+        return 1;
+    }
+
+    printf(fmt, "MODULE", "HWSUPPORT", "PROVISIONED", "ENABLED");
 
-    for (size_t i = 0; modules[i]; ++i) {
-        bool hwsupp = modules[i]->is_hw_supported();
+    for (size_t i = 0; i < n_modules; ++i) {
+        struct probe const * probe = &pool->probes[i];
         enum module_status status = puflib_module_status(modules[i]);
         bool provisioned = (status & MODULE_PROVISIONED);
         bool enabled = !(status & MODULE_DISABLED);
 
+        char const * hwsupp;
+        if (probe->state == PROBE_TIMEOUT) {
+            hwsupp = "probe-timeout";
+        } else {
+            hwsupp = probe->supported ? "supported" : "not-supp";
+        }
+
         if (include_all || (provisioned && enabled)) {
             printf(fmt, modules[i]->name,
-                    hwsupp ? "supported" : "not-supp",
+                    hwsupp,
                     provisioned ? "provisioned" : "not-prov",
                     enabled ? "enabled" : "disabled");
         }
     }
 
+    if (!pool->n_abandoned) {
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->cond);
+        free(pool->probes);
+        free(pool);
+    }
+
     return 0;
 }
 
 
+// Console shared by all provisioning threads. Status messages hold it while
+// they print, so output from concurrent modules is never interleaved mid-line.
+// While a query waits for input, messages from other modules are held back in
+// PENDING rather than printed over the prompt, and come out once it has been
+// answered; the lock itself is not held over the wait, so those modules carry
+// on provisioning.
+static pthread_mutex_t CONSOLE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static bool PROMPTING = false;
+static char * PENDING = NULL;
+static size_t PENDING_LEN = 0;
+
+// A module's queries make up a dialogue, so once a provisioning thread has
+// asked one, it keeps the terminal until its module is done, and the others
+// wait at their first query. Modules that never query are not held up.
+static pthread_mutex_t QUERY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t QUERY_COND = PTHREAD_COND_INITIALIZER;
+static bool QUERY_HELD = false;
+static pthread_t QUERY_OWNER;
+
+
 static void status_handler(module_info const * module,
         enum puflib_status_level level, char const * message)
 {
     (void) module;
     (void) level;
-    printf("%s\n", message);
+    pthread_mutex_lock(&CONSOLE_LOCK);
+    if (PROMPTING) {
+        size_t len = strlen(message);
+        char * pending = realloc(PENDING, PENDING_LEN + len + 2);
+        if (pending) {
+            memcpy(pending + PENDING_LEN, message, len);
+            pending[PENDING_LEN + len] = '\n';
+            pending[PENDING_LEN + len + 1] = 0;
+            PENDING = pending;
+            PENDING_LEN += len + 1;
+        }
+    } else {
+        printf("%s\n", message);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&CONSOLE_LOCK);
 }
 
 
@@ -78,8 +338,32 @@ static bool query_handler(module_info const * module, char const * key,
 {
     char * input;
 
+    pthread_mutex_lock(&QUERY_LOCK);
+    while (QUERY_HELD && !pthread_equal(QUERY_OWNER, pthread_self())) {
+        pthread_cond_wait(&QUERY_COND, &QUERY_LOCK);
+    }
+    QUERY_HELD = true;
+    QUERY_OWNER = pthread_self();
+    pthread_mutex_unlock(&QUERY_LOCK);
+
+    pthread_mutex_lock(&CONSOLE_LOCK);
     printf("Query from module \"%s\", key \"%s\"\n", module->name, key);
+    PROMPTING = true;
+    pthread_mutex_unlock(&CONSOLE_LOCK);
+
     input = readline(prompt);
+
+    pthread_mutex_lock(&CONSOLE_LOCK);
+    PROMPTING = false;
+    if (PENDING) {
+        fputs(PENDING, stdout);
+        fflush(stdout);
+        free(PENDING);
+        PENDING = NULL;
+        PENDING_LEN = 0;
+    }
+    pthread_mutex_unlock(&CONSOLE_LOCK);
+
     if (!input) {
         return true;
     } else {
@@ -91,71 +375,142 @@ static bool query_handler(module_info const * module, char const * key,
 }
 
 
-static int do_provision(char const * modname)
+/**
+ * Look up a module and check that it can be provisioned (or have its
+ * provisioning continued) on this system, printing an error if not.
+ * @return the module, or NULL if it cannot be provisioned
+ */
+static module_info const * check_provision(char const * modname, bool continuing)
 {
     module_info const * module = puflib_get_module(modname);
 
-    if (module) {
-        enum module_status status = puflib_module_status(module);
-        if (status == MODULE_STATUS_ERROR) {
-            perror("puflib_module_status");
-            return 1;
-        }
-        if (status & MODULE_PROVISIONED) {
-            fprintf(stderr, "pufctl: cannot provision module \"%s\": already provisioned\n",
-                    modname);
-            return 1;
-        } else if (status & MODULE_IN_PROGRESS) {
-            fprintf(stderr, "pufctl: cannot provision module \"%s\": already started provisioning. Try \"continue\"\n",
-                    modname);
-            return 1;
-        }
-        if (module->is_hw_supported()) {
-            module->provision();
-            return 0;
-        } else {
-            fprintf(stderr, "pufctl: module \"%s\" does not support this hardware\n",
-                    modname);
-            return 1;
-        }
-    } else {
+    if (!module) {
         fprintf(stderr, "pufctl: module \"%s\" not found\n", modname);
-        return 1;
+        return NULL;
+    }
+
+    enum module_status status = puflib_module_status(module);
+    if (status == MODULE_STATUS_ERROR) {
+        perror("puflib_module_status");
+        return NULL;
     }
+    if (status & MODULE_PROVISIONED) {
+        fprintf(stderr, "pufctl: cannot provision module \"%s\": already provisioned\n",
+                modname);
+        return NULL;
+    } else if (!continuing && (status & MODULE_IN_PROGRESS)) {
+        fprintf(stderr, "pufctl: cannot provision module \"%s\": already started provisioning. Try \"continue\"\n",
+                modname);
+        return NULL;
+    } else if (continuing && !(status & MODULE_IN_PROGRESS)) {
+        fprintf(stderr, "pufctl: cannot continue provisioning module \"%s\": haven't started yet. Try \"provision\"\n",
+                modname);
+        return NULL;
+    }
+
+    if (!puflib_is_hw_supported(module)) {
+        fprintf(stderr, "pufctl: module \"%s\" does not support this hardware\n",
+                modname);
+        return NULL;
+    }
+
+    return module;
 }
 
 
-static int do_continue(char const * modname)
+struct provision_job {
+    module_info const * module;
+    pthread_t thread;
+    bool started;
+    enum provisioning_status result;
+};
+
+
+static void * provision_worker(void * arg)
 {
-    module_info const * module = puflib_get_module(modname);
+    struct provision_job * job = arg;
+    job->result = job->module->provision();
+
+    // Hand the terminal on if this module had it
+    pthread_mutex_lock(&QUERY_LOCK);
+    if (QUERY_HELD && pthread_equal(QUERY_OWNER, pthread_self())) {
+        QUERY_HELD = false;
+        pthread_cond_broadcast(&QUERY_COND);
+    }
+    pthread_mutex_unlock(&QUERY_LOCK);
+    return NULL;
+}
 
-    if (module) {
-        enum module_status status = puflib_module_status(module);
-        if (status == MODULE_STATUS_ERROR) {
-            perror("puflib_module_status");
-            return 1;
-        }
-        if (status & MODULE_PROVISIONED) {
-            fprintf(stderr, "pufctl: cannot provision module \"%s\": already provisioned\n",
-                    modname);
-            return 1;
-        } else if (!(status & MODULE_IN_PROGRESS)) {
-            fprintf(stderr, "pufctl: cannot continue provisioning module \"%s\": haven't started yet. Try \"provision\"\n",
-                    modname);
+
+/**
+ * Command to provision modules, or continue provisioning them. Modules are
+ * independent, so when several are given they are provisioned concurrently.
+ * @return exit code
+ */
+static int do_provision(int argc, char ** argv, bool continuing)
+{
+    struct provision_job jobs[argc];
+
+    // First check that all modules can be provisioned, and abort before doing
+    // anything if not.
+    for (int i = 0; i < argc; ++i) {
+        jobs[i].module = check_provision(argv[i], continuing);
+        jobs[i].started = false;
+        jobs[i].result = PROVISION_ERROR;
+        if (!jobs[i].module) {
             return 1;
         }
-        if (module->is_hw_supported()) {
-            module->provision();
-            return 0;
-        } else {
-            fprintf(stderr, "pufctl: module \"%s\" does not support this hardware\n",
-                    modname);
-            return 1;
+        for (int j = 0; j < i; ++j) {
+            if (jobs[j].module == jobs[i].module) {
+                fprintf(stderr, "pufctl: module \"%s\" given more than once\n", argv[i]);
+                return 1;
+            }
         }
+    }
+
+    if (argc == 1) {
+        provision_worker(&jobs[0]);
     } else {
-        fprintf(stderr, "pufctl: module \"%s\" not found\n", modname);
-        return 1;
+        for (int i = 0; i < argc; ++i) {
+            int rc = pthread_create(&jobs[i].thread, NULL, &provision_worker, &jobs[i]);
+            if (rc) {
+                errno = rc;
+                perror("pufctl: cannot start provisioning");
+            } else {
+                jobs[i].started = true;
+            }
+        }
+        for (int i = 0; i < argc; ++i) {
+            if (jobs[i].started) {
+                pthread_join(jobs[i].thread, NULL);
+            }
+        }
+    }
+
+    int exit_code = 0;
+    for (int i = 0; i < argc; ++i) {
+        char const * result;
+        switch (jobs[i].result) {
+        case PROVISION_COMPLETE:
+            result = "complete";
+            break;
+        case PROVISION_INCOMPLETE:
+            result = "incomplete; run \"pufctl continue\" when ready";
+            break;
+        case PROVISION_NOT_SUPPORTED:
+            result = "hardware not supported";
+            exit_code = 1;
+            break;
+        case PROVISION_ERROR:
+        default:
+            result = (argc > 1 && !jobs[i].started) ? "not started" : "error";
+            exit_code = 1;
+            break;
+        }
+        printf("%s: provisioning %s\n", jobs[i].module->name, result);
     }
+
+    return exit_code;
 }
 
 
@@ -228,15 +583,23 @@ static int do_simple(int argc, char ** argv, enum module_simple_actions action)
 int main(int argc, char ** argv)
 {
     struct opts opts = {0};
+    opts.jobs = DEFAULT_PROBE_JOBS;
+    opts.probe_timeout = DEFAULT_PROBE_TIMEOUT;
 
     puflib_set_status_handler(&status_handler);
     puflib_set_query_handler(&query_handler);
 
+    // Any command may start deleting trash, ours or left by earlier runs
+    atexit(&puflib_wait_cleanup);
+
     struct optparse options;
     optparse_init(&options, argv);
     struct optparse_long longopts[] = {
         {"help",            'h',    OPTPARSE_NONE},
         {"non-interactive", 'n', OPTPARSE_NONE},
+        {"reprobe",         'r',    OPTPARSE_NONE},
+        {"jobs",            'j',    OPTPARSE_REQUIRED},
+        {"probe-timeout",   't',    OPTPARSE_REQUIRED},
         {0}
     };
 
@@ -246,6 +609,29 @@ int main(int argc, char ** argv)
         case 'h':
             opts.help = true;
             break;
+        case 'r':
+            opts.reprobe = true;
+            break;
+        case 'j':
+            {
+                char * end;
+                opts.jobs = strtol(options.optarg, &end, 10);
+                if (*end || opts.jobs < 1) {
+                    fprintf(stderr, "%s: invalid job count '%s'\n", argv[0], options.optarg);
+                    return 1;
+                }
+            }
+            break;
+        case 't':
+            {
+                char * end;
+                opts.probe_timeout = strtod(options.optarg, &end);
+                if (*end || !(opts.probe_timeout > 0)) {
+                    fprintf(stderr, "%s: invalid timeout '%s'\n", argv[0], options.optarg);
+                    return 1;
+                }
+            }
+            break;
         case '?':
             fprintf(stderr, "%s: %s\n", argv[0], options.errmsg);
             return 1;
@@ -264,23 +650,25 @@ int main(int argc, char ** argv)
         return 0;
     }
 
+    puflib_set_reprobe(opts.reprobe);
+
     if (opts.argc == 0 || !strcmp(opts.argv[0], "list")) {
-        return do_list(true);
+        return do_list(true, opts.jobs, opts.probe_timeout);
     } else if (!strcmp(opts.argv[0], "provisioned")) {
-        return do_list(false);
+        return do_list(false, opts.jobs, opts.probe_timeout);
     } else if (!strcmp(opts.argv[0], "provision")) {
-        if (opts.argc != 2) {
-            fprintf(stderr, "pufctl: expected one argument to command \"provision\". Try --help\n");
+        if (opts.argc < 2) {
+            fprintf(stderr, "pufctl: expected at least one argument to command \"provision\". Try --help\n");
             return 1;
         } else {
-            return do_provision(opts.argv[1]);
+            return do_provision(opts.argc - 1, opts.argv + 1, false);
         }
     } else if (!strcmp(opts.argv[0], "continue")) {
-        if (opts.argc != 2) {
-            fprintf(stderr, "pufctl: expected one argument to command \"continue\". Try --help\n");
+        if (opts.argc < 2) {
+            fprintf(stderr, "pufctl: expected at least one argument to command \"continue\". Try --help\n");
             return 1;
         } else {
-            return do_continue(opts.argv[1]);
+            return do_provision(opts.argc - 1, opts.argv + 1, true);
         }
     } else if (!strcmp(opts.argv[0], "deprovision")) {
         if (opts.argc < 2) {